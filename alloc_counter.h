@@ -0,0 +1,51 @@
+#ifndef ALLOCCOUNTERH
+#define ALLOCCOUNTERH
+
+//* Count the heap allocations of every thread by replacing the global
+//* operator new. The replacement must exist only once in a program, so only
+//* the file with main() includes this header.
+
+#include <cstdlib>
+#include <new>
+
+inline thread_local unsigned long long thread_allocations = 0;
+
+void *operator new(std::size_t size) {
+    thread_allocations++;
+    void *pointer = malloc(size ? size : 1);
+    if (!pointer) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    thread_allocations++;
+    return malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept {
+    free(pointer);
+}
+
+#endif
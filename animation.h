@@ -0,0 +1,46 @@
+#ifndef ANIMATIONH
+#define ANIMATIONH
+
+#include <vector>
+
+#include "vec3.h"
+
+//* Motion of the spheres of an animated scene.
+//* A sphere either moves with a constant velocity from where it is at time
+//* 0, or follows keyframes: linear between them, and held before the first
+//* and after the last one.
+
+typedef struct SphereKeyframe {
+    float time;
+    Vec3 center;
+} SphereKeyframe;
+
+typedef struct SphereMotion {
+    // index in the sphere list of the scene
+    int sphere;
+    // center at time 0 (without keyframes)
+    Vec3 origin;
+    Vec3 velocity;
+    // by time, empty for a velocity
+    std::vector<SphereKeyframe> keyframes;
+} SphereMotion;
+
+Vec3 motion_center(const SphereMotion &motion, float time) {
+    //* Where the sphere is at time (in seconds).
+    const std::vector<SphereKeyframe> &keys = motion.keyframes;
+    if (keys.empty()) {
+        return motion.origin + time * motion.velocity;
+    }
+    if (time <= keys.front().time) {
+        return keys.front().center;
+    }
+    for (size_t i = 1; i < keys.size(); i++) {
+        if (time < keys[i].time) {
+            float t = (time - keys[i - 1].time) / (keys[i].time - keys[i - 1].time);
+            return (1.0f - t) * keys[i - 1].center + t * keys[i].center;
+        }
+    }
+    return keys.back().center;
+}
+
+#endif
@@ -0,0 +1,374 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <cmath>   // for isfinite()
+#include <cstring> // for strcmp(), strstr()
+#include <thread>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "camera.h"
+#include "perf_counters.h"
+#include "scene.h"
+#include "stats.h"
+#include "tile_pool.h"
+#include "tracer.h"
+#include "wavefront.h"
+
+using namespace std;
+
+//* Frame benchmarks of the whole renderer on the standard scenes.
+//* The result is one JSON document, so runs can be stored and compared.
+
+typedef struct BenchScene {
+    const char *name;
+    int small_spheres;
+    SceneVariant variant;
+    // random lights, 0 for the point light
+    int lights;
+    // quantized spheres (Scene::compact()), and instances of a sphere pile
+    bool compact;
+    int instances;
+} BenchScene;
+
+const BenchScene bench_scenes[] = {
+    {"random", 48, SCENE_DEFAULT, 0, false, 0},
+    {"spheres_1k", 1000, SCENE_DEFAULT, 0, false, 0},
+    {"spheres_100k", 100000, SCENE_DEFAULT, 0, false, 0},
+    {"spheres_1m", 1000000, SCENE_DEFAULT, 0, false, 0},
+    {"spheres_1m_compact", 1000000, SCENE_DEFAULT, 0, true, 0},
+    {"instances_100k", 48, SCENE_DEFAULT, 0, false, 100000},
+    {"glass", 48, SCENE_GLASS, 0, false, 0},
+    {"mirror", 48, SCENE_MIRROR, 0, false, 0},
+    {"lights_16", 48, SCENE_DEFAULT, 16, false, 0},
+    {"lights_1k", 48, SCENE_DEFAULT, 1000, false, 0},
+    {"lights_100k", 48, SCENE_DEFAULT, 100000, false, 0}
+};
+
+typedef struct BenchSettings {
+    int width;
+    int height;
+    int samples;
+    int frames;
+    int threads;
+    int tile_size;
+    const char *kernel;
+    Engine engine;
+    int shadow_rays;
+    bool occluder_cache;
+    // sort the waves of secondary rays (wavefront engine)
+    bool sort_rays;
+    // comma separated scene names, NULL for all
+    const char *scenes;
+    // JSON file, NULL for stdout
+    const char *json;
+} BenchSettings;
+
+typedef struct BenchResult {
+    const char *name;
+    long long spheres;
+    int lights;
+    // memory of the spheres, the BVH and the instances
+    size_t geometry_bytes;
+    BVHBuildStats build;
+    double scene_ms;
+    double best_seconds;
+    double mean_seconds;
+    RenderStats stats;
+    StageStats stages;
+    // heap allocations inside the tiles, over all frames (should be 0)
+    unsigned long long heap_allocations;
+    double mean_luminance;
+    int non_finite_pixels;
+} BenchResult;
+
+bool parse_arguments(int argc, char **argv, BenchSettings &settings) {
+    //* Read the command line options. Return false on a bad option.
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--width") == 0 && has_value) {
+            settings.width = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--height") == 0 && has_value) {
+            settings.height = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--samples") == 0 && has_value) {
+            settings.samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--frames") == 0 && has_value) {
+            settings.frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            settings.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tile") == 0 && has_value) {
+            settings.tile_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--kernel") == 0 && has_value) {
+            settings.kernel = argv[++i];
+        } else if (strcmp(argv[i], "--shadow-rays") == 0 && has_value) {
+            settings.shadow_rays = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--occluder-cache") == 0 && has_value) {
+            settings.occluder_cache = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--sort-rays") == 0 && has_value) {
+            settings.sort_rays = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--engine") == 0 && has_value) {
+            if (!parse_engine(argv[++i], settings.engine)) {
+                cerr << "unknown engine " << argv[i] << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--scenes") == 0 && has_value) {
+            settings.scenes = argv[++i];
+        } else if (strcmp(argv[i], "--json") == 0 && has_value) {
+            settings.json = argv[++i];
+        } else {
+            cerr << "usage: " << argv[0] << " [--scenes random,spheres_1k,spheres_100k,spheres_1m,spheres_1m_compact,instances_100k,glass,mirror,lights_16,lights_1k,lights_100k]" << endl
+                 << "       [--width W] [--height H] [--samples N] [--frames N] [--threads N] [--tile SIZE] [--shadow-rays N] [--occluder-cache on|off]" << endl
+                 << "       [--kernel scalar|sse|avx2|avx512] [--engine recursive|wavefront [--sort-rays on|off]] [--json FILE]" << endl;
+            return false;
+        }
+    }
+    if (settings.width < 1 || settings.height < 1 || settings.samples < 1 || settings.frames < 1 ||
+        settings.threads < 1 || settings.tile_size < 1 || settings.shadow_rays < 1 || settings.shadow_rays > MAX_SHADOW_RAYS) {
+        cerr << "all sizes and counts need a positive value, --shadow-rays at most " << MAX_SHADOW_RAYS << endl;
+        return false;
+    }
+    if (settings.sort_rays && settings.engine != ENGINE_WAVEFRONT) {
+        cerr << "--sort-rays sorts the waves of the wavefront engine" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool scene_selected(const BenchSettings &settings, const char *name) {
+    //* Whether name is in the comma separated --scenes list.
+    if (!settings.scenes) {
+        return true;
+    }
+    size_t length = strlen(name);
+    for (const char *p = settings.scenes; (p = strstr(p, name)) != NULL; p += length) {
+        bool starts = p == settings.scenes || p[-1] == ',';
+        bool ends = p[length] == '\0' || p[length] == ',';
+        if (starts && ends) {
+            return true;
+        }
+    }
+    return false;
+}
+
+BenchResult run_scene(const BenchSettings &settings, const BenchScene &bench_scene, const SphereKernels &kernels, TilePool &pool) {
+    //* Build the scene and render it settings.frames times.
+    BenchResult result;
+    result.name = bench_scene.name;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Scene scene = random_scene(bench_scene.small_spheres, bench_scene.variant, bench_scene.lights);
+    scene.bvh.set_kernels(kernels);
+    if (bench_scene.instances > 0) {
+        add_random_instances(scene, bench_scene.instances, bench_scene.compact);
+    }
+    scene.build_bvh();
+    if (bench_scene.compact) {
+        scene.compact();
+    }
+    chrono::duration<double, milli> scene_time = chrono::steady_clock::now() - start;
+    result.spheres = scene.primitive_count();
+    result.lights = (int)scene.lights.size();
+    result.geometry_bytes = scene.geometry_bytes();
+    result.build = scene.bvh.get_build_stats();
+    result.scene_ms = scene_time.count();
+
+    Camera camera;
+    TraceOptions options = {true, 1.0f / 512.0f, -1, settings.shadow_rays, settings.occluder_cache, settings.sort_rays};
+    int width = settings.width;
+    int height = settings.height;
+    vector<Tile> tiles = make_tiles(width, height, settings.tile_size);
+    vector<Vec3> frame(width * height);
+
+    result.best_seconds = 0.0;
+    result.heap_allocations = 0;
+    double total_seconds = 0.0;
+    for (int f = 0; f < settings.frames; f++) {
+        {
+            lock_guard<mutex> guard(global_stats_lock);
+            global_stats.reset();
+        }
+        {
+            lock_guard<mutex> guard(global_stage_stats_lock);
+            global_stage_stats.reset();
+        }
+        start = chrono::steady_clock::now();
+        pool.render(tiles, [&](const Tile &tile) {
+            CacheMissScope cache_misses;
+            static thread_local WavefrontEngine wavefront;
+            bool use_wavefront = settings.engine == ENGINE_WAVEFRONT;
+            // Sized by the first tile of the thread, outside the count (like ray_tracer).
+            if (use_wavefront) {
+                size_t pixels = (size_t)settings.tile_size * settings.tile_size;
+                wavefront.reserve(pixels, pixels * settings.samples);
+            }
+            unsigned long long allocations_before = thread_allocations;
+            if (use_wavefront) {
+                wavefront.clear();
+                for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+                    for (int column_index = tile.x0; column_index < tile.x1; column_index++) {
+                        wavefront.add_pixel(row_index, column_index, 0, settings.samples);
+                    }
+                }
+                wavefront.run(camera, scene, options, SAMPLER_RANDOM, 0, width, height);
+                flush_thread_stage_stats();
+            }
+            int wavefront_sample = 0;
+            for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+                for (int column_index = tile.x0; column_index < tile.x1; column_index++) {
+                    Vec3 sum(0.0, 0.0, 0.0);
+                    for (int times = 0; times < settings.samples; times++) {
+                        if (use_wavefront) {
+                            sum += wavefront.sample_color(wavefront_sample++);
+                        } else {
+                            sum += render_sample(camera, scene, options, SAMPLER_RANDOM, 0, width, height, row_index, column_index, times);
+                        }
+                    }
+                    frame[row_index * width + column_index] = sum / float(settings.samples);
+                }
+            }
+            thread_stats.count[HEAP_ALLOCATIONS] += thread_allocations - allocations_before;
+            flush_thread_stats();
+        });
+        chrono::duration<double> frame_time = chrono::steady_clock::now() - start;
+        total_seconds += frame_time.count();
+        // (every frame, so the buffers growing in the first one show)
+        result.heap_allocations += global_stats.count[HEAP_ALLOCATIONS];
+        if (f == 0 || frame_time.count() < result.best_seconds) {
+            result.best_seconds = frame_time.count();
+        }
+    }
+    result.mean_seconds = total_seconds / settings.frames;
+    // Every frame traces the same rays, so the counters of the last one stand for all.
+    result.stats = global_stats;
+    result.stages = global_stage_stats;
+
+    // The mean luminance changes when a change to the tracer changes the image.
+    // NaN pixels are counted apart, so the JSON stays valid.
+    double luminance_sum = 0.0;
+    result.non_finite_pixels = 0;
+    for (size_t i = 0; i < frame.size(); i++) {
+        double y = 0.2126 * frame[i].r() + 0.7152 * frame[i].g() + 0.0722 * frame[i].b();
+        if (isfinite(y)) {
+            luminance_sum += y;
+        } else {
+            result.non_finite_pixels++;
+        }
+    }
+    result.mean_luminance = luminance_sum / max<size_t>(1, frame.size() - result.non_finite_pixels);
+    return result;
+}
+
+void write_json(ostream &out, const BenchSettings &settings, const SphereKernels &kernels, int threads, const vector<BenchResult> &results) {
+    //* Print the settings and one object per scene.
+    out << "{\n"
+        << "  \"kernel\": \"" << kernels.name << "\",\n"
+        << "  \"engine\": \"" << engine_names[settings.engine] << "\",\n"
+        << "  \"threads\": " << threads << ",\n"
+        << "  \"shadow_rays\": " << settings.shadow_rays << ",\n"
+        << "  \"occluder_cache\": " << (settings.occluder_cache ? "true" : "false") << ",\n"
+        << "  \"sort_rays\": " << (settings.sort_rays ? "true" : "false") << ",\n"
+        << "  \"cache_counters\": " << (thread_perf_counters.available() ? "true" : "false") << ",\n"
+        << "  \"width\": " << settings.width << ",\n"
+        << "  \"height\": " << settings.height << ",\n"
+        << "  \"samples\": " << settings.samples << ",\n"
+        << "  \"frames\": " << settings.frames << ",\n"
+        << "  \"scenes\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        const RenderStats &s = r.stats;
+        unsigned long long primary = s.count[PRIMARY_RAYS];
+        unsigned long long secondary = s.count[CLOSEST_RAYS] - s.count[PRIMARY_RAYS];
+        unsigned long long shadow = s.count[SHADOW_RAYS];
+        double best = r.best_seconds > 0.0 ? r.best_seconds : 1e-9;
+        out << (i ? ",\n" : "\n")
+            << "    {\n"
+            << "      \"name\": \"" << r.name << "\",\n"
+            << "      \"spheres\": " << r.spheres << ",\n"
+            << "      \"lights\": " << r.lights << ",\n"
+            << "      \"geometry_bytes\": " << r.geometry_bytes << ",\n"
+            << "      \"bytes_per_sphere\": " << double(r.geometry_bytes) / max(1LL, r.spheres) << ",\n"
+            << "      \"scene_ms\": " << r.scene_ms << ",\n"
+            << "      \"bvh_build_ms\": " << r.build.build_ms << ",\n"
+            << "      \"bvh_nodes\": " << r.build.nodes << ",\n"
+            << "      \"bvh_depth\": " << r.build.max_depth << ",\n"
+            << "      \"frame_seconds_best\": " << r.best_seconds << ",\n"
+            << "      \"frame_seconds_mean\": " << r.mean_seconds << ",\n"
+            << "      \"primary_rays\": " << primary << ",\n"
+            << "      \"secondary_rays\": " << secondary << ",\n"
+            << "      \"shadow_rays\": " << shadow << ",\n"
+            << "      \"primary_rays_per_second\": " << primary / best << ",\n"
+            << "      \"secondary_rays_per_second\": " << secondary / best << ",\n"
+            << "      \"shadow_rays_per_second\": " << shadow / best << ",\n"
+            << "      \"rays_per_second\": " << (primary + secondary + shadow) / best << ",\n"
+            << "      \"closest_nodes_per_ray\": " << s.ratio(CLOSEST_NODES, CLOSEST_RAYS) << ",\n"
+            << "      \"closest_tests_per_ray\": " << s.ratio(CLOSEST_TESTS, CLOSEST_RAYS) << ",\n"
+            << "      \"shadow_nodes_per_ray\": " << s.ratio(SHADOW_NODES, SHADOW_RAYS) << ",\n"
+            << "      \"shadow_tests_per_ray\": " << s.ratio(SHADOW_TESTS, SHADOW_RAYS) << ",\n"
+            << "      \"shadow_blocked_fraction\": " << s.ratio(SHADOW_BLOCKED, SHADOW_RAYS) << ",\n"
+            << "      \"occluder_cache_hit_rate\": " << s.ratio(OCCLUDER_HITS, OCCLUDER_LOOKUPS) << ",\n"
+            << "      \"light_tree_nodes_per_pick\": " << s.ratio(LIGHT_TREE_NODES, LIGHT_PICKS) << ",\n"
+            << "      \"cache_misses\": " << s.count[CACHE_MISSES] << ",\n"
+            << "      \"l1d_misses\": " << s.count[L1D_MISSES] << ",\n"
+            << "      \"heap_allocations\": " << r.heap_allocations << ",\n"
+            << "      \"mean_luminance\": " << r.mean_luminance << ",\n"
+            << "      \"non_finite_pixels\": " << r.non_finite_pixels;
+        if (settings.engine == ENGINE_WAVEFRONT) {
+            out << ",\n      \"stages\": {";
+            for (int k = 0; k < STAGE_COUNT; k++) {
+                out << (k ? ", " : "") << "\"" << stage_names[k] << "\": {\"items\": " << r.stages.items[k]
+                    << ", \"seconds\": " << r.stages.seconds[k] << "}";
+            }
+            out << "}";
+        }
+        out << "\n    }";
+    }
+    out << "\n  ]\n}" << endl;
+}
+
+int main(int argc, char **argv) {
+    BenchSettings settings;
+    settings.width = 200;
+    settings.height = 100;
+    settings.samples = 16;
+    settings.frames = 3;
+    settings.threads = max(1, (int)thread::hardware_concurrency());
+    settings.tile_size = 16;
+    settings.kernel = NULL;
+    settings.engine = ENGINE_RECURSIVE;
+    settings.shadow_rays = 1;
+    settings.occluder_cache = true;
+    settings.sort_rays = false;
+    settings.scenes = NULL;
+    settings.json = NULL;
+    if (!parse_arguments(argc, argv, settings)) {
+        return 1;
+    }
+
+    const SphereKernels &kernels = select_kernels(settings.kernel);
+    TilePool pool(settings.threads);
+    vector<BenchResult> results;
+    for (size_t i = 0; i < sizeof(bench_scenes) / sizeof(bench_scenes[0]); i++) {
+        if (!scene_selected(settings, bench_scenes[i].name)) {
+            continue;
+        }
+        cerr << "bench: " << bench_scenes[i].name << endl;
+        results.push_back(run_scene(settings, bench_scenes[i], kernels, pool));
+    }
+    if (results.empty()) {
+        cerr << "no scene matches " << settings.scenes << endl;
+        return 1;
+    }
+
+    cout.precision(6);
+    if (settings.json) {
+        ofstream file(settings.json);
+        write_json(file, settings, kernels, pool.size(), results);
+        if (!file) {
+            cerr << "can not write " << settings.json << endl;
+            return 1;
+        }
+    } else {
+        write_json(cout, settings, kernels, pool.size(), results);
+    }
+    return 0;
+}
@@ -0,0 +1,720 @@
+#ifndef BVHH
+#define BVHH
+
+#include <float.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "ray.h"
+#include "sphere.h"
+#include "sphere_compact.h"
+#include "sphere_soa.h"
+#include "sphere_simd.h"
+#include "stats.h"
+
+#define BVH_BINS 16
+#define BVH_MAX_LEAF_SIZE 4
+#define BVH_STACK_SIZE 64
+
+typedef struct AABB {
+    Vec3 lower;
+    Vec3 upper;
+
+    void reset() {
+        lower = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+        upper = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    }
+
+    void grow(const Vec3 &point) {
+        lower = Vec3(std::min(lower.x(), point.x()), std::min(lower.y(), point.y()), std::min(lower.z(), point.z()));
+        upper = Vec3(std::max(upper.x(), point.x()), std::max(upper.y(), point.y()), std::max(upper.z(), point.z()));
+    }
+
+    void grow(const AABB &box) {
+        if (box.lower.x() > box.upper.x()) {
+            // Empty box.
+            return;
+        }
+        grow(box.lower);
+        grow(box.upper);
+    }
+
+    float surface_area() const {
+        Vec3 extent = upper - lower;
+        if (extent.x() < 0) {
+            // Empty box.
+            return 0.0;
+        }
+        return 2.0f * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+    }
+} AABB;
+
+//* One node of the flattened tree, 32 bytes so two nodes share a cache line.
+//* Nodes are stored in depth-first order: the first child of an interior node
+//* is the next node, the second child is at offset.
+typedef struct BVHNode {
+    float lower[3];
+    // first index in the primitive list for a leaf, second child for an interior node
+    int offset;
+    float upper[3];
+    // primitives in a leaf, 0 for an interior node
+    int count;
+} BVHNode;
+
+typedef struct BVHBuildStats {
+    int primitives;
+    int nodes;
+    int leaves;
+    int max_depth;
+    // expected cost of a random ray (traversal cost 1, intersection cost 1)
+    float sah_cost;
+    double build_ms;
+} BVHBuildStats;
+
+//* Bounding volume hierarchy over the spheres of a scene, built with the
+//* binned surface area heuristic. The tree keeps the indices of the scene
+//* list, so self_index keeps meaning the same sphere.
+//* The leaves test their spheres with the SIMD kernels on an SoA copy of
+//* the spheres stored in leaf order. The hit records are filled from that
+//* copy too, so a tree attached to a mapped scene file needs no sphere list.
+//* A compact tree (compact()) keeps the spheres quantized in its leaves
+//* instead, and decodes a leaf when a ray reaches it.
+class BVH {
+    public:
+        /* constructors */
+        BVH() : nodes(NULL), node_count(0), kernels(&select_kernels()), build_stats(), area_growth(1.0f) {}
+        explicit BVH(const std::vector<Sphere> &spheres) : nodes(NULL), node_count(0), kernels(&select_kernels()) {
+            build(spheres);
+        }
+        BVH(const BVH &other) {
+            *this = other;
+        }
+
+        BVH& operator=(const BVH &other) {
+            node_storage = other.node_storage;
+            nodes = other.nodes == other.node_storage.data() ? node_storage.data() : other.nodes;
+            node_count = other.node_count;
+            indices = other.indices;
+            soa = other.soa;
+            kernels = other.kernels;
+            build_stats = other.build_stats;
+            built_areas = other.built_areas;
+            built_sizes = other.built_sizes;
+            area_growth = other.area_growth;
+            compact_spheres = other.compact_spheres;
+            return *this;
+        }
+
+        void set_kernels(const SphereKernels &kernels) {
+            this->kernels = &kernels;
+        }
+
+        const SphereKernels& get_kernels() const {
+            return *kernels;
+        }
+
+        void build(const std::vector<Sphere> &spheres);
+
+        // Fit the boxes to the spheres (the same spheres the tree was built
+        // from, moved), keeping the tree.
+        void refit(const std::vector<Sphere> &spheres);
+
+        // Follow moved spheres: refit, or build again once the boxes have
+        // grown by more than rebuild_threshold on average (area_growth() >
+        // 1 + rebuild_threshold). Return whether it was built again.
+        // The SAH cost is relative to the root, which a big sphere (the
+        // ground) keeps the same size, so it hardly sees the small boxes
+        // grow and overlap; their own growth does.
+        bool update(const std::vector<Sphere> &spheres, float rebuild_threshold);
+
+        // Use a tree stored elsewhere (a mapped scene file), which must outlive this.
+        // soa has to be in the leaf order of the nodes.
+        void attach(const BVHNode *nodes, int node_count, const SphereSoA &soa, const BVHBuildStats &stats) {
+            node_storage.clear();
+            indices.clear();
+            this->nodes = nodes;
+            this->node_count = node_count;
+            this->soa = soa;
+            build_stats = stats;
+            built_areas.clear();
+            built_sizes.clear();
+            area_growth = 1.0f;
+            compact_spheres.clear();
+        }
+
+        // Quantize the spheres into the leaves and drop the SoA copy and
+        // the build data: 12 bytes per sphere besides the nodes. The
+        // spheres are numbered in leaf order from then on, and the tree can
+        // not be refitted. Return false (and keep the tree) when a leaf is
+        // too big for it.
+        bool compact();
+
+        bool is_compact() const {
+            return !compact_spheres.empty();
+        }
+
+        // Spheres in the tree.
+        int size() const {
+            return is_compact() ? compact_spheres.size() : soa.size();
+        }
+
+        // The spheres in leaf order, and their index in the scene.
+        std::vector<Sphere> leaf_spheres() const;
+        int scene_index(int leaf_index) const {
+            return is_compact() ? leaf_index : soa.scene_index[leaf_index];
+        }
+
+        // Memory of the nodes and the spheres in bytes.
+        size_t bytes() const;
+
+        // Closest hit in (t_min, t_max), skip the sphere self_index.
+        bool intersect(const Ray &ray, float t_min, float t_max, hit_record &record, int self_index) const;
+
+        // Any hit in (t_min, t_max), skip the sphere self_index. Stop at the first one.
+        // occluder (when given) is a sphere to test first, -1 for none; it
+        // is set to the blocking sphere found by the traversal. (A compact
+        // tree keeps the leaf of the blocker instead.)
+        bool occluded(const Ray &ray, float t_min, float t_max, int self_index, int *occluder = NULL) const;
+
+        const BVHBuildStats& get_build_stats() const {
+            return build_stats;
+        }
+
+        // Mean area of the interior boxes over their area when built, 1
+        // right after a build. A box weighs as much as the spheres below it,
+        // so every level of the tree counts the same (a ray goes through
+        // about one box per level).
+        float get_area_growth() const {
+            return area_growth;
+        }
+
+        const BVHNode* get_nodes() const {
+            return nodes;
+        }
+
+        int get_node_count() const {
+            return node_count;
+        }
+
+        // The spheres in leaf order (empty for a compact tree).
+        const SphereSoA& get_soa() const {
+            return soa;
+        }
+
+    private:
+        typedef struct BuildItem {
+            AABB bounds;
+            Vec3 centroid;
+            int index;
+        } BuildItem;
+
+        int build_recursive(std::vector<BuildItem> &items, int first, int last, int depth);
+
+        // A wide kernel tests a whole leaf of up to width spheres at once.
+        float leaf_cost(int count) const {
+            return (float)((count + kernels->width - 1) / kernels->width);
+        }
+
+        int max_leaf_size() const {
+            return std::max(BVH_MAX_LEAF_SIZE, kernels->width);
+        }
+        float node_cost(int node_index) const;
+
+        // The spheres of a leaf as SoA arrays from first on: the ones of
+        // the tree, or the compact ones decoded into a per-thread copy.
+        const SphereSoA& leaf_soa(const BVHNode &node, int &first) const {
+            first = node.offset;
+            if (!is_compact()) {
+                return soa;
+            }
+            static thread_local LeafSoA leaf;
+            compact_spheres.decode(node.lower, node.upper, node.offset, node.count, leaf);
+            first = 0;
+            return leaf.soa;
+        }
+
+        // The nodes built here; nodes points either into it or to attached ones.
+        std::vector<BVHNode> node_storage;
+        const BVHNode *nodes;
+        int node_count;
+        std::vector<int> indices;
+        SphereSoA soa;
+        const SphereKernels *kernels;
+        BVHBuildStats build_stats;
+        // area of every interior node when built (0 for the leaves), and its spheres
+        std::vector<float> built_areas;
+        std::vector<int> built_sizes;
+        float area_growth;
+        // kept between builds, so rebuilding an animated scene does not allocate
+        std::vector<BuildItem> items;
+        // the spheres of a compact tree, empty otherwise
+        CompactSpheres compact_spheres;
+};
+
+inline float node_area(const BVHNode &node) {
+    AABB box;
+    box.lower = Vec3(node.lower[0], node.lower[1], node.lower[2]);
+    box.upper = Vec3(node.upper[0], node.upper[1], node.upper[2]);
+    return box.surface_area();
+}
+
+inline bool hit_node(const BVHNode &node, const Vec3 &origin, const Vec3 &inv_direction, float t_min, float t_max, float &t_enter) {
+    //* Slab test of the ray against the box of the node.
+    for (int axis = 0; axis < 3; axis++) {
+        float t0 = (node.lower[axis] - origin[axis]) * inv_direction[axis];
+        float t1 = (node.upper[axis] - origin[axis]) * inv_direction[axis];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max < t_min) {
+            return false;
+        }
+    }
+    t_enter = t_min;
+    return true;
+}
+
+void BVH::build(const std::vector<Sphere> &spheres) {
+    //* Build the tree from scratch.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    items.resize(spheres.size());
+    for (size_t i = 0; i < spheres.size(); i++) {
+        Vec3 center = spheres[i].get_center();
+        float radius = spheres[i].get_radius();
+        items[i].bounds.lower = center - Vec3(radius, radius, radius);
+        items[i].bounds.upper = center + Vec3(radius, radius, radius);
+        items[i].centroid = center;
+        items[i].index = (int)i;
+    }
+
+    node_storage.clear();
+    indices.clear();
+    compact_spheres.clear();
+    node_storage.reserve(spheres.size() * 2);
+    indices.reserve(spheres.size());
+    build_stats = BVHBuildStats{(int)spheres.size(), 0, 0, 0, 0.0f, 0.0};
+    if (!items.empty()) {
+        build_recursive(items, 0, (int)items.size(), 1);
+    }
+    nodes = node_storage.data();
+    node_count = (int)node_storage.size();
+    if (node_count > 0) {
+        build_stats.sah_cost = node_cost(0);
+    }
+    soa.build(spheres, indices);
+    build_stats.nodes = node_count;
+    built_areas.resize(node_count);
+    built_sizes.resize(node_count);
+    for (int i = node_count - 1; i >= 0; i--) {
+        built_areas[i] = nodes[i].count > 0 ? 0.0f : node_area(nodes[i]);
+        built_sizes[i] = nodes[i].count > 0 ? nodes[i].count : built_sizes[i + 1] + built_sizes[nodes[i].offset];
+    }
+    area_growth = 1.0f;
+
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    build_stats.build_ms = elapsed.count();
+}
+
+int BVH::build_recursive(std::vector<BuildItem> &items, int first, int last, int depth) {
+    //* Build the subtree of items[first, last) and return its node index.
+
+    int node_index = (int)node_storage.size();
+    node_storage.push_back(BVHNode());
+    build_stats.max_depth = std::max(build_stats.max_depth, depth);
+
+    AABB bounds, centroid_bounds;
+    bounds.reset();
+    centroid_bounds.reset();
+    for (int i = first; i < last; i++) {
+        bounds.grow(items[i].bounds);
+        centroid_bounds.grow(items[i].centroid);
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        node_storage[node_index].lower[axis] = bounds.lower[axis];
+        node_storage[node_index].upper[axis] = bounds.upper[axis];
+    }
+
+    int count = last - first;
+    // Find the cheapest split over the bins of all three axes.
+    int best_axis = -1;
+    int best_split = 0;
+    float best_cost = FLT_MAX;
+    float parent_area = bounds.surface_area();
+    if (count > 1 && parent_area > 0.0f) {
+        for (int axis = 0; axis < 3; axis++) {
+            float axis_lower = centroid_bounds.lower[axis];
+            float axis_extent = centroid_bounds.upper[axis] - axis_lower;
+            if (axis_extent <= 0.0f) {
+                continue;
+            }
+            AABB bin_bounds[BVH_BINS];
+            int bin_count[BVH_BINS] = {0};
+            for (int b = 0; b < BVH_BINS; b++) {
+                bin_bounds[b].reset();
+            }
+            float scale = BVH_BINS / axis_extent;
+            for (int i = first; i < last; i++) {
+                int b = std::min(BVH_BINS - 1, (int)((items[i].centroid[axis] - axis_lower) * scale));
+                bin_count[b]++;
+                bin_bounds[b].grow(items[i].bounds);
+            }
+
+            // Sweep from the right to get the cost of every right side, then from the left.
+            float right_area[BVH_BINS];
+            int right_count[BVH_BINS];
+            AABB sweep;
+            sweep.reset();
+            int sweep_count = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--) {
+                sweep.grow(bin_bounds[b]);
+                sweep_count += bin_count[b];
+                right_area[b] = sweep.surface_area();
+                right_count[b] = sweep_count;
+            }
+            sweep.reset();
+            sweep_count = 0;
+            for (int b = 0; b < BVH_BINS - 1; b++) {
+                sweep.grow(bin_bounds[b]);
+                sweep_count += bin_count[b];
+                if (sweep_count == 0 || right_count[b + 1] == 0) {
+                    continue;
+                }
+                float cost = 1.0f + (sweep.surface_area() * sweep_count + right_area[b + 1] * right_count[b + 1]) / parent_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b + 1;
+                }
+            }
+        }
+    }
+
+    // A leaf costs one kernel call per kernel width of primitives.
+    // (Also stop before the tree gets deeper than the traversal stack.)
+    bool make_leaf = count == 1 || (best_cost >= leaf_cost(count) && count <= max_leaf_size()) || depth >= BVH_STACK_SIZE - 1;
+    if (make_leaf) {
+        node_storage[node_index].offset = (int)indices.size();
+        node_storage[node_index].count = count;
+        for (int i = first; i < last; i++) {
+            indices.push_back(items[i].index);
+        }
+        build_stats.leaves++;
+        return node_index;
+    }
+
+    int middle;
+    if (best_axis >= 0) {
+        float axis_lower = centroid_bounds.lower[best_axis];
+        float scale = BVH_BINS / (centroid_bounds.upper[best_axis] - axis_lower);
+        BuildItem *split = std::partition(&items[first], &items[first] + count, [&](const BuildItem &item) {
+            return std::min(BVH_BINS - 1, (int)((item.centroid[best_axis] - axis_lower) * scale)) < best_split;
+        });
+        middle = (int)(split - &items[0]);
+    } else {
+        // All centroids are at the same point: split in the middle of the list.
+        middle = first + count / 2;
+    }
+
+    build_recursive(items, first, middle, depth + 1);
+    int second = build_recursive(items, middle, last, depth + 1);
+    node_storage[node_index].offset = second;
+    node_storage[node_index].count = 0;
+    return node_index;
+}
+
+void BVH::refit(const std::vector<Sphere> &spheres) {
+    //* Boxes of the leaves from their spheres, then of every interior node
+    //* from its children. Children come after their parent in the node
+    //* list, so one pass from the back does it.
+    soa.refresh(spheres);
+    double growth_sum = 0.0, weight_sum = 0.0;
+    for (int node_index = node_count - 1; node_index >= 0; node_index--) {
+        BVHNode &node = node_storage[node_index];
+        AABB bounds;
+        bounds.reset();
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) {
+                Vec3 center(soa.center_x[i], soa.center_y[i], soa.center_z[i]);
+                float radius = soa.radius[i];
+                // The same arithmetic as build(), so an unmoved sphere gives the same box.
+                bounds.grow(center - Vec3(radius, radius, radius));
+                bounds.grow(center + Vec3(radius, radius, radius));
+            }
+        } else {
+            const BVHNode *children[2] = {&node_storage[node_index + 1], &node_storage[node.offset]};
+            for (int c = 0; c < 2; c++) {
+                bounds.grow(Vec3(children[c]->lower));
+                bounds.grow(Vec3(children[c]->upper));
+            }
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            node.lower[axis] = bounds.lower[axis];
+            node.upper[axis] = bounds.upper[axis];
+        }
+        if (node.count == 0 && built_areas[node_index] > 0.0f) {
+            growth_sum += built_sizes[node_index] * (double)(node_area(node) / built_areas[node_index]);
+            weight_sum += built_sizes[node_index];
+        }
+    }
+    area_growth = weight_sum > 0.0 ? (float)(growth_sum / weight_sum) : 1.0f;
+    if (node_count > 0) {
+        build_stats.sah_cost = node_cost(0);
+    }
+}
+
+bool BVH::update(const std::vector<Sphere> &spheres, float rebuild_threshold) {
+    // An attached or compact tree is read-only, and other spheres need a new tree anyway.
+    if (node_storage.empty() || is_compact() || (int)spheres.size() != soa.size()) {
+        build(spheres);
+        return true;
+    }
+    refit(spheres);
+    if (area_growth > 1.0f + rebuild_threshold) {
+        build(spheres);
+        return true;
+    }
+    return false;
+}
+
+bool BVH::compact() {
+    //* Quantize every leaf against its own box, then let go of the float copy.
+    for (int n = 0; n < node_count; n++) {
+        if (nodes[n].count > COMPACT_LEAF_CAPACITY) {
+            std::cerr << "a BVH leaf holds " << nodes[n].count << " spheres, a compact tree at most "
+                      << COMPACT_LEAF_CAPACITY << std::endl;
+            return false;
+        }
+    }
+    if (node_count == 0) {
+        return true;
+    }
+    compact_spheres.reset(soa.size());
+    for (int n = 0; n < node_count; n++) {
+        if (nodes[n].count > 0) {
+            compact_spheres.quantize(nodes[n].lower, nodes[n].upper, nodes[n].offset, nodes[n].count, soa);
+        }
+    }
+    soa = SphereSoA();
+    std::vector<int>().swap(indices);
+    std::vector<BuildItem>().swap(items);
+    std::vector<float>().swap(built_areas);
+    std::vector<int>().swap(built_sizes);
+    return true;
+}
+
+std::vector<Sphere> BVH::leaf_spheres() const {
+    std::vector<Sphere> spheres;
+    spheres.reserve(size());
+    for (int n = 0; n < node_count; n++) {
+        const BVHNode &node = nodes[n];
+        for (int i = node.offset; i < node.offset + node.count; i++) {
+            if (is_compact()) {
+                spheres.push_back(compact_spheres.decode_sphere(node.lower, node.upper, i));
+            } else {
+                spheres.push_back(Sphere(Vec3(soa.center_x[i], soa.center_y[i], soa.center_z[i]), soa.radius[i],
+                                         soa.material_id[i]));
+            }
+        }
+    }
+    return spheres;
+}
+
+size_t BVH::bytes() const {
+    //* What the tree keeps for rendering and for refitting or rebuilding
+    //* (an attached tree lives in the mapped file and counts as its size).
+    size_t padded = soa.size() > 0 ? (size_t)soa.size() + SOA_PADDING : 0;
+    return (size_t)node_count * sizeof(BVHNode) + padded * (4 * sizeof(float) + 2 * sizeof(int)) +
+           indices.capacity() * sizeof(int) + items.capacity() * sizeof(BuildItem) +
+           built_areas.capacity() * sizeof(float) + built_sizes.capacity() * sizeof(int) + compact_spheres.bytes();
+}
+
+float BVH::node_cost(int node_index) const {
+    //* SAH cost of the built subtree, relative to the area of its root.
+    const BVHNode &node = nodes[node_index];
+    if (node.count > 0) {
+        return leaf_cost(node.count);
+    }
+    float area = node_area(node);
+    float first_cost = node_cost(node_index + 1);
+    float second_cost = node_cost(node.offset);
+    if (area <= 0.0f) {
+        return 1.0f + first_cost + second_cost;
+    }
+    return 1.0f + (node_area(nodes[node_index + 1]) * first_cost + node_area(nodes[node.offset]) * second_cost) / area;
+}
+
+bool BVH::intersect(const Ray &ray, float t_min, float t_max, hit_record &record, int self_index) const {
+    //* Find the closest intersection and record it to 'record'.
+    //* Visit the nearer child first, and skip the nodes that start behind the
+    //* closest hit found so far: a deferred child keeps its entry distance,
+    //* and is dropped when it comes off the stack behind a hit found since.
+
+    if (node_count == 0) {
+        return false;
+    }
+    Vec3 origin = ray.origin();
+    Vec3 direction = ray.direction();
+    Vec3 inv_direction(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z());
+    KernelRay kray = make_kernel_ray(ray);
+
+    int stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+    int cloest_index = -1;
+    int cloest_node = -1;
+    float current_cloest_t = t_max;
+    unsigned long long visited = 0, tests = 0;
+
+    auto pop = [&]() {
+        while (stack_size > 0) {
+            stack_size--;
+            if (stack_t[stack_size] <= current_cloest_t) {
+                return stack[stack_size];
+            }
+        }
+        return -1;
+    };
+
+    float t_enter;
+    if (!hit_node(nodes[0], origin, inv_direction, t_min, current_cloest_t, t_enter)) {
+        node_index = -1;
+    }
+    while (node_index >= 0) {
+        const BVHNode &node = nodes[node_index];
+        visited++;
+        if (node.count > 0) {
+            tests += node.count;
+            int first;
+            const SphereSoA &leaf = leaf_soa(node, first);
+            int hit = kernels->closest(leaf, first, node.count, kray, t_min, current_cloest_t, self_index);
+            if (hit >= 0) {
+                cloest_index = hit - first + node.offset;
+                cloest_node = node_index;
+            }
+            node_index = pop();
+            continue;
+        }
+
+        int first = node_index + 1;
+        int second = node.offset;
+        float t_first = 0.0f, t_second = 0.0f;
+        bool hit_first = hit_node(nodes[first], origin, inv_direction, t_min, current_cloest_t, t_first);
+        bool hit_second = hit_node(nodes[second], origin, inv_direction, t_min, current_cloest_t, t_second);
+        if (hit_first && hit_second) {
+            if (t_second < t_first) {
+                std::swap(first, second);
+                std::swap(t_first, t_second);
+            }
+            stack[stack_size] = second;
+            stack_t[stack_size++] = t_second;
+            node_index = first;
+        } else if (hit_first) {
+            node_index = first;
+        } else if (hit_second) {
+            node_index = second;
+        } else {
+            node_index = pop();
+        }
+    }
+
+    thread_stats.count[CLOSEST_NODES] += visited;
+    thread_stats.count[CLOSEST_TESTS] += tests;
+    if (cloest_index < 0) {
+        return false;
+    }
+    // Only the final hit needs the hit point and the normal.
+    if (is_compact()) {
+        const BVHNode &leaf = nodes[cloest_node];
+        compact_spheres.decode_sphere(leaf.lower, leaf.upper, cloest_index).set_record(ray, current_cloest_t, record);
+    } else {
+        Sphere sphere(Vec3(soa.center_x[cloest_index], soa.center_y[cloest_index], soa.center_z[cloest_index]),
+                      soa.radius[cloest_index], soa.material_id[cloest_index]);
+        sphere.set_record(ray, current_cloest_t, record);
+    }
+    record.in_scene_index = scene_index(cloest_index);
+    return true;
+}
+
+bool BVH::occluded(const Ray &ray, float t_min, float t_max, int self_index, int *occluder) const {
+    //* Check whether any sphere is hit in (t_min, t_max). The order does not
+    //* matter, so return at the first blocker.
+    //* Shadow rays of nearby samples are mostly blocked by the same sphere,
+    //* so the last blocker (occluder) is tested before the tree is walked.
+
+    if (node_count == 0) {
+        return false;
+    }
+    KernelRay kray = make_kernel_ray(ray);
+    unsigned long long visited = 0, tests = 0;
+    if (occluder && *occluder >= 0 && *occluder < (is_compact() ? node_count : soa.size())) {
+        thread_stats.count[OCCLUDER_LOOKUPS]++;
+        bool hit;
+        if (is_compact()) {
+            const BVHNode &node = nodes[*occluder];
+            int first;
+            const SphereSoA &leaf = leaf_soa(node, first);
+            tests += node.count;
+            hit = kernels->any(leaf, first, node.count, kray, t_min, t_max, self_index);
+        } else {
+            tests++;
+            hit = any_scalar(soa, *occluder, 1, kray, t_min, t_max, self_index);
+        }
+        if (hit) {
+            thread_stats.count[OCCLUDER_HITS]++;
+            thread_stats.count[SHADOW_TESTS] += tests;
+            return true;
+        }
+    }
+    Vec3 origin = ray.origin();
+    Vec3 direction = ray.direction();
+    Vec3 inv_direction(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z());
+
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    bool blocked = false;
+
+    while (stack_size > 0 && !blocked) {
+        const BVHNode &node = nodes[stack[--stack_size]];
+        float t_enter;
+        visited++;
+        if (!hit_node(node, origin, inv_direction, t_min, t_max, t_enter)) {
+            continue;
+        }
+        if (node.count > 0) {
+            tests += node.count;
+            int first;
+            const SphereSoA &leaf = leaf_soa(node, first);
+            blocked = kernels->any(leaf, first, node.count, kray, t_min, t_max, self_index);
+            if (blocked && occluder && is_compact()) {
+                *occluder = (int)(&node - nodes);
+            } else if (blocked && occluder) {
+                // Which sphere of the leaf it was, for the next ray.
+                for (int i = node.offset; i < node.offset + node.count; i++) {
+                    if (any_scalar(soa, i, 1, kray, t_min, t_max, self_index)) {
+                        *occluder = i;
+                        break;
+                    }
+                }
+            }
+        } else {
+            stack[stack_size++] = node.offset;
+            stack[stack_size++] = (int)(&node - nodes) + 1;
+        }
+    }
+
+    thread_stats.count[SHADOW_NODES] += visited;
+    thread_stats.count[SHADOW_TESTS] += tests;
+    if (occluder && !blocked) {
+        // Lit points come in runs as well; they need no test until a ray is blocked again.
+        *occluder = -1;
+    }
+    return blocked;
+}
+
+#endif
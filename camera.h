@@ -1,78 +1,186 @@
-#ifndef CAMERAH
-#define CAMERAH
-
-#include <math.h>
-#define M_PI 3.14159265358979323846
-#include "ray.h"
-
-class Camera {
-    public:
-        /* constructors */
-        Camera() {
-            lower_left_corner = Vec3(-2.0, -1.0, -1.0);
-            origin = Vec3(0.0, 0.0, 1.0);
-            horizontal = Vec3(4.0, 0.0, 0.0);
-            vertical = Vec3(0.0, 2.0, 0.0);
-        }
-
-        Camera(Vec3 lower_left_corner, Vec3 origin,
-               Vec3 horizontal, Vec3 vertical) {
-            this->lower_left_corner = lower_left_corner;
-            this->origin = origin;
-            this->horizontal = horizontal;
-            this->vertical = vertical;
-        }
-        // Camera(Vec3 look_from, Vec3 look_at, Vec3 vup, float vfov, float aspect, float aperture, float focus_dist) {
-        //     //* vup: The camera's tilt direction is view up (referred to as vup, generally set to (0, 1, 0)).
-        //     //* vfov: top to bottom in degrees
-        //     //* aspect = width / height
-        //     lens_radius = aperture / 2;
-        //     float theta = vfov * M_PI / 180;
-        //     float half_height = tan(theta / 2);
-        //     float half_width = aspect * half_height;
-            
-        //     origin = look_from;
-        //     w = unit_vector(look_from - look_at);
-        //     u = unit_vector(cross(vup, w));
-        //     v = cross(w, u);
-
-        //     lower_left_corner = origin - half_width * focus_dist * u - half_height * focus_dist*v - focus_dist*w;
-        //     horizontal = focus_dist * 2 * half_width * u;
-        //     vertical = focus_dist * 2 * half_height * v;
-        // }
-        
-
-        /* other methods */
-        Ray get_ray(float u, float v) {
-            // The vector in the () is the pixel point vector of the plane.
-            // direction = the pixel point vector - origin
-            return Ray(origin, (lower_left_corner + u * horizontal + v * vertical) - origin);
-        }
-
-        // Ray get_ray(float s, float t) {
-        //     Vec3 rd = lens_radius * random_in_unit_disk();
-        //     Vec3 offset = u * rd.x() + v * rd.y();
-        //     return Ray(origin + offset, lower_left_corner + s*horizontal + t*vertical - origin - offset);
-        // }
-
-        Vec3 random_in_unit_disk() {
-            //* On the z = 0 plane, a vector with a starting point at the origin,
-            //* a length less than 1, and a random direction is generated.
-            //* Why the z = 0 plane is related to the tilt direction of the camera.
-            Vec3 p;
-            do {
-                p = 2.0 * Vec3((rand() % (100) / (float)(100)), (rand() % (100) / (float)(100)), 0) - Vec3(1, 1, 0);
-            } while (dot(p, p) >= 1.0);
-            return p;
-        }
-
-    private:
-        Vec3 lower_left_corner;
-        Vec3 origin;
-        Vec3 horizontal;
-        Vec3 vertical;
-        Vec3 u, v, w;
-        float lens_radius;
-};
-
-#endif
\ No newline at end of file
+#ifndef CAMERAH
+#define CAMERAH
+
+#include <math.h>
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+#include "ray.h"
+#include "rng.h"
+
+// sin and cos on [-pi/4, pi/4] for concentric_disk(), Taylor polynomials
+// (error below 3e-7). The SIMD camera kernels evaluate the same ones, so
+// a lens sample has the same bits there.
+#define DISK_SIN_3 (-1.0f / 6.0f)
+#define DISK_SIN_5 (1.0f / 120.0f)
+#define DISK_SIN_7 (-1.0f / 5040.0f)
+#define DISK_COS_2 (-1.0f / 2.0f)
+#define DISK_COS_4 (1.0f / 24.0f)
+#define DISK_COS_6 (-1.0f / 720.0f)
+#define DISK_COS_8 (1.0f / 40320.0f)
+
+inline void concentric_disk(float u1, float u2, float &x, float &y) {
+    //* Map [0, 1)^2 onto the unit disk without rejection (Shirley and Chiu):
+    //* the square [-1, 1]^2 is cut into four triangles by its diagonals,
+    //* and each one is squeezed into a quarter of the disk. Neighbouring
+    //* points stay neighbours and equal areas stay equal, so stratified
+    //* or low-discrepancy samples stay well spread on the lens.
+    float a = 2.0f * u1 - 1.0f;
+    float b = 2.0f * u2 - 1.0f;
+    // The angle is pi/4 * b/a in the left and right triangles, and
+    // pi/2 - pi/4 * a/b in the others (there cos and sin swap).
+    bool sides = fabsf(a) > fabsf(b);
+    float r = sides ? a : b;
+    float ratio = sides ? b / a : a / b;
+    // (the center, a = b = 0, has r = 0)
+    ratio = b == 0.0f ? 0.0f : ratio;
+    float phi = float(M_PI / 4.0) * ratio;
+    float phi2 = phi * phi;
+    float sin_phi = phi * (1.0f + phi2 * (DISK_SIN_3 + phi2 * (DISK_SIN_5 + phi2 * DISK_SIN_7)));
+    float cos_phi = 1.0f + phi2 * (DISK_COS_2 + phi2 * (DISK_COS_4 + phi2 * (DISK_COS_6 + phi2 * DISK_COS_8)));
+    x = r * (sides ? cos_phi : sin_phi);
+    y = r * (sides ? sin_phi : cos_phi);
+}
+
+//* The camera as plain floats, for the network messages.
+typedef struct CameraWire {
+    // lower left corner, origin, horizontal, vertical, u and v
+    float vectors[6][3];
+    float lens_radius;
+} CameraWire;
+
+class Camera {
+    public:
+        /* constructors */
+        Camera() : lower_left_corner(-2.0, -1.0, -1.0), origin(0.0, 0.0, 1.0), horizontal(4.0, 0.0, 0.0),
+                   vertical(0.0, 2.0, 0.0), u(1.0, 0.0, 0.0), v(0.0, 1.0, 0.0), w(0.0, 0.0, 1.0), lens_radius(0.0f) {}
+
+        Camera(Vec3 lower_left_corner, Vec3 origin,
+               Vec3 horizontal, Vec3 vertical) {
+            //* A pinhole camera from its projection plane.
+            this->lower_left_corner = lower_left_corner;
+            this->origin = origin;
+            this->horizontal = horizontal;
+            this->vertical = vertical;
+            u = unit_vector(horizontal);
+            v = unit_vector(vertical);
+            w = cross(u, v);
+            lens_radius = 0.0f;
+        }
+
+        Camera(Vec3 look_from, Vec3 look_at, Vec3 vup, float vfov, float aspect, float aperture, float focus_dist) {
+            //* vup: The camera's tilt direction is view up (referred to as vup, generally set to (0, 1, 0)).
+            //* vfov: top to bottom in degrees
+            //* aspect = width / height
+            //* aperture: diameter of the lens, 0 for a pinhole camera
+            //* focus_dist: distance of the plane in focus (the projection plane)
+            lens_radius = aperture / 2;
+            float theta = vfov * M_PI / 180;
+            float half_height = tan(theta / 2);
+            float half_width = aspect * half_height;
+
+            origin = look_from;
+            w = unit_vector(look_from - look_at);
+            u = unit_vector(cross(vup, w));
+            v = cross(w, u);
+
+            lower_left_corner = origin - half_width * focus_dist * u - half_height * focus_dist * v - focus_dist * w;
+            horizontal = focus_dist * 2 * half_width * u;
+            vertical = focus_dist * 2 * half_height * v;
+        }
+
+        /* other methods */
+        const Vec3& get_lower_left_corner() const {
+            return lower_left_corner;
+        }
+
+        const Vec3& get_origin() const {
+            return origin;
+        }
+
+        const Vec3& get_horizontal() const {
+            return horizontal;
+        }
+
+        const Vec3& get_vertical() const {
+            return vertical;
+        }
+
+        const Vec3& get_u() const {
+            return u;
+        }
+
+        const Vec3& get_v() const {
+            return v;
+        }
+
+        float get_lens_radius() const {
+            return lens_radius;
+        }
+
+        bool has_lens() const {
+            return lens_radius > 0.0f;
+        }
+
+        Ray get_ray(float s, float t) const {
+            // The vector in the () is the pixel point vector of the plane.
+            // direction = the pixel point vector - origin
+            return Ray(origin, (lower_left_corner + s * horizontal + t * vertical) - origin);
+        }
+
+        Ray get_ray(float s, float t, float lens_u, float lens_v) const {
+            //* Thin lens: the ray starts at the point (lens_u, lens_v) in [0, 1)^2
+            //* of the lens (through concentric_disk()), and goes through the same
+            //* point of the plane in focus as the ray from the center.
+            float lens_x, lens_y;
+            concentric_disk(lens_u, lens_v, lens_x, lens_y);
+            Vec3 offset = u * (lens_radius * lens_x) + v * (lens_radius * lens_y);
+            return Ray(origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset);
+        }
+
+        Vec3 random_in_unit_disk(Pcg32 &rng) const {
+            //* On the z = 0 plane, a vector with a starting point at the origin,
+            //* a length less than 1, and a random direction is generated.
+            //* Why the z = 0 plane is related to the tilt direction of the camera.
+            float x, y;
+            concentric_disk(rng.next_float(), rng.next_float(), x, y);
+            return Vec3(x, y, 0);
+        }
+
+        CameraWire to_wire() const;
+        static Camera from_wire(const CameraWire &wire);
+
+    private:
+        Vec3 lower_left_corner;
+        Vec3 origin;
+        Vec3 horizontal;
+        Vec3 vertical;
+        Vec3 u, v, w;
+        float lens_radius;
+};
+
+CameraWire Camera::to_wire() const {
+    CameraWire wire;
+    const Vec3 *vectors[6] = {&lower_left_corner, &origin, &horizontal, &vertical, &u, &v};
+    for (int i = 0; i < 6; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            wire.vectors[i][axis] = (*vectors[i])[axis];
+        }
+    }
+    wire.lens_radius = lens_radius;
+    return wire;
+}
+
+Camera Camera::from_wire(const CameraWire &wire) {
+    Camera camera;
+    Vec3 *vectors[6] = {&camera.lower_left_corner, &camera.origin, &camera.horizontal, &camera.vertical,
+                        &camera.u, &camera.v};
+    for (int i = 0; i < 6; i++) {
+        *vectors[i] = Vec3(wire.vectors[i][0], wire.vectors[i][1], wire.vectors[i][2]);
+    }
+    camera.w = cross(camera.u, camera.v);
+    camera.lens_radius = wire.lens_radius;
+    return camera;
+}
+
+#endif
@@ -0,0 +1,301 @@
+#ifndef CAMERARAYSH
+#define CAMERARAYSH
+
+#include <stddef.h>
+#include <vector>
+
+#include "camera.h"
+#include "rng.h"
+#include "sphere_simd.h"
+
+//* The camera rays of many samples at once. A batch first collects the
+//* sample positions (add_pixel(): the generator of every sample is its own,
+//* so this part stays scalar), then generate() turns all of them into rays
+//* in one pass over SoA arrays, 4 or 8 rays per instruction, lens mapping
+//* included. The SIMD kernels do the float operations of Camera::get_ray()
+//* and the Ray constructor in the same order, so a ray has the same bits as
+//* camera.get_ray() gives (microbench checks it).
+
+inline void camera_sample_position(Pcg32 &rng, Sampler sampler, unsigned int seed, int width, int height,
+                                   int row_index, int column_index, int times, bool lens,
+                                   float &s, float &t, float &lens_u, float &lens_v, unsigned int &path_seed) {
+    //* Where sample times of a pixel (row 0 is the bottom row) goes through
+    //* the image plane (s, t) and the lens (lens_u, lens_v in [0, 1)^2), and
+    //* the seed of its ray tree. rng is the generator of the sample
+    //* (sample_rng()): it does not matter which thread takes it or in
+    //* which pass.
+    unsigned int pixel_index = (unsigned int)(row_index * width + column_index);
+    float jitter_u, jitter_v;
+    sample_2d(sampler, seed, pixel_index, column_index, row_index, times, rng, jitter_u, jitter_v);
+    // s is the horizontal offset of the current point from the lower left corner.
+    s = (column_index + jitter_u) / float(width);
+    // t is the vertical offset of the current point from the lower left corner.
+    t = (row_index + jitter_v) / float(height);
+    path_seed = rng.next();
+    lens_u = lens_v = 0.5f;
+    if (lens) {
+        // Drawn after the seed, so a pinhole camera keeps the numbers it had.
+        lens_u = rng.next_float();
+        lens_v = rng.next_float();
+    }
+}
+
+class CameraRayBatch {
+    public:
+        void clear() {
+            s.clear(); t.clear();
+            lens_u.clear(); lens_v.clear();
+            path_seed.clear();
+        }
+
+        void reserve(size_t count) {
+            //* Room for count samples, so batches up to that size do not allocate.
+            s.reserve(count); t.reserve(count);
+            lens_u.reserve(count); lens_v.reserve(count);
+            path_seed.reserve(count);
+            ox.reserve(count); oy.reserve(count); oz.reserve(count);
+            dx.reserve(count); dy.reserve(count); dz.reserve(count);
+        }
+
+        // Append samples [first, end) of a pixel.
+        void add_pixel(const Camera &camera, Sampler sampler, unsigned int seed, int width, int height,
+                       int row_index, int column_index, int first, int end);
+
+        // Fill the rays of all samples with the kernel of isa.
+        void generate(const Camera &camera, SimdIsa isa);
+
+        Ray ray(size_t i) const {
+            return Ray::from_unit(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]));
+        }
+
+        size_t size() const {
+            return path_seed.size();
+        }
+
+        // the sample positions on the image plane and on the lens
+        std::vector<float> s, t;
+        std::vector<float> lens_u, lens_v;
+        std::vector<unsigned int> path_seed;
+        // the rays, after generate()
+        std::vector<float> ox, oy, oz;
+        std::vector<float> dx, dy, dz;
+};
+
+void CameraRayBatch::add_pixel(const Camera &camera, Sampler sampler, unsigned int seed, int width, int height,
+                               int row_index, int column_index, int first, int end) {
+    size_t base = size(), count = end > first ? (size_t)(end - first) : 0;
+    s.resize(base + count); t.resize(base + count);
+    lens_u.resize(base + count); lens_v.resize(base + count);
+    path_seed.resize(base + count);
+    // sample_rng() without hashing the pixel again for every sample
+    unsigned int pixel_index = (unsigned int)(row_index * width + column_index);
+    uint64_t pixel_hash = mix64(((uint64_t)seed << 32) | pixel_index);
+    bool lens = camera.has_lens();
+    for (size_t k = 0; k < count; k++) {
+        int times = first + (int)k;
+        Pcg32 rng(pixel_hash, (unsigned int)times);
+        camera_sample_position(rng, sampler, seed, width, height, row_index, column_index, times, lens,
+                               s[base + k], t[base + k], lens_u[base + k], lens_v[base + k], path_seed[base + k]);
+    }
+}
+
+RT_NO_CONTRACT_BEGIN
+
+void camera_rays_scalar(const Camera &camera, CameraRayBatch &batch, size_t first, size_t last) {
+    //* Rays [first, last) of the batch, one at a time.
+    bool lens = camera.has_lens();
+    for (size_t i = first; i < last; i++) {
+        Ray ray = lens ? camera.get_ray(batch.s[i], batch.t[i], batch.lens_u[i], batch.lens_v[i])
+                       : camera.get_ray(batch.s[i], batch.t[i]);
+        batch.ox[i] = ray.origin().x(); batch.oy[i] = ray.origin().y(); batch.oz[i] = ray.origin().z();
+        batch.dx[i] = ray.direction().x(); batch.dy[i] = ray.direction().y(); batch.dz[i] = ray.direction().z();
+    }
+}
+
+void camera_rays_scalar(const Camera &camera, CameraRayBatch &batch) {
+    camera_rays_scalar(camera, batch, 0, batch.size());
+}
+
+#ifdef RT_SIMD_X86
+
+/* SSE2 (4 rays) */
+
+inline __m128 inverse_sqrt_sse(__m128 x) {
+#if defined(RT_FAST_RSQRT) && defined(VEC3_HAVE_RSQRT)
+    // inverse_sqrt_fast(): y * (1.5 - 0.5 * x * y * y)
+    __m128 y = _mm_rsqrt_ps(x);
+    __m128 half_x_y_y = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), x), y), y);
+    return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), half_x_y_y));
+#else
+    return _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(x));
+#endif
+}
+
+inline __m128 select_sse(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+inline void concentric_disk_sse(__m128 u1, __m128 u2, __m128 &x, __m128 &y) {
+    //* concentric_disk() of 4 points.
+    __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), sign = _mm_set1_ps(-0.0f);
+    __m128 a = _mm_sub_ps(_mm_mul_ps(two, u1), one);
+    __m128 b = _mm_sub_ps(_mm_mul_ps(two, u2), one);
+    __m128 sides = _mm_cmpgt_ps(_mm_andnot_ps(sign, a), _mm_andnot_ps(sign, b));
+    __m128 r = select_sse(sides, a, b);
+    __m128 ratio = select_sse(sides, _mm_div_ps(b, a), _mm_div_ps(a, b));
+    ratio = _mm_andnot_ps(_mm_cmpeq_ps(b, _mm_setzero_ps()), ratio);
+    __m128 phi = _mm_mul_ps(_mm_set1_ps(float(M_PI / 4.0)), ratio);
+    __m128 phi2 = _mm_mul_ps(phi, phi);
+    __m128 sin_phi = _mm_add_ps(_mm_set1_ps(DISK_SIN_5), _mm_mul_ps(phi2, _mm_set1_ps(DISK_SIN_7)));
+    sin_phi = _mm_add_ps(_mm_set1_ps(DISK_SIN_3), _mm_mul_ps(phi2, sin_phi));
+    sin_phi = _mm_mul_ps(phi, _mm_add_ps(one, _mm_mul_ps(phi2, sin_phi)));
+    __m128 cos_phi = _mm_add_ps(_mm_set1_ps(DISK_COS_6), _mm_mul_ps(phi2, _mm_set1_ps(DISK_COS_8)));
+    cos_phi = _mm_add_ps(_mm_set1_ps(DISK_COS_4), _mm_mul_ps(phi2, cos_phi));
+    cos_phi = _mm_add_ps(_mm_set1_ps(DISK_COS_2), _mm_mul_ps(phi2, cos_phi));
+    cos_phi = _mm_add_ps(one, _mm_mul_ps(phi2, cos_phi));
+    x = _mm_mul_ps(r, select_sse(sides, cos_phi, sin_phi));
+    y = _mm_mul_ps(r, select_sse(sides, sin_phi, cos_phi));
+}
+
+void camera_rays_sse(const Camera &camera, CameraRayBatch &batch) {
+    const Vec3 &corner = camera.get_lower_left_corner(), &origin = camera.get_origin();
+    const Vec3 &horizontal = camera.get_horizontal(), &vertical = camera.get_vertical();
+    const Vec3 &u = camera.get_u(), &v = camera.get_v();
+    bool lens = camera.has_lens();
+    __m128 lens_radius = _mm_set1_ps(camera.get_lens_radius());
+    size_t count = batch.size();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 s = _mm_loadu_ps(&batch.s[i]), t = _mm_loadu_ps(&batch.t[i]);
+        __m128 o[3], d[3];
+        for (int axis = 0; axis < 3; axis++) {
+            // (corner + s * horizontal + t * vertical) - origin
+            __m128 point = _mm_add_ps(_mm_add_ps(_mm_set1_ps(corner[axis]), _mm_mul_ps(s, _mm_set1_ps(horizontal[axis]))),
+                                      _mm_mul_ps(t, _mm_set1_ps(vertical[axis])));
+            o[axis] = _mm_set1_ps(origin[axis]);
+            d[axis] = _mm_sub_ps(point, o[axis]);
+        }
+        if (lens) {
+            __m128 disk_x, disk_y;
+            concentric_disk_sse(_mm_loadu_ps(&batch.lens_u[i]), _mm_loadu_ps(&batch.lens_v[i]), disk_x, disk_y);
+            __m128 lx = _mm_mul_ps(lens_radius, disk_x), ly = _mm_mul_ps(lens_radius, disk_y);
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 offset = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(u[axis]), lx), _mm_mul_ps(_mm_set1_ps(v[axis]), ly));
+                o[axis] = _mm_add_ps(o[axis], offset);
+                d[axis] = _mm_sub_ps(d[axis], offset);
+            }
+        }
+        __m128 squared_length = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d[0], d[0]), _mm_mul_ps(d[1], d[1])), _mm_mul_ps(d[2], d[2]));
+        __m128 inverse = inverse_sqrt_sse(squared_length);
+        _mm_storeu_ps(&batch.ox[i], o[0]); _mm_storeu_ps(&batch.oy[i], o[1]); _mm_storeu_ps(&batch.oz[i], o[2]);
+        _mm_storeu_ps(&batch.dx[i], _mm_mul_ps(d[0], inverse));
+        _mm_storeu_ps(&batch.dy[i], _mm_mul_ps(d[1], inverse));
+        _mm_storeu_ps(&batch.dz[i], _mm_mul_ps(d[2], inverse));
+    }
+    camera_rays_scalar(camera, batch, i, count);
+}
+
+/* AVX2 (8 rays) */
+
+__attribute__((target("avx2")))
+inline __m256 inverse_sqrt_avx2(__m256 x) {
+#if defined(RT_FAST_RSQRT) && defined(VEC3_HAVE_RSQRT)
+    __m256 y = _mm256_rsqrt_ps(x);
+    __m256 half_x_y_y = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), x), y), y);
+    return _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.5f), half_x_y_y));
+#else
+    return _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(x));
+#endif
+}
+
+__attribute__((target("avx2")))
+inline void concentric_disk_avx2(__m256 u1, __m256 u2, __m256 &x, __m256 &y) {
+    __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), sign = _mm256_set1_ps(-0.0f);
+    __m256 a = _mm256_sub_ps(_mm256_mul_ps(two, u1), one);
+    __m256 b = _mm256_sub_ps(_mm256_mul_ps(two, u2), one);
+    __m256 sides = _mm256_cmp_ps(_mm256_andnot_ps(sign, a), _mm256_andnot_ps(sign, b), _CMP_GT_OQ);
+    __m256 r = _mm256_blendv_ps(b, a, sides);
+    __m256 ratio = _mm256_blendv_ps(_mm256_div_ps(a, b), _mm256_div_ps(b, a), sides);
+    ratio = _mm256_andnot_ps(_mm256_cmp_ps(b, _mm256_setzero_ps(), _CMP_EQ_OQ), ratio);
+    __m256 phi = _mm256_mul_ps(_mm256_set1_ps(float(M_PI / 4.0)), ratio);
+    __m256 phi2 = _mm256_mul_ps(phi, phi);
+    __m256 sin_phi = _mm256_add_ps(_mm256_set1_ps(DISK_SIN_5), _mm256_mul_ps(phi2, _mm256_set1_ps(DISK_SIN_7)));
+    sin_phi = _mm256_add_ps(_mm256_set1_ps(DISK_SIN_3), _mm256_mul_ps(phi2, sin_phi));
+    sin_phi = _mm256_mul_ps(phi, _mm256_add_ps(one, _mm256_mul_ps(phi2, sin_phi)));
+    __m256 cos_phi = _mm256_add_ps(_mm256_set1_ps(DISK_COS_6), _mm256_mul_ps(phi2, _mm256_set1_ps(DISK_COS_8)));
+    cos_phi = _mm256_add_ps(_mm256_set1_ps(DISK_COS_4), _mm256_mul_ps(phi2, cos_phi));
+    cos_phi = _mm256_add_ps(_mm256_set1_ps(DISK_COS_2), _mm256_mul_ps(phi2, cos_phi));
+    cos_phi = _mm256_add_ps(one, _mm256_mul_ps(phi2, cos_phi));
+    x = _mm256_mul_ps(r, _mm256_blendv_ps(sin_phi, cos_phi, sides));
+    y = _mm256_mul_ps(r, _mm256_blendv_ps(cos_phi, sin_phi, sides));
+}
+
+__attribute__((target("avx2")))
+void camera_rays_avx2(const Camera &camera, CameraRayBatch &batch) {
+    const Vec3 &corner = camera.get_lower_left_corner(), &origin = camera.get_origin();
+    const Vec3 &horizontal = camera.get_horizontal(), &vertical = camera.get_vertical();
+    const Vec3 &u = camera.get_u(), &v = camera.get_v();
+    bool lens = camera.has_lens();
+    __m256 lens_radius = _mm256_set1_ps(camera.get_lens_radius());
+    size_t count = batch.size();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 s = _mm256_loadu_ps(&batch.s[i]), t = _mm256_loadu_ps(&batch.t[i]);
+        __m256 o[3], d[3];
+        for (int axis = 0; axis < 3; axis++) {
+            __m256 point = _mm256_add_ps(_mm256_add_ps(_mm256_set1_ps(corner[axis]), _mm256_mul_ps(s, _mm256_set1_ps(horizontal[axis]))),
+                                         _mm256_mul_ps(t, _mm256_set1_ps(vertical[axis])));
+            o[axis] = _mm256_set1_ps(origin[axis]);
+            d[axis] = _mm256_sub_ps(point, o[axis]);
+        }
+        if (lens) {
+            __m256 disk_x, disk_y;
+            concentric_disk_avx2(_mm256_loadu_ps(&batch.lens_u[i]), _mm256_loadu_ps(&batch.lens_v[i]), disk_x, disk_y);
+            __m256 lx = _mm256_mul_ps(lens_radius, disk_x), ly = _mm256_mul_ps(lens_radius, disk_y);
+            for (int axis = 0; axis < 3; axis++) {
+                __m256 offset = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(u[axis]), lx), _mm256_mul_ps(_mm256_set1_ps(v[axis]), ly));
+                o[axis] = _mm256_add_ps(o[axis], offset);
+                d[axis] = _mm256_sub_ps(d[axis], offset);
+            }
+        }
+        __m256 squared_length = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], d[0]), _mm256_mul_ps(d[1], d[1])),
+                                              _mm256_mul_ps(d[2], d[2]));
+        __m256 inverse = inverse_sqrt_avx2(squared_length);
+        _mm256_storeu_ps(&batch.ox[i], o[0]); _mm256_storeu_ps(&batch.oy[i], o[1]); _mm256_storeu_ps(&batch.oz[i], o[2]);
+        _mm256_storeu_ps(&batch.dx[i], _mm256_mul_ps(d[0], inverse));
+        _mm256_storeu_ps(&batch.dy[i], _mm256_mul_ps(d[1], inverse));
+        _mm256_storeu_ps(&batch.dz[i], _mm256_mul_ps(d[2], inverse));
+    }
+    camera_rays_scalar(camera, batch, i, count);
+}
+
+#endif
+
+RT_NO_CONTRACT_END
+
+typedef void (*CameraRayKernel)(const Camera &camera, CameraRayBatch &batch);
+
+CameraRayKernel camera_ray_kernel(SimdIsa isa) {
+    //* The camera ray kernel of one ISA. AVX-512 uses the AVX2 one: the
+    //* pass is short next to the tracing, and 8 rays already fill it.
+#ifdef RT_SIMD_X86
+    switch (isa) {
+        case ISA_SSE: return camera_rays_sse;
+        case ISA_AVX2: return camera_rays_avx2;
+        case ISA_AVX512: return camera_rays_avx2;
+        default: return camera_rays_scalar;
+    }
+#else
+    (void)isa;
+    return camera_rays_scalar;
+#endif
+}
+
+void CameraRayBatch::generate(const Camera &camera, SimdIsa isa) {
+    size_t count = size();
+    ox.resize(count); oy.resize(count); oz.resize(count);
+    dx.resize(count); dy.resize(count); dz.resize(count);
+    camera_ray_kernel(isa)(camera, *this);
+}
+
+#endif
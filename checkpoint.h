@@ -0,0 +1,224 @@
+#ifndef CHECKPOINTH
+#define CHECKPOINTH
+
+#include <stdint.h>
+#include <stdio.h> // for rename(), remove()
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "rng.h"
+#include "sample_buffer.h"
+
+//* Checkpoint files: the accumulation buffer of a render, so a stopped
+//* render goes on where it was, or a finished one gets more samples.
+//*
+//* The random numbers of a sample only depend on the seed, the sampler, the
+//* pixel and the sample index (sample_rng(), sample_2d()), so the sample
+//* count of a pixel is the whole state of its generators: a resumed pixel
+//* draws the numbers it would have drawn without the stop, and the frame
+//* comes out with the same bits. The header keeps the image size, the seed,
+//* the sampler and the camera, and only a render with the same ones may
+//* resume the file (the scene and the trace options are up to the caller).
+//*
+//* After the header come the pixels of the smallest rectangle that holds
+//* every pixel with samples, rows from the bottom up (CheckpointPixel),
+//* then their guide sums when the render keeps them (CheckpointAov). Like a
+//* binary scene, the file is in the byte order of the machine. It is
+//* written to PATH.tmp and then renamed over PATH, so a render stopped
+//* while writing leaves the last checkpoint whole.
+
+#define CHECKPOINT_MAGIC "RTCHKPT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_BYTE_ORDER 0x01020304u
+// The file has the guide sums of the pixels (SampleBuffer::enable_aovs()).
+#define CHECKPOINT_HAS_AOVS 1
+
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t flags;
+    int32_t width;
+    int32_t height;
+    uint32_t seed;
+    int32_t sampler;
+    // the pixels in the file, [x0, x1) * [y0, y1) (row 0 is the bottom row; empty without samples)
+    int32_t x0, y0, x1, y1;
+    CameraWire camera;
+    uint64_t total_samples;
+} CheckpointHeader;
+
+typedef struct CheckpointPixel {
+    float sum[3];
+    int32_t count;
+    double luminance_sum;
+    double luminance_squared_sum;
+} CheckpointPixel;
+
+typedef struct CheckpointAov {
+    float albedo[3];
+    float normal[3];
+    float depth;
+} CheckpointAov;
+
+CheckpointHeader checkpoint_header(const SampleBuffer &samples, unsigned int seed, Sampler sampler, const Camera &camera) {
+    //* The header of a checkpoint of samples, with the rectangle of the pixels that have samples.
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    header.byte_order = CHECKPOINT_BYTE_ORDER;
+    header.version = CHECKPOINT_VERSION;
+    header.flags = samples.has_aovs() ? CHECKPOINT_HAS_AOVS : 0;
+    header.width = samples.width;
+    header.height = samples.height;
+    header.seed = seed;
+    header.sampler = (int32_t)sampler;
+    header.x0 = samples.width;
+    header.y0 = samples.height;
+    for (int row_index = 0; row_index < samples.height; row_index++) {
+        for (int column_index = 0; column_index < samples.width; column_index++) {
+            int count = samples.at(row_index, column_index).count;
+            if (count > 0) {
+                header.x0 = std::min(header.x0, column_index);
+                header.y0 = std::min(header.y0, row_index);
+                header.x1 = std::max(header.x1, column_index + 1);
+                header.y1 = std::max(header.y1, row_index + 1);
+                header.total_samples += count;
+            }
+        }
+    }
+    if (header.total_samples == 0) {
+        header.x0 = header.y0 = 0;
+    }
+    header.camera = camera.to_wire();
+    return header;
+}
+
+bool save_checkpoint(const char *path, const SampleBuffer &samples, unsigned int seed, Sampler sampler, const Camera &camera,
+                     size_t &bytes) {
+    //* Write samples to path (bytes: the size of the file).
+    CheckpointHeader header = checkpoint_header(samples, seed, sampler, camera);
+    std::vector<CheckpointPixel> pixels;
+    std::vector<CheckpointAov> aovs;
+    pixels.reserve((size_t)(header.x1 - header.x0) * (header.y1 - header.y0));
+    for (int row_index = header.y0; row_index < header.y1; row_index++) {
+        for (int column_index = header.x0; column_index < header.x1; column_index++) {
+            const PixelSamples &pixel = samples.at(row_index, column_index);
+            pixels.push_back(CheckpointPixel{{pixel.sum.r(), pixel.sum.g(), pixel.sum.b()}, pixel.count,
+                                             pixel.luminance_sum, pixel.luminance_squared_sum});
+            if (samples.has_aovs()) {
+                const PixelAov &aov = samples.aov_at(row_index, column_index);
+                aovs.push_back(CheckpointAov{{aov.albedo.r(), aov.albedo.g(), aov.albedo.b()},
+                                             {aov.normal.r(), aov.normal.g(), aov.normal.b()}, aov.depth});
+            }
+        }
+    }
+    std::string temporary = std::string(path) + ".tmp";
+    {
+        std::ofstream file(temporary.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)pixels.data(), pixels.size() * sizeof(CheckpointPixel));
+        file.write((const char*)aovs.data(), aovs.size() * sizeof(CheckpointAov));
+        if (!file.flush()) {
+            std::cerr << "can not write " << temporary << std::endl;
+            return false;
+        }
+    }
+    // (rename() does not replace a file everywhere)
+    if (rename(temporary.c_str(), path) != 0 && (remove(path) != 0 || rename(temporary.c_str(), path) != 0)) {
+        std::cerr << "can not replace " << path << " by " << temporary << std::endl;
+        return false;
+    }
+    bytes = sizeof(header) + pixels.size() * sizeof(CheckpointPixel) + aovs.size() * sizeof(CheckpointAov);
+    return true;
+}
+
+bool load_checkpoint(const char *path, SampleBuffer &samples, unsigned int seed, Sampler sampler, const Camera &camera) {
+    //* Replace the samples by the ones of the checkpoint at path, made by
+    //* a render of the same size, seed, sampler and camera. The guide sums
+    //* are read when samples keeps them. Every pixel is left unconverged.
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file) {
+        std::cerr << "can not read " << path << std::endl;
+        return false;
+    }
+    CheckpointHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+        std::cerr << path << ": not a checkpoint" << std::endl;
+        return false;
+    }
+    if (header.byte_order != CHECKPOINT_BYTE_ORDER) {
+        std::cerr << path << ": the checkpoint was written on a machine of the other byte order" << std::endl;
+        return false;
+    }
+    if (header.version != CHECKPOINT_VERSION) {
+        std::cerr << path << ": checkpoint version " << header.version << ", this build reads " << CHECKPOINT_VERSION << std::endl;
+        return false;
+    }
+    if (header.width != samples.width || header.height != samples.height) {
+        std::cerr << path << ": the checkpoint is of a " << header.width << "x" << header.height << " image, not "
+                  << samples.width << "x" << samples.height << std::endl;
+        return false;
+    }
+    CameraWire wire = camera.to_wire();
+    if (header.seed != seed || header.sampler != (int32_t)sampler || memcmp(&header.camera, &wire, sizeof(CameraWire)) != 0) {
+        std::cerr << path << ": the checkpoint was rendered with another seed, sampler or camera" << std::endl;
+        return false;
+    }
+    bool has_aovs = (header.flags & CHECKPOINT_HAS_AOVS) != 0;
+    if (samples.has_aovs() && !has_aovs) {
+        std::cerr << path << ": the checkpoint has no guide images (render it with --denoise or --aov)" << std::endl;
+        return false;
+    }
+    if (header.x0 < 0 || header.y0 < 0 || header.x1 > header.width || header.y1 > header.height ||
+        header.x0 > header.x1 || header.y0 > header.y1) {
+        std::cerr << path << ": the checkpoint is broken" << std::endl;
+        return false;
+    }
+    size_t count = (size_t)(header.x1 - header.x0) * (header.y1 - header.y0);
+    std::vector<CheckpointPixel> pixels(count);
+    std::vector<CheckpointAov> aovs(has_aovs ? count : 0);
+    if (!file.read((char*)pixels.data(), count * sizeof(CheckpointPixel)) ||
+        !file.read((char*)aovs.data(), aovs.size() * sizeof(CheckpointAov))) {
+        std::cerr << path << ": the checkpoint is truncated" << std::endl;
+        return false;
+    }
+    // A count is the sample index the generators go on from, so it has to be sound.
+    uint64_t total_samples = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (pixels[k].count < 0) {
+            total_samples = UINT64_MAX;
+            break;
+        }
+        total_samples += (uint64_t)pixels[k].count;
+    }
+    if (total_samples != header.total_samples) {
+        std::cerr << path << ": the checkpoint is broken" << std::endl;
+        return false;
+    }
+    samples.clear();
+    size_t i = 0;
+    for (int row_index = header.y0; row_index < header.y1; row_index++) {
+        for (int column_index = header.x0; column_index < header.x1; column_index++, i++) {
+            PixelSamples &pixel = samples.at(row_index, column_index);
+            pixel.sum = Vec3(pixels[i].sum);
+            pixel.count = pixels[i].count;
+            pixel.luminance_sum = pixels[i].luminance_sum;
+            pixel.luminance_squared_sum = pixels[i].luminance_squared_sum;
+            if (samples.has_aovs()) {
+                PixelAov &aov = samples.aov_at(row_index, column_index);
+                aov.albedo = Vec3(aovs[i].albedo);
+                aov.normal = Vec3(aovs[i].normal);
+                aov.depth = aovs[i].depth;
+            }
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef DEFLATEH
+#define DEFLATEH
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+//* A small zlib (RFC 1950 / 1951) compressor for the PNG writer:
+//* greedy LZ77 over a 32 KB window with a hash chain, coded with the fixed
+//* Huffman tables, so there are no tables to build or send.
+//* Data can be fed in pieces; every piece becomes one deflate block.
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_SIZE 32768
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+// Longest hash chain followed for one match (speed against size).
+#define DEFLATE_MAX_CHAIN 32
+
+typedef struct Crc32Table {
+    uint32_t entry[256];
+} Crc32Table;
+
+inline Crc32Table make_crc32_table() {
+    Crc32Table table;
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table.entry[n] = c;
+    }
+    return table;
+}
+
+inline uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t size) {
+    //* CRC-32 (the one of PNG and zip), crc starts at 0.
+    static const Crc32Table table = make_crc32_table();
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entry[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+class DeflateStream {
+    public:
+        /* constructors */
+        DeflateStream() : base(0), bit_buffer(0), bit_count(0), adler_a(1), adler_b(0), started(false) {
+            head.assign(DEFLATE_HASH_SIZE, -1);
+            chain.assign(DEFLATE_WINDOW, -1);
+        }
+
+        void write(const unsigned char *data, size_t size, std::vector<unsigned char> &out);
+        void finish(std::vector<unsigned char> &out);
+
+    private:
+        void put_bits(uint32_t bits, int count, std::vector<unsigned char> &out);
+        void put_huffman(uint32_t code, int length, std::vector<unsigned char> &out);
+        void put_literal(int symbol, std::vector<unsigned char> &out);
+        void put_match(int length, int distance, std::vector<unsigned char> &out);
+
+        static uint32_t hash(const unsigned char *p) {
+            return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & (DEFLATE_HASH_SIZE - 1);
+        }
+
+        // The last DEFLATE_WINDOW bytes before the current piece, then the piece.
+        std::vector<unsigned char> window;
+        // Stream position of window[0].
+        long long base;
+        // Newest stream position of every hash, and the previous position of
+        // the same hash for the positions in the window (ring buffer).
+        std::vector<long long> head;
+        std::vector<long long> chain;
+        uint32_t bit_buffer;
+        int bit_count;
+        uint32_t adler_a, adler_b;
+        bool started;
+};
+
+void DeflateStream::put_bits(uint32_t bits, int count, std::vector<unsigned char> &out) {
+    //* Deflate packs bits from the least significant one up.
+    bit_buffer |= bits << bit_count;
+    bit_count += count;
+    while (bit_count >= 8) {
+        out.push_back((unsigned char)bit_buffer);
+        bit_buffer >>= 8;
+        bit_count -= 8;
+    }
+}
+
+void DeflateStream::put_huffman(uint32_t code, int length, std::vector<unsigned char> &out) {
+    //* Huffman codes are stored from the most significant bit down.
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    put_bits(reversed, length, out);
+}
+
+void DeflateStream::put_literal(int symbol, std::vector<unsigned char> &out) {
+    //* Fixed literal/length code of symbol (0-287).
+    if (symbol < 144) {
+        put_huffman(0x30 + symbol, 8, out);
+    } else if (symbol < 256) {
+        put_huffman(0x190 + symbol - 144, 9, out);
+    } else if (symbol < 280) {
+        put_huffman(symbol - 256, 7, out);
+    } else {
+        put_huffman(0xC0 + symbol - 280, 8, out);
+    }
+}
+
+void DeflateStream::put_match(int length, int distance, std::vector<unsigned char> &out) {
+    static const int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                         3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const int distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                          257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static const int distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                           7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while (length_base[l] > length) l--;
+    put_literal(257 + l, out);
+    put_bits(length - length_base[l], length_extra[l], out);
+    int d = 29;
+    while (distance_base[d] > distance) d--;
+    put_huffman(d, 5, out);
+    put_bits(distance - distance_base[d], distance_extra[d], out);
+}
+
+void DeflateStream::write(const unsigned char *data, size_t size, std::vector<unsigned char> &out) {
+    //* Compress data as one (not final) fixed Huffman block and append it to out.
+    if (!started) {
+        // zlib header: deflate with a 32 KB window, no dictionary.
+        out.push_back(0x78);
+        out.push_back(0x01);
+        started = true;
+    }
+    for (size_t i = 0; i < size; i++) {
+        adler_a = (adler_a + data[i]) % 65521;
+        adler_b = (adler_b + adler_a) % 65521;
+    }
+
+    // Keep only the window before the new data.
+    if (window.size() > DEFLATE_WINDOW) {
+        size_t drop = window.size() - DEFLATE_WINDOW;
+        window.erase(window.begin(), window.begin() + drop);
+        base += (long long)drop;
+    }
+    size_t begin = window.size();
+    window.insert(window.end(), data, data + size);
+    const unsigned char *bytes = window.data();
+    size_t end = window.size();
+
+    put_bits(0, 1, out);  // BFINAL = 0
+    put_bits(1, 2, out);  // BTYPE = 01, fixed Huffman
+    size_t i = begin;
+    while (i < end) {
+        int best_length = 0;
+        int best_distance = 0;
+        if (i + DEFLATE_MIN_MATCH <= end) {
+            uint32_t h = hash(bytes + i);
+            long long position = base + (long long)i;
+            int max_length = (int)std::min<size_t>(DEFLATE_MAX_MATCH, end - i);
+            long long candidate = head[h];
+            for (int steps = 0; steps < DEFLATE_MAX_CHAIN && candidate >= base && position - candidate <= DEFLATE_WINDOW; steps++) {
+                const unsigned char *match = bytes + (candidate - base);
+                int length = 0;
+                while (length < max_length && match[length] == bytes[i + length]) length++;
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = (int)(position - candidate);
+                    if (length == max_length) break;
+                }
+                candidate = chain[candidate & (DEFLATE_WINDOW - 1)];
+            }
+        }
+        int advance = 1;
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            put_match(best_length, best_distance, out);
+            advance = best_length;
+        } else {
+            put_literal(bytes[i], out);
+        }
+        // Insert every position the step covers into the hash chains.
+        for (int k = 0; k < advance; k++, i++) {
+            if (i + DEFLATE_MIN_MATCH <= end) {
+                uint32_t h = hash(bytes + i);
+                long long position = base + (long long)i;
+                chain[position & (DEFLATE_WINDOW - 1)] = head[h];
+                head[h] = position;
+            }
+        }
+    }
+    put_literal(256, out);  // end of block
+}
+
+void DeflateStream::finish(std::vector<unsigned char> &out) {
+    //* Close the stream with an empty final block and the Adler-32 checksum.
+    if (!started) {
+        out.push_back(0x78);
+        out.push_back(0x01);
+        started = true;
+    }
+    put_bits(1, 1, out);  // BFINAL = 1
+    put_bits(1, 2, out);
+    put_literal(256, out);
+    if (bit_count > 0) {
+        put_bits(0, 8 - bit_count, out);
+    }
+    uint32_t adler = (adler_b << 16) | adler_a;
+    out.push_back((unsigned char)(adler >> 24));
+    out.push_back((unsigned char)(adler >> 16));
+    out.push_back((unsigned char)(adler >> 8));
+    out.push_back((unsigned char)adler);
+}
+
+#endif
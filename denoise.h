@@ -0,0 +1,363 @@
+#ifndef DENOISEH
+#define DENOISEH
+
+#include <math.h>
+#include <cmath>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "sample_buffer.h"
+#include "sphere_simd.h"
+#include "tile_pool.h"
+
+//* Edge-aware a-trous wavelet filter over the averaged samples (Dammertz et
+//* al., "Edge-Avoiding A-Trous Wavelet Transform for fast Global
+//* Illumination Filtering", with the variance-guided color weight of Schied
+//* et al., "Spatiotemporal Variance-Guided Filtering").
+//* Every iteration is a 5x5 B3-spline blur with its taps 2^i pixels apart,
+//* so a few iterations cover a wide area. A tap loses weight across an edge
+//* of the guides (albedo, normal and depth of the first hit) and when its
+//* color differs by more than the noise of the pixel (the standard error of
+//* its luminance) explains. The variance is filtered along with the color,
+//* so the color weight gets stricter as the image gets cleaner.
+
+#define DENOISE_MAX_ITERATIONS 8
+// rows per work item of the thread pool
+#define DENOISE_BAND_ROWS 4
+
+typedef struct DenoiseSettings {
+    int iterations;
+    // Edge-stopping widths: in standard errors of the pixel, in normal and
+    // albedo distance, and in depth relative to the depth of the pixel.
+    float sigma_color;
+    float sigma_normal;
+    float sigma_albedo;
+    float sigma_depth;
+} DenoiseSettings;
+
+//* The planes of one iteration (row 0 is the bottom row, like SampleBuffer).
+typedef struct DenoisePlanes {
+    int width;
+    int height;
+    // the guides
+    const float *albedo[3];
+    const float *normal[3];
+    const float *depth;
+    // color and variance in, and out
+    const float *color[3];
+    const float *variance;
+    float *out_color[3];
+    float *out_variance;
+    // sigma_color^2, 1 / sigma_normal^2, 1 / sigma_albedo^2 and sigma_depth^2
+    float color_width;
+    float normal_scale;
+    float albedo_scale;
+    float depth_width;
+} DenoisePlanes;
+
+// Filter rows [y0, y1) with taps step pixels apart. scratch holds 7 * width floats.
+typedef void (*AtrousKernel)(const DenoisePlanes &planes, int step, int y0, int y1, float *scratch);
+
+// The planes of a loop never overlap, but GCC gives up on proving that
+// for this many of them (restrict on local pointers does not help).
+#if defined(__clang__)
+#define RT_DENOISE_INLINE inline __attribute__((always_inline))
+#define RT_IVDEP _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define RT_DENOISE_INLINE inline __attribute__((always_inline))
+#define RT_IVDEP _Pragma("GCC ivdep")
+#else
+#define RT_DENOISE_INLINE inline
+#define RT_IVDEP
+#endif
+
+RT_DENOISE_INLINE float exp_negative(float x) {
+    //* e^x for 0 >= x >= -24 to about 2e-4 (relative), and e^-24 below, so
+    //* that the squared weights stay far from the denormals. No call and no
+    //* branch, so that the loops below vectorize: 2^x split into a power
+    //* of two, put into the exponent bits, times a polynomial for the rest.
+    // max(x, -24) with fabsf, as a select here would keep GCC from
+    // vectorizing (and in this order, which is exact for a huge -x)
+    float above = x + 24.0f;
+    float t = (0.5f * (above + fabsf(above)) - 24.0f) * 1.44269504f;
+    // (int) rounds towards 0, so this is the integer in [t - 1, t) for t <= 0.
+    int i = (int)(t - 1.0f);
+    float f = t - (float)i;
+    float p = 1.0f + f * (0.693147182f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+    unsigned int bits;
+    memcpy(&bits, &p, sizeof(bits));
+    bits += (unsigned int)i << 23;
+    memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+RT_DENOISE_INLINE void atrous_rows(const DenoisePlanes &planes, int step, int y0, int y1, float *scratch) {
+    static const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+    const int width = planes.width;
+    const float normal_scale = planes.normal_scale;
+    const float albedo_scale = planes.albedo_scale;
+    float *sum_w = scratch;
+    float *sum_r = scratch + width;
+    float *sum_g = scratch + 2 * width;
+    float *sum_b = scratch + 3 * width;
+    float *sum_v = scratch + 4 * width;
+    // per pixel: 1 / the color and the depth width
+    float *color_scale = scratch + 5 * width;
+    float *depth_scale = scratch + 6 * width;
+    for (int y = y0; y < y1; y++) {
+        size_t row = (size_t)y * width;
+        const float *pr = planes.color[0] + row;
+        const float *pg = planes.color[1] + row;
+        const float *pb = planes.color[2] + row;
+        const float *pz = planes.depth + row;
+        const float *pnx = planes.normal[0] + row;
+        const float *pny = planes.normal[1] + row;
+        const float *pnz = planes.normal[2] + row;
+        const float *pax = planes.albedo[0] + row;
+        const float *pay = planes.albedo[1] + row;
+        const float *paz = planes.albedo[2] + row;
+        for (int x = 0; x < width; x++) {
+            sum_w[x] = sum_r[x] = sum_g[x] = sum_b[x] = sum_v[x] = 0.0f;
+            color_scale[x] = 1.0f / (planes.color_width * planes.variance[row + x] + 1e-10f);
+            depth_scale[x] = 1.0f / (planes.depth_width * pz[x] * pz[x] + 1e-10f);
+        }
+        for (int ty = 0; ty < 5; ty++) {
+            int qy = y + (ty - 2) * step;
+            if (qy < 0 || qy >= planes.height) {
+                continue;
+            }
+            for (int tx = 0; tx < 5; tx++) {
+                // Taps outside the image do not count.
+                int offset = (tx - 2) * step;
+                int x_begin = std::max(0, -offset);
+                int x_end = std::min(width, width - offset);
+                float h = kernel[ty] * kernel[tx];
+                ptrdiff_t q = (ptrdiff_t)qy * width + offset;
+                const float *qr = planes.color[0] + q;
+                const float *qg = planes.color[1] + q;
+                const float *qb = planes.color[2] + q;
+                const float *qv = planes.variance + q;
+                const float *qz = planes.depth + q;
+                const float *qnx = planes.normal[0] + q;
+                const float *qny = planes.normal[1] + q;
+                const float *qnz = planes.normal[2] + q;
+                const float *qax = planes.albedo[0] + q;
+                const float *qay = planes.albedo[1] + q;
+                const float *qaz = planes.albedo[2] + q;
+                RT_IVDEP
+                for (int x = x_begin; x < x_end; x++) {
+                    float dl = 0.2126f * (pr[x] - qr[x]) + 0.7152f * (pg[x] - qg[x]) + 0.0722f * (pb[x] - qb[x]);
+                    float dnx = pnx[x] - qnx[x], dny = pny[x] - qny[x], dnz = pnz[x] - qnz[x];
+                    float dax = pax[x] - qax[x], day = pay[x] - qay[x], daz = paz[x] - qaz[x];
+                    float dz = pz[x] - qz[x];
+                    float e = dl * dl * color_scale[x] + (dnx * dnx + dny * dny + dnz * dnz) * normal_scale +
+                              (dax * dax + day * day + daz * daz) * albedo_scale + dz * dz * depth_scale[x];
+                    float w = h * exp_negative(-e);
+                    sum_w[x] += w;
+                    sum_r[x] += w * qr[x];
+                    sum_g[x] += w * qg[x];
+                    sum_b[x] += w * qb[x];
+                    sum_v[x] += w * w * qv[x];
+                }
+            }
+        }
+        // The center tap always has weight, so sum_w > 0.
+        for (int x = 0; x < width; x++) {
+            float inverse = 1.0f / sum_w[x];
+            planes.out_color[0][row + x] = sum_r[x] * inverse;
+            planes.out_color[1][row + x] = sum_g[x] * inverse;
+            planes.out_color[2][row + x] = sum_b[x] * inverse;
+            planes.out_variance[row + x] = sum_v[x] * inverse * inverse;
+        }
+    }
+}
+
+//* The same loops compiled for each ISA, picked like the sphere kernels.
+void atrous_default(const DenoisePlanes &planes, int step, int y0, int y1, float *scratch) {
+    atrous_rows(planes, step, y0, y1, scratch);
+}
+
+#ifdef RT_SIMD_X86
+__attribute__((target("avx2")))
+void atrous_avx2(const DenoisePlanes &planes, int step, int y0, int y1, float *scratch) {
+    atrous_rows(planes, step, y0, y1, scratch);
+}
+
+__attribute__((target("avx512f")))
+void atrous_avx512(const DenoisePlanes &planes, int step, int y0, int y1, float *scratch) {
+    atrous_rows(planes, step, y0, y1, scratch);
+}
+#endif
+
+typedef struct DenoiseKernel {
+    const char *name;
+    AtrousKernel run;
+} DenoiseKernel;
+
+const DenoiseKernel& denoise_kernel(SimdIsa isa) {
+    //* The filter for the ISA of the sphere kernels in use.
+#ifdef RT_SIMD_X86
+    static const DenoiseKernel table[ISA_COUNT] = {
+        {"default", atrous_default}, {"default", atrous_default}, {"avx2", atrous_avx2}, {"avx512", atrous_avx512}};
+    return table[isa];
+#else
+    (void)isa;
+    static const DenoiseKernel portable = {"default", atrous_default};
+    return portable;
+#endif
+}
+
+//* Runs the filter on the threads of a TilePool, a band of rows per work
+//* item, and keeps its planes from frame to frame.
+class Denoiser {
+    public:
+        /* constructors */
+        Denoiser() : width(0), height(0), elapsed_ms(0.0) {}
+
+        // Filter the averages of samples (which needs its aovs) into rgb,
+        // top row first like SampleBuffer::rows_rgb().
+        void run(const SampleBuffer &samples, TilePool &pool, const DenoiseKernel &kernel, const DenoiseSettings &settings,
+                 std::vector<float> &rgb);
+
+        // time of the last run() in ms
+        double last_ms() const {
+            return elapsed_ms;
+        }
+
+    private:
+        void prepare_rows(const SampleBuffer &samples, int y0, int y1);
+        void prefilter_variance_rows(int y0, int y1);
+
+        int width;
+        int height;
+        std::vector<Tile> bands;
+        // albedo (3), normal (3) and depth
+        std::vector<float> guide_planes[7];
+        // color and variance, read from one and written to the other
+        std::vector<float> color_planes[2][3];
+        std::vector<float> variance_planes[2];
+        double elapsed_ms;
+};
+
+void Denoiser::prepare_rows(const SampleBuffer &samples, int y0, int y1) {
+    //* Averages of the color and the guides, and the variance of the mean luminance.
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            const PixelSamples &pixel = samples.pixels[i];
+            const PixelAov &aov = samples.aovs[i];
+            float inverse = pixel.count > 0 ? 1.0f / float(pixel.count) : 0.0f;
+            Vec3 color = pixel.sum * inverse;
+            for (int c = 0; c < 3; c++) {
+                // A NaN would spread over the whole filter footprint; the writer shows it as 0 anyway.
+                color_planes[0][c][i] = std::isfinite(color[c]) ? color[c] : 0.0f;
+                guide_planes[c][i] = aov.albedo[c] * inverse;
+                guide_planes[3 + c][i] = aov.normal[c] * inverse;
+            }
+            guide_planes[6][i] = aov.depth * inverse;
+            // One sample says nothing about the noise: leave the color to the guides.
+            double error = standard_error(pixel);
+            variance_planes[1][i] = pixel.count >= 2 && std::isfinite(error) ? float(error * error) : 1.0f;
+        }
+    }
+}
+
+void Denoiser::prefilter_variance_rows(int y0, int y1) {
+    //* A 3x3 blur of the variance, which is noisy itself at a few samples.
+    static const float kernel[3] = {0.25f, 0.5f, 0.25f};
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < width; x++) {
+            float sum = 0.0f, weight = 0.0f;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    int qx = x + dx, qy = y + dy;
+                    if (qx >= 0 && qx < width && qy >= 0 && qy < height) {
+                        float k = kernel[dy + 1] * kernel[dx + 1];
+                        sum += k * variance_planes[1][(size_t)qy * width + qx];
+                        weight += k;
+                    }
+                }
+            }
+            variance_planes[0][(size_t)y * width + x] = sum / weight;
+        }
+    }
+}
+
+void Denoiser::run(const SampleBuffer &samples, TilePool &pool, const DenoiseKernel &kernel, const DenoiseSettings &settings,
+                   std::vector<float> &rgb) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (width != samples.width || height != samples.height) {
+        width = samples.width;
+        height = samples.height;
+        size_t size = (size_t)width * height;
+        for (int i = 0; i < 7; i++) {
+            guide_planes[i].assign(size, 0.0f);
+        }
+        for (int p = 0; p < 2; p++) {
+            for (int c = 0; c < 3; c++) {
+                color_planes[p][c].assign(size, 0.0f);
+            }
+            variance_planes[p].assign(size, 0.0f);
+        }
+        bands.clear();
+        for (int y = 0; y < height; y += DENOISE_BAND_ROWS) {
+            bands.push_back(Tile{0, y, width, std::min(height, y + DENOISE_BAND_ROWS), (int)bands.size()});
+        }
+    }
+
+    pool.render(bands, [&](const Tile &band) {
+        prepare_rows(samples, band.y0, band.y1);
+    });
+    pool.render(bands, [&](const Tile &band) {
+        prefilter_variance_rows(band.y0, band.y1);
+    });
+
+    DenoisePlanes planes;
+    planes.width = width;
+    planes.height = height;
+    for (int c = 0; c < 3; c++) {
+        planes.albedo[c] = guide_planes[c].data();
+        planes.normal[c] = guide_planes[3 + c].data();
+    }
+    planes.depth = guide_planes[6].data();
+    planes.color_width = settings.sigma_color * settings.sigma_color;
+    planes.normal_scale = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+    planes.albedo_scale = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+    planes.depth_width = settings.sigma_depth * settings.sigma_depth;
+    int iterations = std::min(settings.iterations, DENOISE_MAX_ITERATIONS);
+    int current = 0;
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        int next = 1 - current;
+        for (int c = 0; c < 3; c++) {
+            planes.color[c] = color_planes[current][c].data();
+            planes.out_color[c] = color_planes[next][c].data();
+        }
+        planes.variance = variance_planes[current].data();
+        planes.out_variance = variance_planes[next].data();
+        int step = 1 << iteration;
+        pool.render(bands, [&](const Tile &band) {
+            static thread_local std::vector<float> scratch;
+            scratch.resize((size_t)7 * width);
+            kernel.run(planes, step, band.y0, band.y1, scratch.data());
+        });
+        current = next;
+    }
+
+    rgb.resize((size_t)width * height * 3);
+    float *out = rgb.data();
+    for (int y = height - 1; y >= 0; y--) {
+        for (int x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            *out++ = color_planes[current][0][i];
+            *out++ = color_planes[current][1][i];
+            *out++ = color_planes[current][2][i];
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    elapsed_ms = elapsed.count();
+}
+
+#endif
@@ -0,0 +1,736 @@
+#ifndef DISTRIBUTEDH
+#define DISTRIBUTEDH
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_SOCKETS 1
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include "camera.h"
+#include "sample_buffer.h"
+#include "scene.h"
+#include "scene_io.h"
+#include "stats.h"
+#include "tile_pool.h"
+#include "tile_render.h"
+
+//* Distributed rendering of one frame over TCP.
+//* The coordinator (ray_tracer --coordinator PORT) builds the scene and
+//* waits for workers (ray_tracer --worker HOST:PORT). A worker says how many
+//* threads it has and gets the job: the tile settings and the scene in the
+//* binary scene format, BVH included, so it neither parses nor builds
+//* anything. The handshake of every new connection runs on a thread of its
+//* own, so a slow upload or a stray connection does not hold up the
+//* results of the workers already rendering. Then the coordinator hands out batches of tiles and the worker
+//* sends back the sample sums of every tile it finishes. Each worker has up
+//* to CLUSTER_BATCHES_IN_FLIGHT batches, and the next one goes out as
+//* results come in, so faster workers take more tiles. A worker that
+//* disconnects, or stays silent for the timeout with tiles outstanding, is
+//* dropped and its tiles go back to the front of the queue.
+//* A pixel only depends on the seed and its own samples, so the frame has
+//* the same bits as a local render, whichever worker rendered which tile.
+//* Messages use the byte order of the machines, and the handshake refuses
+//* a worker of another byte order, protocol version or build.
+
+#define CLUSTER_VERSION 2
+#define CLUSTER_BYTE_ORDER 0x01020304u
+// Seconds a new connection has to say hello.
+#define CLUSTER_HANDSHAKE_TIMEOUT 5.0
+// One batch being rendered, one waiting in the socket.
+#define CLUSTER_BATCHES_IN_FLIGHT 2
+// Largest message accepted by default (a scene of some million spheres fits).
+#define CLUSTER_MAX_MESSAGE (1ull << 32)
+
+enum MessageType {
+    // worker -> coordinator: ClusterHello
+    MESSAGE_HELLO = 1,
+    // coordinator -> worker: ClusterJob, then the scene file
+    MESSAGE_JOB,
+    // coordinator -> worker: the int32 indices of a batch of tiles
+    MESSAGE_TILES,
+    // worker -> coordinator: TileResultHeader, then a PixelWire per pixel
+    MESSAGE_RESULT,
+    // coordinator -> worker: the frame is done, or the worker is refused
+    MESSAGE_DONE,
+    // client -> render server (render_server.h): RenderRequest, then the scene path
+    MESSAGE_RENDER,
+    // render server -> client: RenderReport, the job is over
+    MESSAGE_REPORT
+};
+
+typedef struct MessageHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t length;
+} MessageHeader;
+
+typedef struct ClusterHello {
+    uint32_t version;
+    uint32_t byte_order;
+    // sizeof(TileRenderSettings), to catch workers of an other build
+    uint32_t settings_size;
+    int32_t threads;
+} ClusterHello;
+
+typedef struct ClusterJob {
+    TileRenderSettings settings;
+    int32_t tile_size;
+    CameraWire camera;
+} ClusterJob;
+
+typedef struct TileResultHeader {
+    int32_t tile_index;
+    int32_t reserved;
+    // seconds the worker spent on the tile
+    double busy_seconds;
+} TileResultHeader;
+
+//* The state of a finished pixel, rows of the tile from the bottom up.
+typedef struct PixelWire {
+    float sum[3];
+    int32_t count;
+    double luminance_sum;
+    double luminance_squared_sum;
+} PixelWire;
+
+static_assert(sizeof(MessageHeader) == 16 && sizeof(PixelWire) == 32, "the message layout is part of the protocol");
+
+//* One TCP connection that sends and receives whole messages.
+class Connection {
+    public:
+        /* constructors */
+        Connection() : descriptor(-1) {}
+        explicit Connection(int descriptor) : descriptor(descriptor) {}
+        ~Connection() {
+            close();
+        }
+
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        // Connect to "host:port".
+        bool connect_to(const char *address);
+        // Give up on a receive (or a send) after seconds without progress.
+        void set_timeout(double seconds);
+        bool send_message(MessageType type, const void *data, size_t size);
+        // Refuse a message longer than max_length before reading its payload.
+        bool receive_message(uint32_t &type, std::vector<char> &payload, uint64_t max_length = CLUSTER_MAX_MESSAGE);
+        void close();
+
+        int get_descriptor() const {
+            return descriptor;
+        }
+
+    private:
+        bool send_all(const char *data, size_t size);
+        bool receive_all(char *data, size_t size);
+
+        int descriptor;
+};
+
+bool Connection::connect_to(const char *address) {
+    close();
+#ifdef RT_HAVE_SOCKETS
+    std::string text(address);
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "worker address " << address << " is not HOST:PORT" << std::endl;
+        return false;
+    }
+    std::string host = text.substr(0, colon);
+    std::string port = text.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+        return false;
+    }
+    for (struct addrinfo *candidate = found; candidate && descriptor < 0; candidate = candidate->ai_next) {
+        descriptor = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (descriptor >= 0 && ::connect(descriptor, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+            ::close(descriptor);
+            descriptor = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (descriptor < 0) {
+        return false;
+    }
+    // Results are small and should leave as soon as they are done.
+    int on = 1;
+    setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return true;
+#else
+    (void)address;
+    return false;
+#endif
+}
+
+void Connection::set_timeout(double seconds) {
+#ifdef RT_HAVE_SOCKETS
+    struct timeval timeout;
+    timeout.tv_sec = (time_t)seconds;
+    timeout.tv_usec = (suseconds_t)((seconds - (double)timeout.tv_sec) * 1e6);
+    setsockopt(descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(descriptor, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#else
+    (void)seconds;
+#endif
+}
+
+bool Connection::send_all(const char *data, size_t size) {
+#ifdef RT_HAVE_SOCKETS
+    while (size > 0) {
+        ssize_t sent = ::send(descriptor, data, size, 0);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+#else
+    (void)data;
+    return size == 0;
+#endif
+}
+
+bool Connection::receive_all(char *data, size_t size) {
+#ifdef RT_HAVE_SOCKETS
+    while (size > 0) {
+        ssize_t received = ::recv(descriptor, data, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        size -= (size_t)received;
+    }
+    return true;
+#else
+    (void)data;
+    return size == 0;
+#endif
+}
+
+bool Connection::send_message(MessageType type, const void *data, size_t size) {
+    if (descriptor < 0) {
+        return false;
+    }
+    MessageHeader header = {(uint32_t)type, 0, (uint64_t)size};
+    return send_all((const char *)&header, sizeof(header)) && send_all((const char *)data, size);
+}
+
+bool Connection::receive_message(uint32_t &type, std::vector<char> &payload, uint64_t max_length) {
+    //* Wait for the next message. Return false when the peer is gone, too
+    //* slow or not speaking the protocol. The length is checked before the
+    //* payload is allocated, so a peer can not make us reserve more.
+    MessageHeader header;
+    if (descriptor < 0 || !receive_all((char *)&header, sizeof(header)) || header.length > max_length) {
+        return false;
+    }
+    type = header.type;
+    payload.resize((size_t)header.length);
+    return receive_all(payload.data(), payload.size());
+}
+
+void Connection::close() {
+#ifdef RT_HAVE_SOCKETS
+    if (descriptor >= 0) {
+        ::close(descriptor);
+    }
+#endif
+    descriptor = -1;
+}
+
+//* What the coordinator saw of one worker.
+typedef struct ClusterWorkerReport {
+    std::string name;
+    int threads;
+    int tiles;
+    unsigned long long samples;
+    // time the worker spent rendering, and the time it was connected
+    double busy_seconds;
+    double connected_seconds;
+    // dropped before the frame was done
+    bool lost;
+} ClusterWorkerReport;
+
+class Coordinator {
+    public:
+        /* constructors */
+        Coordinator(const ClusterJob &job, const std::string &scene_data, SampleBuffer &samples, double worker_timeout)
+            : job(job), scene_data(scene_data), samples(samples), worker_timeout(worker_timeout), requeued(0) {}
+
+        // Serve the frame on port until every tile is back.
+        bool run(int port);
+
+        std::vector<ClusterWorkerReport> worker_reports() const;
+
+        int requeued_tiles() const {
+            return requeued;
+        }
+
+        int tile_count() const {
+            return (int)tiles.size();
+        }
+
+    private:
+        struct Worker {
+            std::unique_ptr<Connection> connection;
+            ClusterWorkerReport report;
+            // tiles handed out and not back yet
+            std::vector<int> outstanding;
+            std::chrono::steady_clock::time_point joined;
+            std::chrono::steady_clock::time_point last_heard;
+        };
+
+        void accept_worker(int listener);
+        void handshake(Worker *joining_worker);
+        void take_joined();
+        void finish_handshakes();
+        bool receive_result(Worker &worker);
+        void hand_out(Worker &worker, int live_workers);
+        void drop(Worker &worker, const char *reason);
+
+        ClusterJob job;
+        std::string scene_data;
+        SampleBuffer &samples;
+        double worker_timeout;
+        std::vector<Tile> tiles;
+        std::deque<int> pending;
+        std::vector<char> done;
+        int completed;
+        int requeued;
+        std::vector<std::unique_ptr<Worker>> workers;
+        // Connections in their handshake (by descriptor), and the workers
+        // that got the job and wait for the loop to take them.
+        std::mutex joining_lock;
+        std::vector<int> handshaking;
+        std::vector<std::unique_ptr<Worker>> joining;
+        std::vector<std::thread> handshakes;
+};
+
+bool Coordinator::run(int port) {
+#ifdef RT_HAVE_SOCKETS
+    // A worker that goes away mid-send is a failed send, not the end of the process.
+    signal(SIGPIPE, SIG_IGN);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "can not listen on port " << port << ": " << strerror(errno) << std::endl;
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        return false;
+    }
+
+    tiles = make_tiles(job.settings.width, job.settings.height, job.tile_size);
+    pending.clear();
+    for (size_t i = 0; i < tiles.size(); i++) {
+        pending.push_back((int)i);
+    }
+    done.assign(tiles.size(), 0);
+    completed = 0;
+    std::cout << "coordinator: " << tiles.size() << " tiles, waiting for workers on port " << port << std::endl;
+
+    std::vector<struct pollfd> descriptors;
+    std::vector<Worker *> polled;
+    while (completed < (int)tiles.size()) {
+        take_joined();
+        descriptors.assign(1, pollfd{listener, POLLIN, 0});
+        polled.clear();
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (!workers[i]->report.lost) {
+                descriptors.push_back(pollfd{workers[i]->connection->get_descriptor(), POLLIN, 0});
+                polled.push_back(workers[i].get());
+            }
+        }
+        if (poll(descriptors.data(), descriptors.size(), 100) < 0 && errno != EINTR) {
+            std::cerr << "coordinator: poll failed: " << strerror(errno) << std::endl;
+            ::close(listener);
+            finish_handshakes();
+            return false;
+        }
+        for (size_t i = 1; i < descriptors.size(); i++) {
+            if ((descriptors[i].revents & (POLLIN | POLLHUP | POLLERR)) && !receive_result(*polled[i - 1])) {
+                drop(*polled[i - 1], "disconnected");
+            }
+        }
+        if (descriptors[0].revents & POLLIN) {
+            accept_worker(listener);
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int live_workers = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            Worker &worker = *workers[i];
+            std::chrono::duration<double> silent = now - worker.last_heard;
+            if (!worker.report.lost && !worker.outstanding.empty() && silent.count() > worker_timeout) {
+                drop(worker, "timed out");
+            }
+            live_workers += worker.report.lost ? 0 : 1;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (!workers[i]->report.lost) {
+                hand_out(*workers[i], live_workers);
+            }
+        }
+    }
+
+    ::close(listener);
+    finish_handshakes();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < workers.size(); i++) {
+        Worker &worker = *workers[i];
+        if (!worker.report.lost) {
+            worker.connection->send_message(MESSAGE_DONE, NULL, 0);
+            worker.connection->close();
+            worker.report.connected_seconds = std::chrono::duration<double>(now - worker.joined).count();
+        }
+    }
+    return true;
+#else
+    (void)port;
+    std::cerr << "distributed rendering needs sockets, which this build does not have" << std::endl;
+    return false;
+#endif
+}
+
+void Coordinator::accept_worker(int listener) {
+    //* Take a new connection and start its handshake.
+#ifdef RT_HAVE_SOCKETS
+    struct sockaddr_storage peer;
+    socklen_t peer_size = sizeof(peer);
+    int descriptor = accept(listener, (struct sockaddr *)&peer, &peer_size);
+    if (descriptor < 0) {
+        return;
+    }
+    std::unique_ptr<Worker> worker(new Worker());
+    worker->connection.reset(new Connection(descriptor));
+    char host[NI_MAXHOST], service[NI_MAXSERV];
+    if (getnameinfo((struct sockaddr *)&peer, peer_size, host, sizeof(host), service, sizeof(service),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        worker->report.name = std::string(host) + ":" + service;
+    } else {
+        worker->report.name = "?";
+    }
+    {
+        std::lock_guard<std::mutex> guard(joining_lock);
+        handshaking.push_back(descriptor);
+    }
+    handshakes.push_back(std::thread(&Coordinator::handshake, this, worker.release()));
+#else
+    (void)listener;
+#endif
+}
+
+void Coordinator::handshake(Worker *joining_worker) {
+    //* Check the hello of a new connection and send it the job (on a
+    //* thread of its own). A worker that gets the job goes to joining.
+    std::unique_ptr<Worker> worker(joining_worker);
+    int descriptor = worker->connection->get_descriptor();
+    bool joined = false;
+    worker->connection->set_timeout(CLUSTER_HANDSHAKE_TIMEOUT);
+    uint32_t type;
+    std::vector<char> payload;
+    ClusterHello hello;
+    if (!worker->connection->receive_message(type, payload, sizeof(hello)) || type != MESSAGE_HELLO ||
+        payload.size() != sizeof(hello)) {
+        std::cerr << "coordinator: " << worker->report.name << " is not a worker" << std::endl;
+    } else {
+        memcpy(&hello, payload.data(), sizeof(hello));
+        if (hello.version != CLUSTER_VERSION || hello.byte_order != CLUSTER_BYTE_ORDER ||
+            hello.settings_size != sizeof(TileRenderSettings) || hello.threads < 1) {
+            std::cerr << "coordinator: refused worker " << worker->report.name << " (protocol " << hello.version
+                      << ", another byte order or build)" << std::endl;
+            worker->connection->send_message(MESSAGE_DONE, NULL, 0);
+        } else {
+            worker->connection->set_timeout(worker_timeout);
+            std::vector<char> message(sizeof(ClusterJob) + scene_data.size());
+            memcpy(message.data(), &job, sizeof(ClusterJob));
+            memcpy(message.data() + sizeof(ClusterJob), scene_data.data(), scene_data.size());
+            joined = worker->connection->send_message(MESSAGE_JOB, message.data(), message.size());
+            if (!joined) {
+                std::cerr << "coordinator: worker " << worker->report.name << " left during the job" << std::endl;
+            }
+        }
+    }
+    if (joined) {
+        worker->report.threads = hello.threads;
+        worker->report.tiles = 0;
+        worker->report.samples = 0;
+        worker->report.busy_seconds = 0.0;
+        worker->report.connected_seconds = 0.0;
+        worker->report.lost = false;
+    }
+    // The descriptor leaves handshaking before it is closed, so
+    // finish_handshakes() never shuts down a descriptor reused by now.
+    std::lock_guard<std::mutex> guard(joining_lock);
+    handshaking.erase(std::find(handshaking.begin(), handshaking.end(), descriptor));
+    if (joined) {
+        joining.push_back(std::move(worker));
+    }
+}
+
+void Coordinator::take_joined() {
+    //* Move the workers that finished their handshake to the loop.
+    std::lock_guard<std::mutex> guard(joining_lock);
+    for (size_t i = 0; i < joining.size(); i++) {
+        std::unique_ptr<Worker> &worker = joining[i];
+        worker->joined = worker->last_heard = std::chrono::steady_clock::now();
+        std::cout << "coordinator: worker " << workers.size() << " (" << worker->report.name << ", "
+                  << worker->report.threads << " threads) joined" << std::endl;
+        workers.push_back(std::move(worker));
+    }
+    joining.clear();
+}
+
+void Coordinator::finish_handshakes() {
+    //* Cut the handshakes still going (the frame is over) and wait for
+    //* their threads. Workers that got the job are taken, to be told so.
+#ifdef RT_HAVE_SOCKETS
+    {
+        std::lock_guard<std::mutex> guard(joining_lock);
+        for (size_t i = 0; i < handshaking.size(); i++) {
+            shutdown(handshaking[i], SHUT_RDWR);
+        }
+    }
+#endif
+    for (size_t i = 0; i < handshakes.size(); i++) {
+        handshakes[i].join();
+    }
+    handshakes.clear();
+    take_joined();
+}
+
+bool Coordinator::receive_result(Worker &worker) {
+    //* Read one result and merge its tile. Return false when the worker
+    //* has to go.
+    uint32_t type;
+    std::vector<char> payload;
+    TileResultHeader header;
+    uint64_t largest = sizeof(header) + (uint64_t)job.tile_size * job.tile_size * sizeof(PixelWire);
+    if (!worker.connection->receive_message(type, payload, largest) || type != MESSAGE_RESULT ||
+        payload.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, payload.data(), sizeof(header));
+    std::vector<int>::iterator found = std::find(worker.outstanding.begin(), worker.outstanding.end(), header.tile_index);
+    if (found == worker.outstanding.end()) {
+        return false;
+    }
+    const Tile &tile = tiles[header.tile_index];
+    size_t pixel_count = (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+    if (payload.size() != sizeof(header) + pixel_count * sizeof(PixelWire)) {
+        return false;
+    }
+    worker.outstanding.erase(found);
+    worker.last_heard = std::chrono::steady_clock::now();
+    worker.report.tiles++;
+    worker.report.busy_seconds += header.busy_seconds;
+
+    // A tile that came back twice (from a worker given up on) has the same bits.
+    const PixelWire *wire = (const PixelWire *)(payload.data() + sizeof(header));
+    for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+        for (int column_index = tile.x0; column_index < tile.x1; column_index++, wire++) {
+            worker.report.samples += wire->count;
+            if (done[header.tile_index]) {
+                continue;
+            }
+            PixelSamples &pixel = samples.at(row_index, column_index);
+            pixel.sum = Vec3(wire->sum);
+            pixel.count = wire->count;
+            pixel.luminance_sum = wire->luminance_sum;
+            pixel.luminance_squared_sum = wire->luminance_squared_sum;
+            pixel.converged = true;
+        }
+    }
+    if (!done[header.tile_index]) {
+        done[header.tile_index] = 1;
+        completed++;
+    }
+    return true;
+}
+
+void Coordinator::hand_out(Worker &worker, int live_workers) {
+    //* Keep the worker's batches in flight. A batch is a tile per thread,
+    //* smaller near the end so the last tiles are spread over the workers.
+    int threads = worker.report.threads;
+    while (!pending.empty()) {
+        int fair_share = (int)((pending.size() + live_workers - 1) / std::max(1, live_workers));
+        int batch = std::max(1, std::min(threads, fair_share));
+        if ((int)worker.outstanding.size() + batch > CLUSTER_BATCHES_IN_FLIGHT * threads) {
+            return;
+        }
+        std::vector<int32_t> indices;
+        while ((int)indices.size() < batch && !pending.empty()) {
+            indices.push_back(pending.front());
+            pending.pop_front();
+        }
+        if (worker.outstanding.empty()) {
+            worker.last_heard = std::chrono::steady_clock::now();
+        }
+        worker.outstanding.insert(worker.outstanding.end(), indices.begin(), indices.end());
+        if (!worker.connection->send_message(MESSAGE_TILES, indices.data(), indices.size() * sizeof(int32_t))) {
+            drop(worker, "disconnected");
+            return;
+        }
+    }
+}
+
+void Coordinator::drop(Worker &worker, const char *reason) {
+    //* Give up on the worker and put its tiles back in front of the queue.
+    if (worker.report.lost) {
+        return;
+    }
+    worker.report.lost = true;
+    worker.report.connected_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.joined).count();
+    worker.connection->close();
+    for (size_t i = worker.outstanding.size(); i > 0; i--) {
+        pending.push_front(worker.outstanding[i - 1]);
+    }
+    requeued += (int)worker.outstanding.size();
+    std::cout << "coordinator: worker " << worker.report.name << " " << reason << ", " << worker.outstanding.size()
+              << " tiles requeued" << std::endl;
+    worker.outstanding.clear();
+}
+
+std::vector<ClusterWorkerReport> Coordinator::worker_reports() const {
+    std::vector<ClusterWorkerReport> reports;
+    for (size_t i = 0; i < workers.size(); i++) {
+        reports.push_back(workers[i]->report);
+    }
+    return reports;
+}
+
+int run_worker(const char *address, int threads, const char *kernel) {
+    //* Render tiles for the coordinator at address until it says the frame
+    //* is done. Return the exit status of the process.
+#ifdef RT_HAVE_SOCKETS
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    Connection connection;
+    // The coordinator may still be building its scene.
+    for (int attempt = 0; !connection.connect_to(address); attempt++) {
+        if (attempt == 100) {
+            std::cerr << "worker: can not connect to " << address << std::endl;
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    ClusterHello hello = {CLUSTER_VERSION, CLUSTER_BYTE_ORDER, (uint32_t)sizeof(TileRenderSettings), threads};
+    uint32_t type;
+    std::vector<char> payload;
+    if (!connection.send_message(MESSAGE_HELLO, &hello, sizeof(hello)) || !connection.receive_message(type, payload) ||
+        type != MESSAGE_JOB || payload.size() < sizeof(ClusterJob)) {
+        std::cerr << "worker: the coordinator at " << address << " refused the worker or went away" << std::endl;
+        return 1;
+    }
+    ClusterJob job;
+    memcpy(&job, payload.data(), sizeof(job));
+    Scene scene;
+    SceneLoadInfo info;
+    if (!read_scene_binary(payload.data() + sizeof(job), payload.size() - sizeof(job), scene, info, "coordinator scene")) {
+        return 1;
+    }
+    payload.clear();
+    payload.shrink_to_fit();
+    scene.bvh.set_kernels(select_kernels(kernel));
+    if (!info.prebuilt_bvh) {
+        scene.build_bvh();
+    }
+    std::cout << "worker: " << job.settings.width << "x" << job.settings.height << ", " << scene.sphere_count()
+              << " spheres, " << scene.lights.size() << " lights from " << address << std::endl;
+
+    Camera camera = Camera::from_wire(job.camera);
+    std::vector<Tile> tiles = make_tiles(job.settings.width, job.settings.height, job.tile_size);
+    SampleBuffer samples(job.settings.width, job.settings.height);
+    TilePool pool(threads);
+    std::mutex send_lock;
+    bool connected = true;
+    int tiles_done = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (connected && connection.receive_message(type, payload)) {
+        if (type == MESSAGE_DONE) {
+            std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+            unsigned long long rays = global_stats.count[CLOSEST_RAYS] + global_stats.count[SHADOW_RAYS];
+            std::cout << "worker: " << tiles_done << " tiles in " << wall.count() << " s, "
+                      << (wall.count() > 0.0 ? rays / wall.count() / 1e6 : 0.0) << " M rays/s" << std::endl;
+            return 0;
+        }
+        if (type != MESSAGE_TILES || payload.size() % sizeof(int32_t) != 0) {
+            break;
+        }
+        std::vector<Tile> batch;
+        const int32_t *indices = (const int32_t *)payload.data();
+        for (size_t i = 0; i < payload.size() / sizeof(int32_t); i++) {
+            if (indices[i] < 0 || indices[i] >= (int32_t)tiles.size()) {
+                std::cerr << "worker: the coordinator sent an unknown tile " << indices[i] << std::endl;
+                return 1;
+            }
+            batch.push_back(tiles[indices[i]]);
+        }
+        pool.render(batch, [&](const Tile &tile) {
+            std::chrono::steady_clock::time_point tile_start = std::chrono::steady_clock::now();
+            // All passes of the tile at once: only the coordinator holds the frame.
+            while (!render_tile_pass(tile, samples, camera, scene, job.settings)) {
+            }
+            flush_thread_stats();
+            std::chrono::duration<double> busy = std::chrono::steady_clock::now() - tile_start;
+
+            TileResultHeader header = {tile.index, 0, busy.count()};
+            std::vector<char> result(sizeof(header) + (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * sizeof(PixelWire));
+            memcpy(result.data(), &header, sizeof(header));
+            PixelWire *wire = (PixelWire *)(result.data() + sizeof(header));
+            for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+                for (int column_index = tile.x0; column_index < tile.x1; column_index++, wire++) {
+                    const PixelSamples &pixel = samples.at(row_index, column_index);
+                    *wire = PixelWire{{pixel.sum.r(), pixel.sum.g(), pixel.sum.b()}, pixel.count,
+                                      pixel.luminance_sum, pixel.luminance_squared_sum};
+                }
+            }
+            std::lock_guard<std::mutex> guard(send_lock);
+            connected = connected && connection.send_message(MESSAGE_RESULT, result.data(), result.size());
+            tiles_done++;
+        });
+    }
+    std::cerr << "worker: lost the coordinator at " << address << std::endl;
+    return 1;
+}
+
+#endif
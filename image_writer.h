@@ -0,0 +1,440 @@
+#ifndef IMAGEWRITERH
+#define IMAGEWRITERH
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "deflate.h"
+#include "mapped_file.h"
+
+enum ImageFormat {
+    // ASCII PPM (the old output)
+    IMAGE_P3,
+    // binary PPM, 8 and 16 bits per channel
+    IMAGE_P6,
+    IMAGE_P6_16,
+    // 32-bit float RGB (portable float map)
+    IMAGE_PFM,
+    // 8-bit RGB PNG
+    IMAGE_PNG,
+    IMAGE_FORMAT_COUNT
+};
+
+inline const char *const image_format_names[IMAGE_FORMAT_COUNT] = {"p3", "p6", "p16", "pfm", "png"};
+
+inline bool parse_image_format(const char *name, ImageFormat &format) {
+    for (int i = 0; i < IMAGE_FORMAT_COUNT; i++) {
+        if (strcmp(name, image_format_names[i]) == 0) {
+            format = (ImageFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline ImageFormat image_format_of_path(const char *path) {
+    //* Guess the format from the file extension (binary PPM by default).
+    const char *dot = strrchr(path, '.');
+    if (dot && strcmp(dot, ".png") == 0) {
+        return IMAGE_PNG;
+    }
+    if (dot && strcmp(dot, ".pfm") == 0) {
+        return IMAGE_PFM;
+    }
+    return IMAGE_P6;
+}
+
+inline int quantize(float x, int max_value) {
+    //* Truncate like the old int(x * 255), but clamped, and NaN becomes 0.
+    return x > 0.0f ? (int)std::min((float)max_value, x * max_value) : 0;
+}
+
+//* Writes a frame while it is being rendered.
+//* Render threads submit finished bands of rows (copied out as float RGB),
+//* and one writer thread formats, compresses and writes them, so the render
+//* threads never wait on formatting or on the disk.
+//* The formats with a fixed row size (P6, 16-bit P6, PFM) write every band
+//* straight to its place in the file, in any order, optionally through a
+//* memory map. P3 and PNG are streams: their bands wait until the rows above
+//* them are written.
+class FrameWriter {
+    public:
+        /* constructors */
+        FrameWriter() : format(IMAGE_P6), width(0), height(0), header_size(0), mapping(NULL), mapping_size(0), descriptor(-1),
+                        next_row(0), closing(false), ok(false), is_open(false), written(0), encode_time(0.0) {}
+
+        ~FrameWriter() {
+            close();
+        }
+
+        bool open(const char *path, ImageFormat format, int width, int height, bool use_mmap);
+        void submit(int top_row, int row_count, std::vector<float> &rgb);
+        bool close();
+
+        size_t bytes_written() const {
+            return written;
+        }
+
+        double encode_seconds() const {
+            return encode_time;
+        }
+
+        bool mapped() const {
+            return mapping != NULL;
+        }
+
+    private:
+        typedef struct RowBand {
+            // first row counted from the top, and the rows as RGB floats
+            int top_row;
+            int row_count;
+            std::vector<float> rgb;
+        } RowBand;
+
+        bool fixed_row_size() const {
+            return format == IMAGE_P6 || format == IMAGE_P6_16 || format == IMAGE_PFM;
+        }
+
+        size_t row_bytes() const {
+            return (size_t)width * (format == IMAGE_P6 ? 3 : format == IMAGE_P6_16 ? 6 : 12);
+        }
+
+        void writer_loop();
+        void write_band(const RowBand &band);
+        void encode_fixed_row(const float *rgb, unsigned char *out) const;
+        void encode_text_row(const float *rgb, std::string &out) const;
+        void encode_png_row(const float *rgb, std::vector<unsigned char> &out);
+        void write_at(size_t offset, const unsigned char *data, size_t size);
+        void append(const unsigned char *data, size_t size);
+        void png_chunk(const char *type, const unsigned char *data, size_t size);
+
+        ImageFormat format;
+        int width;
+        int height;
+        size_t header_size;
+        std::fstream file;
+        unsigned char *mapping;
+        size_t mapping_size;
+        int descriptor;
+
+        std::thread thread;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<RowBand> queue;
+        // bands of a stream format that came before the rows above them
+        std::map<int, RowBand> pending;
+        int next_row;
+        bool closing;
+        bool ok;
+        bool is_open;
+
+        // PNG state: the compressor and the previous row for the filters.
+        DeflateStream deflate;
+        std::vector<unsigned char> previous_row;
+        std::vector<unsigned char> row_buffer;
+        std::vector<unsigned char> compressed;
+
+        size_t written;
+        double encode_time;
+};
+
+bool FrameWriter::open(const char *path, ImageFormat format, int width, int height, bool use_mmap) {
+    //* Create the file, write the header and start the writer thread.
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    next_row = 0;
+    written = 0;
+    encode_time = 0.0;
+
+    std::string header;
+    if (format == IMAGE_P3) {
+        header = "P3\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    } else if (format == IMAGE_P6 || format == IMAGE_P6_16) {
+        header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + (format == IMAGE_P6 ? "\n255\n" : "\n65535\n");
+    } else if (format == IMAGE_PFM) {
+        // A negative scale means little-endian floats.
+        header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+    }
+    header_size = header.size();
+
+#ifdef RT_HAVE_MMAP
+    if (use_mmap && fixed_row_size()) {
+        mapping_size = header_size + row_bytes() * height;
+        descriptor = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (descriptor < 0) {
+            return false;
+        }
+        void *address = MAP_FAILED;
+        if (ftruncate(descriptor, (off_t)mapping_size) == 0) {
+            address = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+        }
+        if (address == MAP_FAILED) {
+            ::close(descriptor);
+            descriptor = -1;
+            return false;
+        }
+        mapping = (unsigned char *)address;
+    }
+#else
+    (void)use_mmap;
+#endif
+    if (!mapping) {
+        file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+    }
+
+    ok = true;
+    if (format == IMAGE_PNG) {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        append(signature, 8);
+        unsigned char ihdr[13] = {(unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                                  (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                                  // 8 bits, RGB, deflate, adaptive filters, no interlace
+                                  8, 2, 0, 0, 0};
+        png_chunk("IHDR", ihdr, 13);
+        previous_row.assign((size_t)width * 3, 0);
+    } else {
+        write_at(0, (const unsigned char *)header.data(), header.size());
+    }
+
+    closing = false;
+    is_open = true;
+    thread = std::thread(&FrameWriter::writer_loop, this);
+    return true;
+}
+
+void FrameWriter::submit(int top_row, int row_count, std::vector<float> &rgb) {
+    //* Hand rows [top_row, top_row + row_count) (counted from the top, RGB
+    //* floats, top row first) to the writer thread. Takes over rgb.
+    std::lock_guard<std::mutex> guard(lock);
+    queue.push_back(RowBand());
+    queue.back().top_row = top_row;
+    queue.back().row_count = row_count;
+    queue.back().rgb.swap(rgb);
+    wake.notify_one();
+}
+
+bool FrameWriter::close() {
+    //* Write what is left, finish the file and return whether all of it was written.
+    if (!is_open) {
+        return ok;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closing = true;
+        wake.notify_one();
+    }
+    thread.join();
+    is_open = false;
+
+    if (!fixed_row_size() && next_row != height) {
+        std::cerr << "frame writer: " << height - next_row << " rows were never submitted" << std::endl;
+        ok = false;
+    }
+    if (format == IMAGE_PNG) {
+        compressed.clear();
+        deflate.finish(compressed);
+        png_chunk("IDAT", compressed.data(), compressed.size());
+        png_chunk("IEND", NULL, 0);
+    }
+#ifdef RT_HAVE_MMAP
+    if (mapping) {
+        ok = msync(mapping, mapping_size, MS_ASYNC) == 0 && ok;
+        munmap(mapping, mapping_size);
+        ::close(descriptor);
+        mapping = NULL;
+        descriptor = -1;
+        written = mapping_size;
+        return ok;
+    }
+#endif
+    file.close();
+    return ok && !file.fail();
+}
+
+void FrameWriter::writer_loop() {
+    while (true) {
+        RowBand band;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this] { return !queue.empty() || closing; });
+            if (queue.empty()) {
+                return;
+            }
+            band.top_row = queue.front().top_row;
+            band.row_count = queue.front().row_count;
+            band.rgb.swap(queue.front().rgb);
+            queue.pop_front();
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (fixed_row_size()) {
+            write_band(band);
+        } else {
+            // Streams are written top to bottom.
+            int top_row = band.top_row;
+            pending[top_row].top_row = top_row;
+            pending[top_row].row_count = band.row_count;
+            pending[top_row].rgb.swap(band.rgb);
+            while (!pending.empty() && pending.begin()->first == next_row) {
+                write_band(pending.begin()->second);
+                next_row += pending.begin()->second.row_count;
+                pending.erase(pending.begin());
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        encode_time += elapsed.count();
+    }
+}
+
+void FrameWriter::write_band(const RowBand &band) {
+    if (fixed_row_size()) {
+        size_t size = row_bytes();
+        row_buffer.resize(size);
+        for (int r = 0; r < band.row_count; r++) {
+            int row = band.top_row + r;
+            // PFM stores the bottom row first.
+            int file_row = format == IMAGE_PFM ? height - 1 - row : row;
+            encode_fixed_row(&band.rgb[(size_t)r * width * 3], row_buffer.data());
+            write_at(header_size + (size_t)file_row * size, row_buffer.data(), size);
+        }
+    } else if (format == IMAGE_P3) {
+        std::string text;
+        for (int r = 0; r < band.row_count; r++) {
+            encode_text_row(&band.rgb[(size_t)r * width * 3], text);
+        }
+        append((const unsigned char *)text.data(), text.size());
+    } else {
+        // One deflate block and one IDAT chunk per band.
+        std::vector<unsigned char> filtered;
+        for (int r = 0; r < band.row_count; r++) {
+            encode_png_row(&band.rgb[(size_t)r * width * 3], filtered);
+        }
+        compressed.clear();
+        deflate.write(filtered.data(), filtered.size(), compressed);
+        png_chunk("IDAT", compressed.data(), compressed.size());
+    }
+}
+
+void FrameWriter::encode_fixed_row(const float *rgb, unsigned char *out) const {
+    for (int i = 0; i < width * 3; i++) {
+        if (format == IMAGE_P6) {
+            out[i] = (unsigned char)quantize(rgb[i], 255);
+        } else if (format == IMAGE_P6_16) {
+            // big-endian
+            int value = quantize(rgb[i], 65535);
+            out[2 * i] = (unsigned char)(value >> 8);
+            out[2 * i + 1] = (unsigned char)value;
+        } else {
+            uint32_t bits;
+            memcpy(&bits, &rgb[i], 4);
+            out[4 * i] = (unsigned char)bits;
+            out[4 * i + 1] = (unsigned char)(bits >> 8);
+            out[4 * i + 2] = (unsigned char)(bits >> 16);
+            out[4 * i + 3] = (unsigned char)(bits >> 24);
+        }
+    }
+}
+
+void FrameWriter::encode_text_row(const float *rgb, std::string &out) const {
+    for (int x = 0; x < width; x++) {
+        out += std::to_string(quantize(rgb[3 * x], 255));
+        out += ' ';
+        out += std::to_string(quantize(rgb[3 * x + 1], 255));
+        out += ' ';
+        out += std::to_string(quantize(rgb[3 * x + 2], 255));
+        out += '\n';
+    }
+}
+
+inline unsigned char paeth(int a, int b, int c) {
+    //* The PNG Paeth predictor: the neighbour closest to a + b - c.
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return (unsigned char)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+void FrameWriter::encode_png_row(const float *rgb, std::vector<unsigned char> &out) {
+    //* Append the filter byte and the filtered row. The filter is chosen per
+    //* row by the usual heuristic: the smallest sum of |signed residuals|.
+    size_t size = (size_t)width * 3;
+    row_buffer.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        row_buffer[i] = (unsigned char)quantize(rgb[i], 255);
+    }
+    const unsigned char *row = row_buffer.data();
+    const unsigned char *up = previous_row.data();
+    long best_cost = -1;
+    int best_filter = 0;
+    std::vector<unsigned char> candidate(size);
+    std::vector<unsigned char> best(size);
+    for (int filter = 0; filter < 5; filter++) {
+        long cost = 0;
+        for (size_t i = 0; i < size; i++) {
+            int a = i >= 3 ? row[i - 3] : 0;
+            int b = up[i];
+            int c = i >= 3 ? up[i - 3] : 0;
+            int prediction = filter == 0 ? 0 : filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : paeth(a, b, c);
+            candidate[i] = (unsigned char)(row[i] - prediction);
+            cost += abs((signed char)candidate[i]);
+        }
+        if (best_cost < 0 || cost < best_cost) {
+            best_cost = cost;
+            best_filter = filter;
+            best.swap(candidate);
+        }
+    }
+    out.push_back((unsigned char)best_filter);
+    out.insert(out.end(), best.begin(), best.end());
+    previous_row.swap(row_buffer);
+}
+
+void FrameWriter::write_at(size_t offset, const unsigned char *data, size_t size) {
+    if (mapping) {
+        memcpy(mapping + offset, data, size);
+        return;
+    }
+    file.seekp((std::streamoff)offset);
+    file.write((const char *)data, (std::streamsize)size);
+    written = std::max(written, offset + size);
+    if (!file) {
+        ok = false;
+    }
+}
+
+void FrameWriter::append(const unsigned char *data, size_t size) {
+    file.write((const char *)data, (std::streamsize)size);
+    written += size;
+    if (!file) {
+        ok = false;
+    }
+}
+
+void FrameWriter::png_chunk(const char *type, const unsigned char *data, size_t size) {
+    //* Length, type, data and the CRC of type and data.
+    unsigned char length[4] = {(unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size};
+    append(length, 4);
+    append((const unsigned char *)type, 4);
+    if (size > 0) {
+        append(data, size);
+    }
+    uint32_t crc = crc32_update(0, (const unsigned char *)type, 4);
+    crc = crc32_update(crc, data, size);
+    unsigned char crc_bytes[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc};
+    append(crc_bytes, 4);
+}
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef INSTANCINGH
+#define INSTANCINGH
+
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#include "bvh.h"
+#include "ray.h"
+#include "sphere.h"
+#include "stats.h"
+
+//* One placement of a prototype: its spheres moved by translation and
+//* scaled by scale around the origin of the prototype.
+typedef struct SphereInstance {
+    int prototype;
+    Vec3 translation;
+    float scale;
+    // index of its first sphere, sphere i of the prototype is first_index + i
+    int first_index;
+} SphereInstance;
+
+//* Repeated geometry: prototypes (groups of spheres with their own BVH)
+//* placed many times, each placement costing one SphereInstance instead of
+//* a copy of its spheres. A ray enters an instance by moving into the space
+//* of its prototype: origin (origin - translation) / scale, the same unit
+//* direction, and t / scale (the scale is uniform, so the normals stay).
+//* A top-level tree over the boxes of the instances finds the ones a ray
+//* goes through; its nodes are BVHNodes with one instance in every leaf.
+class InstanceSet {
+    public:
+        /* constructors */
+        InstanceSet() : sphere_total(0), first_index(0) {}
+
+        // Add a prototype and return its index. Its tree is built here, and
+        // made compact with compact (which falls back to the float one).
+        int add_prototype(const std::vector<Sphere> &spheres, bool compact);
+
+        void add_instance(int prototype, const Vec3 &translation, float scale) {
+            instances.push_back(SphereInstance{prototype, translation, scale, 0});
+        }
+
+        // Number the spheres of the instances from first_index on (after
+        // the spheres of the scene) and build the top-level tree.
+        void build(int first_index);
+
+        bool empty() const {
+            return instances.empty();
+        }
+
+        int instance_count() const {
+            return (int)instances.size();
+        }
+
+        int prototype_count() const {
+            return (int)prototypes.size();
+        }
+
+        // Spheres of all instances together.
+        long long sphere_count() const {
+            return sphere_total;
+        }
+
+        // Memory of the prototypes, the instances and the top-level tree in bytes.
+        size_t bytes() const;
+
+        // Closest hit in (t_min, t_max), skip the sphere self_index.
+        bool intersect(const Ray &ray, float t_min, float t_max, hit_record &record, int self_index) const;
+
+        // Any hit in (t_min, t_max), skip the sphere self_index.
+        bool occluded(const Ray &ray, float t_min, float t_max, int self_index) const;
+
+    private:
+        int build_recursive(std::vector<int> &order, int first, int last);
+        void instance_bounds(const SphereInstance &instance, AABB &box) const;
+
+        // The ray in the space of the prototype of instance.
+        Ray local_ray(const SphereInstance &instance, const Ray &ray) const {
+            return Ray::from_unit((ray.origin() - instance.translation) / instance.scale, ray.direction());
+        }
+
+        int local_self(const SphereInstance &instance, int self_index) const {
+            int local = self_index - instance.first_index;
+            return local >= 0 && local < prototypes[instance.prototype].size() ? local : -1;
+        }
+
+        std::vector<BVH> prototypes;
+        std::vector<SphereInstance> instances;
+        std::vector<BVHNode> nodes;
+        long long sphere_total;
+        int first_index;
+};
+
+int InstanceSet::add_prototype(const std::vector<Sphere> &spheres, bool compact) {
+    prototypes.push_back(BVH(spheres));
+    if (compact) {
+        prototypes.back().compact();
+    }
+    return (int)prototypes.size() - 1;
+}
+
+void InstanceSet::instance_bounds(const SphereInstance &instance, AABB &box) const {
+    const BVHNode &root = prototypes[instance.prototype].get_nodes()[0];
+    box.lower = instance.scale * Vec3(root.lower[0], root.lower[1], root.lower[2]) + instance.translation;
+    box.upper = instance.scale * Vec3(root.upper[0], root.upper[1], root.upper[2]) + instance.translation;
+}
+
+void InstanceSet::build(int first_index) {
+    //* Instances of empty prototypes are dropped, they can not be hit.
+    this->first_index = first_index;
+    std::vector<SphereInstance> kept;
+    kept.reserve(instances.size());
+    long long next = first_index;
+    for (size_t i = 0; i < instances.size(); i++) {
+        const BVH &prototype = prototypes[instances[i].prototype];
+        if (prototype.get_node_count() > 0 && instances[i].scale > 0.0f) {
+            kept.push_back(instances[i]);
+            kept.back().first_index = (int)next;
+            next += prototype.size();
+        }
+    }
+    instances.swap(kept);
+    sphere_total = next - first_index;
+
+    nodes.clear();
+    if (instances.empty()) {
+        return;
+    }
+    nodes.reserve(instances.size() * 2);
+    std::vector<int> order(instances.size());
+    for (size_t i = 0; i < instances.size(); i++) {
+        order[i] = (int)i;
+    }
+    build_recursive(order, 0, (int)order.size());
+}
+
+int InstanceSet::build_recursive(std::vector<int> &order, int first, int last) {
+    //* Split at the median of the longest axis of the box centers, like the light tree.
+    int node_index = (int)nodes.size();
+    nodes.push_back(BVHNode());
+    AABB bounds, centers;
+    bounds.reset();
+    centers.reset();
+    for (int i = first; i < last; i++) {
+        AABB box;
+        instance_bounds(instances[order[i]], box);
+        bounds.grow(box);
+        centers.grow(0.5f * (box.lower + box.upper));
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        nodes[node_index].lower[axis] = bounds.lower[axis];
+        nodes[node_index].upper[axis] = bounds.upper[axis];
+    }
+    if (last - first == 1) {
+        nodes[node_index].offset = order[first];
+        nodes[node_index].count = 1;
+        return node_index;
+    }
+    Vec3 extent = centers.upper - centers.lower;
+    int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+    int middle = first + (last - first) / 2;
+    std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+        AABB a_box, b_box;
+        instance_bounds(instances[a], a_box);
+        instance_bounds(instances[b], b_box);
+        return a_box.lower[axis] + a_box.upper[axis] < b_box.lower[axis] + b_box.upper[axis];
+    });
+    build_recursive(order, first, middle);
+    int second = build_recursive(order, middle, last);
+    nodes[node_index].offset = second;
+    nodes[node_index].count = 0;
+    return node_index;
+}
+
+size_t InstanceSet::bytes() const {
+    size_t total = instances.capacity() * sizeof(SphereInstance) + nodes.capacity() * sizeof(BVHNode);
+    for (size_t i = 0; i < prototypes.size(); i++) {
+        total += sizeof(BVH) + prototypes[i].bytes();
+    }
+    return total;
+}
+
+bool InstanceSet::intersect(const Ray &ray, float t_min, float t_max, hit_record &record, int self_index) const {
+    //* Walk the top-level tree nearer child first, like BVH::intersect();
+    //* every instance hit shrinks t_max for the next ones, and deferred
+    //* nodes that start behind it are dropped.
+    if (nodes.empty()) {
+        return false;
+    }
+    Vec3 origin = ray.origin();
+    Vec3 direction = ray.direction();
+    Vec3 inv_direction(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z());
+    int stack[BVH_STACK_SIZE];
+    float stack_t[BVH_STACK_SIZE];
+    int stack_size = 0;
+    int node_index = 0;
+    bool hit = false;
+    unsigned long long visited = 0;
+    auto pop = [&]() {
+        while (stack_size > 0) {
+            stack_size--;
+            if (stack_t[stack_size] <= t_max) {
+                return stack[stack_size];
+            }
+        }
+        return -1;
+    };
+    float t_enter;
+    if (!hit_node(nodes[0], origin, inv_direction, t_min, t_max, t_enter)) {
+        node_index = -1;
+    }
+    while (node_index >= 0) {
+        const BVHNode &node = nodes[node_index];
+        visited++;
+        if (node.count > 0) {
+            const SphereInstance &instance = instances[node.offset];
+            hit_record local;
+            if (prototypes[instance.prototype].intersect(local_ray(instance, ray), t_min / instance.scale,
+                                                         t_max / instance.scale, local,
+                                                         local_self(instance, self_index))) {
+                // Back to the space of the scene; the normal stays.
+                record = local;
+                record.t = instance.scale * local.t;
+                record.p = instance.scale * local.p + instance.translation;
+                record.in_scene_index = instance.first_index + local.in_scene_index;
+                t_max = record.t;
+                hit = true;
+            }
+            node_index = pop();
+            continue;
+        }
+        int first = node_index + 1;
+        int second = node.offset;
+        float t_first = 0.0f, t_second = 0.0f;
+        bool hit_first = hit_node(nodes[first], origin, inv_direction, t_min, t_max, t_first);
+        bool hit_second = hit_node(nodes[second], origin, inv_direction, t_min, t_max, t_second);
+        if (hit_first && hit_second) {
+            if (t_second < t_first) {
+                std::swap(first, second);
+                std::swap(t_first, t_second);
+            }
+            stack[stack_size] = second;
+            stack_t[stack_size++] = t_second;
+            node_index = first;
+        } else if (hit_first) {
+            node_index = first;
+        } else if (hit_second) {
+            node_index = second;
+        } else {
+            node_index = pop();
+        }
+    }
+    thread_stats.count[INSTANCE_NODES] += visited;
+    return hit;
+}
+
+bool InstanceSet::occluded(const Ray &ray, float t_min, float t_max, int self_index) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vec3 origin = ray.origin();
+    Vec3 direction = ray.direction();
+    Vec3 inv_direction(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z());
+    int stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    bool blocked = false;
+    unsigned long long visited = 0;
+    while (stack_size > 0 && !blocked) {
+        const BVHNode &node = nodes[stack[--stack_size]];
+        float t_enter;
+        visited++;
+        if (!hit_node(node, origin, inv_direction, t_min, t_max, t_enter)) {
+            continue;
+        }
+        if (node.count == 0) {
+            stack[stack_size++] = node.offset;
+            stack[stack_size++] = (int)(&node - &nodes[0]) + 1;
+            continue;
+        }
+        const SphereInstance &instance = instances[node.offset];
+        blocked = prototypes[instance.prototype].occluded(local_ray(instance, ray), t_min / instance.scale,
+                                                          t_max / instance.scale, local_self(instance, self_index));
+    }
+    thread_stats.count[INSTANCE_NODES] += visited;
+    return blocked;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef LIGHTH
+#define LIGHTH
+
+#include <math.h>
+#include <algorithm>
+
+#include "vec3.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+//* Light sources of a scene.
+//*   point   the light of the original tracer: a point whose intensity does
+//*           not fall off with the distance.
+//*   sphere  a sphere that emits radiance from its whole surface.
+//*   area    a parallelogram (corner + edge_u + edge_v) that emits radiance
+//*           to the side of cross(edge_u, edge_v).
+//* The sphere and area lights only light the scene; they are not geometry,
+//* so a scene that should show them adds a sphere at the same place.
+enum LightType {
+    LIGHT_POINT,
+    LIGHT_SPHERE,
+    LIGHT_AREA
+};
+
+typedef struct Light {
+    LightType type;
+    // point position, sphere center or area corner
+    Vec3 position;
+    Vec3 edge_u;
+    Vec3 edge_v;
+    float radius;
+    // intensity of a point light, radiance of the others
+    Vec3 emission;
+} Light;
+
+inline Light point_light(const Vec3 &position, const Vec3 &intensity) {
+    return Light{LIGHT_POINT, position, Vec3(0, 0, 0), Vec3(0, 0, 0), 0.0f, intensity};
+}
+
+inline Light sphere_light(const Vec3 &center, float radius, const Vec3 &radiance) {
+    return Light{LIGHT_SPHERE, center, Vec3(0, 0, 0), Vec3(0, 0, 0), radius, radiance};
+}
+
+inline Light area_light(const Vec3 &corner, const Vec3 &edge_u, const Vec3 &edge_v, const Vec3 &radiance) {
+    return Light{LIGHT_AREA, corner, edge_u, edge_v, 0.0f, radiance};
+}
+
+inline Light default_light() {
+    //* The light of the original tracer, for scenes that bring none.
+    return point_light(Vec3(-10, 10, 0), Vec3(1.0, 1.0, 1.0));
+}
+
+inline void light_bounds(const Light &light, Vec3 &lower, Vec3 &upper) {
+    //* The box around everything the light emits from.
+    if (light.type == LIGHT_SPHERE) {
+        Vec3 r(light.radius, light.radius, light.radius);
+        lower = light.position - r;
+        upper = light.position + r;
+        return;
+    }
+    lower = upper = light.position;
+    if (light.type == LIGHT_AREA) {
+        Vec3 corners[3] = {light.position + light.edge_u, light.position + light.edge_v,
+                           light.position + light.edge_u + light.edge_v};
+        for (int i = 0; i < 3; i++) {
+            lower = Vec3(std::min(lower.x(), corners[i].x()), std::min(lower.y(), corners[i].y()), std::min(lower.z(), corners[i].z()));
+            upper = Vec3(std::max(upper.x(), corners[i].x()), std::max(upper.y(), corners[i].y()), std::max(upper.z(), corners[i].z()));
+        }
+    }
+}
+
+inline float light_power(const Light &light) {
+    //* Emitted power (by luminance), the weight of the light in the light tree.
+    float emitted = luminance(light.emission);
+    if (light.type == LIGHT_SPHERE) {
+        return emitted * float(M_PI) * 4.0f * float(M_PI) * light.radius * light.radius;
+    } else if (light.type == LIGHT_AREA) {
+        return emitted * float(M_PI) * cross(light.edge_u, light.edge_v).length();
+    }
+    return emitted * 4.0f * float(M_PI);
+}
+
+inline void orthonormal_basis(const Vec3 &w, Vec3 &u, Vec3 &v) {
+    //* Two unit vectors that make an orthonormal basis with the unit vector w
+    //* (Duff et al., "Building an Orthonormal Basis, Revisited").
+    float sign = copysignf(1.0f, w.z());
+    float a = -1.0f / (sign + w.z());
+    float b = w.x() * w.y() * a;
+    u = Vec3(1.0f + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+    v = Vec3(b, sign + w.y() * w.y() * a, -w.y());
+}
+
+bool sample_light(const Light &light, const Vec3 &point, const Vec3 &normal, float u1, float u2,
+                  Vec3 &direction, float &distance, float &weight) {
+    //* One sample of the light seen from point (with the surface normal).
+    //* The light adds kd * emission * weight when the shadow ray (direction,
+    //* up to distance) is not blocked. Return false when the sample adds
+    //* nothing, so no shadow ray is needed. direction is a unit vector.
+    if (light.type == LIGHT_POINT) {
+        // The shading of the original tracer, to the bit.
+        direction = unit_vector(light.position - point);
+        distance = Vec3(light.position - point).length();
+        weight = std::max<float>(0.0, dot(normal, direction));
+        return weight > 0.0f;
+    }
+
+    if (light.type == LIGHT_SPHERE) {
+        // Uniform in the cone of directions that hit the sphere.
+        Vec3 to_center = light.position - point;
+        float center_distance2 = dot(to_center, to_center);
+        float radius2 = light.radius * light.radius;
+        if (center_distance2 <= radius2) {
+            return false;
+        }
+        float center_distance = sqrtf(center_distance2);
+        Vec3 w = to_center / center_distance;
+        float cos_max = sqrtf(std::max(0.0f, 1.0f - radius2 / center_distance2));
+        float cos_theta = 1.0f - u1 * (1.0f - cos_max);
+        float sin_theta = sqrtf(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+        float phi = 2.0f * float(M_PI) * u2;
+        Vec3 u, v;
+        orthonormal_basis(w, u, v);
+        direction = u * (cosf(phi) * sin_theta) + v * (sinf(phi) * sin_theta) + w * cos_theta;
+        float cosine = dot(normal, direction);
+        if (cosine <= 0.0f) {
+            return false;
+        }
+        // Distance to the near side of the sphere.
+        float b = dot(direction, to_center);
+        float discriminant = b * b - (center_distance2 - radius2);
+        distance = (b - sqrtf(std::max(0.0f, discriminant))) * (1.0f - 1e-4f);
+        // cosine / pdf, the pdf being 1 / solid angle of the cone
+        weight = cosine * 2.0f * float(M_PI) * (1.0f - cos_max);
+        return true;
+    }
+
+    // Area: uniform on the parallelogram.
+    Vec3 target = light.position + u1 * light.edge_u + u2 * light.edge_v;
+    Vec3 light_normal = cross(light.edge_u, light.edge_v);
+    float area = light_normal.length();
+    Vec3 to_target = target - point;
+    float distance2 = dot(to_target, to_target);
+    if (area <= 0.0f || distance2 <= 0.0f) {
+        return false;
+    }
+    float length = sqrtf(distance2);
+    direction = to_target / length;
+    float cosine = dot(normal, direction);
+    float light_cosine = -dot(light_normal, direction) / area;
+    if (cosine <= 0.0f || light_cosine <= 0.0f) {
+        return false;
+    }
+    distance = length * (1.0f - 1e-4f);
+    weight = cosine * light_cosine * area / distance2;
+    return true;
+}
+
+#endif
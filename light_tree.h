@@ -0,0 +1,166 @@
+#ifndef LIGHTTREEH
+#define LIGHTTREEH
+
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#include "light.h"
+#include "stats.h"
+
+//* One node of the flattened light tree, in depth-first order like the BVH:
+//* the first child of an interior node is the next node, the second child
+//* is at offset. A leaf holds one light.
+typedef struct LightNode {
+    float lower[3];
+    float upper[3];
+    // summed light_power() of the lights below
+    float power;
+    // light index for a leaf, second child for an interior node
+    int offset;
+    // 1 for a leaf, 0 for an interior node
+    int count;
+} LightNode;
+
+//* Binary tree over the lights of a scene for picking one light per shadow
+//* ray in proportion to its estimated contribution at the shading point
+//* (power over squared distance, zero when the whole box is behind the
+//* surface). A pick walks one path down the tree, so its cost grows with the
+//* log of the light count.
+class LightTree {
+    public:
+        void build(const std::vector<Light> &lights);
+
+        // Pick a light for point (normal) with u in [0, 1). Return false
+        // without lights; pdf is the probability of the picked light.
+        bool pick(const Vec3 &point, const Vec3 &normal, float u, int &light_index, float &pdf) const;
+
+        int size() const {
+            return (int)nodes.size();
+        }
+
+    private:
+        int build_recursive(const std::vector<Light> &lights, std::vector<int> &order, int first, int last);
+        float importance(const LightNode &node, const Vec3 &point, const Vec3 &normal) const;
+
+        std::vector<LightNode> nodes;
+};
+
+void LightTree::build(const std::vector<Light> &lights) {
+    nodes.clear();
+    if (lights.empty()) {
+        return;
+    }
+    nodes.reserve(lights.size() * 2);
+    std::vector<int> order(lights.size());
+    for (size_t i = 0; i < lights.size(); i++) {
+        order[i] = (int)i;
+    }
+    build_recursive(lights, order, 0, (int)order.size());
+}
+
+int LightTree::build_recursive(const std::vector<Light> &lights, std::vector<int> &order, int first, int last) {
+    //* Split at the median of the longest axis of the light centers.
+    int node_index = (int)nodes.size();
+    nodes.push_back(LightNode());
+    Vec3 lower(FLT_MAX, FLT_MAX, FLT_MAX), upper(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Vec3 center_lower = lower, center_upper = upper;
+    float power = 0.0f;
+    for (int i = first; i < last; i++) {
+        const Light &light = lights[order[i]];
+        Vec3 light_lower, light_upper;
+        light_bounds(light, light_lower, light_upper);
+        Vec3 center = 0.5f * (light_lower + light_upper);
+        for (int axis = 0; axis < 3; axis++) {
+            lower[axis] = std::min(lower[axis], light_lower[axis]);
+            upper[axis] = std::max(upper[axis], light_upper[axis]);
+            center_lower[axis] = std::min(center_lower[axis], center[axis]);
+            center_upper[axis] = std::max(center_upper[axis], center[axis]);
+        }
+        power += light_power(light);
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        nodes[node_index].lower[axis] = lower[axis];
+        nodes[node_index].upper[axis] = upper[axis];
+    }
+    nodes[node_index].power = power;
+
+    if (last - first == 1) {
+        nodes[node_index].offset = order[first];
+        nodes[node_index].count = 1;
+        return node_index;
+    }
+    Vec3 extent = center_upper - center_lower;
+    int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+    int middle = first + (last - first) / 2;
+    std::nth_element(order.begin() + first, order.begin() + middle, order.begin() + last, [&](int a, int b) {
+        Vec3 a_lower, a_upper, b_lower, b_upper;
+        light_bounds(lights[a], a_lower, a_upper);
+        light_bounds(lights[b], b_lower, b_upper);
+        return a_lower[axis] + a_upper[axis] < b_lower[axis] + b_upper[axis];
+    });
+    build_recursive(lights, order, first, middle);
+    int second = build_recursive(lights, order, middle, last);
+    nodes[node_index].offset = second;
+    nodes[node_index].count = 0;
+    return node_index;
+}
+
+float LightTree::importance(const LightNode &node, const Vec3 &point, const Vec3 &normal) const {
+    //* Estimated contribution of the lights below node at point.
+    bool in_front = false;
+    for (int corner = 0; corner < 8 && !in_front; corner++) {
+        Vec3 position((corner & 1) ? node.upper[0] : node.lower[0], (corner & 2) ? node.upper[1] : node.lower[1],
+                      (corner & 4) ? node.upper[2] : node.lower[2]);
+        in_front = dot(position - point, normal) > 0.0f;
+    }
+    if (!in_front) {
+        // Every light below is behind the surface and adds nothing.
+        return 0.0f;
+    }
+    Vec3 lower(node.lower), upper(node.upper);
+    Vec3 to_center = 0.5f * (lower + upper) - point;
+    Vec3 extent = upper - lower;
+    // Closer than the box is big: the distance says little, use the box size.
+    float distance2 = std::max(dot(to_center, to_center), 0.25f * dot(extent, extent));
+    return node.power / std::max(distance2, 1e-8f);
+}
+
+bool LightTree::pick(const Vec3 &point, const Vec3 &normal, float u, int &light_index, float &pdf) const {
+    //* Walk down, choosing each child by its share of the importance and
+    //* reusing u for the next level.
+    if (nodes.empty()) {
+        return false;
+    }
+    int node_index = 0;
+    pdf = 1.0f;
+    unsigned long long visited = 1;
+    while (nodes[node_index].count == 0) {
+        int first = node_index + 1;
+        int second = nodes[node_index].offset;
+        float first_weight = importance(nodes[first], point, normal);
+        float second_weight = importance(nodes[second], point, normal);
+        if (first_weight + second_weight <= 0.0f) {
+            // Nothing below adds light; any pick does, keep the power split.
+            first_weight = nodes[first].power;
+            second_weight = nodes[second].power;
+        }
+        float first_probability = first_weight + second_weight > 0.0f ? first_weight / (first_weight + second_weight) : 0.5f;
+        if (u < first_probability) {
+            u = u / first_probability;
+            pdf *= first_probability;
+            node_index = first;
+        } else {
+            u = (u - first_probability) / (1.0f - first_probability);
+            pdf *= 1.0f - first_probability;
+            node_index = second;
+        }
+        u = std::min(u, 0x1.fffffep-1f);
+        visited++;
+    }
+    thread_stats.count[LIGHT_TREE_NODES] += visited;
+    light_index = nodes[node_index].offset;
+    return pdf > 0.0f;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+#include <stddef.h>
+#include <string.h>
+#include <fstream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//* A read-only view of a whole file.
+//* The file is memory-mapped where the system supports it, so opening costs
+//* the same for any size and pages are only read when they are touched.
+//* Elsewhere the file is read into memory.
+class MappedFile {
+    public:
+        /* constructors */
+        MappedFile() : address(NULL), length(0), is_mapped(false) {}
+        ~MappedFile() {
+            close();
+        }
+
+        bool open(const char *path);
+        // Hold a copy of size bytes of data, as if they had been read from a file.
+        void assign(const char *data, size_t size);
+        void close();
+
+        const char* data() const {
+            return (const char *)address;
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        bool mapped() const {
+            return is_mapped;
+        }
+
+    private:
+        MappedFile(const MappedFile &);
+        MappedFile& operator=(const MappedFile &);
+
+        void *address;
+        size_t length;
+        bool is_mapped;
+        // the contents when the file is not mapped (8-byte aligned)
+        std::vector<unsigned long long> buffer;
+};
+
+bool MappedFile::open(const char *path) {
+    //* Map the file. Return false when it can not be read.
+    close();
+#ifdef RT_HAVE_MMAP
+    int descriptor = ::open(path, O_RDONLY);
+    if (descriptor < 0) {
+        return false;
+    }
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+        ::close(descriptor);
+        return false;
+    }
+    length = (size_t)status.st_size;
+    if (length > 0) {
+        void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping != MAP_FAILED) {
+            address = mapping;
+            is_mapped = true;
+        }
+    }
+    ::close(descriptor);
+    if (is_mapped || length == 0) {
+        return true;
+    }
+#endif
+    std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    length = (size_t)file.tellg();
+    buffer.assign((length + sizeof(unsigned long long) - 1) / sizeof(unsigned long long), 0);
+    file.seekg(0);
+    if (!file.read((char *)buffer.data(), length)) {
+        length = 0;
+        buffer.clear();
+        return false;
+    }
+    address = buffer.data();
+    return true;
+}
+
+void MappedFile::assign(const char *data, size_t size) {
+    close();
+    length = size;
+    buffer.assign((length + sizeof(unsigned long long) - 1) / sizeof(unsigned long long), 0);
+    memcpy(buffer.data(), data, length);
+    address = buffer.data();
+}
+
+void MappedFile::close() {
+#ifdef RT_HAVE_MMAP
+    if (is_mapped) {
+        munmap(address, length);
+    }
+#endif
+    buffer.clear();
+    address = NULL;
+    length = 0;
+    is_mapped = false;
+}
+
+#endif
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <chrono>
+#include <cstring> // for strcmp(), memcmp()
+#include <vector>
+
+#include "camera_rays.h"
+#include "sphere_soa.h"
+#include "sphere_simd.h"
+
+using namespace std;
+
+//* Microbenchmarks of the hot-path kernels.
+//* Every ISA is checked against the scalar kernel before it is timed.
+
+static unsigned int bench_state = 819;
+
+float bench_random() {
+    //* Uniform float in [0, 1) from a fixed LCG, so every run tests the same data.
+    bench_state = bench_state * 1664525u + 1013904223u;
+    return (bench_state >> 8) * (1.0f / 16777216.0f);
+}
+
+SphereSoA random_spheres(int count) {
+    //* Small spheres in the box [-4, 4]^3.
+    vector<Sphere> spheres;
+    vector<int> order;
+    for (int i = 0; i < count; i++) {
+        spheres.push_back(Sphere(Vec3(bench_random() * 8 - 4, bench_random() * 8 - 4, bench_random() * 8 - 4), 0.1f + 0.4f * bench_random(), i));
+        order.push_back(i);
+    }
+    SphereSoA soa;
+    soa.build(spheres, order);
+    return soa;
+}
+
+vector<KernelRay> random_rays(int count) {
+    //* Rays from around the origin in random directions (unit, like every Ray).
+    vector<KernelRay> rays;
+    for (int i = 0; i < count; i++) {
+        Vec3 origin(bench_random() - 0.5f, bench_random() - 0.5f, bench_random() - 0.5f);
+        Vec3 direction(bench_random() * 2 - 1, bench_random() * 2 - 1, bench_random() * 2 - 1);
+        rays.push_back(make_kernel_ray(Ray(origin, direction)));
+    }
+    return rays;
+}
+
+RayPacket8 make_packet(const vector<KernelRay> &rays, int first) {
+    RayPacket8 packet;
+    for (int lane = 0; lane < 8; lane++) {
+        const KernelRay &ray = rays[first + lane];
+        packet.ox[lane] = ray.ox;
+        packet.oy[lane] = ray.oy;
+        packet.oz[lane] = ray.oz;
+        packet.dx[lane] = ray.dx;
+        packet.dy[lane] = ray.dy;
+        packet.dz[lane] = ray.dz;
+    }
+    return packet;
+}
+
+bool check_kernels(const SphereKernels &kernels, const SphereSoA &soa, const vector<KernelRay> &rays) {
+    //* Compare every result bit by bit with the scalar kernels.
+    const SphereKernels &scalar = sphere_kernels(ISA_SCALAR);
+    int count = soa.size();
+    for (size_t i = 0; i < rays.size(); i++) {
+        // Odd ranges and a skipped sphere, so the tail masks and self_index are checked too.
+        int first = (int)(i % 5);
+        int self_index = (int)(i % 7);
+        float t_ref = 1e30f, t = 1e30f;
+        int hit_ref = scalar.closest(soa, first, count - first, rays[i], 0.001f, t_ref, self_index);
+        int hit = kernels.closest(soa, first, count - first, rays[i], 0.001f, t, self_index);
+        if (hit != hit_ref || memcmp(&t, &t_ref, sizeof(float)) != 0) {
+            cerr << kernels.name << ": closest hit differs for ray " << i << endl;
+            return false;
+        }
+        float t_limit = 2.0f;
+        if (kernels.any(soa, first, count - first, rays[i], 0.001f, t_limit, self_index) !=
+            scalar.any(soa, first, count - first, rays[i], 0.001f, t_limit, self_index)) {
+            cerr << kernels.name << ": any hit differs for ray " << i << endl;
+            return false;
+        }
+    }
+    for (size_t i = 0; i + 8 <= rays.size(); i += 8) {
+        RayPacket8 packet = make_packet(rays, (int)i);
+        float t_ref[8], t[8];
+        int hit_ref[8], hit[8];
+        for (int lane = 0; lane < 8; lane++) {
+            t_ref[lane] = t[lane] = 1e30f;
+            hit_ref[lane] = hit[lane] = -1;
+        }
+        for (int s = 0; s < count; s++) {
+            scalar.packet8(soa, s, packet, 0.001f, t_ref, hit_ref);
+            kernels.packet8(soa, s, packet, 0.001f, t, hit);
+        }
+        if (memcmp(t, t_ref, sizeof(t)) != 0 || memcmp(hit, hit_ref, sizeof(hit)) != 0) {
+            cerr << kernels.name << ": packet hit differs for rays " << i << "-" << i + 7 << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void bench_kernels(const SphereKernels &kernels, const SphereSoA &soa, const vector<KernelRay> &rays, int repeat) {
+    //* Rays per second of the three kernels, each ray tested against all spheres.
+    int count = soa.size();
+    long long checksum = 0;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < rays.size(); i++) {
+            float t = 1e30f;
+            checksum += kernels.closest(soa, 0, count, rays[i], 0.001f, t, -1);
+        }
+    }
+    chrono::duration<double> closest_time = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < rays.size(); i++) {
+            // A short segment, so most rays have to test every sphere.
+            checksum += kernels.any(soa, 0, count, rays[i], 0.001f, 0.05f, -1);
+        }
+    }
+    chrono::duration<double> any_time = chrono::steady_clock::now() - start;
+
+    vector<RayPacket8> packets;
+    for (size_t i = 0; i + 8 <= rays.size(); i += 8) {
+        packets.push_back(make_packet(rays, (int)i));
+    }
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t p = 0; p < packets.size(); p++) {
+            float t[8];
+            int hit[8];
+            for (int lane = 0; lane < 8; lane++) {
+                t[lane] = 1e30f;
+                hit[lane] = -1;
+            }
+            for (int s = 0; s < count; s++) {
+                kernels.packet8(soa, s, packets[p], 0.001f, t, hit);
+            }
+            checksum += hit[0];
+        }
+    }
+    chrono::duration<double> packet_time = chrono::steady_clock::now() - start;
+
+    double rays_total = double(rays.size()) * repeat;
+    double packet_rays = double(packets.size()) * 8 * repeat;
+    cout << "  " << kernels.name << " (" << kernels.width << " wide): "
+         << rays_total / closest_time.count() / 1e6 << " Mrays/s closest, "
+         << rays_total / any_time.count() / 1e6 << " Mrays/s any, "
+         << packet_rays / packet_time.count() / 1e6 << " Mrays/s packet8"
+         << " (checksum " << checksum << ")" << endl;
+}
+
+bool check_vec3(const vector<Vec3> &a, const vector<Vec3> &b) {
+    //* Vec3 has to give the bits of the plain float formulas with either backend.
+    for (size_t i = 0; i < a.size(); i++) {
+        float ax = a[i].x(), ay = a[i].y(), az = a[i].z();
+        float bx = b[i].x(), by = b[i].y(), bz = b[i].z();
+        float d = ax * bx + ay * by + az * bz;
+        float cx = ay * bz - az * by, cy = -(ax * bz - az * bx), cz = ax * by - ay * bx;
+        float inverse = inverse_sqrt(ax * ax + ay * ay + az * az);
+        Vec3 c = cross(a[i], b[i]);
+        Vec3 u = unit_vector(a[i]);
+        float values[7] = {dot(a[i], b[i]), c.x(), c.y(), c.z(), u.x(), u.y(), u.z()};
+        float expected[7] = {d, cx, cy, cz, ax * inverse, ay * inverse, az * inverse};
+        if (memcmp(values, expected, sizeof(values)) != 0) {
+            cerr << "vec3 (" << VEC3_BACKEND << ") differs from the scalar formulas at " << i << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void bench_vec3(const vector<Vec3> &a, const vector<Vec3> &b, int repeat) {
+    //* Nanoseconds per call of dot, cross and unit_vector over arrays of vectors.
+    vector<float> dots(a.size());
+    vector<Vec3> out(a.size());
+    double checksum = 0.0;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < a.size(); i++) {
+            dots[i] = dot(a[i], b[i]);
+        }
+        checksum += dots[r % dots.size()];
+    }
+    chrono::duration<double, nano> dot_time = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < a.size(); i++) {
+            out[i] = cross(a[i], b[i]);
+        }
+        checksum += out[r % out.size()].x();
+    }
+    chrono::duration<double, nano> cross_time = chrono::steady_clock::now() - start;
+
+    start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        for (size_t i = 0; i < a.size(); i++) {
+            out[i] = unit_vector(a[i]);
+        }
+        checksum += out[r % out.size()].y();
+    }
+    chrono::duration<double, nano> unit_time = chrono::steady_clock::now() - start;
+
+    double calls = double(a.size()) * repeat;
+    cout << "  " << VEC3_BACKEND << " (" << sizeof(Vec3) << " bytes): "
+         << dot_time.count() / calls << " ns dot, "
+         << cross_time.count() / calls << " ns cross, "
+         << unit_time.count() / calls << " ns unit_vector"
+         << " (checksum " << checksum << ")" << endl;
+}
+
+bool check_normalize(const vector<Vec3> &a, int repeat) {
+    //* Error bounds of the two inverse_sqrt() paths, measured in double:
+    //* the relative error of 1 / sqrt, how far a unit vector is from
+    //* length 1, the angle between the fast and the precise unit vector,
+    //* and the drift of a direction reflected 64 times without normalizing
+    //* again (what reflected_ray() does). Then the time per call.
+    double inverse_error[2] = {0.0, 0.0}, length_error[2] = {0.0, 0.0};
+    double angle = 0.0, drift = 0.0;
+    for (size_t i = 0; i < a.size(); i++) {
+        // Lengths from 1e-3 to 1e3.
+        Vec3 vec = a[i] * powf(10.0f, 6.0f * bench_random() - 3.0f);
+        float x = vec.squared_length();
+        if (!(x > 0.0f)) continue;
+        double exact = 1.0 / sqrt((double)x);
+        float inverse[2] = {inverse_sqrt_precise(x), inverse_sqrt_fast(x)};
+        Vec3 unit[2];
+        for (int k = 0; k < 2; k++) {
+            inverse_error[k] = max(inverse_error[k], fabs(inverse[k] / exact - 1.0));
+            unit[k] = vec * inverse[k];
+            double ux = unit[k].x(), uy = unit[k].y(), uz = unit[k].z();
+            length_error[k] = max(length_error[k], fabs(sqrt(ux * ux + uy * uy + uz * uz) - 1.0));
+        }
+        // sin of the angle, |u0 x u1| / (|u0| |u1|); acos of the dot would be all rounding here.
+        double x0 = unit[0].x(), y0 = unit[0].y(), z0 = unit[0].z();
+        double x1 = unit[1].x(), y1 = unit[1].y(), z1 = unit[1].z();
+        double cx = y0 * z1 - z0 * y1, cy = z0 * x1 - x0 * z1, cz = x0 * y1 - y0 * x1;
+        angle = max(angle, sqrt((cx * cx + cy * cy + cz * cz) /
+                                ((x0 * x0 + y0 * y0 + z0 * z0) * (x1 * x1 + y1 * y1 + z1 * z1))));
+
+        Vec3 direction = unit[0];
+        for (int bounce = 0; bounce < 64; bounce++) {
+            Vec3 normal = unit_vector(a[(i + bounce + 1) % a.size()]);
+            direction = direction - dot(direction, normal) * 2 * normal;
+        }
+        double dx = direction.x(), dy = direction.y(), dz = direction.z();
+        drift = max(drift, fabs(sqrt(dx * dx + dy * dy + dz * dz) - 1.0));
+    }
+    cout << "  1/sqrt relative error: " << inverse_error[0] << " precise, " << inverse_error[1] << " fast" << endl;
+    cout << "  unit length error: " << length_error[0] << " precise, " << length_error[1] << " fast, "
+         << angle << " rad between them" << endl;
+    cout << "  length drift after 64 reflections: " << drift << endl;
+    // About 1 ulp for the precise path, the Newton step leaves a few.
+    if (inverse_error[0] > 2e-7 || length_error[0] > 4e-7 || inverse_error[1] > 1e-6 || length_error[1] > 2e-6 ||
+        angle > 1e-6 || drift > 1e-5) {
+        cerr << "normalizing is off by more than its bounds" << endl;
+        return false;
+    }
+
+    vector<float> x(a.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        x[i] = a[i].squared_length() + 1e-3f;
+    }
+    double checksum = 0.0;
+    chrono::duration<double, nano> time[2];
+    for (int k = 0; k < 2; k++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++) {
+            float sum = 0.0f;
+            for (size_t i = 0; i < x.size(); i++) {
+                sum += k == 0 ? inverse_sqrt_precise(x[i]) : inverse_sqrt_fast(x[i]);
+            }
+            checksum += sum;
+        }
+        time[k] = chrono::steady_clock::now() - start;
+    }
+    double calls = double(x.size()) * repeat;
+    cout << "  " << time[0].count() / calls << " ns precise, " << time[1].count() / calls << " ns fast"
+#ifdef RT_FAST_RSQRT
+         << " (this build uses fast)"
+#endif
+         << " (checksum " << checksum << ")" << endl;
+    return true;
+}
+
+bool check_camera_rays(const Camera &camera, const char *name, int repeat) {
+    //* The camera rays of a 16x16 tile at 64 samples per pixel: every ISA
+    //* has to give the rays of camera.get_ray() bit by bit. Then the
+    //* nanoseconds per ray of the sample positions (add()) and of the rays
+    //* (generate()) of every ISA.
+    static CameraRayBatch batch;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++) {
+        batch.clear();
+        for (int row_index = 0; row_index < 16; row_index++) {
+            for (int column_index = 0; column_index < 16; column_index++) {
+                batch.add_pixel(camera, SAMPLER_RANDOM, r, 200, 100, row_index, column_index, 0, 64);
+            }
+        }
+    }
+    chrono::duration<double, nano> add_time = chrono::steady_clock::now() - start;
+    double rays = double(batch.size()) * repeat;
+    cout << "  " << name << ": " << add_time.count() / rays << " ns positions";
+
+    for (int isa = 0; isa < ISA_COUNT; isa++) {
+        if (!isa_supported((SimdIsa)isa)) {
+            continue;
+        }
+        batch.generate(camera, (SimdIsa)isa);
+        for (size_t i = 0; i < batch.size(); i++) {
+            Ray ray = camera.has_lens() ? camera.get_ray(batch.s[i], batch.t[i], batch.lens_u[i], batch.lens_v[i])
+                                        : camera.get_ray(batch.s[i], batch.t[i]);
+            float expected[6] = {ray.origin().x(), ray.origin().y(), ray.origin().z(),
+                                 ray.direction().x(), ray.direction().y(), ray.direction().z()};
+            float values[6] = {batch.ox[i], batch.oy[i], batch.oz[i], batch.dx[i], batch.dy[i], batch.dz[i]};
+            if (memcmp(values, expected, sizeof(values)) != 0) {
+                cout << endl;
+                cerr << sphere_kernels((SimdIsa)isa).name << ": camera ray " << i << " differs from Camera::get_ray()" << endl;
+                return false;
+            }
+        }
+        start = chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++) {
+            batch.generate(camera, (SimdIsa)isa);
+        }
+        chrono::duration<double, nano> generate_time = chrono::steady_clock::now() - start;
+        cout << ", " << generate_time.count() / rays << " ns " << sphere_kernels((SimdIsa)isa).name;
+    }
+    cout << " per ray" << endl;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int sphere_counts[2] = {16, 256};
+    int ray_count = 4096;
+    int repeat = argc > 1 ? atoi(argv[1]) : 20;
+
+    for (int c = 0; c < 2; c++) {
+        SphereSoA soa = random_spheres(sphere_counts[c]);
+        vector<KernelRay> rays = random_rays(ray_count);
+        cout << "ray vs " << sphere_counts[c] << " spheres:" << endl;
+        for (int isa = 0; isa < ISA_COUNT; isa++) {
+            if (!isa_supported((SimdIsa)isa)) {
+                cout << "  " << sphere_kernels((SimdIsa)isa).name << ": not supported by this CPU" << endl;
+                continue;
+            }
+            const SphereKernels &kernels = sphere_kernels((SimdIsa)isa);
+            if (!check_kernels(kernels, soa, rays)) {
+                return 1;
+            }
+            bench_kernels(kernels, soa, rays, repeat);
+        }
+    }
+
+    vector<Vec3> a, b;
+    for (int i = 0; i < ray_count; i++) {
+        a.push_back(Vec3(bench_random() * 2 - 1, bench_random() * 2 - 1, bench_random() * 2 - 1));
+        b.push_back(Vec3(bench_random() * 2 - 1, bench_random() * 2 - 1, bench_random() * 2 - 1));
+    }
+    cout << "vec3:" << endl;
+    if (!check_vec3(a, b)) {
+        return 1;
+    }
+    bench_vec3(a, b, repeat * 50);
+    cout << "normalize:" << endl;
+    if (!check_normalize(a, repeat * 50)) {
+        return 1;
+    }
+    cout << "camera rays:" << endl;
+    Camera pinhole;
+    Camera thin_lens(Vec3(0.0, 0.0, 1.0), Vec3(0.0, 0.0, -1.0), Vec3(0.0, 1.0, 0.0), 53.13f, 2.0f, 0.2f, 2.0f);
+    if (!check_camera_rays(pinhole, "pinhole", repeat) || !check_camera_rays(thin_lens, "thin lens", repeat)) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#ifndef PERFCOUNTERSH
+#define PERFCOUNTERSH
+
+#include <stdint.h>
+#include <string.h>
+
+#include "stats.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define RT_HAVE_PERF_EVENTS 1
+#endif
+
+//* Hardware cache counters of the calling thread (Linux perf events), for
+//* the cache-miss figures of the reports. Where there are none (another
+//* OS, a virtual machine without a PMU, perf_event_paranoid above 2)
+//* available() is false and nothing is counted.
+
+enum PerfEvent {
+    // last level cache misses ("cache-misses" of perf)
+    PERF_CACHE_MISSES,
+    // L1 data cache read misses
+    PERF_L1D_MISSES,
+    PERF_EVENT_COUNT
+};
+
+class ThreadPerfCounters {
+    public:
+        /* constructors */
+        ThreadPerfCounters();
+        ~ThreadPerfCounters() {
+#ifdef RT_HAVE_PERF_EVENTS
+            for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+                if (descriptors[i] >= 0) {
+                    close(descriptors[i]);
+                }
+            }
+#endif
+        }
+        ThreadPerfCounters(const ThreadPerfCounters&) = delete;
+        ThreadPerfCounters& operator=(const ThreadPerfCounters&) = delete;
+
+        bool available() const {
+            return descriptors[PERF_CACHE_MISSES] >= 0;
+        }
+
+        // The counts of the thread so far (0 for a counter it does not have).
+        void read_counts(uint64_t counts[PERF_EVENT_COUNT]) const;
+
+    private:
+        int descriptors[PERF_EVENT_COUNT];
+};
+
+ThreadPerfCounters::ThreadPerfCounters() {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        descriptors[i] = -1;
+    }
+#ifdef RT_HAVE_PERF_EVENTS
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        if (i == PERF_CACHE_MISSES) {
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        } else {
+            attributes.type = PERF_TYPE_HW_CACHE;
+            attributes.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+        // Only the user space of this thread, which needs no privileges.
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        descriptors[i] = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    }
+#endif
+}
+
+void ThreadPerfCounters::read_counts(uint64_t counts[PERF_EVENT_COUNT]) const {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        counts[i] = 0;
+#ifdef RT_HAVE_PERF_EVENTS
+        if (descriptors[i] >= 0 && ::read(descriptors[i], &counts[i], sizeof(counts[i])) != sizeof(counts[i])) {
+            counts[i] = 0;
+        }
+#endif
+    }
+}
+
+// Opened by the first use in a thread.
+inline thread_local ThreadPerfCounters thread_perf_counters;
+
+//* Counts the cache misses of the calling thread while it lives into
+//* thread_stats (CACHE_MISSES, L1D_MISSES). Meant for a whole tile: it
+//* costs a few system calls.
+class CacheMissScope {
+    public:
+        /* constructors */
+        CacheMissScope() {
+            thread_perf_counters.read_counts(before);
+        }
+        ~CacheMissScope() {
+            uint64_t after[PERF_EVENT_COUNT];
+            thread_perf_counters.read_counts(after);
+            thread_stats.count[CACHE_MISSES] += after[PERF_CACHE_MISSES] - before[PERF_CACHE_MISSES];
+            thread_stats.count[L1D_MISSES] += after[PERF_L1D_MISSES] - before[PERF_L1D_MISSES];
+        }
+
+    private:
+        uint64_t before[PERF_EVENT_COUNT];
+};
+
+#endif
@@ -0,0 +1,467 @@
+#ifndef PROFILEH
+#define PROFILEH
+
+//* Hot-path profiling, only in a build with RT_PROFILE (cmake -DRT_PROFILE=ON).
+//* Otherwise the PROFILE_* macros expand to nothing and none of this exists.
+//*
+//* The tracer marks its parts as zones (PROFILE_ZONE). The time of a thread
+//* goes to the innermost zone it is in, and to the material of the hit it
+//* works for (PROFILE_MATERIAL): the shadow rays of a hit and the closest
+//* hits of its branches count for the material of the hit, camera rays and
+//* their misses for none (in the wavefront engine, all closest hits count
+//* for none). Every tile pass of a profiled frame is a span on
+//* the timeline of its thread, with its zone times, and every pixel gets the
+//* time its samples took. ray_tracer --profile PREFIX writes heat maps of
+//* the pixel and tile costs, the timelines as a Chrome trace (for
+//* chrome://tracing or Perfetto) and a report.
+
+#ifdef RT_PROFILE
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#include "sample_buffer.h"
+#include "tile_pool.h"
+
+enum ProfileZone {
+    // in a tile but in none of the zones below: the tile loops and the
+    // wavefront queues
+    ZONE_TILE,
+    // camera rays and their sample positions
+    ZONE_CAMERA,
+    // trace() itself: the end of a path, the branches and the mixing
+    ZONE_TRACE,
+    // closest hits: the BVH, the instances and the sphere kernels
+    ZONE_INTERSECT,
+    // picking and sampling the lights of a hit
+    ZONE_LIGHTS,
+    // shadow rays
+    ZONE_SHADOW,
+    ZONE_COUNT
+};
+
+inline const char *const zone_names[ZONE_COUNT] = {
+    "tile",
+    "camera",
+    "trace",
+    "intersect",
+    "lights",
+    "shadow"
+};
+
+// Deepest ray of the depth histogram (ROULETTE_MAX_STEP); deeper ones count there.
+#define PROFILE_MAX_DEPTH 32
+
+inline uint64_t profile_clock() {
+    //* The time stamp counter: a third of the cost of the steady clock, in
+    //* ticks of a constant rate (FrameProfile::ticks_to_ms() converts them).
+    return __rdtsc();
+}
+
+inline uint64_t steady_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline std::atomic<int> next_profile_thread(0);
+
+//* What a thread measured since its last tile was flushed.
+typedef struct ProfileThread {
+    ProfileThread() : id(next_profile_thread++), zone(ZONE_TILE), material(-1), last(0), depth_capped(0) {
+        std::fill(zone_ticks, zone_ticks + ZONE_COUNT, 0);
+        std::fill(depth, depth + PROFILE_MAX_DEPTH + 1, 0);
+    }
+
+    // Give the time since the last charge to the zone and the material.
+    void charge(uint64_t now) {
+        uint64_t elapsed = last ? now - last : 0;
+        zone_ticks[zone] += elapsed;
+        // material_ticks[0] is no material
+        if ((size_t)(material + 1) >= material_ticks.size()) {
+            material_ticks.resize(material + 2, 0);
+        }
+        material_ticks[material + 1] += elapsed;
+        last = now;
+    }
+
+    void reset() {
+        std::fill(zone_ticks, zone_ticks + ZONE_COUNT, 0);
+        std::fill(material_ticks.begin(), material_ticks.end(), 0);
+        std::fill(depth, depth + PROFILE_MAX_DEPTH + 1, 0);
+        depth_capped = 0;
+    }
+
+    int id;
+    ProfileZone zone;
+    int material;
+    uint64_t last;
+    uint64_t zone_ticks[ZONE_COUNT];
+    std::vector<uint64_t> material_ticks;
+    // rays by depth, and the ones that ended at the depth cap
+    unsigned long long depth[PROFILE_MAX_DEPTH + 1];
+    unsigned long long depth_capped;
+} ProfileThread;
+
+inline thread_local ProfileThread profile_thread;
+
+//* A span on the timeline of a thread: a tile pass (tile.index >= 0) with
+//* the time of its zones, or a step of the main thread.
+typedef struct ProfileEvent {
+    const char *name;
+    int thread;
+    // ticks since FrameProfile::start()
+    uint64_t start;
+    uint64_t end;
+    Tile tile;
+    uint64_t zone_ticks[ZONE_COUNT];
+} ProfileEvent;
+
+//* Everything measured for the frames since start().
+class FrameProfile {
+    public:
+        /* constructors */
+        FrameProfile() : active(false), width(0), height(0), epoch(0), epoch_ns(0), main_thread(-1), depth_capped(0) {
+            std::fill(zone_ticks, zone_ticks + ZONE_COUNT, 0);
+            std::fill(depth, depth + PROFILE_MAX_DEPTH + 1, 0);
+        }
+
+        // Profile the tiles of width * height frames from now on.
+        // The calling thread is the main thread of the timeline.
+        void start(int width, int height);
+
+        bool is_active() const {
+            return active;
+        }
+
+        void add_pixel(int row_index, int column_index, uint64_t ticks) {
+            // A pixel is only touched by the thread of its tile.
+            pixel_ticks[row_index * width + column_index] += ticks;
+        }
+
+        // Milliseconds of ticks of profile_clock(), at the rate it had since start().
+        double ticks_to_ms(uint64_t ticks) const {
+            uint64_t elapsed = profile_clock() - epoch;
+            return elapsed ? ticks * ((steady_ns() - epoch_ns) / 1e6) / elapsed : 0.0;
+        }
+
+        // Flush what the calling thread measured into the profile, with a
+        // span from start (a profile_clock() tick) to now.
+        void add_span(const char *name, const Tile &tile, uint64_t start);
+
+        // The pixel and the tile costs, from blue (cheap) to red (the most
+        // expensive pixel or tile), as P3 PPM files.
+        bool write_pixel_heatmap(const char *path) const;
+        bool write_tile_heatmap(const char *path) const;
+
+        // The spans as Chrome trace events.
+        bool write_trace(const char *path) const;
+
+        const uint64_t* get_zone_ticks() const {
+            return zone_ticks;
+        }
+
+        const std::vector<uint64_t>& get_material_ticks() const {
+            return material_ticks;
+        }
+
+        const unsigned long long* get_depth() const {
+            return depth;
+        }
+
+        unsigned long long get_depth_capped() const {
+            return depth_capped;
+        }
+
+        size_t get_span_count() const {
+            return events.size();
+        }
+
+    private:
+        bool active;
+        int width;
+        int height;
+        uint64_t epoch;
+        uint64_t epoch_ns;
+        int main_thread;
+        std::mutex lock;
+        std::vector<uint64_t> pixel_ticks;
+        std::vector<ProfileEvent> events;
+        uint64_t zone_ticks[ZONE_COUNT];
+        // by material, [0] is no material
+        std::vector<uint64_t> material_ticks;
+        unsigned long long depth[PROFILE_MAX_DEPTH + 1];
+        unsigned long long depth_capped;
+};
+
+inline FrameProfile frame_profile;
+
+void FrameProfile::start(int width, int height) {
+    this->width = width;
+    this->height = height;
+    pixel_ticks.assign((size_t)width * height, 0);
+    events.clear();
+    std::fill(zone_ticks, zone_ticks + ZONE_COUNT, 0);
+    material_ticks.clear();
+    std::fill(depth, depth + PROFILE_MAX_DEPTH + 1, 0);
+    depth_capped = 0;
+    main_thread = profile_thread.id;
+    epoch = profile_clock();
+    epoch_ns = steady_ns();
+    active = true;
+}
+
+void FrameProfile::add_span(const char *name, const Tile &tile, uint64_t start) {
+    ProfileThread &thread = profile_thread;
+    uint64_t now = profile_clock();
+    ProfileEvent event;
+    event.name = name;
+    event.thread = thread.id;
+    event.start = start - epoch;
+    event.end = now - epoch;
+    event.tile = tile;
+    std::copy(thread.zone_ticks, thread.zone_ticks + ZONE_COUNT, event.zone_ticks);
+
+    std::lock_guard<std::mutex> guard(lock);
+    events.push_back(event);
+    for (int i = 0; i < ZONE_COUNT; i++) {
+        zone_ticks[i] += thread.zone_ticks[i];
+    }
+    if (material_ticks.size() < thread.material_ticks.size()) {
+        material_ticks.resize(thread.material_ticks.size(), 0);
+    }
+    for (size_t i = 0; i < thread.material_ticks.size(); i++) {
+        material_ticks[i] += thread.material_ticks[i];
+    }
+    for (int i = 0; i <= PROFILE_MAX_DEPTH; i++) {
+        depth[i] += thread.depth[i];
+    }
+    depth_capped += thread.depth_capped;
+    thread.reset();
+}
+
+inline bool write_cost_heatmap(const char *path, int width, int height, const std::vector<uint64_t> &cost) {
+    //* cost (a value per pixel, row 0 at the bottom) as a heat map, scaled to its largest value.
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    uint64_t most = std::max<uint64_t>(1, *std::max_element(cost.begin(), cost.end()));
+    file << "P3\n" << width << " " << height << "\n255\n";
+    for (int row_index = height - 1; row_index >= 0; row_index--) {
+        for (int column_index = 0; column_index < width; column_index++) {
+            int rgb[3];
+            heat_color(float(double(cost[row_index * width + column_index]) / double(most)), rgb);
+            file << rgb[0] << " " << rgb[1] << " " << rgb[2] << "\n";
+        }
+    }
+    return (bool)file;
+}
+
+bool FrameProfile::write_pixel_heatmap(const char *path) const {
+    return !pixel_ticks.empty() && write_cost_heatmap(path, width, height, pixel_ticks);
+}
+
+bool FrameProfile::write_tile_heatmap(const char *path) const {
+    //* A tile costs the time of all of its passes; every pixel of it shows that.
+    std::vector<uint64_t> tile_ticks;
+    std::vector<Tile> tiles;
+    for (size_t i = 0; i < events.size(); i++) {
+        const Tile &tile = events[i].tile;
+        if (tile.index < 0) {
+            continue;
+        }
+        if ((size_t)tile.index >= tiles.size()) {
+            tiles.resize(tile.index + 1, Tile{0, 0, 0, 0, -1});
+            tile_ticks.resize(tile.index + 1, 0);
+        }
+        tiles[tile.index] = tile;
+        tile_ticks[tile.index] += events[i].end - events[i].start;
+    }
+    if (pixel_ticks.empty()) {
+        return false;
+    }
+    std::vector<uint64_t> cost(pixel_ticks.size(), 0);
+    for (size_t t = 0; t < tiles.size(); t++) {
+        for (int row_index = tiles[t].y0; row_index < tiles[t].y1; row_index++) {
+            for (int column_index = tiles[t].x0; column_index < tiles[t].x1; column_index++) {
+                cost[row_index * width + column_index] = tile_ticks[t];
+            }
+        }
+    }
+    return write_cost_heatmap(path, width, height, cost);
+}
+
+bool FrameProfile::write_trace(const char *path) const {
+    //* The Chrome trace event format: complete ("X") events in microseconds,
+    //* one timeline (tid) per thread.
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    double us_per_tick = ticks_to_ms(1000000000ULL) / 1e6;
+    int threads = next_profile_thread;
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    for (int t = 0; t < threads; t++) {
+        file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t << ", \"args\": {\"name\": \""
+             << (t == main_thread ? "main" : "render") << " " << t << "\"}},\n";
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        const ProfileEvent &event = events[i];
+        file << "{\"name\": \"" << event.name;
+        if (event.tile.index >= 0) {
+            file << " " << event.tile.index;
+        }
+        file << "\", \"cat\": \"" << (event.tile.index >= 0 ? "tile" : "frame") << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+             << event.thread << ", \"ts\": " << event.start * us_per_tick << ", \"dur\": " << (event.end - event.start) * us_per_tick
+             << ", \"args\": {";
+        if (event.tile.index >= 0) {
+            file << "\"x0\": " << event.tile.x0 << ", \"y0\": " << event.tile.y0 << ", \"x1\": " << event.tile.x1
+                 << ", \"y1\": " << event.tile.y1;
+            for (int z = 0; z < ZONE_COUNT; z++) {
+                file << ", \"" << zone_names[z] << "_us\": " << event.zone_ticks[z] * us_per_tick;
+            }
+        }
+        file << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+    }
+    file << "]}\n";
+    return (bool)file;
+}
+
+//* The time in a zone; zones nest, the innermost one gets the time.
+class ProfileZoneScope {
+    public:
+        /* constructors */
+        explicit ProfileZoneScope(ProfileZone zone) : thread(profile_thread), previous(profile_thread.zone) {
+            if (frame_profile.is_active()) {
+                thread.charge(profile_clock());
+                thread.zone = zone;
+            }
+        }
+        ~ProfileZoneScope() {
+            if (frame_profile.is_active()) {
+                thread.charge(profile_clock());
+                thread.zone = previous;
+            }
+        }
+
+    private:
+        ProfileThread &thread;
+        ProfileZone previous;
+};
+
+//* The time spent for the hit of a material.
+class ProfileMaterialScope {
+    public:
+        /* constructors */
+        explicit ProfileMaterialScope(int material) : thread(profile_thread), previous(profile_thread.material) {
+            if (frame_profile.is_active()) {
+                thread.charge(profile_clock());
+                thread.material = material;
+            }
+        }
+        ~ProfileMaterialScope() {
+            if (frame_profile.is_active()) {
+                thread.charge(profile_clock());
+                thread.material = previous;
+            }
+        }
+
+    private:
+        ProfileThread &thread;
+        int previous;
+};
+
+//* A tile pass: a span on the timeline of its thread. The time before it
+//* (waiting for tiles, other work of the thread) counts for nothing.
+class ProfileTileScope {
+    public:
+        /* constructors */
+        explicit ProfileTileScope(const Tile &tile) : tile(tile), start(0) {
+            if (frame_profile.is_active()) {
+                start = profile_clock();
+                profile_thread.reset();
+                profile_thread.zone = ZONE_TILE;
+                profile_thread.material = -1;
+                profile_thread.last = start;
+            }
+        }
+        ~ProfileTileScope() {
+            if (start) {
+                profile_thread.charge(profile_clock());
+                frame_profile.add_span("tile", tile, start);
+            }
+        }
+
+    private:
+        const Tile &tile;
+        uint64_t start;
+};
+
+//* A step of the main thread (a pass, the denoiser) on its timeline.
+class ProfileSpanScope {
+    public:
+        /* constructors */
+        explicit ProfileSpanScope(const char *name) : name(name), start(frame_profile.is_active() ? profile_clock() : 0) {}
+        ~ProfileSpanScope() {
+            if (start) {
+                frame_profile.add_span(name, Tile{0, 0, 0, 0, -1}, start);
+            }
+        }
+
+    private:
+        const char *name;
+        uint64_t start;
+};
+
+//* The time of the samples of a pixel in a pass, plus extra_ticks spent on
+//* them elsewhere.
+class ProfilePixelScope {
+    public:
+        /* constructors */
+        ProfilePixelScope(int row_index, int column_index, double extra_ticks)
+            : row_index(row_index), column_index(column_index), extra_ticks(extra_ticks),
+              start(frame_profile.is_active() ? profile_clock() : 0) {}
+        ~ProfilePixelScope() {
+            if (start) {
+                frame_profile.add_pixel(row_index, column_index, profile_clock() - start + (uint64_t)extra_ticks);
+            }
+        }
+
+    private:
+        int row_index;
+        int column_index;
+        double extra_ticks;
+        uint64_t start;
+};
+
+#define PROFILE_ZONE(zone) ProfileZoneScope profile_zone_scope(zone)
+#define PROFILE_MATERIAL(material) ProfileMaterialScope profile_material_scope(material)
+#define PROFILE_TILE(tile) ProfileTileScope profile_tile_scope(tile)
+#define PROFILE_SPAN(name) ProfileSpanScope profile_span_scope(name)
+#define PROFILE_PIXEL(row_index, column_index, extra_ticks) ProfilePixelScope profile_pixel_scope(row_index, column_index, extra_ticks)
+#define PROFILE_DEPTH(ray_depth) (profile_thread.depth[std::min(ray_depth, PROFILE_MAX_DEPTH)]++)
+#define PROFILE_DEPTH_CAPPED() (profile_thread.depth_capped++)
+
+#else
+
+#define PROFILE_ZONE(zone)
+#define PROFILE_MATERIAL(material)
+#define PROFILE_TILE(tile)
+#define PROFILE_SPAN(name)
+#define PROFILE_PIXEL(row_index, column_index, extra_ticks)
+#define PROFILE_DEPTH(ray_depth) ((void)0)
+#define PROFILE_DEPTH_CAPPED() ((void)0)
+
+#endif
+
+#endif
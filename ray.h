@@ -1,44 +1,50 @@
-#ifndef RAYH
-#define RAYH
-
-#include "vec3.h"
-
-class Ray {
-    public:
-        /* constructors */
-        Ray() {} 
-        Ray(const Vec3& vector_a, const Vec3& vector_b) {
-            // Notice the vectors are not unit vector.
-            O = vector_a;
-            D = vector_b;
-        }
-        Ray(const Ray& ray) {
-            O = ray.origin();
-            D = ray.direction();
-        }
-
-        /* accessors */
-        Vec3 origin() const {
-            return O;
-        }
-
-        Vec3 direction() const {
-            return D;
-        }
-
-        /* other methods */
-        Vec3 point_at_parameter(float t) const {
-            return O + t * D;
-        }
-
-    private:
-        Vec3 O;
-        Vec3 D;
-};
-
-inline std::ostream &operator<<(std::ostream &os, const Ray &r) {
-    os << "Ray <" << r.origin() << ", " << r.direction() << ">";
-    return os;
-}
-
+#ifndef RAYH
+#define RAYH
+
+#include "vec3.h"
+
+class Ray {
+    public:
+        /* constructors */
+        Ray() = default;
+        Ray(const Vec3& vector_a, const Vec3& vector_b) : O(vector_a), D(unit_vector(vector_b)) {
+            // The direction is always a unit vector, so t is the distance
+            // from the origin and the sphere test can skip dot(D, D).
+        }
+
+        // For a direction that is already a unit vector (a reflection of
+        // one, a ray read back from a wave): no normalizing again.
+        static Ray from_unit(const Vec3& origin, const Vec3& unit_direction) {
+            Ray ray;
+            ray.O = origin;
+            ray.D = unit_direction;
+            return ray;
+        }
+
+        /* accessors */
+        const Vec3& origin() const {
+            return O;
+        }
+
+        const Vec3& direction() const {
+            return D;
+        }
+
+        /* other methods */
+        Vec3 point_at_parameter(float t) const {
+            return O + t * D;
+        }
+
+    private:
+        Vec3 O;
+        Vec3 D;
+};
+
+static_assert(std::is_trivially_copyable<Ray>::value, "Ray has to stay trivially copyable");
+
+inline std::ostream &operator<<(std::ostream &os, const Ray &r) {
+    os << "Ray <" << r.origin() << ", " << r.direction() << ">";
+    return os;
+}
+
 #endif
\ No newline at end of file
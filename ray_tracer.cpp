@@ -1,256 +1,1129 @@
-#include <iostream>
-#include <fstream>
-#include <float.h> // for FLT_EPSILON, FLT_MAX
-#include <ctime>   // for time()
-#include <vector>
-
-#include "camera.h"
-#include "sphere.h"
-#include "material.h"
-
-#define random(a, b) (rand() % (b - a + 1) + a)
-
-using namespace std;
-
-#define MAX_STEP 5
-
-Vec3 skybox(const Ray &ray) {
-    //* Render the background part.
-    // Fix value range -1~1.
-    // And there is the concept that standardize all normal vectors
-    // of different lengths on the surface of the sphere.
-    Vec3 unit_direction = unit_vector(ray.direction());
-    // Fix value range 0~2 in the (), and fix value range 0~1 with multiple 0.5.
-    float t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * Vec3(1, 1, 1) + t * Vec3(0.5, 0.7, 1.0);
-}
-
-bool check_in_shadow(const Ray &ray, const vector<Sphere> scene, Vec3 &light_source, int self_index) {
-    //* Find whether the shadow ray hit other object. And if there is
-    //* intersection, it means that there are other obstacles between this point
-    //* and the light source, which means that this point is now under the shadow
-    //* of others, which means that the color of this point does not need to
-    //* consider the effect of light from the light source. However, it is necessary
-    //* to notice a situation: when this point (assuming p) is in line with the
-    //* light source and other objects (assuming q), that is, q will be judged
-    //* to be hit by shadow ray, but the light source is actually in p and
-    //* between q, so p is not in the shadow of q. So we need to determine whether
-    //* the distance between p and q is less than the distance between p and
-    //* light source.
-    //* self_index is the index of the sphere of current hit point.
-
-    float current_cloest_t = FLT_EPSILON;
-    float length_to_light_source = Vec3(light_source - ray.origin()).length();
-
-    // Need to skip self surface or set a tmin, or, there will be noise in the surface.
-    for (int i = 0; i < scene.size(); i++) {
-        if (i == self_index) {
-            continue;
-        } else {
-            if (scene[i].shadow_hit(ray, current_cloest_t)) {
-                if (current_cloest_t < length_to_light_source) {
-                    return true;
-                }
-            }
-        }
-    }
-
-    return false;
-}
-
-Vec3 shading(Vec3 &light_source, Vec3 &light_intensity, hit_record record, const vector<Sphere> &scene) {
-    //* Compute local color with shadow.
-    //* record is the information about current hit point.
-
-    // Calculate shadow ray.
-    Vec3 N = record.normal;
-    // L is the light direction that it need to point to light source.
-    Vec3 light_direction = unit_vector(light_source - record.p);
-    Ray shadow_ray(record.p, light_direction);
-    
-    // Find whether the shadow_ray hit other object.
-    bool is_in_shadow = check_in_shadow(shadow_ray, scene, light_source, record.in_scene_index);
-
-    // Surface is only illuminated if nothing blocks its view of the light.
-    if (!is_in_shadow) {
-        return record.material.get_kd() * light_intensity * std::max<float>(0.0, dot(N, light_direction));
-    } else {
-        return Vec3(0.0, 0.0, 0.0);
-    }
-}
-
-bool intersect(const Ray &ray, const vector<Sphere> scene, float t_min, float t_max, hit_record &record, int self_index) {
-    //* Find there is intersection or no, and record the closest intersection
-    //* to 'record'.
-    //* self_index is the index of the current sphere, and then need to skip
-    //* self, or, it will be noise.
-
-    hit_record current_cloest_record;
-    bool has_hit = false;
-    double current_cloest_t = t_max;
-
-    for (int i = 0; i < scene.size(); i++) {
-        if (i == self_index) continue;
-        if (scene[i].hit(ray, t_min, current_cloest_t, current_cloest_record)) {
-            has_hit = true;
-            current_cloest_t = current_cloest_record.t;
-            current_cloest_record.in_scene_index = i;
-            record = current_cloest_record;
-        }
-    }
-
-    return has_hit;
-}
-
-Vec3 trace(const Ray &ray, const vector<Sphere> &scene, int depth, int self_index = -1) {
-    //* Deal with the color of the current pixel.
-    //* If the pixel is not sphere, then it is skybox.
-    //* self_index is the index of the current sphere, default -1 means that step is 0.
-    //* When trace to find intersection, need to skip self, or, it will be noise.
-
-    if (depth >= MAX_STEP) {
-        return skybox(ray);
-    }
-
-    /* Spheres part */
-    // Find intersection of this ray with which sphere in the scene and record the information of the intersection.
-    hit_record cloest_record;
-    float t_min = FLT_EPSILON;
-    float t_max = FLT_MAX;
-    bool has_intersection = intersect(ray, scene, t_min, t_max, cloest_record, self_index);
-    if (has_intersection) {
-        Vec3 light_source(-10, 10, 0);
-        Vec3 light_intensity = Vec3(1.0, 1.0, 1.0); // intensity of lightsource.
-
-        // Local color with shadow.
-        Vec3 local_color = shading(light_source, light_intensity, cloest_record, scene);
-
-        // Reflected color
-        Vec3 reflected_direction = reflect(ray.direction(), cloest_record.normal);
-        reflected_direction.make_unit_vector();
-        Ray reflected_ray = Ray(cloest_record.p, reflected_direction);
-        Vec3 reflected_color = trace(reflected_ray, scene, depth + 1, cloest_record.in_scene_index);
-
-        // Transmitted color
-        // assumes that is air to glass.
-        float n_over_nt = 1 / 1.46;
-        Vec3 refracted_direction = refract(ray.direction(), cloest_record.normal, n_over_nt);
-        refracted_direction.make_unit_vector();
-        // Ray transmitted_ray;
-        // if (refracted_direction.length() == 0) {
-        //     // Total internal reflection.
-        //     transmitted_ray = Ray(cloest_record.p, reflected_direction);
-        // } else {
-        //     transmitted_ray = Ray(cloest_record.p, refracted_direction);
-        // }
-        Ray transmitted_ray = Ray(cloest_record.p, refracted_direction);
-        Vec3 transmitted_color = trace(transmitted_ray, scene, depth + 1, cloest_record.in_scene_index);
-
-        // Mix color.
-        Vec3 color;
-        if (fabsf(cloest_record.material.get_wr() - 0) < FLT_EPSILON && fabsf(cloest_record.material.get_wt() - 0)  < FLT_EPSILON) {
-            // No reflection and refraction.
-            color = local_color;
-        } else if (fabsf(cloest_record.material.get_wt() - 0)  < FLT_EPSILON) {
-            // Just reflection.
-            color = (1.0 - cloest_record.material.get_wr()) * local_color + cloest_record.material.get_wr() * reflected_color;
-        } else {
-            // Need reflection and refraction.
-            color = (1.0 - cloest_record.material.get_wt()) * ((1.0 - cloest_record.material.get_wr()) * local_color + cloest_record.material.get_wr() * reflected_color) +
-                    cloest_record.material.get_wt() * transmitted_color;
-            // Clamped color [0, 255].
-            // color = (1.0 - cloest_record.material.get_wt()) * (local_color + cloest_record.material.get_wr() * reflected_color) +
-            //         cloest_record.material.get_wt() * transmitted_color;
-        }
-        return color;
-    } else {
-        /* Skybox part */
-        return skybox(ray);
-    }
-}
-
-vector<Sphere> random_scene() {
-    //* Generate the scene.
-    //* There is a big sphere as ground.
-    //* And there are three same size spheres in the center.
-    //* And there are some randomly generated small spheres on the ground.
-
-    vector<Sphere> hitable_list;
-
-    // First sphere is the big sphere as ground.
-    hitable_list.push_back(Sphere(Vec3(0.0, -100.5, -2.0), 100.0));
-
-    // The three center spheres.
-    hitable_list.push_back(Sphere(Vec3(0.0, 0.0, -2.0), 0.5, Material(Vec3(1.0f, 1.0f, 1.0f), 0.0f, 0.9f)));
-    hitable_list.push_back(Sphere(Vec3(1, 0, -1.75), 0.5, Material(Vec3(1.0f, 1.0f, 1.0f), 0.9f, 0.0f)));
-    hitable_list.push_back(Sphere(Vec3(-1, 0, -2.25), 0.5, Material(Vec3(1.0f, 0.7f, 0.3f), 0.0f, 0.0f)));
-
-    Vec3 colorlist[8] = {Vec3(0.8, 0.3, 0.3), Vec3(0.3, 0.8, 0.3), Vec3(0.3, 0.3, 0.8),
-                         Vec3(0.8, 0.8, 0.3), Vec3(0.3, 0.8, 0.8), Vec3(0.8, 0.3, 0.8),
-                         Vec3(0.8, 0.8, 0.8), Vec3(0.3, 0.3, 0.3)};
-
-    // srand(time(NULL));
-    srand(819);
-    for (int i = 0; i < 48; i++) {
-        float xr = ((float)rand() / (float)(RAND_MAX)) * 6.0f - 3.0f;
-        float zr = ((float)rand() / (float)(RAND_MAX)) * 3.0f - 1.5f;
-        int cindex = rand() % 8;
-        float rand_reflec = ((float)rand() / (float)(RAND_MAX));
-        // float rand_refrac = ((float)rand() / (float)(RAND_MAX));
-        // hitable_list.push_back(Sphere(Vec3(xr, -0.4, zr - 2), 0.1, Material(colorlist[cindex], rand_reflec, rand_refrac)));
-        hitable_list.push_back(Sphere(Vec3(xr, -0.4, zr - 2), 0.1, Material(colorlist[cindex], rand_reflec, 0.0)));
-    }
-
-    return hitable_list;
-}
-
-int main() {
-    int width = 200;
-    int height = 100;
-
-    // For anti-aliasing.
-    int anti_aliasing_times = 100;
-
-    fstream ppm_file;
-    ppm_file.open("ray_tracing_with_anti-alias.ppm", ios::out);
-
-    // Construct the camera and projection plane.
-    // Vec3 look_from(3.0, 3.0, 2.0);
-    // Vec3 look_at(0.0, 0.0, -1.0);
-    // Vec3 vup(0.0, 1.0, 0.0);
-    // float vfov = 20;
-    // float aspect = float(width) / float(height);
-    // float dist_to_focus = 10.0;
-    // float aperture = 0.1;
-    // Camera camera(look_from, look_at, vup, vfov, aspect, aperture, dist_to_focus);
-    Camera camera;
-
-    // Construct spheres.
-    vector<Sphere> scene = random_scene();
-
-    ppm_file << "P3\n"
-             << width << " " << height << "\n255\n";
-    for (int row_index = height - 1; row_index >= 0; row_index--) {
-        for (int column_index = 0; column_index < width; column_index++) {
-            // Deal with anti-alias.
-            // Same pixel calculate many times ray, then sum,
-            // and then calculate average at last.
-            Vec3 current_pixel_color(0.0, 0.0, 0.0);
-            for (int times = 0; times < anti_aliasing_times; times++) {
-                // u is the horizontal offset of the current point from the lower left corner.
-                float u = float(column_index + float(random(0, 100)) / 100.0f) / float(width);
-                // v is the vertical offset of the current point from the lower left corner.
-                float v = float(row_index + float(random(0, 100)) / 100.0f) / float(height);
-                Ray ray = camera.get_ray(u, v);
-                current_pixel_color += trace(ray, scene, 0);
-            }
-            current_pixel_color /= float(anti_aliasing_times);
-            //gamma correct
-            // current_pixel_color = Vec3(sqrt(current_pixel_color.r()), sqrt(current_pixel_color.g()), sqrt(current_pixel_color.b()));
-
-            ppm_file << int(current_pixel_color.r() * 255) << " " << int(current_pixel_color.g() * 255) << " " << int(current_pixel_color.b() * 255) << "\n";
-        }
-    }
-
-    return 0;
-}
\ No newline at end of file
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cstring> // for strcmp()
+#include <atomic>
+#include <cstdio> // for snprintf(), sscanf()
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "camera.h"
+#include "checkpoint.h"
+#include "denoise.h"
+#include "distributed.h"
+#include "image_writer.h"
+#include "perf_counters.h"
+#include "profile.h"
+#include "render_server.h"
+#include "sample_buffer.h"
+#include "scene.h"
+#include "scene_io.h"
+#include "stats.h"
+#include "tile_pool.h"
+#include "tile_render.h"
+#include "tracer.h"
+#include "wavefront.h"
+
+using namespace std;
+
+typedef struct RenderSettings {
+    int width;
+    int height;
+    // For anti-aliasing (the sample budget of a pixel).
+    int anti_aliasing_times;
+    // Adaptive sampling: stop a pixel after min_samples once the standard
+    // error of its luminance is below noise (in 8-bit steps, 0 = off).
+    int min_samples;
+    double noise;
+    // Samples per pixel and pass (when adaptive or progressive).
+    int pass_samples;
+    // Write the frame after every pass.
+    bool progressive;
+    // Filter the frame with the denoiser (denoise.h), and write the guide
+    // images of the first hit and the variance as aov_prefix_*.pfm.
+    bool denoise;
+    DenoiseSettings denoiser;
+    const char *aov_prefix;
+    const char *heatmap;
+    // Profile the frame (a build with RT_PROFILE) and write the results as profile_*.
+    const char *profile;
+    // Look-at camera (when any of these is given, else the fixed camera of
+    // the original tracer, which they default to): the vertical field of
+    // view in degrees, and the thin lens, its aperture (diameter, 0 =
+    // pinhole) and the distance in focus (0 = the distance to look_at).
+    bool look_at_camera;
+    float look_from[3];
+    float look_at[3];
+    float vfov;
+    float aperture;
+    float focus_distance;
+    // Write the samples to a checkpoint file every checkpoint_seconds (0 =
+    // after every pass) and at the end, and start from the samples of a
+    // checkpoint file (resume), adding samples up to the budget.
+    const char *checkpoint;
+    double checkpoint_seconds;
+    const char *resume;
+    // Only render the region of region_size[0] x region_size[1] pixels
+    // whose top left pixel is region_at (in the image, from the top); the
+    // other pixels keep the samples they have (none, or resumed ones).
+    bool has_region;
+    int region_at[2];
+    int region_size[2];
+    // Output file, its format and whether it is written through a memory map.
+    const char *output;
+    ImageFormat format;
+    bool use_mmap;
+    // Scene file to render (NULL for the built-in scene), and where to save the scene.
+    const char *scene;
+    // small spheres of the built-in scene, and its random lights (0 for the point light)
+    int small_spheres;
+    int lights;
+    // Quantize the spheres into the BVH leaves (sphere_compact.h), and
+    // scatter that many instances of a pile of spheres (instancing.h).
+    bool compact;
+    int instances;
+    const char *save_scene;
+    // Store the BVH in a saved binary scene.
+    bool save_bvh;
+    int threads;
+    int tile_size;
+    unsigned int seed;
+    // Sub-pixel sample positions: random, halton, sobol or bluenoise.
+    Sampler sampler;
+    // recursive or wavefront
+    Engine engine;
+    // SIMD kernel name, NULL for the widest supported one
+    const char *kernel;
+    TraceOptions trace;
+    // Distributed rendering: serve the frame on this port (0 = render
+    // locally), or work for the coordinator at HOST:PORT.
+    int coordinator_port;
+    const char *worker;
+    // seconds a worker may stay silent with tiles outstanding
+    double worker_timeout;
+    // Render server: serve jobs on this port (0 = off) and keep that many
+    // scenes built, or send this job to the server at HOST:PORT.
+    int serve_port;
+    int cache_scenes;
+    const char *submit;
+    // Animation: frames to render at fps, moving the spheres of the scene
+    // (and the built-in scene too with animate). The BVH is refitted until
+    // that makes it rebuild_threshold slower than a new build.
+    int frames;
+    float fps;
+    float rebuild_threshold;
+    bool animate;
+} RenderSettings;
+
+bool parse_vector(const char *text, float vector[3]) {
+    //* Read "X,Y,Z".
+    char end;
+    return sscanf(text, "%f,%f,%f%c", &vector[0], &vector[1], &vector[2], &end) == 3;
+}
+
+bool parse_region(const char *text, int at[2], int size[2]) {
+    //* Read "X,Y,WIDTH,HEIGHT".
+    char end;
+    return sscanf(text, "%d,%d,%d,%d%c", &at[0], &at[1], &size[0], &size[1], &end) == 4;
+}
+
+bool parse_arguments(int argc, char **argv, RenderSettings &settings) {
+    //* Read the command line options. Return false on a bad option.
+    const char *format_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--threads") == 0 && has_value) {
+            settings.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tile") == 0 && has_value) {
+            settings.tile_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+            settings.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--sampler") == 0 && has_value) {
+            if (!parse_sampler(argv[++i], settings.sampler)) {
+                cerr << "unknown sampler " << argv[i] << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--engine") == 0 && has_value) {
+            if (!parse_engine(argv[++i], settings.engine)) {
+                cerr << "unknown engine " << argv[i] << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--kernel") == 0 && has_value) {
+            settings.kernel = argv[++i];
+        } else if (strcmp(argv[i], "--adaptive") == 0 && has_value) {
+            settings.trace.adaptive = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--min-throughput") == 0 && has_value) {
+            settings.trace.min_throughput = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--roulette") == 0 && has_value) {
+            settings.trace.roulette_depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--occluder-cache") == 0 && has_value) {
+            settings.trace.occluder_cache = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--sort-rays") == 0 && has_value) {
+            settings.trace.sort_rays = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--samples") == 0 && has_value) {
+            settings.anti_aliasing_times = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--min-samples") == 0 && has_value) {
+            settings.min_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--noise") == 0 && has_value) {
+            settings.noise = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--pass-samples") == 0 && has_value) {
+            settings.pass_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--progressive") == 0) {
+            settings.progressive = true;
+        } else if (strcmp(argv[i], "--denoise") == 0) {
+            settings.denoise = true;
+        } else if (strcmp(argv[i], "--denoise-iterations") == 0 && has_value) {
+            settings.denoiser.iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--aov") == 0 && has_value) {
+            settings.aov_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--heatmap") == 0 && has_value) {
+            settings.heatmap = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && has_value) {
+            settings.profile = argv[++i];
+        } else if (strcmp(argv[i], "--look-from") == 0 && has_value) {
+            settings.look_at_camera = true;
+            if (!parse_vector(argv[++i], settings.look_from)) {
+                cerr << "--look-from needs X,Y,Z" << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--look-at") == 0 && has_value) {
+            settings.look_at_camera = true;
+            if (!parse_vector(argv[++i], settings.look_at)) {
+                cerr << "--look-at needs X,Y,Z" << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--vfov") == 0 && has_value) {
+            settings.look_at_camera = true;
+            settings.vfov = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--aperture") == 0 && has_value) {
+            settings.look_at_camera = true;
+            settings.aperture = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--focus-distance") == 0 && has_value) {
+            settings.look_at_camera = true;
+            settings.focus_distance = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && has_value) {
+            settings.checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && has_value) {
+            settings.checkpoint_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0 && has_value) {
+            settings.resume = argv[++i];
+        } else if (strcmp(argv[i], "--region") == 0 && has_value) {
+            settings.has_region = true;
+            if (!parse_region(argv[++i], settings.region_at, settings.region_size)) {
+                cerr << "--region needs X,Y,WIDTH,HEIGHT" << endl;
+                return false;
+            }
+        } else if (strcmp(argv[i], "--output") == 0 && has_value) {
+            settings.output = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && has_value) {
+            format_name = argv[++i];
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            settings.use_mmap = true;
+        } else if (strcmp(argv[i], "--spheres") == 0 && has_value) {
+            settings.small_spheres = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lights") == 0 && has_value) {
+            settings.lights = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compact") == 0) {
+            settings.compact = true;
+        } else if (strcmp(argv[i], "--instances") == 0 && has_value) {
+            settings.instances = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shadow-rays") == 0 && has_value) {
+            settings.trace.shadow_rays = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scene") == 0 && has_value) {
+            settings.scene = argv[++i];
+        } else if (strcmp(argv[i], "--save-scene") == 0 && has_value) {
+            settings.save_scene = argv[++i];
+        } else if (strcmp(argv[i], "--save-bvh") == 0 && has_value) {
+            settings.save_bvh = strcmp(argv[++i], "off") != 0;
+        } else if (strcmp(argv[i], "--coordinator") == 0 && has_value) {
+            settings.coordinator_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--worker") == 0 && has_value) {
+            settings.worker = argv[++i];
+        } else if (strcmp(argv[i], "--worker-timeout") == 0 && has_value) {
+            settings.worker_timeout = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--serve") == 0 && has_value) {
+            settings.serve_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-scenes") == 0 && has_value) {
+            settings.cache_scenes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--submit") == 0 && has_value) {
+            settings.submit = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && has_value) {
+            settings.frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fps") == 0 && has_value) {
+            settings.fps = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--rebuild-threshold") == 0 && has_value) {
+            settings.rebuild_threshold = (float)atof(argv[++i]);
+        } else if (strcmp(argv[i], "--animate") == 0) {
+            settings.animate = true;
+        } else {
+            cerr << "usage: " << argv[0] << " [--threads N] [--tile SIZE] [--seed N] [--sampler random|halton|sobol|bluenoise]" << endl
+                 << "       [--kernel scalar|sse|avx2|avx512] [--engine recursive|wavefront [--sort-rays on|off]]" << endl
+                 << "       [--adaptive on|off] [--min-throughput W] [--roulette DEPTH] [--shadow-rays N] [--occluder-cache on|off]" << endl
+                 << "       [--samples N] [--noise STEPS --min-samples N] [--pass-samples N] [--progressive] [--heatmap FILE]" << endl
+                 << "       [--denoise [--denoise-iterations N]] [--aov PREFIX] [--profile PREFIX]" << endl
+                 << "       [--look-from X,Y,Z [--look-at X,Y,Z] [--vfov DEGREES] [--aperture A [--focus-distance D]]]" << endl
+                 << "       [--checkpoint FILE [--checkpoint-every SECONDS]] [--resume FILE] [--region X,Y,WIDTH,HEIGHT]" << endl
+                 << "       [--output FILE] [--format p3|p6|p16|pfm|png] [--mmap]" << endl
+                 << "       [--spheres N] [--lights N] [--compact] [--instances N] [--scene FILE] [--save-scene FILE.scene|FILE] [--save-bvh on|off]" << endl
+                 << "       [--coordinator PORT [--worker-timeout SECONDS]] [--worker HOST:PORT]" << endl
+                 << "       [--serve PORT [--cache-scenes N]] [--submit HOST:PORT]" << endl
+                 << "       [--frames N [--fps F] [--rebuild-threshold X] [--animate]]" << endl;
+            return false;
+        }
+    }
+    if (settings.threads < 1 || settings.tile_size < 1 || settings.anti_aliasing_times < 1 ||
+        settings.min_samples < 2 || settings.pass_samples < 1 || settings.small_spheres < 0 || settings.lights < 0 ||
+        settings.instances < 0) {
+        cerr << "--threads, --tile, --samples and --pass-samples need a positive value, --min-samples at least 2, --spheres, --lights and --instances at least 0" << endl;
+        return false;
+    }
+    if (settings.trace.sort_rays && settings.engine != ENGINE_WAVEFRONT) {
+        cerr << "--sort-rays sorts the waves of the wavefront engine" << endl;
+        return false;
+    }
+    if (settings.trace.shadow_rays < 1 || settings.trace.shadow_rays > MAX_SHADOW_RAYS) {
+        cerr << "--shadow-rays needs a value from 1 to " << MAX_SHADOW_RAYS << endl;
+        return false;
+    }
+    if (settings.coordinator_port < 0 || settings.coordinator_port > 65535 || settings.worker_timeout <= 0.0 ||
+        (settings.coordinator_port > 0 && settings.worker)) {
+        cerr << "--coordinator needs a port, --worker-timeout a positive value, and a process is either coordinator or worker" << endl;
+        return false;
+    }
+    if (settings.coordinator_port > 0 && (settings.progressive || settings.denoise || settings.aov_prefix)) {
+        cerr << "--progressive frames, --denoise and --aov are not written by a coordinator" << endl;
+        return false;
+    }
+    if (settings.coordinator_port > 0 && settings.instances > 0) {
+        cerr << "the scene file of the workers has no instances" << endl;
+        return false;
+    }
+    bool serving = settings.serve_port != 0 || settings.submit;
+    if (settings.serve_port < 0 || settings.serve_port > 65535 || settings.cache_scenes < 1 ||
+        (settings.serve_port > 0 && settings.submit) || (serving && (settings.coordinator_port > 0 || settings.worker))) {
+        cerr << "--serve needs a port, --cache-scenes a positive value, and a process is a render server, its client, a coordinator or a worker" << endl;
+        return false;
+    }
+    if (settings.submit && (settings.progressive || settings.denoise || settings.aov_prefix || settings.save_scene ||
+                            settings.animate || settings.frames > 1)) {
+        cerr << "a render server job is one frame without --progressive, --denoise, --aov, --save-scene or --animate" << endl;
+        return false;
+    }
+#ifndef RT_PROFILE
+    if (settings.profile) {
+        cerr << "--profile needs a build with the profiler (cmake -DRT_PROFILE=ON)" << endl;
+        return false;
+    }
+#endif
+    if (settings.profile && (settings.coordinator_port > 0 || settings.submit)) {
+        cerr << "--profile profiles a local render" << endl;
+        return false;
+    }
+    if (settings.animate && settings.compact) {
+        cerr << "a compact scene can not move" << endl;
+        return false;
+    }
+    if (settings.vfov <= 0.0f || settings.vfov >= 180.0f || settings.aperture < 0.0f || settings.focus_distance < 0.0f) {
+        cerr << "--vfov needs a value between 0 and 180 degrees, --aperture and --focus-distance at least 0" << endl;
+        return false;
+    }
+    if (settings.checkpoint_seconds < 0.0) {
+        cerr << "--checkpoint-every needs a value of at least 0" << endl;
+        return false;
+    }
+    if ((settings.checkpoint || settings.resume || settings.has_region) &&
+        (settings.coordinator_port > 0 || settings.submit || settings.frames > 1)) {
+        cerr << "--checkpoint, --resume and --region work on a local render of one frame" << endl;
+        return false;
+    }
+    if (settings.has_region &&
+        (settings.region_at[0] < 0 || settings.region_at[1] < 0 || settings.region_size[0] < 1 || settings.region_size[1] < 1 ||
+         settings.region_at[0] + settings.region_size[0] > settings.width ||
+         settings.region_at[1] + settings.region_size[1] > settings.height)) {
+        cerr << "--region needs at least one pixel, inside the " << settings.width << "x" << settings.height << " image" << endl;
+        return false;
+    }
+    if (settings.denoiser.iterations < 1 || settings.denoiser.iterations > DENOISE_MAX_ITERATIONS) {
+        cerr << "--denoise-iterations needs a value from 1 to " << DENOISE_MAX_ITERATIONS << endl;
+        return false;
+    }
+    if (settings.frames < 1 || settings.fps <= 0.0f || settings.rebuild_threshold < 0.0f) {
+        cerr << "--frames and --fps need a positive value, --rebuild-threshold at least 0" << endl;
+        return false;
+    }
+    if (settings.frames > 1 && (settings.coordinator_port > 0 || settings.progressive)) {
+        cerr << "--frames renders locally and without --progressive" << endl;
+        return false;
+    }
+    settings.format = image_format_of_path(settings.output);
+    if (format_name && !parse_image_format(format_name, settings.format)) {
+        cerr << "unknown format " << format_name << endl;
+        return false;
+    }
+    return true;
+}
+
+void print_scaling_report(const RenderSettings &settings, const vector<WorkerReport> &reports, int tile_count, double wall_seconds) {
+    //* Print how the tiles were spread over the threads.
+    //* speedup = busy time of all threads / wall time, so it is the speedup
+    //* over one thread doing the same work, and efficiency = speedup / threads.
+    double busy_seconds = 0.0;
+    for (size_t i = 0; i < reports.size(); i++) {
+        busy_seconds += reports[i].busy_seconds;
+    }
+    double speedup = wall_seconds > 0.0 ? busy_seconds / wall_seconds : 0.0;
+
+    cout << "threads " << settings.threads << ", tiles " << tile_count
+         << " (" << settings.tile_size << "x" << settings.tile_size << "), wall " << wall_seconds << " s" << endl;
+    for (size_t i = 0; i < reports.size(); i++) {
+        cout << "  thread " << i << ": " << reports[i].tiles << " tiles (" << reports[i].stolen << " stolen), busy "
+             << reports[i].busy_seconds << " s" << endl;
+    }
+    cout << "speedup " << speedup << "x, efficiency " << 100.0 * speedup / settings.threads << "%" << endl;
+}
+
+void print_scene_report(const RenderSettings &settings, const Scene &scene, const SceneLoadInfo &info, double load_ms) {
+    //* Print where the scene came from and how long it took to get it.
+    cout << "scene: " << scene.sphere_count() << " spheres, " << scene.materials.size() << " materials, "
+         << scene.lights.size() << " lights, ";
+    if (!settings.scene) {
+        cout << "built in";
+    } else {
+        cout << settings.scene << " (" << (info.binary ? (info.mapped ? "binary, mapped" : "binary, read") : "text")
+             << (info.prebuilt_bvh ? ", prebuilt BVH" : "") << ") loaded in";
+    }
+    cout << " " << load_ms << " ms" << endl;
+}
+
+void print_memory_report(const Scene &scene, const RenderStats &stats, double wall_seconds) {
+    //* Print the memory of the geometry per sphere and the rays traced per second.
+    long long primitives = scene.primitive_count();
+    size_t bytes = scene.geometry_bytes();
+    cout << "geometry: " << primitives << " spheres";
+    if (!scene.instances.empty()) {
+        cout << " (" << scene.instances.sphere_count() << " in " << scene.instances.instance_count() << " instances of "
+             << scene.instances.prototype_count() << " prototypes)";
+    }
+    cout << ", " << bytes / (1024.0 * 1024.0) << " MiB, " << (primitives ? double(bytes) / primitives : 0.0)
+         << " bytes/sphere" << (scene.bvh.is_compact() ? " (compact)" : "") << endl;
+    unsigned long long rays = stats.count[CLOSEST_RAYS] + stats.count[SHADOW_RAYS];
+    cout << "  " << (wall_seconds > 0.0 ? rays / wall_seconds / 1e6 : 0.0) << " Mrays/s";
+    if (!scene.instances.empty()) {
+        cout << ", " << (rays ? double(stats.count[INSTANCE_NODES]) / rays : 0.0) << " top-level nodes/ray";
+    }
+    cout << endl;
+}
+
+void print_bvh_report(const BVH &bvh, const RenderStats &stats) {
+    //* Print the build and the traversal statistics of the BVH.
+    const BVHBuildStats &build = bvh.get_build_stats();
+    cout << "bvh (" << bvh.get_kernels().name << " kernel): " << build.primitives << " spheres, " << build.nodes << " nodes, " << build.leaves
+         << " leaves, depth " << build.max_depth << ", SAH cost " << build.sah_cost
+         << ", built in " << build.build_ms << " ms" << endl;
+    cout << "  closest hit: " << stats.count[CLOSEST_RAYS] << " rays, "
+         << stats.ratio(CLOSEST_NODES, CLOSEST_RAYS) << " nodes/ray, "
+         << stats.ratio(CLOSEST_TESTS, CLOSEST_RAYS) << " tests/ray" << endl;
+    cout << "  any hit:     " << stats.count[SHADOW_RAYS] << " rays, "
+         << stats.ratio(SHADOW_NODES, SHADOW_RAYS) << " nodes/ray, "
+         << stats.ratio(SHADOW_TESTS, SHADOW_RAYS) << " tests/ray, "
+         << 100.0 * stats.ratio(SHADOW_BLOCKED, SHADOW_RAYS) << "% blocked" << endl;
+    if (stats.count[OCCLUDER_LOOKUPS] > 0) {
+        cout << "  occluder cache: " << stats.count[OCCLUDER_HITS] << " of " << stats.count[OCCLUDER_LOOKUPS] << " lookups hit ("
+             << 100.0 * stats.ratio(OCCLUDER_HITS, OCCLUDER_LOOKUPS) << "%), "
+             << 100.0 * stats.ratio(OCCLUDER_HITS, SHADOW_RAYS) << "% of the shadow rays skip the tree" << endl;
+    }
+}
+
+void print_light_report(const Scene &scene, const TraceOptions &options, const RenderStats &stats) {
+    //* Print how the lights were sampled: every light per hit, or picked from the tree.
+    if ((int)scene.lights.size() <= options.shadow_rays) {
+        cout << "lights: " << scene.lights.size() << ", every light sampled at every hit" << endl;
+        return;
+    }
+    cout << "lights: " << scene.lights.size() << ", " << options.shadow_rays << " shadow rays per hit from a light tree of "
+         << scene.light_tree.size() << " nodes, " << stats.ratio(LIGHT_TREE_NODES, LIGHT_PICKS) << " nodes per pick" << endl;
+}
+
+void print_cache_report(const RenderStats &stats) {
+    //* Print the cache misses of the render threads, when there are hardware counters.
+    if (!thread_perf_counters.available()) {
+        cout << "cache misses: no hardware counters here" << endl;
+        return;
+    }
+    unsigned long long rays = stats.count[CLOSEST_RAYS] + stats.count[SHADOW_RAYS];
+    cout << "cache misses: " << stats.count[CACHE_MISSES] << " last level, " << stats.count[L1D_MISSES] << " L1 data reads ("
+         << (rays ? double(stats.count[CACHE_MISSES]) / rays : 0.0) << " and " << (rays ? double(stats.count[L1D_MISSES]) / rays : 0.0)
+         << " per ray)" << endl;
+}
+
+void print_allocation_report(const RenderStats &stats) {
+    //* Print the heap allocations made while tracing. Should be 0.
+    unsigned long long rays = stats.count[CLOSEST_RAYS] + stats.count[SHADOW_RAYS];
+    cout << "heap allocations while tracing: " << stats.count[HEAP_ALLOCATIONS] << " ("
+         << (rays ? double(stats.count[HEAP_ALLOCATIONS]) / double(rays) : 0.0) << " per ray)" << endl;
+}
+
+void print_spawn_report(const TraceOptions &options, const RenderStats &stats) {
+    //* Print how many secondary rays were traced and how many were saved.
+    //* Every skipped, culled or terminated branch is at least one ray that
+    //* the full ray tree (--adaptive off) would have traced.
+    unsigned long long secondary = stats.count[CLOSEST_RAYS] - stats.count[PRIMARY_RAYS];
+    unsigned long long saved = stats.count[SKIPPED_BRANCHES] + stats.count[CULLED_BRANCHES] + stats.count[ROULETTE_TERMINATED];
+    cout << "secondary rays: " << secondary << " traced (" << double(secondary) / double(max(1ULL, stats.count[PRIMARY_RAYS]))
+         << " per primary ray), " << saved << " saved" << endl;
+    cout << "  " << stats.count[SKIPPED_BRANCHES] << " zero-weight branches skipped, "
+         << stats.count[CULLED_BRANCHES] << " branches below throughput " << options.min_throughput << " cut, "
+         << stats.count[ROULETTE_TERMINATED] << " terminated by roulette"
+         << (options.adaptive ? "" : " (adaptive spawning off)") << endl;
+}
+
+#ifdef RT_PROFILE
+bool write_profile(const char *prefix, const Scene &scene, const RenderStats &stats) {
+    //* Write the cost heat maps and the timelines of the profile as
+    //* prefix_pixels.ppm, prefix_tiles.ppm and prefix_trace.json, and print
+    //* where the time of the tiles went.
+    const char *names[3] = {"_pixels.ppm", "_tiles.ppm", "_trace.json"};
+    for (int file = 0; file < 3; file++) {
+        string path = string(prefix) + names[file];
+        bool written = file == 0 ? frame_profile.write_pixel_heatmap(path.c_str())
+                       : file == 1 ? frame_profile.write_tile_heatmap(path.c_str())
+                                   : frame_profile.write_trace(path.c_str());
+        if (!written) {
+            cerr << "can not write " << path << endl;
+            return false;
+        }
+    }
+    const uint64_t *zone_ticks = frame_profile.get_zone_ticks();
+    uint64_t total_ticks = 0;
+    for (int z = 0; z < ZONE_COUNT; z++) {
+        total_ticks += zone_ticks[z];
+    }
+    double total = double(max<uint64_t>(1, total_ticks));
+    cout << "profile: " << frame_profile.ticks_to_ms(total_ticks) << " ms in " << frame_profile.get_span_count() << " spans, written to " << prefix
+         << "_*" << endl;
+    cout << "  zones:";
+    for (int z = 0; z < ZONE_COUNT; z++) {
+        cout << " " << zone_names[z] << " " << 100.0 * zone_ticks[z] / total << "%";
+    }
+    cout << endl;
+
+    // The most expensive materials; [0] is the time of no material.
+    const vector<uint64_t> &material_ticks = frame_profile.get_material_ticks();
+    vector<int> order;
+    for (size_t i = 0; i < material_ticks.size(); i++) {
+        order.push_back((int)i);
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) { return material_ticks[a] > material_ticks[b]; });
+    for (size_t i = 0; i < order.size() && i < 5; i++) {
+        int material = order[i] - 1;
+        cout << "  " << 100.0 * material_ticks[order[i]] / total << "% ";
+        if (material < 0 || material >= (int)scene.materials.size()) {
+            cout << "camera rays and misses" << endl;
+            continue;
+        }
+        const Material &m = scene.materials[material];
+        cout << "material " << material << " (kd " << m.get_kd() << ", w_r " << m.get_wr() << ", w_t " << m.get_wt() << ")" << endl;
+    }
+
+    const unsigned long long *depth = frame_profile.get_depth();
+    int deepest = 0;
+    for (int d = 0; d <= PROFILE_MAX_DEPTH; d++) {
+        deepest = depth[d] ? d : deepest;
+    }
+    cout << "  rays by depth:";
+    for (int d = 0; d <= deepest; d++) {
+        cout << " " << depth[d];
+    }
+    cout << ", " << frame_profile.get_depth_capped() << " ended at the depth cap" << endl;
+    cout << "  " << stats.count[CLOSEST_TESTS] << " closest and " << stats.count[SHADOW_TESTS] << " any-hit sphere tests, "
+         << stats.count[SHADOW_RAYS] << " shadow rays; early ends: " << stats.count[SKIPPED_BRANCHES] << " skipped, "
+         << stats.count[CULLED_BRANCHES] << " culled, " << stats.count[ROULETTE_TERMINATED] << " roulette" << endl;
+    return true;
+}
+#endif
+
+bool write_image(const char *path, ImageFormat format, bool use_mmap, int width, int height, vector<float> &rgb) {
+    //* Write a whole image in one go (RGB floats, top row first; rgb is handed to the writer).
+    FrameWriter writer;
+    if (!writer.open(path, format, width, height, use_mmap)) {
+        return false;
+    }
+    writer.submit(0, height, rgb);
+    return writer.close();
+}
+
+bool write_frame(const char *path, ImageFormat format, bool use_mmap, const SampleBuffer &samples) {
+    //* Write the average of the samples so far (the progressive frames).
+    vector<float> rgb;
+    samples.rows_rgb(0, samples.height, rgb);
+    return write_image(path, format, use_mmap, samples.width, samples.height, rgb);
+}
+
+bool write_aovs(const string &prefix, const SampleBuffer &samples) {
+    //* Write the averaged guides and the variance of the mean luminance as
+    //* float images: prefix_albedo.pfm, _normal.pfm, _depth.pfm and _variance.pfm.
+    const char *names[4] = {"_albedo.pfm", "_normal.pfm", "_depth.pfm", "_variance.pfm"};
+    for (int image = 0; image < 4; image++) {
+        vector<float> rgb;
+        rgb.reserve((size_t)samples.width * samples.height * 3);
+        for (int row_index = samples.height - 1; row_index >= 0; row_index--) {
+            for (int column_index = 0; column_index < samples.width; column_index++) {
+                const PixelSamples &pixel = samples.at(row_index, column_index);
+                const PixelAov &aov = samples.aov_at(row_index, column_index);
+                float inverse = pixel.count > 0 ? 1.0f / float(pixel.count) : 0.0f;
+                Vec3 value;
+                if (image == 0) {
+                    value = aov.albedo * inverse;
+                } else if (image == 1) {
+                    value = aov.normal * inverse;
+                } else if (image == 2) {
+                    value = Vec3(1.0, 1.0, 1.0) * (aov.depth * inverse);
+                } else {
+                    double error = pixel.count >= 2 ? standard_error(pixel) : 0.0;
+                    value = Vec3(1.0, 1.0, 1.0) * float(error * error);
+                }
+                rgb.push_back(value.r());
+                rgb.push_back(value.g());
+                rgb.push_back(value.b());
+            }
+        }
+        string path = prefix + names[image];
+        if (!write_image(path.c_str(), IMAGE_PFM, false, samples.width, samples.height, rgb)) {
+            cerr << "can not write " << path << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void print_cluster_report(const Coordinator &coordinator, double wall_seconds) {
+    //* Print how the tiles were spread over the workers.
+    //* The imbalance compares the busiest worker (busy time per thread)
+    //* with the mean, 0% when all threads worked equally long.
+    vector<ClusterWorkerReport> reports = coordinator.worker_reports();
+    cout << "distributed: " << reports.size() << " workers, " << coordinator.tile_count() << " tiles ("
+         << coordinator.requeued_tiles() << " requeued), wall " << wall_seconds << " s" << endl;
+    double busiest = 0.0, busy_sum = 0.0;
+    int counted = 0;
+    for (size_t i = 0; i < reports.size(); i++) {
+        const ClusterWorkerReport &r = reports[i];
+        cout << "  worker " << i << " (" << r.name << ", " << r.threads << " threads): " << r.tiles << " tiles, "
+             << r.samples << " samples, busy " << r.busy_seconds << " s of " << r.connected_seconds << " s connected, "
+             << (r.connected_seconds > 0.0 ? r.samples / r.connected_seconds / 1e6 : 0.0) << " M samples/s"
+             << (r.lost ? ", lost" : "") << endl;
+        if (!r.lost && r.tiles > 0) {
+            double per_thread = r.busy_seconds / r.threads;
+            busiest = max(busiest, per_thread);
+            busy_sum += per_thread;
+            counted++;
+        }
+    }
+    double mean = counted > 0 ? busy_sum / counted : 0.0;
+    cout << "load imbalance: " << (mean > 0.0 ? 100.0 * (busiest / mean - 1.0) : 0.0) << "% (busiest worker over the mean)" << endl;
+}
+
+string frame_path(const char *path, int frame, int frames) {
+    //* The file of a frame: path itself for a single frame, else the frame
+    //* number goes before the extension (image.ppm -> image_0007.ppm).
+    string name(path);
+    if (frames == 1) {
+        return name;
+    }
+    char number[16];
+    snprintf(number, sizeof(number), "_%04d", frame);
+    size_t dot = name.find_last_of('.');
+    size_t slash = name.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        dot = name.size();
+    }
+    return name.insert(dot, number);
+}
+
+void print_frame_report(int frame, float time, bool rebuilt, double update_seconds, const BVH &bvh,
+                        double render_seconds, double output_seconds) {
+    //* Print one frame of an animation: what following the motion cost
+    //* (refit or build) and how good the tree still is, then the rendering.
+    // Frame 0 shows the first build of the scene.
+    double update_ms = frame == 0 ? bvh.get_build_stats().build_ms : update_seconds * 1000.0;
+    cout << "frame " << frame << " (t " << time << " s): " << (frame == 0 ? "build" : (rebuilt ? "rebuild" : "refit"))
+          << " " << update_ms << " ms, SAH cost " << bvh.get_build_stats().sah_cost << ", boxes "
+         << bvh.get_area_growth() << "x their built area, render " << render_seconds << " s, output "
+         << output_seconds * 1000.0 << " ms" << endl;
+}
+
+void print_animation_report(int frames, int rebuilds, double update_seconds, double render_seconds) {
+    //* Print the update and the render cost of the whole animation.
+    cout << "animation: " << frames << " frames, " << rebuilds << " rebuilds, " << frames - 1 - rebuilds << " refits, update "
+         << update_seconds * 1000.0 << " ms (" << update_seconds * 1000.0 / frames << " ms/frame), render "
+         << render_seconds << " s (" << render_seconds / frames << " s/frame)" << endl;
+}
+
+void print_output_report(const RenderSettings &settings, const FrameWriter &writer, double close_seconds) {
+    //* Print the size of the (last) frame and what writing it cost outside the render threads.
+    cout << "output: " << frame_path(settings.output, settings.frames - 1, settings.frames) << " (" << image_format_names[settings.format] << (writer.mapped() ? ", mmap" : "")
+         << "), " << writer.bytes_written() << " bytes, " << writer.encode_seconds() * 1000.0
+         << " ms on the writer thread, " << close_seconds * 1000.0 << " ms waited after rendering" << endl;
+}
+
+void print_denoise_report(const DenoiseSettings &settings, const DenoiseKernel &kernel, int threads, int frames, double ms) {
+    //* Print what the denoiser cost, apart from rendering.
+    cout << "denoise: " << settings.iterations << " iterations (" << kernel.name << " kernel, " << threads << " threads), "
+         << ms / frames << " ms per frame" << endl;
+}
+
+void print_wavefront_report(const StageStats &stats) {
+    //* Print the items and the time of every wavefront stage (summed over the threads).
+    cout << "wavefront stages:" << endl;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        cout << "  " << stage_names[i] << ": " << stats.items[i] << " items in " << stats.seconds[i] * 1000.0 << " ms, "
+             << (stats.seconds[i] > 0.0 ? stats.items[i] / stats.seconds[i] / 1e6 : 0.0) << " M/s" << endl;
+    }
+}
+
+void print_camera_report(const Camera &camera, const StageStats &stats, const vector<WorkerReport> &reports) {
+    //* Print what the camera rays cost, against the time the threads spent on tiles.
+    double busy_seconds = 0.0;
+    for (size_t i = 0; i < reports.size(); i++) {
+        busy_seconds += reports[i].busy_seconds;
+    }
+    unsigned long long rays = stats.items[STAGE_GENERATE];
+    double seconds = stats.seconds[STAGE_GENERATE];
+    cout << "camera rays: " << rays << " (" << (camera.has_lens() ? "thin lens" : "pinhole") << ") in "
+         << seconds * 1000.0 << " ms, " << (rays ? seconds * 1e9 / rays : 0.0) << " ns/ray, "
+         << (busy_seconds > 0.0 ? 100.0 * seconds / busy_seconds : 0.0) << "% of the tile time" << endl;
+}
+
+void print_sampling_report(const RenderSettings &settings, const SampleBuffer &samples, int passes) {
+    //* Print the samples spent against the fixed budget of every pixel.
+    unsigned long long total = samples.total_samples();
+    unsigned long long budget = (unsigned long long)settings.anti_aliasing_times * samples.width * samples.height;
+    cout << "samples: " << total << " in " << passes << " passes, " << double(total) / (samples.width * samples.height)
+         << " per pixel (" << double(budget) / double(max(1ULL, total)) << "x fewer than " << settings.anti_aliasing_times << " spp)";
+    if (settings.noise > 0.0) {
+        int over_budget = 0;
+        for (size_t i = 0; i < samples.pixels.size(); i++) {
+            const PixelSamples &pixel = samples.pixels[i];
+            over_budget += pixel.count >= settings.anti_aliasing_times && standard_error(pixel) > settings.noise / 255.0 ? 1 : 0;
+        }
+        cout << ", " << over_budget << " pixels hit the budget before noise " << settings.noise;
+    }
+    cout << endl;
+}
+
+void print_checkpoint_report(const RenderSettings &settings, unsigned long long resumed_samples, int checkpoints,
+                             size_t checkpoint_bytes, double checkpoint_ms) {
+    //* Print what was resumed and what the checkpoints cost.
+    if (settings.resume) {
+        cout << "resumed: " << resumed_samples << " samples from " << settings.resume << endl;
+    }
+    if (settings.checkpoint) {
+        cout << "checkpoints: " << checkpoints << " written to " << settings.checkpoint << ", " << checkpoint_bytes
+             << " bytes (the last), " << (checkpoints ? checkpoint_ms / checkpoints : 0.0) << " ms each" << endl;
+    }
+}
+
+void mark_done_pixels(SampleBuffer &samples, const Tile &region, const TileRenderSettings &settings) {
+    //* Mark the pixels that need no more samples: those outside the region,
+    //* and those that got their budget or their noise from a checkpoint.
+    for (int row_index = 0; row_index < samples.height; row_index++) {
+        for (int column_index = 0; column_index < samples.width; column_index++) {
+            PixelSamples &pixel = samples.at(row_index, column_index);
+            bool inside = row_index >= region.y0 && row_index < region.y1 && column_index >= region.x0 && column_index < region.x1;
+            pixel.converged = !inside || pixel_converged(pixel, settings);
+        }
+    }
+}
+
+int submit_job(const RenderSettings &settings, const TileRenderSettings &tile_settings, const Camera &camera) {
+    //* Render the frame on the render server at settings.submit and write it.
+    //* The scene path goes as it is, so it has to be one the server can open.
+    RenderRequest request;
+    memset(&request, 0, sizeof(request));
+    request.version = SERVER_VERSION;
+    request.byte_order = CLUSTER_BYTE_ORDER;
+    request.settings_size = sizeof(TileRenderSettings);
+    request.tile_size = settings.tile_size;
+    request.settings = tile_settings;
+    request.camera = camera.to_wire();
+    request.scene = SceneRequest{settings.small_spheres, settings.lights, settings.instances, settings.compact ? 1 : 0};
+
+    SampleBuffer samples(settings.width, settings.height);
+    RenderReport report;
+    double first_tile_ms = 0.0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (!submit_render(settings.submit, request, settings.scene, samples, report, first_tile_ms)) {
+        return 1;
+    }
+    chrono::duration<double, milli> wall = chrono::steady_clock::now() - start;
+    if (!write_frame(settings.output, settings.format, settings.use_mmap, samples)) {
+        cerr << "can not write " << settings.output << endl;
+        return 1;
+    }
+    cout << "render server " << settings.submit << ": scene " << (report.cache_hit ? "cached" : "loaded") << " in "
+         << report.scene_ms << " ms, first tile after " << first_tile_ms << " ms (" << report.first_tile_ms
+         << " ms on the server), frame after " << wall.count() << " ms" << endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    RenderSettings settings;
+    settings.width = 200;
+    settings.height = 100;
+    settings.anti_aliasing_times = 100;
+    settings.min_samples = 16;
+    settings.noise = 0.0;
+    settings.pass_samples = 8;
+    settings.progressive = false;
+    settings.denoise = false;
+    // Taps 1 to 16 pixels apart; colors within 4 standard errors blend.
+    settings.denoiser = DenoiseSettings{5, 4.0f, 0.3f, 0.1f, 0.05f};
+    settings.aov_prefix = NULL;
+    settings.heatmap = NULL;
+    settings.profile = NULL;
+    settings.look_at_camera = false;
+    // The view of the fixed camera: from (0, 0, 1) towards -z.
+    settings.look_from[0] = 0.0f; settings.look_from[1] = 0.0f; settings.look_from[2] = 1.0f;
+    settings.look_at[0] = 0.0f; settings.look_at[1] = 0.0f; settings.look_at[2] = -1.0f;
+    settings.vfov = 53.13f;
+    settings.aperture = 0.0f;
+    settings.focus_distance = 0.0f;
+    settings.checkpoint = NULL;
+    settings.checkpoint_seconds = 60.0;
+    settings.resume = NULL;
+    settings.has_region = false;
+    settings.output = "ray_tracing_with_anti-alias.ppm";
+    settings.use_mmap = false;
+    settings.scene = NULL;
+    settings.save_scene = NULL;
+    settings.save_bvh = true;
+    settings.small_spheres = 48;
+    settings.lights = 0;
+    settings.compact = false;
+    settings.instances = 0;
+    settings.threads = max(1, (int)thread::hardware_concurrency());
+    settings.tile_size = 16;
+    settings.seed = 0;
+    settings.sampler = SAMPLER_RANDOM;
+    settings.engine = ENGINE_RECURSIVE;
+    settings.kernel = NULL;
+    settings.trace.adaptive = true;
+    // Below half a step of the 8-bit output.
+    settings.trace.min_throughput = 1.0f / 512.0f;
+    settings.trace.shadow_rays = 1;
+    settings.trace.roulette_depth = -1;
+    settings.trace.occluder_cache = true;
+    settings.trace.sort_rays = false;
+    settings.coordinator_port = 0;
+    settings.worker = NULL;
+    settings.worker_timeout = 60.0;
+    settings.serve_port = 0;
+    settings.cache_scenes = SERVER_CACHE_SCENES;
+    settings.submit = NULL;
+    settings.frames = 1;
+    settings.fps = 24.0f;
+    settings.rebuild_threshold = 0.25f;
+    settings.animate = false;
+    if (!parse_arguments(argc, argv, settings)) {
+        return 1;
+    }
+    if (settings.worker) {
+        // The worker gets the scene and the settings from its coordinator.
+        return run_worker(settings.worker, settings.threads, settings.kernel);
+    }
+    if (settings.serve_port > 0) {
+        // Every job brings its own settings, camera and scene.
+        RenderServer server(settings.threads, select_kernels(settings.kernel), settings.cache_scenes);
+        return server.run(settings.serve_port) ? 0 : 1;
+    }
+    int width = settings.width;
+    int height = settings.height;
+    const char *output_path = settings.output;
+
+    // For anti-aliasing.
+    int anti_aliasing_times = settings.anti_aliasing_times;
+    // Render in passes when pixels may stop early, the frame is shown while
+    // it grows, or the samples are saved while they grow (the passes do not
+    // change the colors).
+    bool adaptive = settings.noise > 0.0;
+    int pass_samples = adaptive || settings.progressive || settings.checkpoint ? settings.pass_samples : anti_aliasing_times;
+    // The noise target in color units.
+    double noise = settings.noise / 255.0;
+
+    // Construct the camera and projection plane.
+    Camera camera;
+    if (settings.look_at_camera) {
+        Vec3 look_from(settings.look_from);
+        Vec3 look_at(settings.look_at);
+        float aspect = float(width) / float(height);
+        float focus_distance = settings.focus_distance > 0.0f ? settings.focus_distance : (look_at - look_from).length();
+        camera = Camera(look_from, look_at, Vec3(0.0, 1.0, 0.0), settings.vfov, aspect, settings.aperture, focus_distance);
+    }
+    TileRenderSettings tile_settings = {width, height, anti_aliasing_times, settings.min_samples, adaptive ? noise : 0.0,
+                                        pass_samples, settings.seed, settings.sampler, settings.engine, settings.trace};
+    if (settings.submit) {
+        return submit_job(settings, tile_settings, camera);
+    }
+
+    // Construct spheres, or load them.
+    chrono::steady_clock::time_point load_start = chrono::steady_clock::now();
+    Scene scene = settings.scene ? Scene() : random_scene(settings.small_spheres, SCENE_DEFAULT, settings.lights);
+    SceneLoadInfo load_info = {false, false, false};
+    if (settings.scene && !load_scene(settings.scene, scene, load_info)) {
+        return 1;
+    }
+    chrono::duration<double, milli> load_time = chrono::steady_clock::now() - load_start;
+    const SphereKernels &kernels = select_kernels(settings.kernel);
+    if (settings.kernel && strcmp(settings.kernel, kernels.name) != 0) {
+        cerr << "kernel " << settings.kernel << " is not supported here, using " << kernels.name << endl;
+    }
+    scene.bvh.set_kernels(kernels);
+    if (settings.animate || !scene.motions.empty()) {
+        if (scene.spheres.empty()) {
+            // A mapped scene only has its BVH arrays, and moving spheres need the list.
+            scene.spheres = scene_spheres(scene);
+            load_info.prebuilt_bvh = false;
+        }
+        if (settings.animate) {
+            add_random_motion(scene);
+        }
+        scene.set_time(0.0f);
+    }
+    if (settings.instances > 0) {
+        add_random_instances(scene, settings.instances, settings.compact);
+    }
+    if (!load_info.prebuilt_bvh) {
+        scene.build_bvh();
+    } else {
+        scene.instances.build(scene.sphere_count());
+    }
+    if (settings.compact && !scene.compact()) {
+        return 1;
+    }
+    print_scene_report(settings, scene, load_info, load_time.count());
+    if (settings.save_scene && !save_scene(scene, settings.save_scene, settings.save_bvh)) {
+        cerr << "can not write " << settings.save_scene << endl;
+        return 1;
+    }
+
+    SampleBuffer samples(width, height);
+    if (settings.coordinator_port > 0) {
+        // The workers get the scene as a binary scene file, with the BVH built here.
+        ostringstream scene_data;
+        write_scene_binary(scene, scene_data, true);
+        ClusterJob job = {tile_settings, settings.tile_size, camera.to_wire()};
+        Coordinator coordinator(job, scene_data.str(), samples, settings.worker_timeout);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (!coordinator.run(settings.coordinator_port)) {
+            return 1;
+        }
+        chrono::duration<double> wall = chrono::steady_clock::now() - start;
+        if (!write_frame(output_path, settings.format, settings.use_mmap, samples)) {
+            cerr << "can not write " << output_path << endl;
+            return 1;
+        }
+        if (settings.heatmap && !samples.write_heatmap(settings.heatmap, anti_aliasing_times)) {
+            cerr << "can not write " << settings.heatmap << endl;
+            return 1;
+        }
+        print_cluster_report(coordinator, wall.count());
+        print_sampling_report(settings, samples, 1);
+        return 0;
+    }
+    // The pixels to render, rows from the bottom up like the samples.
+    Tile region = {0, 0, width, height, 0};
+    if (settings.has_region) {
+        region = Tile{settings.region_at[0], height - settings.region_at[1] - settings.region_size[1],
+                      settings.region_at[0] + settings.region_size[0], height - settings.region_at[1], 0};
+    }
+    vector<Tile> tiles = make_tiles(region, settings.tile_size);
+    TilePool pool(settings.threads);
+    vector<WorkerReport> reports(pool.size(), WorkerReport{0, 0, 0.0});
+
+    // Without progressive frames, a band of tiles is written as soon as all of
+    // its pixels are done, while the rest of the image is still rendering.
+    // A denoised frame needs all of its pixels first, and the bands of a
+    // region are not whole rows.
+    bool stream_output = !settings.progressive && !settings.denoise && !settings.has_region;
+    FrameWriter writer;
+    if (settings.denoise || settings.aov_prefix) {
+        samples.enable_aovs();
+    }
+    Denoiser denoiser;
+    const DenoiseKernel &denoise_with = denoise_kernel(scene.bvh.get_kernels().isa);
+    vector<float> denoised;
+    double denoise_ms = 0.0;
+    int band_tiles = (region.x1 - region.x0 + settings.tile_size - 1) / settings.tile_size;
+    vector<char> tile_done(tiles.size(), 0);
+    vector<atomic<int>> band_remaining(tiles.size() / band_tiles);
+    unsigned long long resumed_samples = 0;
+    if (settings.resume) {
+        if (!load_checkpoint(settings.resume, samples, settings.seed, settings.sampler, camera)) {
+            return 1;
+        }
+        resumed_samples = samples.total_samples();
+    }
+    mark_done_pixels(samples, region, tile_settings);
+    int checkpoints = 0;
+    size_t checkpoint_bytes = 0;
+    double checkpoint_ms = 0.0;
+    chrono::steady_clock::time_point last_checkpoint = chrono::steady_clock::now();
+
+    // The frames of an animation reuse the threads, the buffers and the BVH.
+    chrono::duration<double> wall(0.0);
+    chrono::duration<double> close_time(0.0);
+    double update_seconds = 0.0;
+    int passes = 0;
+    int frame_passes = 0;
+    int rebuilds = 0;
+#ifdef RT_PROFILE
+    if (settings.profile) {
+        frame_profile.start(width, height);
+    }
+#endif
+    for (int frame = 0; frame < settings.frames; frame++) {
+        string frame_output = frame_path(output_path, frame, settings.frames);
+        float time = frame / settings.fps;
+        chrono::steady_clock::time_point update_start = chrono::steady_clock::now();
+        bool rebuilt = false;
+        if (frame > 0) {
+            scene.set_time(time);
+            rebuilt = scene.update_bvh(settings.rebuild_threshold);
+            rebuilds += rebuilt ? 1 : 0;
+            samples.clear();
+        }
+        chrono::duration<double> update_time = chrono::steady_clock::now() - update_start;
+        if (frame > 0) {
+            update_seconds += update_time.count();
+        }
+
+        if (stream_output && !writer.open(frame_output.c_str(), settings.format, width, height, settings.use_mmap)) {
+            cerr << "can not write " << frame_output << endl;
+            return 1;
+        }
+        fill(tile_done.begin(), tile_done.end(), 0);
+        for (size_t i = 0; i < band_remaining.size(); i++) {
+            band_remaining[i] = band_tiles;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        frame_passes = 0;
+        // At least one pass, so the tiles of a resumed frame that is already
+        // done still reach the writer.
+        do {
+            PROFILE_SPAN("pass");
+            pool.render(tiles, [&](const Tile &tile) {
+                CacheMissScope cache_misses;
+                // The buffers of the thread are sized by its first tile, outside the count.
+                reserve_tile_render(tile_settings, settings.tile_size);
+                unsigned long long allocations_before = thread_allocations;
+                bool tile_converged = render_tile_pass(tile, samples, camera, scene, tile_settings);
+                thread_stats.count[HEAP_ALLOCATIONS] += thread_allocations - allocations_before;
+                flush_thread_stats();
+                // The last finished tile of a band hands the band to the writer.
+                if (stream_output && tile_converged && !tile_done[tile.index]) {
+                    tile_done[tile.index] = 1;
+                    if (band_remaining[tile.index / band_tiles].fetch_sub(1) == 1) {
+                        vector<float> rgb;
+                        samples.rows_rgb(tile.y0, tile.y1, rgb);
+                        writer.submit(height - tile.y1, tile.y1 - tile.y0, rgb);
+                    }
+                }
+            });
+            passes++;
+            frame_passes++;
+            for (size_t i = 0; i < reports.size(); i++) {
+                reports[i].tiles += pool.last_reports()[i].tiles;
+                reports[i].stolen += pool.last_reports()[i].stolen;
+                reports[i].busy_seconds += pool.last_reports()[i].busy_seconds;
+            }
+            if (settings.progressive && !write_frame(output_path, settings.format, settings.use_mmap, samples)) {
+                cerr << "can not write " << output_path << endl;
+                return 1;
+            }
+            // The last pass always saves, the others when it is time.
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            bool last_pass = samples.unconverged_pixels() == 0;
+            if (settings.checkpoint &&
+                (last_pass || chrono::duration<double>(now - last_checkpoint).count() >= settings.checkpoint_seconds)) {
+                if (!save_checkpoint(settings.checkpoint, samples, settings.seed, settings.sampler, camera, checkpoint_bytes)) {
+                    return 1;
+                }
+                last_checkpoint = chrono::steady_clock::now();
+                checkpoint_ms += chrono::duration<double, milli>(last_checkpoint - now).count();
+                checkpoints++;
+            }
+        } while (samples.unconverged_pixels() > 0);
+        chrono::duration<double> frame_wall = chrono::steady_clock::now() - start;
+        wall += frame_wall;
+
+        if (settings.denoise) {
+            PROFILE_SPAN("denoise");
+            denoiser.run(samples, pool, denoise_with, settings.denoiser, denoised);
+            denoise_ms += denoiser.last_ms();
+        }
+
+        chrono::steady_clock::time_point close_start = chrono::steady_clock::now();
+        if (stream_output && !writer.close()) {
+            cerr << "can not write " << frame_output << endl;
+            return 1;
+        }
+        if (settings.denoise && !write_image(frame_output.c_str(), settings.format, settings.use_mmap, width, height, denoised)) {
+            cerr << "can not write " << frame_output << endl;
+            return 1;
+        }
+        if (settings.has_region && !settings.progressive && !settings.denoise &&
+            !write_frame(frame_output.c_str(), settings.format, settings.use_mmap, samples)) {
+            cerr << "can not write " << frame_output << endl;
+            return 1;
+        }
+        close_time = chrono::steady_clock::now() - close_start;
+        if (settings.heatmap) {
+            string heatmap = frame_path(settings.heatmap, frame, settings.frames);
+            if (!samples.write_heatmap(heatmap.c_str(), anti_aliasing_times)) {
+                cerr << "can not write " << heatmap << endl;
+                return 1;
+            }
+        }
+        if (settings.aov_prefix && !write_aovs(frame_path(settings.aov_prefix, frame, settings.frames), samples)) {
+            return 1;
+        }
+        if (settings.frames > 1) {
+            print_frame_report(frame, time, rebuilt, update_time.count(), scene.bvh, frame_wall.count(), close_time.count());
+        }
+    }
+
+    print_scaling_report(settings, reports, (int)tiles.size() * passes, wall.count());
+    print_bvh_report(scene.bvh, global_stats);
+    print_memory_report(scene, global_stats, wall.count());
+    print_cache_report(global_stats);
+    print_allocation_report(global_stats);
+    print_spawn_report(settings.trace, global_stats);
+    print_light_report(scene, settings.trace, global_stats);
+    // (of the last frame)
+    print_sampling_report(settings, samples, frame_passes);
+    if (settings.frames > 1) {
+        print_animation_report(settings.frames, rebuilds, update_seconds, wall.count());
+    }
+    if (settings.denoise) {
+        print_denoise_report(settings.denoiser, denoise_with, pool.size(), settings.frames, denoise_ms);
+    }
+    print_camera_report(camera, global_stage_stats, reports);
+    print_checkpoint_report(settings, resumed_samples, checkpoints, checkpoint_bytes, checkpoint_ms);
+    if (settings.engine == ENGINE_WAVEFRONT) {
+        print_wavefront_report(global_stage_stats);
+    }
+    if (stream_output) {
+        print_output_report(settings, writer, close_time.count());
+    }
+#ifdef RT_PROFILE
+    if (settings.profile && !write_profile(settings.profile, scene, global_stats)) {
+        return 1;
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,462 @@
+#ifndef RENDERSERVERH
+#define RENDERSERVERH
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "camera.h"
+#include "distributed.h"
+#include "mapped_file.h"
+#include "rng.h"
+#include "sample_buffer.h"
+#include "scene.h"
+#include "scene_io.h"
+#include "tile_pool.h"
+#include "tile_render.h"
+
+//* A long-running render server for short jobs (ray_tracer --serve PORT).
+//* It listens on the loopback interface only and speaks the message framing
+//* of distributed.h. A client (ray_tracer --submit HOST:PORT) sends one
+//* RenderRequest: the tile settings, the camera and the scene, either the
+//* built-in one by its parameters or a scene file on this machine by path.
+//* The server sends back every tile as soon as all of its samples are done
+//* (a MESSAGE_RESULT like a worker's), then a RenderReport.
+//* Scenes stay loaded, BVH built, in an LRU cache keyed by a hash of their
+//* content (the parameters of a built-in scene, the bytes of a file), so a
+//* repeated scene costs one hash instead of a parse and a build. Every
+//* job has its own thread, and all of them share one TilePool: a job
+//* renders a batch of one tile per pool thread at a time, and the batches
+//* of the jobs take turns, so a new job has its first tile after at most
+//* one batch of the others.
+
+#define SERVER_VERSION 2
+// Scenes the cache keeps by default.
+#define SERVER_CACHE_SCENES 8
+// Largest image side and scene path a job may ask for.
+#define SERVER_MAX_SIZE 16384
+#define SERVER_MAX_PATH 4096
+
+//* The scene of a job: built in (random_scene() with these parameters)
+//* when no path follows the request.
+typedef struct SceneRequest {
+    int32_t small_spheres;
+    int32_t lights;
+    int32_t instances;
+    int32_t compact;
+} SceneRequest;
+
+typedef struct RenderRequest {
+    uint32_t version;
+    uint32_t byte_order;
+    // sizeof(TileRenderSettings), to catch clients of an other build
+    uint32_t settings_size;
+    int32_t tile_size;
+    TileRenderSettings settings;
+    CameraWire camera;
+    SceneRequest scene;
+} RenderRequest;
+
+typedef struct RenderReport {
+    // 0 when every tile was sent, else the job failed and the reason follows
+    int32_t status;
+    // the scene came from the cache
+    int32_t cache_hit;
+    // getting the scene, the first tile and the whole job, from the request on
+    double scene_ms;
+    double first_tile_ms;
+    double total_ms;
+} RenderReport;
+
+inline uint64_t content_hash(const char *data, size_t size, uint64_t seed) {
+    //* 64-bit hash of size bytes, 8 at a time through mix64().
+    uint64_t h = mix64(seed ^ (uint64_t)size);
+    size_t words = size / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, data + 8 * i, 8);
+        h = mix64(h ^ word) + 0x9E3779B97F4A7C15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + 8 * words, size - 8 * words);
+    return mix64(h ^ tail);
+}
+
+//* Built scenes by content hash, the least recently used one goes first.
+//* A scene is loaded by the first job that asks for it; jobs asking for it
+//* meanwhile wait for that load instead of doing their own.
+class SceneCache {
+    public:
+        /* constructors */
+        explicit SceneCache(size_t capacity) : capacity(std::max<size_t>(1, capacity)), hits(0), misses(0) {}
+
+        // The scene of key, made by load() on a miss. NULL when it fails.
+        // hit says whether it was there (or being loaded) already.
+        std::shared_ptr<const Scene> get(uint64_t key, const std::function<bool(Scene&)> &load, bool &hit);
+
+        // Scenes in the cache, and the jobs that found or missed theirs.
+        void get_counts(size_t &scenes, unsigned long long &hit_count, unsigned long long &miss_count) {
+            std::lock_guard<std::mutex> guard(lock);
+            scenes = entries.size();
+            hit_count = hits;
+            miss_count = misses;
+        }
+
+    private:
+        typedef std::shared_future<std::shared_ptr<const Scene>> SceneFuture;
+        typedef struct Entry {
+            uint64_t key;
+            // the miss that made it, to tell it from a later entry of key
+            unsigned long long load;
+            SceneFuture scene;
+        } Entry;
+
+        std::mutex lock;
+        // most recently used first
+        std::list<Entry> entries;
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+        size_t capacity;
+        unsigned long long hits;
+        unsigned long long misses;
+};
+
+std::shared_ptr<const Scene> SceneCache::get(uint64_t key, const std::function<bool(Scene&)> &load, bool &hit) {
+    std::unique_lock<std::mutex> guard(lock);
+    std::unordered_map<uint64_t, std::list<Entry>::iterator>::iterator found = index.find(key);
+    if (found != index.end()) {
+        entries.splice(entries.begin(), entries, found->second);
+        SceneFuture scene = found->second->scene;
+        hits++;
+        guard.unlock();
+        hit = true;
+        return scene.get();
+    }
+    std::promise<std::shared_ptr<const Scene>> promise;
+    SceneFuture scene = promise.get_future().share();
+    unsigned long long load_number = ++misses;
+    entries.push_front(Entry{key, load_number, scene});
+    index[key] = entries.begin();
+    while (entries.size() > capacity) {
+        // A job still rendering an evicted scene keeps its own reference.
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+    guard.unlock();
+
+    hit = false;
+    std::shared_ptr<Scene> loaded(new Scene());
+    if (!load(*loaded)) {
+        loaded.reset();
+        guard.lock();
+        found = index.find(key);
+        // A failed load is not kept, the next job tries again.
+        if (found != index.end() && found->second->load == load_number) {
+            entries.erase(found->second);
+            index.erase(found);
+        }
+        guard.unlock();
+    }
+    promise.set_value(loaded);
+    return scene.get();
+}
+
+class RenderServer {
+    public:
+        /* constructors */
+        RenderServer(int threads, const SphereKernels &kernels, size_t cache_scenes)
+            : pool(threads), kernels(kernels), cache(cache_scenes), next_job(0) {}
+
+        // Serve jobs on 127.0.0.1:port. Only returns when it can not listen.
+        bool run(int port);
+
+    private:
+        void serve_client(int descriptor);
+        bool check_request(const RenderRequest &request, const std::string &path, std::string &error) const;
+        std::shared_ptr<const Scene> get_scene(const RenderRequest &request, const std::string &path, bool &hit,
+                                               std::string &error);
+
+        TilePool pool;
+        const SphereKernels &kernels;
+        SceneCache cache;
+        std::atomic<int> next_job;
+};
+
+bool RenderServer::run(int port) {
+#ifdef RT_HAVE_SOCKETS
+    // A client that goes away mid-send is a failed job, not the end of the server.
+    signal(SIGPIPE, SIG_IGN);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "can not listen on 127.0.0.1:" << port << ": " << strerror(errno) << std::endl;
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        return false;
+    }
+    std::cout << "server: " << pool.size() << " threads, " << kernels.name << " kernel, listening on 127.0.0.1:" << port
+              << std::endl;
+    while (true) {
+        int descriptor = accept(listener, NULL, NULL);
+        if (descriptor < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::cerr << "server: accept failed: " << strerror(errno) << std::endl;
+            ::close(listener);
+            return false;
+        }
+        // The server runs until the process ends, and so do the job threads it starts.
+        std::thread(&RenderServer::serve_client, this, descriptor).detach();
+    }
+#else
+    (void)port;
+    std::cerr << "the render server needs sockets, which this build does not have" << std::endl;
+    return false;
+#endif
+}
+
+bool RenderServer::check_request(const RenderRequest &request, const std::string &path, std::string &error) const {
+    const TileRenderSettings &settings = request.settings;
+    if (request.version != SERVER_VERSION || request.byte_order != CLUSTER_BYTE_ORDER ||
+        request.settings_size != sizeof(TileRenderSettings)) {
+        error = "the client speaks another protocol version, byte order or build";
+    } else if (settings.width < 1 || settings.height < 1 || settings.width > SERVER_MAX_SIZE ||
+               settings.height > SERVER_MAX_SIZE || request.tile_size < 1) {
+        error = "bad image or tile size";
+    } else if (settings.samples < 1 || settings.pass_samples < 1 || settings.min_samples < 2 || settings.noise < 0.0) {
+        error = "bad sample counts";
+    } else if ((unsigned)settings.sampler > SAMPLER_BLUE_NOISE || (unsigned)settings.engine > ENGINE_WAVEFRONT ||
+               settings.trace.shadow_rays < 1 || settings.trace.shadow_rays > MAX_SHADOW_RAYS) {
+        error = "bad sampler, engine or shadow rays";
+    } else if (path.empty() && (request.scene.small_spheres < 0 || request.scene.lights < 0 || request.scene.instances < 0)) {
+        error = "bad built-in scene";
+    } else {
+        return true;
+    }
+    return false;
+}
+
+std::shared_ptr<const Scene> RenderServer::get_scene(const RenderRequest &request, const std::string &path, bool &hit,
+                                                     std::string &error) {
+    //* The scene of the request from the cache, loaded and built on a miss.
+    //* A file is hashed from a mapping, and loaded from the same mapping.
+    std::shared_ptr<MappedFile> file;
+    uint64_t key;
+    if (path.empty()) {
+        key = content_hash((const char *)&request.scene, sizeof(request.scene), 1);
+    } else {
+        file.reset(new MappedFile());
+        if (!file->open(path.c_str())) {
+            error = "can not read " + path;
+            return NULL;
+        }
+        key = content_hash(file->data(), file->size(), 2 + (uint64_t)request.scene.compact);
+    }
+    std::shared_ptr<const Scene> scene = cache.get(key, [&](Scene &loaded) {
+        SceneLoadInfo info = {false, false, false};
+        if (path.empty()) {
+            loaded = random_scene(request.scene.small_spheres, SCENE_DEFAULT, request.scene.lights);
+            if (request.scene.instances > 0) {
+                add_random_instances(loaded, request.scene.instances, request.scene.compact != 0);
+            }
+        } else if (!load_scene(file, loaded, info, path.c_str())) {
+            return false;
+        }
+        loaded.bvh.set_kernels(kernels);
+        if (!loaded.motions.empty()) {
+            // Jobs render the scene at time 0, and a mapped scene needs its
+            // sphere list back to get there.
+            if (loaded.spheres.empty()) {
+                loaded.spheres = scene_spheres(loaded);
+                info.prebuilt_bvh = false;
+            }
+            loaded.set_time(0.0f);
+            loaded.motions.clear();
+        }
+        if (!info.prebuilt_bvh) {
+            loaded.build_bvh();
+        } else {
+            loaded.instances.build(loaded.sphere_count());
+        }
+        return !request.scene.compact || loaded.compact();
+    }, hit);
+    if (!scene) {
+        error = "the scene can not be loaded";
+    }
+    return scene;
+}
+
+void RenderServer::serve_client(int descriptor) {
+    //* One job: read the request, get the scene, send the tiles and the report.
+    Connection connection(descriptor);
+    connection.set_timeout(60.0);
+    int job = next_job++;
+    uint32_t type;
+    std::vector<char> payload;
+    RenderRequest request;
+    if (!connection.receive_message(type, payload, sizeof(request) + SERVER_MAX_PATH) || type != MESSAGE_RENDER ||
+        payload.size() < sizeof(request)) {
+        std::cerr << "server: job " << job << " is not a render request" << std::endl;
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    memcpy(&request, payload.data(), sizeof(request));
+    std::string path(payload.data() + sizeof(request), payload.size() - sizeof(request));
+
+    RenderReport report = {0, 0, 0.0, 0.0, 0.0};
+    std::string error;
+    bool hit = false;
+    std::shared_ptr<const Scene> scene;
+    if (check_request(request, path, error)) {
+        scene = get_scene(request, path, hit, error);
+    }
+    report.cache_hit = hit ? 1 : 0;
+    report.scene_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!scene) {
+        std::cerr << "server: job " << job << " failed: " << error << std::endl;
+        report.status = 1;
+        std::vector<char> message(sizeof(report) + error.size());
+        memcpy(message.data(), &report, sizeof(report));
+        memcpy(message.data() + sizeof(report), error.data(), error.size());
+        connection.send_message(MESSAGE_REPORT, message.data(), message.size());
+        return;
+    }
+
+    const TileRenderSettings &settings = request.settings;
+    Camera camera = Camera::from_wire(request.camera);
+    std::vector<Tile> tiles = make_tiles(settings.width, settings.height, request.tile_size);
+    SampleBuffer samples(settings.width, settings.height);
+    std::mutex send_lock;
+    bool connected = true;
+    bool first_sent = false;
+    // One tile per thread and turn, so the other jobs get the pool again soon.
+    size_t batch_size = (size_t)pool.size();
+    for (size_t first = 0; first < tiles.size() && connected; first += batch_size) {
+        std::vector<Tile> batch(tiles.begin() + first, tiles.begin() + std::min(tiles.size(), first + batch_size));
+        pool.render(batch, [&](const Tile &tile) {
+            std::chrono::steady_clock::time_point tile_start = std::chrono::steady_clock::now();
+            while (!render_tile_pass(tile, samples, camera, *scene, settings)) {
+            }
+            std::chrono::duration<double> busy = std::chrono::steady_clock::now() - tile_start;
+
+            TileResultHeader header = {tile.index, 0, busy.count()};
+            std::vector<char> result(sizeof(header) + (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * sizeof(PixelWire));
+            memcpy(result.data(), &header, sizeof(header));
+            PixelWire *wire = (PixelWire *)(result.data() + sizeof(header));
+            for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+                for (int column_index = tile.x0; column_index < tile.x1; column_index++, wire++) {
+                    const PixelSamples &pixel = samples.at(row_index, column_index);
+                    *wire = PixelWire{{pixel.sum.r(), pixel.sum.g(), pixel.sum.b()}, pixel.count,
+                                      pixel.luminance_sum, pixel.luminance_squared_sum};
+                }
+            }
+            std::lock_guard<std::mutex> guard(send_lock);
+            connected = connected && connection.send_message(MESSAGE_RESULT, result.data(), result.size());
+            if (connected && !first_sent) {
+                first_sent = true;
+                report.first_tile_ms =
+                    std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+        });
+    }
+    report.total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (!connected || !connection.send_message(MESSAGE_REPORT, &report, sizeof(report))) {
+        std::cerr << "server: job " << job << " lost its client" << std::endl;
+        return;
+    }
+    size_t cached;
+    unsigned long long hits, misses;
+    cache.get_counts(cached, hits, misses);
+    std::cout << "server: job " << job << ", " << settings.width << "x" << settings.height << " " << settings.samples
+              << " spp, " << (path.empty() ? std::string("built-in scene") : path) << (hit ? " (cached)" : " (loaded)")
+              << " in " << report.scene_ms << " ms, first tile " << report.first_tile_ms << " ms, done "
+              << report.total_ms << " ms; cache " << cached << " scenes, " << hits << " hits, " << misses << " misses"
+              << std::endl;
+}
+
+bool submit_render(const char *address, const RenderRequest &request, const char *scene_path, SampleBuffer &samples,
+                   RenderReport &report, double &first_tile_ms) {
+    //* Send a job to the render server at address and merge its tiles into
+    //* samples. first_tile_ms is the time from the request to the first
+    //* tile, seen here. Return false (and say why) when the job failed.
+#ifdef RT_HAVE_SOCKETS
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    Connection connection;
+    if (!connection.connect_to(address)) {
+        std::cerr << "can not connect to the render server at " << address << std::endl;
+        return false;
+    }
+    std::string path = scene_path ? scene_path : "";
+    std::vector<char> message(sizeof(request) + path.size());
+    memcpy(message.data(), &request, sizeof(request));
+    memcpy(message.data() + sizeof(request), path.data(), path.size());
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!connection.send_message(MESSAGE_RENDER, message.data(), message.size())) {
+        std::cerr << "the render server at " << address << " went away" << std::endl;
+        return false;
+    }
+    std::vector<Tile> tiles = make_tiles(request.settings.width, request.settings.height, request.tile_size);
+    first_tile_ms = 0.0;
+    uint32_t type;
+    std::vector<char> payload;
+    while (connection.receive_message(type, payload)) {
+        if (type == MESSAGE_REPORT && payload.size() >= sizeof(report)) {
+            memcpy(&report, payload.data(), sizeof(report));
+            if (report.status != 0) {
+                std::cerr << "the render server refused the job: "
+                          << std::string(payload.data() + sizeof(report), payload.size() - sizeof(report)) << std::endl;
+                return false;
+            }
+            return true;
+        }
+        TileResultHeader header;
+        if (type != MESSAGE_RESULT || payload.size() < sizeof(header)) {
+            break;
+        }
+        memcpy(&header, payload.data(), sizeof(header));
+        if (header.tile_index < 0 || header.tile_index >= (int)tiles.size()) {
+            break;
+        }
+        const Tile &tile = tiles[header.tile_index];
+        if (payload.size() != sizeof(header) + (size_t)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * sizeof(PixelWire)) {
+            break;
+        }
+        if (first_tile_ms == 0.0) {
+            first_tile_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        const PixelWire *wire = (const PixelWire *)(payload.data() + sizeof(header));
+        for (int row_index = tile.y0; row_index < tile.y1; row_index++) {
+            for (int column_index = tile.x0; column_index < tile.x1; column_index++, wire++) {
+                PixelSamples &pixel = samples.at(row_index, column_index);
+                pixel.sum = Vec3(wire->sum);
+                pixel.count = wire->count;
+                pixel.luminance_sum = wire->luminance_sum;
+                pixel.luminance_squared_sum = wire->luminance_squared_sum;
+                pixel.converged = true;
+            }
+        }
+    }
+    std::cerr << "lost the render server at " << address << std::endl;
+    return false;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef RNGH
+#define RNGH
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+//* Random numbers for the renderer.
+//* Nothing here has hidden global state: every sample builds its own small
+//* generator from (seed, pixel, sample), so the image is the same for any
+//* thread count and tile order.
+
+inline uint64_t mix64(uint64_t x) {
+    //* splitmix64 finalizer, a cheap 64-bit hash.
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline unsigned int hash_combine(unsigned int seed, unsigned int value) {
+    //* Mix value into seed (used to give every ray of a sample its own seed).
+    unsigned int h = seed ^ (value + 0x9E3779B9u + (seed << 6) + (seed >> 2));
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+inline float hash_to_float(unsigned int h) {
+    //* Map a hash to [0, 1).
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+//* PCG32 (O'Neill, pcg-random.org): 64-bit LCG state with a permuted
+//* 32-bit output. The stream selects one of 2^63 independent sequences.
+class Pcg32 {
+    public:
+        /* constructors */
+        explicit Pcg32(uint64_t seed = 0, uint64_t stream = 0) {
+            state = 0;
+            increment = (stream << 1) | 1;
+            next();
+            state += seed;
+            next();
+        }
+
+        unsigned int next() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ULL + increment;
+            unsigned int xorshifted = (unsigned int)(((old >> 18) ^ old) >> 27);
+            unsigned int rotation = (unsigned int)(old >> 59);
+            return (xorshifted >> rotation) | (xorshifted << ((0u - rotation) & 31));
+        }
+
+        float next_float() {
+            //* Uniform in [0, 1) with all 24 bits of the mantissa.
+            return (next() >> 8) * (1.0f / 16777216.0f);
+        }
+
+    private:
+        uint64_t state;
+        uint64_t increment;
+};
+
+inline Pcg32 sample_rng(unsigned int seed, unsigned int pixel_index, unsigned int sample_index) {
+    //* The generator of one sample of one pixel.
+    return Pcg32(mix64(((uint64_t)seed << 32) | pixel_index), sample_index);
+}
+
+/* Low-discrepancy sample positions */
+
+enum Sampler {
+    SAMPLER_RANDOM,
+    SAMPLER_HALTON,
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE
+};
+
+inline bool parse_sampler(const char *name, Sampler &sampler) {
+    const char *names[4] = {"random", "halton", "sobol", "bluenoise"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            sampler = (Sampler)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline float radical_inverse(unsigned int base, unsigned int index) {
+    //* Mirror the digits of index in base around the decimal point.
+    float inverse_base = 1.0f / base;
+    float factor = inverse_base;
+    float result = 0.0f;
+    while (index > 0) {
+        result += (index % base) * factor;
+        index /= base;
+        factor *= inverse_base;
+    }
+    return result;
+}
+
+inline unsigned int reverse_bits(unsigned int x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+    x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+    return x;
+}
+
+inline unsigned int sobol_second_dimension(unsigned int index) {
+    //* Second Sobol dimension (primitive polynomial x + 1): the direction
+    //* numbers are v[i] = v[i - 1] ^ (v[i - 1] >> 1), v[0] = 2^31.
+    unsigned int result = 0;
+    for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+    }
+    return result;
+}
+
+inline float wrap_unit(float x) {
+    //* x mod 1 for x in [0, 2).
+    x = x >= 1.0f ? x - 1.0f : x;
+    // Guard against rounding up to 1.
+    return x < 1.0f ? x : 0.99999994f;
+}
+
+inline void sample_2d(Sampler sampler, unsigned int seed, unsigned int pixel_index, int column_index, int row_index,
+                      unsigned int sample_index, Pcg32 &rng, float &u, float &v) {
+    //* Position of sample sample_index inside the pixel, in [0, 1)^2.
+    //* The random sampler draws it from rng, the generator of the sample.
+    //* The low-discrepancy sets are decorrelated between pixels:
+    //* Halton by a random toroidal shift, Sobol by random digit scrambling
+    //* (keeps it a (0, 2)-sequence), and blue noise shifts Sobol points by
+    //* the R2 sequence over the pixel grid, which spreads the remaining
+    //* error over the image as high-frequency (blue) noise.
+    switch (sampler) {
+        case SAMPLER_HALTON: {
+            Pcg32 shift(mix64(((uint64_t)seed << 32) | pixel_index), 0xFFFFFFFFu);
+            u = wrap_unit(radical_inverse(2, sample_index) + shift.next_float());
+            v = wrap_unit(radical_inverse(3, sample_index) + shift.next_float());
+            return;
+        }
+        case SAMPLER_SOBOL: {
+            Pcg32 scramble(mix64(((uint64_t)seed << 32) | pixel_index), 0xFFFFFFFFu);
+            u = ((reverse_bits(sample_index) ^ scramble.next()) >> 8) * (1.0f / 16777216.0f);
+            v = ((sobol_second_dimension(sample_index) ^ scramble.next()) >> 8) * (1.0f / 16777216.0f);
+            return;
+        }
+        case SAMPLER_BLUE_NOISE: {
+            // R2 over the pixel grid: (x / g + y / g^2, x / g^2 + y / g) mod 1,
+            // g = 1.3247... (the plastic number), offset by the seed.
+            double r_u = column_index * 0.7548776662466927 + row_index * 0.5698402909980532 + hash_to_float(seed);
+            double r_v = column_index * 0.5698402909980532 + row_index * 0.7548776662466927 + hash_to_float(hash_combine(seed, 1));
+            float shift_u = (float)(r_u - floor(r_u));
+            float shift_v = (float)(r_v - floor(r_v));
+            u = wrap_unit((reverse_bits(sample_index) >> 8) * (1.0f / 16777216.0f) + shift_u);
+            v = wrap_unit((sobol_second_dimension(sample_index) >> 8) * (1.0f / 16777216.0f) + shift_v);
+            return;
+        }
+        default:
+            u = rng.next_float();
+            v = rng.next_float();
+            return;
+    }
+}
+
+#endif
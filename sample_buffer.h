@@ -0,0 +1,164 @@
+#ifndef SAMPLEBUFFERH
+#define SAMPLEBUFFERH
+
+#include <math.h>
+#include <fstream>
+#include <vector>
+
+#include "vec3.h"
+
+//* Running state of one pixel: the color sum and the luminance moments for
+//* the noise estimate. The random numbers of a sample only depend on the
+//* seed, the pixel and count, so more samples can be added in a later pass
+//* as if they were taken in one go.
+typedef struct PixelSamples {
+    Vec3 sum;
+    double luminance_sum;
+    double luminance_squared_sum;
+    int count;
+    bool converged;
+} PixelSamples;
+
+//* Sums of the first-hit guides of a pixel's samples (SampleAov in tracer.h),
+//* over the same count as its PixelSamples.
+typedef struct PixelAov {
+    Vec3 albedo;
+    Vec3 normal;
+    float depth;
+} PixelAov;
+
+//* Accumulation buffer of the whole image (row 0 is the bottom row).
+//* The guide sums (aovs) are only kept after enable_aovs().
+class SampleBuffer {
+    public:
+        /* constructors */
+        SampleBuffer(int width, int height) : width(width), height(height), pixels(width * height) {
+            clear();
+        }
+
+        void clear() {
+            //* Drop all samples, for the next frame.
+            for (size_t i = 0; i < pixels.size(); i++) {
+                pixels[i].sum = Vec3(0.0, 0.0, 0.0);
+                pixels[i].luminance_sum = 0.0;
+                pixels[i].luminance_squared_sum = 0.0;
+                pixels[i].count = 0;
+                pixels[i].converged = false;
+            }
+            aovs.assign(aovs.size(), PixelAov{Vec3(0.0, 0.0, 0.0), Vec3(0.0, 0.0, 0.0), 0.0f});
+        }
+
+        void enable_aovs() {
+            aovs.assign(pixels.size(), PixelAov{Vec3(0.0, 0.0, 0.0), Vec3(0.0, 0.0, 0.0), 0.0f});
+        }
+
+        bool has_aovs() const {
+            return !aovs.empty();
+        }
+
+        PixelAov& aov_at(int row_index, int column_index) {
+            return aovs[row_index * width + column_index];
+        }
+
+        const PixelAov& aov_at(int row_index, int column_index) const {
+            return aovs[row_index * width + column_index];
+        }
+
+        PixelSamples& at(int row_index, int column_index) {
+            return pixels[row_index * width + column_index];
+        }
+
+        const PixelSamples& at(int row_index, int column_index) const {
+            return pixels[row_index * width + column_index];
+        }
+
+        Vec3 color(int row_index, int column_index) const {
+            //* Average of the samples so far.
+            const PixelSamples &pixel = at(row_index, column_index);
+            return pixel.count > 0 ? pixel.sum / float(pixel.count) : Vec3(0.0, 0.0, 0.0);
+        }
+
+        void rows_rgb(int y0, int y1, std::vector<float> &rgb) const {
+            //* Colors of the rows [y0, y1) as RGB floats, top row first (the file order).
+            rgb.resize((size_t)(y1 - y0) * width * 3);
+            float *out = rgb.data();
+            for (int row_index = y1 - 1; row_index >= y0; row_index--) {
+                for (int column_index = 0; column_index < width; column_index++) {
+                    Vec3 c = color(row_index, column_index);
+                    *out++ = c.r();
+                    *out++ = c.g();
+                    *out++ = c.b();
+                }
+            }
+        }
+
+        unsigned long long total_samples() const {
+            unsigned long long total = 0;
+            for (size_t i = 0; i < pixels.size(); i++) {
+                total += pixels[i].count;
+            }
+            return total;
+        }
+
+        int unconverged_pixels() const {
+            int count = 0;
+            for (size_t i = 0; i < pixels.size(); i++) {
+                count += pixels[i].converged ? 0 : 1;
+            }
+            return count;
+        }
+
+        bool write_heatmap(const char *path, int max_samples) const;
+
+        int width;
+        int height;
+        std::vector<PixelSamples> pixels;
+        std::vector<PixelAov> aovs;
+};
+
+inline void add_sample(PixelSamples &pixel, const Vec3 &color) {
+    pixel.sum += color;
+    double y = luminance(color);
+    pixel.luminance_sum += y;
+    pixel.luminance_squared_sum += y * y;
+    pixel.count++;
+}
+
+inline double standard_error(const PixelSamples &pixel) {
+    //* Standard error of the mean luminance, the noise left in the pixel.
+    if (pixel.count < 2) {
+        return HUGE_VAL;
+    }
+    double n = pixel.count;
+    double mean = pixel.luminance_sum / n;
+    double variance = (pixel.luminance_squared_sum - n * mean * mean) / (n - 1.0);
+    return sqrt(std::max(0.0, variance) / n);
+}
+
+inline void heat_color(float x, int rgb[3]) {
+    //* The heat map color of x in [0, 1], two linear ramps: blue -> green -> red.
+    rgb[0] = int(255 * std::max(0.0f, 2.0f * x - 1.0f));
+    rgb[1] = int(255 * (1.0f - fabsf(2.0f * x - 1.0f)));
+    rgb[2] = int(255 * std::max(0.0f, 1.0f - 2.0f * x));
+}
+
+bool SampleBuffer::write_heatmap(const char *path, int max_samples) const {
+    //* Write the sample count of every pixel as a PPM, from blue (few
+    //* samples) over green to red (max_samples).
+    std::ofstream file(path, std::ios::out | std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file << "P3\n" << width << " " << height << "\n255\n";
+    for (int row_index = height - 1; row_index >= 0; row_index--) {
+        for (int column_index = 0; column_index < width; column_index++) {
+            float x = max_samples > 0 ? std::min(1.0f, float(at(row_index, column_index).count) / float(max_samples)) : 0.0f;
+            int rgb[3];
+            heat_color(x, rgb);
+            file << rgb[0] << " " << rgb[1] << " " << rgb[2] << "\n";
+        }
+    }
+    return (bool)file;
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef SCENEH
+#define SCENEH
+
+#include <math.h>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "animation.h"
+#include "instancing.h"
+#include "light.h"
+#include "light_tree.h"
+#include "mapped_file.h"
+#include "rng.h"
+#include "sphere.h"
+#include "material.h"
+#include "bvh.h"
+
+//* Everything the tracer needs to know about the world.
+//* Spheres only keep the index of their material, and a hit is resolved to
+//* its Material once, after the closest hit is known.
+//* A scene mapped from a binary file (scene_io.h) has no sphere list: its
+//* BVH and sphere arrays point into the file, which storage keeps open.
+//* A compact scene (compact()) has none either: its spheres are quantized
+//* into the leaves of the BVH. Repeated groups of spheres are instances
+//* (instancing.h), numbered after the spheres of the scene.
+class Scene {
+    public:
+        /* constructors */
+        Scene() {
+            // Material 0 is the default material.
+            materials.push_back(Material());
+        }
+
+        int add_material(const Material &material) {
+            materials.push_back(material);
+            return (int)materials.size() - 1;
+        }
+
+        void add_sphere(const Vec3 &center, float radius, int material_id = 0) {
+            spheres.push_back(Sphere(center, radius, material_id));
+        }
+
+        void add_light(const Light &light) {
+            lights.push_back(light);
+        }
+
+        // Build the acceleration structures: the BVH, the light tree and
+        // the top-level tree of the instances.
+        void build_bvh() {
+            bvh.build(spheres);
+            build_light_tree();
+            instances.build(sphere_count());
+        }
+
+        // Quantize the spheres into the BVH (built already) and drop the
+        // sphere list. Return false when the scene can not be made compact.
+        bool compact() {
+            if (!motions.empty()) {
+                std::cerr << "moving spheres need the sphere list, the scene stays as it is" << std::endl;
+                return false;
+            }
+            if (!bvh.compact()) {
+                return false;
+            }
+            std::vector<Sphere>().swap(spheres);
+            return true;
+        }
+
+        void build_light_tree() {
+            light_tree.build(lights);
+        }
+
+        // Move the spheres that have a motion to where they are at time.
+        void set_time(float time) {
+            for (size_t i = 0; i < motions.size(); i++) {
+                spheres[motions[i].sphere].set_center(motion_center(motions[i], time));
+            }
+        }
+
+        // Follow moved spheres: refit the BVH, or build it again (and
+        // return true) once refitting has made it rebuild_threshold slower.
+        bool update_bvh(float rebuild_threshold) {
+            return bvh.update(spheres, rebuild_threshold);
+        }
+
+        const Material& material_of(const hit_record &record) const {
+            return materials[record.material_id];
+        }
+
+        int sphere_count() const {
+            return spheres.empty() ? bvh.size() : (int)spheres.size();
+        }
+
+        // Spheres with the ones of the instances.
+        long long primitive_count() const {
+            return sphere_count() + instances.sphere_count();
+        }
+
+        // Memory of the geometry in bytes: the sphere list, the BVH and the
+        // instances (the materials are shared and not counted).
+        size_t geometry_bytes() const {
+            return spheres.capacity() * sizeof(Sphere) + bvh.bytes() + instances.bytes();
+        }
+
+        std::vector<Sphere> spheres;
+        std::vector<Material> materials;
+        std::vector<Light> lights;
+        std::vector<SphereMotion> motions;
+        BVH bvh;
+        LightTree light_tree;
+        InstanceSet instances;
+        std::shared_ptr<MappedFile> storage;
+};
+
+enum SceneVariant {
+    // small spheres with random mirror weights (the original scene)
+    SCENE_DEFAULT,
+    // glass small spheres (two secondary rays per hit)
+    SCENE_GLASS,
+    // mirror small spheres
+    SCENE_MIRROR
+};
+
+void add_random_lights(Scene &scene, int count) {
+    //* Sphere and area lights scattered above the scene. Each light is scaled
+    //* so that all of them together light the center of the scene about as
+    //* much as the point light of the original scene.
+    Vec3 target(0.0, 0.0, -2.0);
+    Vec3 tints[4] = {Vec3(1.0, 1.0, 1.0), Vec3(1.0, 0.8, 0.6), Vec3(0.6, 0.8, 1.0), Vec3(1.0, 0.9, 0.8)};
+    Pcg32 rng(1729);
+    for (int i = 0; i < count; i++) {
+        Vec3 position(rng.next_float() * 12.0f - 6.0f, rng.next_float() * 6.0f + 2.0f, rng.next_float() * 8.0f - 6.0f);
+        Vec3 tint = tints[rng.next() % 4];
+        float distance2 = Vec3(position - target).squared_length();
+        if (i % 2 == 0) {
+            float radius = 0.05f + 0.25f * rng.next_float();
+            // Seen from the target, the sphere covers about pi r^2 / d^2 steradians.
+            float scale = distance2 / (float(M_PI) * radius * radius * count);
+            scene.add_light(sphere_light(position, radius, scale * tint));
+        } else {
+            // A square facing down.
+            float size = 0.2f + 0.4f * rng.next_float();
+            float scale = distance2 / (size * size * count);
+            scene.add_light(area_light(position, Vec3(size, 0.0, 0.0), Vec3(0.0, 0.0, size), scale * tint));
+        }
+    }
+}
+
+void add_random_motion(Scene &scene) {
+    //* Make the scene move: the spheres smaller than the ground roll over it
+    //* in random directions, and the three center spheres of the built-in
+    //* scene (when there) take turns hopping, by keyframes.
+    Pcg32 rng(2718);
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+        const Sphere &sphere = scene.spheres[i];
+        if (sphere.get_radius() >= 1.0f) {
+            continue;
+        }
+        SphereMotion motion = {(int)i, sphere.get_center(), Vec3(0.0, 0.0, 0.0), std::vector<SphereKeyframe>()};
+        if (i >= 1 && i <= 3 && sphere.get_radius() == 0.5f) {
+            Vec3 center = sphere.get_center();
+            float start = 0.5f * (i - 1);
+            motion.keyframes.push_back(SphereKeyframe{start, center});
+            motion.keyframes.push_back(SphereKeyframe{start + 0.25f, center + Vec3(0.0, 0.4, 0.0)});
+            motion.keyframes.push_back(SphereKeyframe{start + 0.5f, center});
+        } else {
+            float angle = 2.0f * float(M_PI) * rng.next_float();
+            float speed = 0.2f + 0.3f * rng.next_float();
+            motion.velocity = Vec3(speed * cosf(angle), 0.0, speed * sinf(angle));
+        }
+        scene.motions.push_back(motion);
+    }
+}
+
+void add_random_instances(Scene &scene, int count, bool compact) {
+    //* Scatter count copies of one pile of 64 small spheres over the
+    //* ground, each turned into a little mound by its own scale. The pile
+    //* uses 8 materials of the shared table.
+    //* The top-level tree is built by build_bvh().
+    Vec3 colorlist[8] = {Vec3(0.8, 0.3, 0.3), Vec3(0.3, 0.8, 0.3), Vec3(0.3, 0.3, 0.8),
+                         Vec3(0.8, 0.8, 0.3), Vec3(0.3, 0.8, 0.8), Vec3(0.8, 0.3, 0.8),
+                         Vec3(0.8, 0.8, 0.8), Vec3(0.3, 0.3, 0.3)};
+    int first_material = (int)scene.materials.size();
+    for (int i = 0; i < 8; i++) {
+        scene.add_material(Material(colorlist[i], 0.2f * (i % 3), 0.0));
+    }
+    Pcg32 rng(4242);
+    std::vector<Sphere> pile;
+    for (int i = 0; i < 64; i++) {
+        // Inside the half ball of radius 1 on y = 0, bigger toward the middle.
+        float angle = 2.0f * float(M_PI) * rng.next_float();
+        float distance = sqrtf(rng.next_float());
+        float radius = 0.1f + 0.15f * (1.0f - distance);
+        float height = radius + (1.0f - distance) * 0.6f * rng.next_float();
+        pile.push_back(Sphere(Vec3(distance * cosf(angle), height, distance * sinf(angle)), radius,
+                              first_material + (int)(rng.next() % 8)));
+    }
+    int prototype = scene.instances.add_prototype(pile, compact);
+    for (int i = 0; i < count; i++) {
+        float xr = rng.next_float() * 6.0f - 3.0f;
+        float zr = rng.next_float() * 3.0f - 1.5f;
+        float scale = 0.04f + 0.08f * rng.next_float();
+        scene.instances.add_instance(prototype, Vec3(xr, -0.5f, zr - 2.0f), scale);
+    }
+}
+
+Scene random_scene(int small_spheres = 48, SceneVariant variant = SCENE_DEFAULT, int lights = 0) {
+    //* Generate the scene.
+    //* There is a big sphere as ground.
+    //* And there are three same size spheres in the center.
+    //* And there are some randomly generated small spheres on the ground.
+    //* More than 48 small spheres cover the same ground with smaller spheres,
+    //* so the framing (and the screen area covered) stays the same.
+    //* The scene is lit by the point light of the original tracer, or, with
+    //* lights > 0, by that many random sphere and area lights.
+
+    Scene scene;
+
+    // First sphere is the big sphere as ground (default material 0).
+    scene.add_sphere(Vec3(0.0, -100.5, -2.0), 100.0);
+
+    // The three center spheres.
+    scene.add_sphere(Vec3(0.0, 0.0, -2.0), 0.5, scene.add_material(Material(Vec3(1.0f, 1.0f, 1.0f), 0.0f, 0.9f)));
+    scene.add_sphere(Vec3(1, 0, -1.75), 0.5, scene.add_material(Material(Vec3(1.0f, 1.0f, 1.0f), 0.9f, 0.0f)));
+    scene.add_sphere(Vec3(-1, 0, -2.25), 0.5, scene.add_material(Material(Vec3(1.0f, 0.7f, 0.3f), 0.0f, 0.0f)));
+
+    Vec3 colorlist[8] = {Vec3(0.8, 0.3, 0.3), Vec3(0.3, 0.8, 0.3), Vec3(0.3, 0.3, 0.8),
+                         Vec3(0.8, 0.8, 0.3), Vec3(0.3, 0.8, 0.8), Vec3(0.8, 0.3, 0.8),
+                         Vec3(0.8, 0.8, 0.8), Vec3(0.3, 0.3, 0.3)};
+
+    double radius = small_spheres > 48 ? 0.1 * sqrt(48.0 / small_spheres) : 0.1;
+    scene.spheres.reserve(scene.spheres.size() + small_spheres);
+    scene.materials.reserve(scene.materials.size() + small_spheres);
+    // A fixed generator, so the scene does not depend on the C library's rand().
+    Pcg32 rng(819);
+    for (int i = 0; i < small_spheres; i++) {
+        float xr = rng.next_float() * 6.0f - 3.0f;
+        float zr = rng.next_float() * 3.0f - 1.5f;
+        int cindex = rng.next() % 8;
+        float rand_reflec = rng.next_float();
+        // float rand_refrac = rng.next_float();
+        // scene.add_sphere(Vec3(xr, -0.4, zr - 2), 0.1, scene.add_material(Material(colorlist[cindex], rand_reflec, rand_refrac)));
+        Material material(colorlist[cindex], rand_reflec, 0.0);
+        if (variant == SCENE_GLASS) {
+            material = Material(colorlist[cindex], rand_reflec, 0.9);
+        } else if (variant == SCENE_MIRROR) {
+            material = Material(colorlist[cindex], 0.9, 0.0);
+        }
+        scene.add_sphere(Vec3(xr, -0.5 + radius, zr - 2), radius, scene.add_material(material));
+    }
+
+    if (lights > 0) {
+        add_random_lights(scene, lights);
+    } else {
+        scene.add_light(default_light());
+    }
+
+    return scene;
+}
+
+#endif
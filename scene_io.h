@@ -0,0 +1,605 @@
+#ifndef SCENEIOH
+#define SCENEIOH
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mapped_file.h"
+#include "scene.h"
+
+//* Scene files.
+//*
+//* The text format is for writing scenes by hand, one statement per line:
+//*     # comment
+//*     material NAME R G B REFLECT TRANSMIT
+//*     sphere X Y Z RADIUS [MATERIAL]
+//*     light point X Y Z R G B
+//*     light sphere X Y Z RADIUS R G B
+//*     light area X Y Z UX UY UZ VX VY VZ R G B
+//*     velocity SPHERE VX VY VZ
+//*     keyframe SPHERE TIME X Y Z
+//* A material has to be defined before the spheres that use it, and the
+//* material "default" always exists. A scene without lights is lit by the
+//* point light of the original tracer. SPHERE is the index of a sphere
+//* defined above (from 0), which then moves (animation.h): with a velocity,
+//* or through its keyframes, given in time order.
+//*
+//* The binary format is the scene in the layout the renderer uses, so it is
+//* memory-mapped and used in place: the sphere SoA arrays (in BVH leaf
+//* order when the file has a tree), the deduplicated material table,
+//* optionally the BVH nodes, and the lights. It is written in the byte
+//* order of the machine and refused on a machine of the other byte order.
+//* Version 1 files (without lights) are still read. Motion is only kept in
+//* the text format.
+
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 2
+// the header of version 1 ends before light_count
+#define SCENE_FILE_V1_HEADER 80
+#define SCENE_FILE_BYTE_ORDER 0x01020304u
+// Every section starts on a cache line.
+#define SCENE_FILE_ALIGNMENT 64
+// The file has BVH nodes, and the sphere arrays are in their leaf order.
+#define SCENE_FILE_HAS_BVH 1
+
+typedef struct SceneFileHeader {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t sphere_count;
+    // entries of every sphere array (sphere_count + SOA_PADDING, rounded up to the alignment)
+    uint32_t array_stride;
+    uint32_t material_count;
+    uint32_t node_count;
+    // build statistics of the tree
+    int32_t leaves;
+    int32_t max_depth;
+    float sah_cost;
+    // center_x, center_y, center_z, radius (float), material_id, scene_index (int32)
+    uint64_t sphere_offset;
+    uint64_t material_offset;
+    uint64_t node_offset;
+    uint64_t file_size;
+    // version 2
+    uint32_t light_count;
+    uint32_t reserved;
+    uint64_t light_offset;
+} SceneFileHeader;
+
+typedef struct SceneFileMaterial {
+    float kd[3];
+    float w_r;
+    float w_t;
+} SceneFileMaterial;
+
+typedef struct SceneFileLight {
+    // a LightType
+    uint32_t type;
+    float position[3];
+    float edge_u[3];
+    float edge_v[3];
+    float radius;
+    float emission[3];
+} SceneFileLight;
+
+static_assert(sizeof(SceneFileHeader) == 96, "the header layout is part of the file format");
+static_assert(sizeof(SceneFileMaterial) == 20, "the material layout is part of the file format");
+static_assert(sizeof(SceneFileLight) == 56, "the light layout is part of the file format");
+static_assert(sizeof(BVHNode) == 32, "the node layout is part of the file format");
+
+typedef struct SceneLoadInfo {
+    bool binary;
+    bool mapped;
+    // The BVH came with the file, the scene needs no build_bvh().
+    bool prebuilt_bvh;
+} SceneLoadInfo;
+
+inline uint64_t align_offset(uint64_t offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+std::vector<Sphere> scene_spheres(const Scene &scene) {
+    //* The spheres in scene order. A mapped or compact scene has no sphere
+    //* list, so it is rebuilt from the leaves of its tree.
+    if (!scene.spheres.empty()) {
+        return scene.spheres;
+    }
+    std::vector<Sphere> leaf_spheres = scene.bvh.leaf_spheres();
+    std::vector<Sphere> spheres(leaf_spheres.size());
+    for (size_t i = 0; i < leaf_spheres.size(); i++) {
+        spheres[scene.bvh.scene_index((int)i)] = leaf_spheres[i];
+    }
+    return spheres;
+}
+
+inline const char* skip_blanks(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+inline bool read_word(const char *&p, std::string &word) {
+    //* Read the next word of the line into word.
+    p = skip_blanks(p);
+    const char *start = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#') {
+        p++;
+    }
+    word.assign(start, p);
+    return p > start;
+}
+
+inline bool read_float(const char *&p, float &value) {
+    //* Read the next number of the line (strtof would go on to the next line).
+    p = skip_blanks(p);
+    if (*p == '\n' || *p == '#') {
+        return false;
+    }
+    char *end;
+    value = strtof(p, &end);
+    if (end == p) {
+        return false;
+    }
+    p = end;
+    return true;
+}
+
+bool parse_scene_text(const char *text, Scene &scene, const char *path) {
+    //* Parse the text format. Report the first bad line and return false.
+    scene = Scene();
+    std::unordered_map<std::string, int> material_ids;
+    material_ids["default"] = 0;
+
+    std::string keyword, name;
+    int line_number = 0;
+    const char *p = text;
+    while (*p) {
+        line_number++;
+        const char *line = p;
+        bool ok = true;
+        if (read_word(p, keyword)) {
+            float values[13];
+            if (keyword == "material") {
+                ok = read_word(p, name);
+                for (int i = 0; ok && i < 5; i++) {
+                    ok = read_float(p, values[i]);
+                }
+                if (ok) {
+                    material_ids[name] = scene.add_material(Material(Vec3(values[0], values[1], values[2]), values[3], values[4]));
+                }
+            } else if (keyword == "sphere") {
+                for (int i = 0; ok && i < 4; i++) {
+                    ok = read_float(p, values[i]);
+                }
+                int material_id = 0;
+                if (ok && read_word(p, name)) {
+                    std::unordered_map<std::string, int>::const_iterator found = material_ids.find(name);
+                    if (found == material_ids.end()) {
+                        std::cerr << path << ":" << line_number << ": unknown material " << name << std::endl;
+                        return false;
+                    }
+                    material_id = found->second;
+                }
+                if (ok) {
+                    scene.add_sphere(Vec3(values[0], values[1], values[2]), values[3], material_id);
+                }
+            } else if (keyword == "velocity" || keyword == "keyframe") {
+                bool keyframe = keyword == "keyframe";
+                int count = keyframe ? 5 : 4;
+                for (int i = 0; ok && i < count; i++) {
+                    ok = read_float(p, values[i]);
+                }
+                int sphere = (int)values[0];
+                ok = ok && sphere == values[0] && sphere >= 0 && sphere < (int)scene.spheres.size();
+                SphereMotion *motion = NULL;
+                for (size_t i = 0; ok && i < scene.motions.size() && !motion; i++) {
+                    motion = scene.motions[i].sphere == sphere ? &scene.motions[i] : NULL;
+                }
+                if (ok && !motion) {
+                    scene.motions.push_back(SphereMotion{sphere, scene.spheres[sphere].get_center(), Vec3(0.0, 0.0, 0.0),
+                                                         std::vector<SphereKeyframe>()});
+                    motion = &scene.motions.back();
+                }
+                if (ok && keyframe) {
+                    ok = motion->keyframes.empty() || motion->keyframes.back().time < values[1];
+                    motion->keyframes.push_back(SphereKeyframe{values[1], Vec3(values[2], values[3], values[4])});
+                } else if (ok) {
+                    motion->velocity = Vec3(values[1], values[2], values[3]);
+                }
+            } else if (keyword == "light") {
+                // point: position, color; sphere: center, radius, color;
+                // area: corner, edge u, edge v, color
+                ok = read_word(p, name);
+                int count = name == "point" ? 6 : name == "sphere" ? 7 : name == "area" ? 12 : 0;
+                ok = ok && count > 0;
+                for (int i = 0; ok && i < count; i++) {
+                    ok = read_float(p, values[i]);
+                }
+                if (ok) {
+                    Vec3 position(values[0], values[1], values[2]);
+                    Vec3 color(values[count - 3], values[count - 2], values[count - 1]);
+                    if (name == "point") {
+                        scene.add_light(point_light(position, color));
+                    } else if (name == "sphere") {
+                        scene.add_light(sphere_light(position, values[3], color));
+                    } else {
+                        scene.add_light(area_light(position, Vec3(values[3], values[4], values[5]),
+                                                   Vec3(values[6], values[7], values[8]), color));
+                    }
+                }
+            } else {
+                ok = false;
+            }
+        }
+        // Only a comment may follow.
+        p = skip_blanks(p);
+        if (!ok || (*p && *p != '\n' && *p != '#')) {
+            std::cerr << path << ":" << line_number << ": can not read \"" << std::string(line, strcspn(line, "\r\n"))
+                      << "\"" << std::endl;
+            return false;
+        }
+        p += strcspn(p, "\n");
+        if (*p) {
+            p++;
+        }
+    }
+    if (scene.lights.empty()) {
+        scene.add_light(default_light());
+    }
+    return true;
+}
+
+inline bool section_fits(uint64_t offset, uint64_t bytes, uint64_t size) {
+    //* Whether [offset, offset + bytes) is inside a file of size bytes, an
+    //* aligned section. (offset + bytes itself may wrap around.)
+    return offset % SCENE_FILE_ALIGNMENT == 0 && bytes <= size && offset <= size - bytes;
+}
+
+bool scene_binary_in_range(const SceneFileHeader &header, const int *ints, const BVHNode *nodes, bool has_bvh) {
+    //* Whether the indices of a binary scene stay in their arrays: the
+    //* material of every sphere, and with a tree the scene index of every
+    //* sphere, the children of every node (after the node, so the tree has
+    //* no cycles) and the spheres of every leaf. One pass over the ints and
+    //* the nodes, the floats are not read.
+    if (header.sphere_count > INT_MAX || header.node_count > INT_MAX) {
+        return false;
+    }
+    int count = (int)header.sphere_count;
+    int node_count = has_bvh ? (int)header.node_count : 0;
+    const int *scene_indices = ints + (size_t)header.array_stride;
+    for (int i = 0; i < count; i++) {
+        if (ints[i] < 0 || (uint32_t)ints[i] >= header.material_count) {
+            return false;
+        }
+        if (has_bvh && (scene_indices[i] < 0 || scene_indices[i] >= count)) {
+            return false;
+        }
+    }
+    for (int node_index = 0; node_index < node_count; node_index++) {
+        const BVHNode &node = nodes[node_index];
+        bool sound = node.count > 0 ? node.offset >= 0 && node.offset <= count - node.count
+                                    : node.count == 0 && node_index + 1 < node_count &&
+                                      node.offset > node_index && node.offset < node_count;
+        if (!sound) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool map_scene_binary(const std::shared_ptr<MappedFile> &file, Scene &scene, SceneLoadInfo &info, const char *path) {
+    //* Use a mapped binary scene in place. The floats of the spheres are not
+    //* read here, but every index in the file is checked before it is used
+    //* (scene_binary_in_range()); the file may come from the network.
+    const char *data = file->data();
+    size_t size = file->size();
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    if (size < SCENE_FILE_V1_HEADER) {
+        std::cerr << path << ": not a scene file" << std::endl;
+        return false;
+    }
+    memcpy(&header, data, SCENE_FILE_V1_HEADER);
+    if (header.byte_order != SCENE_FILE_BYTE_ORDER) {
+        std::cerr << path << ": the scene was written on a machine of the other byte order" << std::endl;
+        return false;
+    }
+    if (header.version != 1 && header.version != SCENE_FILE_VERSION) {
+        std::cerr << path << ": scene file version " << header.version << ", this build reads 1 to " << SCENE_FILE_VERSION << std::endl;
+        return false;
+    }
+    if (header.version >= 2 && size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+    }
+    bool has_bvh = (header.flags & SCENE_FILE_HAS_BVH) != 0;
+    uint64_t sphere_bytes = 6ull * header.array_stride * 4;
+    uint64_t material_bytes = (uint64_t)header.material_count * sizeof(SceneFileMaterial);
+    uint64_t node_bytes = (uint64_t)header.node_count * sizeof(BVHNode);
+    uint64_t light_bytes = (uint64_t)header.light_count * sizeof(SceneFileLight);
+    bool fits = header.file_size == size && header.array_stride >= (uint64_t)header.sphere_count + SOA_PADDING &&
+                section_fits(header.sphere_offset, sphere_bytes, size) &&
+                section_fits(header.material_offset, material_bytes, size) &&
+                section_fits(header.node_offset, node_bytes, size) &&
+                section_fits(header.light_offset, light_bytes, size) &&
+                header.material_count > 0 && (!has_bvh || header.sphere_count == 0 || header.node_count > 0);
+    if (!fits) {
+        std::cerr << path << ": the scene file is truncated or broken" << std::endl;
+        return false;
+    }
+    const int *sphere_ints = (const int *)(data + header.sphere_offset + 4 * sizeof(float) * header.array_stride);
+    if (!scene_binary_in_range(header, sphere_ints, (const BVHNode *)(data + header.node_offset), has_bvh)) {
+        std::cerr << path << ": the scene file has an index out of range" << std::endl;
+        return false;
+    }
+
+    scene = Scene();
+    scene.materials.clear();
+    scene.materials.reserve(header.material_count);
+    const SceneFileMaterial *materials = (const SceneFileMaterial *)(data + header.material_offset);
+    for (uint32_t i = 0; i < header.material_count; i++) {
+        scene.materials.push_back(Material(Vec3(materials[i].kd[0], materials[i].kd[1], materials[i].kd[2]),
+                                           materials[i].w_r, materials[i].w_t));
+    }
+    const SceneFileLight *lights = (const SceneFileLight *)(data + header.light_offset);
+    for (uint32_t i = 0; i < header.light_count; i++) {
+        if (lights[i].type > LIGHT_AREA) {
+            std::cerr << path << ": unknown light type " << lights[i].type << std::endl;
+            return false;
+        }
+        Light light = {(LightType)lights[i].type, Vec3(lights[i].position), Vec3(lights[i].edge_u), Vec3(lights[i].edge_v),
+                       lights[i].radius, Vec3(lights[i].emission)};
+        scene.add_light(light);
+    }
+    if (scene.lights.empty()) {
+        scene.add_light(default_light());
+    }
+
+    const float *floats = (const float *)(data + header.sphere_offset);
+    const int *ints = (const int *)(floats + 4 * (size_t)header.array_stride);
+    size_t stride = header.array_stride;
+    int count = (int)header.sphere_count;
+    if (has_bvh) {
+        SphereSoA soa;
+        soa.attach(count, floats, floats + stride, floats + 2 * stride, floats + 3 * stride, ints, ints + stride);
+        BVHBuildStats stats = {count, (int)header.node_count, header.leaves, header.max_depth, header.sah_cost, 0.0};
+        scene.bvh.attach((const BVHNode *)(data + header.node_offset), (int)header.node_count, soa, stats);
+        // The scene keeps the file mapped as long as it uses it.
+        scene.storage = file;
+        scene.build_light_tree();
+    } else {
+        // Spheres in scene order, the tree is built after loading.
+        scene.spheres.reserve(count);
+        for (int i = 0; i < count; i++) {
+            scene.add_sphere(Vec3(floats[i], floats[stride + i], floats[2 * stride + i]), floats[3 * stride + i], ints[i]);
+        }
+    }
+    info.prebuilt_bvh = has_bvh;
+    return true;
+}
+
+bool load_scene(const std::shared_ptr<MappedFile> &file, Scene &scene, SceneLoadInfo &info, const char *path) {
+    //* Load a text or a binary scene from an opened file; the magic number
+    //* tells them apart. Return false (and say why) when it can not be used.
+    info = SceneLoadInfo{false, false, false};
+    if (file->size() >= sizeof(SCENE_FILE_MAGIC) && memcmp(file->data(), SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) == 0) {
+        info.binary = true;
+        info.mapped = file->mapped();
+        return map_scene_binary(file, scene, info, path);
+    }
+    std::string text(file->data(), file->size());
+    return parse_scene_text(text.c_str(), scene, path);
+}
+
+bool load_scene(const char *path, Scene &scene, SceneLoadInfo &info) {
+    info = SceneLoadInfo{false, false, false};
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(path)) {
+        std::cerr << "can not read " << path << std::endl;
+        return false;
+    }
+    return load_scene(file, scene, info, path);
+}
+
+bool save_scene_text(const Scene &scene, const char *path) {
+    //* Write the scene in the text format. Materials are named m<index>.
+    std::ofstream file(path);
+    file.precision(9);
+    file << "# " << scene.sphere_count() << " spheres, " << scene.materials.size() - 1 << " materials, "
+         << scene.lights.size() << " lights" << std::endl;
+    for (size_t i = 1; i < scene.materials.size(); i++) {
+        const Material &material = scene.materials[i];
+        Vec3 kd = material.get_kd();
+        file << "material m" << i << " " << kd.r() << " " << kd.g() << " " << kd.b() << " "
+             << material.get_wr() << " " << material.get_wt() << "\n";
+    }
+    std::vector<Sphere> spheres = scene_spheres(scene);
+    for (size_t i = 0; i < spheres.size(); i++) {
+        Vec3 center = spheres[i].get_center();
+        file << "sphere " << center.x() << " " << center.y() << " " << center.z() << " " << spheres[i].get_radius();
+        if (spheres[i].get_material_id() == 0) {
+            file << "\n";
+        } else {
+            file << " m" << spheres[i].get_material_id() << "\n";
+        }
+    }
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        const Light &light = scene.lights[i];
+        const Vec3 &p = light.position;
+        file << "light ";
+        if (light.type == LIGHT_POINT) {
+            file << "point " << p.x() << " " << p.y() << " " << p.z();
+        } else if (light.type == LIGHT_SPHERE) {
+            file << "sphere " << p.x() << " " << p.y() << " " << p.z() << " " << light.radius;
+        } else {
+            file << "area " << p.x() << " " << p.y() << " " << p.z() << " " << light.edge_u.x() << " " << light.edge_u.y() << " "
+                 << light.edge_u.z() << " " << light.edge_v.x() << " " << light.edge_v.y() << " " << light.edge_v.z();
+        }
+        file << " " << light.emission.r() << " " << light.emission.g() << " " << light.emission.b() << "\n";
+    }
+    for (size_t i = 0; i < scene.motions.size(); i++) {
+        const SphereMotion &motion = scene.motions[i];
+        if (motion.keyframes.empty()) {
+            file << "velocity " << motion.sphere << " " << motion.velocity.x() << " " << motion.velocity.y() << " "
+                 << motion.velocity.z() << "\n";
+        }
+        for (size_t k = 0; k < motion.keyframes.size(); k++) {
+            const SphereKeyframe &key = motion.keyframes[k];
+            file << "keyframe " << motion.sphere << " " << key.time << " " << key.center.x() << " " << key.center.y() << " "
+                 << key.center.z() << "\n";
+        }
+    }
+    return (bool)file;
+}
+
+bool write_scene_binary(const Scene &scene, std::ostream &file, bool with_bvh) {
+    //* Write the binary format. Equal materials are stored once.
+    //* with_bvh stores the built tree of the scene (build_bvh() first).
+    if (with_bvh && scene.sphere_count() > 0 && scene.bvh.get_node_count() == 0) {
+        std::cerr << "the scene has no BVH to save" << std::endl;
+        return false;
+    }
+
+    // Deduplicate the materials on their bits; material 0 stays the default.
+    std::vector<int> material_map(scene.materials.size());
+    std::vector<SceneFileMaterial> materials;
+    std::unordered_map<std::string, int> material_index;
+    for (size_t i = 0; i < scene.materials.size(); i++) {
+        Vec3 kd = scene.materials[i].get_kd();
+        SceneFileMaterial material = {{kd.r(), kd.g(), kd.b()}, scene.materials[i].get_wr(), scene.materials[i].get_wt()};
+        std::string key((const char *)&material, sizeof(material));
+        std::unordered_map<std::string, int>::const_iterator found = material_index.find(key);
+        if (found == material_index.end()) {
+            found = material_index.insert(std::make_pair(key, (int)materials.size())).first;
+            materials.push_back(material);
+        }
+        material_map[i] = found->second;
+    }
+
+    // The sphere arrays, in leaf order with the tree, in scene order without.
+    int count = scene.sphere_count();
+    size_t stride = (size_t)align_offset((uint64_t)(count + SOA_PADDING) * 4) / 4;
+    std::vector<float> floats(4 * stride, 0.0f);
+    std::vector<int> ints(2 * stride, 0);
+    std::fill(ints.begin() + stride, ints.end(), -1);
+    if (with_bvh) {
+        // A compact tree is stored with its decoded spheres.
+        std::vector<Sphere> spheres = scene.bvh.leaf_spheres();
+        for (int i = 0; i < count; i++) {
+            Vec3 center = spheres[i].get_center();
+            floats[i] = center.x();
+            floats[stride + i] = center.y();
+            floats[2 * stride + i] = center.z();
+            floats[3 * stride + i] = spheres[i].get_radius();
+            ints[i] = material_map[spheres[i].get_material_id()];
+            ints[stride + i] = scene.bvh.scene_index(i);
+        }
+    } else {
+        std::vector<Sphere> spheres = scene_spheres(scene);
+        for (int i = 0; i < count; i++) {
+            Vec3 center = spheres[i].get_center();
+            floats[i] = center.x();
+            floats[stride + i] = center.y();
+            floats[2 * stride + i] = center.z();
+            floats[3 * stride + i] = spheres[i].get_radius();
+            ints[i] = material_map[spheres[i].get_material_id()];
+            ints[stride + i] = i;
+        }
+    }
+
+    std::vector<SceneFileLight> lights(scene.lights.size());
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        const Light &light = scene.lights[i];
+        SceneFileLight &stored = lights[i];
+        stored.type = (uint32_t)light.type;
+        for (int axis = 0; axis < 3; axis++) {
+            stored.position[axis] = light.position[axis];
+            stored.edge_u[axis] = light.edge_u[axis];
+            stored.edge_v[axis] = light.edge_v[axis];
+            stored.emission[axis] = light.emission[axis];
+        }
+        stored.radius = light.radius;
+    }
+
+    SceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC));
+    header.byte_order = SCENE_FILE_BYTE_ORDER;
+    header.version = SCENE_FILE_VERSION;
+    header.flags = with_bvh ? SCENE_FILE_HAS_BVH : 0;
+    header.sphere_count = (uint32_t)count;
+    header.array_stride = (uint32_t)stride;
+    header.material_count = (uint32_t)materials.size();
+    header.node_count = with_bvh ? (uint32_t)scene.bvh.get_node_count() : 0;
+    if (with_bvh) {
+        const BVHBuildStats &stats = scene.bvh.get_build_stats();
+        header.leaves = stats.leaves;
+        header.max_depth = stats.max_depth;
+        header.sah_cost = stats.sah_cost;
+    }
+    header.sphere_offset = align_offset(sizeof(header));
+    header.material_offset = align_offset(header.sphere_offset + 6 * stride * 4);
+    header.node_offset = align_offset(header.material_offset + materials.size() * sizeof(SceneFileMaterial));
+    header.light_count = (uint32_t)lights.size();
+    header.light_offset = align_offset(header.node_offset + header.node_count * sizeof(BVHNode));
+    header.file_size = header.light_offset + lights.size() * sizeof(SceneFileLight);
+
+    std::vector<char> padding(SCENE_FILE_ALIGNMENT, 0);
+    file.write((const char *)&header, sizeof(header));
+    file.write(padding.data(), header.sphere_offset - sizeof(header));
+    file.write((const char *)floats.data(), floats.size() * sizeof(float));
+    file.write((const char *)ints.data(), ints.size() * sizeof(int));
+    file.write(padding.data(), header.material_offset - (header.sphere_offset + 6 * stride * 4));
+    file.write((const char *)materials.data(), materials.size() * sizeof(SceneFileMaterial));
+    file.write(padding.data(), header.node_offset - (header.material_offset + materials.size() * sizeof(SceneFileMaterial)));
+    if (header.node_count > 0) {
+        file.write((const char *)scene.bvh.get_nodes(), header.node_count * sizeof(BVHNode));
+    }
+    file.write(padding.data(), header.light_offset - (header.node_offset + header.node_count * sizeof(BVHNode)));
+    file.write((const char *)lights.data(), lights.size() * sizeof(SceneFileLight));
+    return (bool)file;
+}
+
+bool save_scene_binary(const Scene &scene, const char *path, bool with_bvh) {
+    if (!scene.motions.empty()) {
+        std::cerr << "the binary scene format has no motion, " << path << " stays still (save a .scene to keep it)" << std::endl;
+    }
+    std::ofstream file(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    return write_scene_binary(scene, file, with_bvh);
+}
+
+bool read_scene_binary(const char *data, size_t size, Scene &scene, SceneLoadInfo &info, const char *name) {
+    //* Use a binary scene that is in memory (received from somewhere), like
+    //* a mapped file. The scene keeps its own copy.
+    info = SceneLoadInfo{true, false, false};
+    std::shared_ptr<MappedFile> file(new MappedFile());
+    file->assign(data, size);
+    if (size < sizeof(SCENE_FILE_MAGIC) || memcmp(data, SCENE_FILE_MAGIC, sizeof(SCENE_FILE_MAGIC)) != 0) {
+        std::cerr << name << ": not a scene file" << std::endl;
+        return false;
+    }
+    return map_scene_binary(file, scene, info, name);
+}
+
+bool save_scene(const Scene &scene, const char *path, bool with_bvh) {
+    //* Write the text format for a .scene file, the binary format otherwise.
+    if (!scene.instances.empty()) {
+        std::cerr << "the scene formats have no instances, " << path << " only gets the spheres of the scene" << std::endl;
+    }
+    size_t length = strlen(path);
+    if (length >= 6 && strcmp(path + length - 6, ".scene") == 0) {
+        return save_scene_text(scene, path);
+    }
+    return save_scene_binary(scene, path, with_bvh);
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SPHERECOMPACTH
+#define SPHERECOMPACTH
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "sphere.h"
+#include "sphere_soa.h"
+
+// Spheres in one leaf of a compact tree, the widest kernel tests them at once.
+#define COMPACT_LEAF_CAPACITY 16
+// Steps of a quantized coordinate over the box of its leaf.
+#define COMPACT_STEPS 65535.0f
+
+//* A sphere in 12 bytes: the center in 16-bit steps of the box of its BVH
+//* leaf on each axis, the radius in steps of the longest side of that box,
+//* and the index of its material.
+typedef struct CompactSphere {
+    uint16_t x, y, z;
+    uint16_t radius;
+    uint32_t material_id;
+} CompactSphere;
+
+//* Float SoA arrays for the spheres of one leaf, decoded from the compact
+//* storage, so the SIMD kernels can test them as they are. Each thread
+//* keeps one; the arrays are padded like the ones of a SphereSoA.
+class LeafSoA {
+    public:
+        /* constructors */
+        LeafSoA() {
+            std::fill(center_x, center_x + LEAF_SOA_SIZE, 0.0f);
+            std::fill(center_y, center_y + LEAF_SOA_SIZE, 0.0f);
+            std::fill(center_z, center_z + LEAF_SOA_SIZE, 0.0f);
+            std::fill(radius, radius + LEAF_SOA_SIZE, 0.0f);
+            std::fill(material_id, material_id + LEAF_SOA_SIZE, 0);
+            std::fill(scene_index, scene_index + LEAF_SOA_SIZE, -1);
+            soa.attach(0, center_x, center_y, center_z, radius, material_id, scene_index);
+        }
+        // soa points into this object.
+        LeafSoA(const LeafSoA &other) = delete;
+        LeafSoA& operator=(const LeafSoA &other) = delete;
+
+        static const int LEAF_SOA_SIZE = COMPACT_LEAF_CAPACITY + SOA_PADDING;
+
+        float center_x[LEAF_SOA_SIZE];
+        float center_y[LEAF_SOA_SIZE];
+        float center_z[LEAF_SOA_SIZE];
+        float radius[LEAF_SOA_SIZE];
+        int material_id[LEAF_SOA_SIZE];
+        int scene_index[LEAF_SOA_SIZE];
+        SphereSoA soa;
+};
+
+//* The spheres of a BVH in leaf order, quantized against the box of their
+//* leaf. A sphere is numbered by its place in that order.
+//* A center moves by at most half a step of its axis; the radius is rounded
+//* down to keep the decoded sphere inside the box, so the boxes of the tree
+//* stay valid and every box test stays conservative.
+class CompactSpheres {
+    public:
+        // Make room for count spheres.
+        void reset(int count) {
+            spheres.assign(count, CompactSphere());
+        }
+
+        // Quantize the spheres soa[first, first + count), one leaf with the
+        // box lower, upper, to the same places.
+        void quantize(const float *lower, const float *upper, int first, int count, const SphereSoA &soa);
+
+        // Decode the spheres first, first + count (one leaf with the box
+        // lower, upper) into leaf, numbered from first.
+        void decode(const float *lower, const float *upper, int first, int count, LeafSoA &leaf) const;
+
+        // Decode one sphere of the leaf with the box lower, upper.
+        Sphere decode_sphere(const float *lower, const float *upper, int index) const;
+
+        void clear() {
+            spheres.clear();
+            spheres.shrink_to_fit();
+        }
+
+        bool empty() const {
+            return spheres.empty();
+        }
+
+        int size() const {
+            return (int)spheres.size();
+        }
+
+        size_t bytes() const {
+            return spheres.capacity() * sizeof(CompactSphere);
+        }
+
+    private:
+        std::vector<CompactSphere> spheres;
+};
+
+inline void leaf_steps(const float *lower, const float *upper, float step[3], float &radius_step) {
+    //* Size of one quantization step on each axis and for the radius.
+    float longest = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = upper[axis] - lower[axis];
+        step[axis] = extent / COMPACT_STEPS;
+        longest = std::max(longest, extent);
+    }
+    radius_step = longest / COMPACT_STEPS;
+}
+
+void CompactSpheres::quantize(const float *lower, const float *upper, int first, int count, const SphereSoA &soa) {
+    float step[3], radius_step;
+    leaf_steps(lower, upper, step, radius_step);
+    for (int i = first; i < first + count; i++) {
+        const float center[3] = {soa.center_x[i], soa.center_y[i], soa.center_z[i]};
+        uint16_t q[3];
+        float room = soa.radius[i];
+        for (int axis = 0; axis < 3; axis++) {
+            float steps = step[axis] > 0.0f ? (center[axis] - lower[axis]) / step[axis] : 0.0f;
+            q[axis] = (uint16_t)std::min(COMPACT_STEPS, std::max(0.0f, floorf(steps + 0.5f)));
+            // The decoded center, with the same arithmetic as decode().
+            float decoded = lower[axis] + q[axis] * step[axis];
+            room = std::min(room, std::min(decoded - lower[axis], upper[axis] - decoded));
+        }
+        room = std::max(room, 0.0f);
+        uint16_t qr = 0;
+        if (radius_step > 0.0f) {
+            qr = (uint16_t)std::min(COMPACT_STEPS, floorf(room / radius_step));
+            while (qr > 0 && qr * radius_step > room) {
+                qr--;
+            }
+        }
+        CompactSphere &sphere = spheres[i];
+        sphere.x = q[0];
+        sphere.y = q[1];
+        sphere.z = q[2];
+        sphere.radius = qr;
+        sphere.material_id = (uint32_t)soa.material_id[i];
+    }
+}
+
+void CompactSpheres::decode(const float *lower, const float *upper, int first, int count, LeafSoA &leaf) const {
+    float step[3], radius_step;
+    leaf_steps(lower, upper, step, radius_step);
+    for (int j = 0; j < count; j++) {
+        const CompactSphere &sphere = spheres[first + j];
+        leaf.center_x[j] = lower[0] + sphere.x * step[0];
+        leaf.center_y[j] = lower[1] + sphere.y * step[1];
+        leaf.center_z[j] = lower[2] + sphere.z * step[2];
+        leaf.radius[j] = sphere.radius * radius_step;
+        leaf.material_id[j] = (int)sphere.material_id;
+        leaf.scene_index[j] = first + j;
+    }
+    leaf.soa.attach(count, leaf.center_x, leaf.center_y, leaf.center_z, leaf.radius, leaf.material_id, leaf.scene_index);
+}
+
+Sphere CompactSpheres::decode_sphere(const float *lower, const float *upper, int index) const {
+    float step[3], radius_step;
+    leaf_steps(lower, upper, step, radius_step);
+    const CompactSphere &sphere = spheres[index];
+    return Sphere(Vec3(lower[0] + sphere.x * step[0], lower[1] + sphere.y * step[1], lower[2] + sphere.z * step[2]),
+                  sphere.radius * radius_step, (int)sphere.material_id);
+}
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef SPHERESIMDH
+#define SPHERESIMDH
+
+#include <string.h>
+
+#include "sphere_soa.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+//* SIMD versions of the kernels in sphere_soa.h.
+//* SSE2 tests one ray against 4 spheres, AVX2 against 8 and AVX-512
+//* against 16. Each kernel is compiled for its ISA with a target attribute,
+//* and select_kernels() picks the widest one the CPU supports at runtime.
+
+enum SimdIsa {
+    ISA_SCALAR,
+    ISA_SSE,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT
+};
+
+typedef int (*ClosestKernel)(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                             float t_min, float &t_max, int self_index);
+typedef bool (*AnyKernel)(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                          float t_min, float t_max, int self_index);
+typedef void (*Packet8Kernel)(const SphereSoA &soa, int index, const RayPacket8 &rays,
+                              float t_min, float *t_max, int *hit);
+
+typedef struct SphereKernels {
+    SimdIsa isa;
+    const char *name;
+    // spheres tested per instruction
+    int width;
+    ClosestKernel closest;
+    AnyKernel any;
+    Packet8Kernel packet8;
+} SphereKernels;
+
+#ifdef RT_SIMD_X86
+
+RT_NO_CONTRACT_BEGIN
+
+/* SSE2 (4 spheres) */
+
+int closest_sse(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                float t_min, float &t_max, int self_index) {
+    __m128 ox = _mm_set1_ps(ray.ox), oy = _mm_set1_ps(ray.oy), oz = _mm_set1_ps(ray.oz);
+    __m128 dx = _mm_set1_ps(ray.dx), dy = _mm_set1_ps(ray.dy), dz = _mm_set1_ps(ray.dz);
+    __m128 tmin = _mm_set1_ps(t_min);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 infinity = _mm_set1_ps(FLT_MAX);
+    __m128i self = _mm_set1_epi32(self_index);
+    __m128i lane_index = _mm_setr_epi32(0, 1, 2, 3);
+    int best = -1;
+    int last = first + count;
+
+    for (int i = first; i < last; i += 4) {
+        __m128 tmax = _mm_set1_ps(t_max);
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&soa.center_x[i]));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&soa.center_y[i]));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&soa.center_z[i]));
+        __m128 r = _mm_loadu_ps(&soa.radius[i]);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+        __m128 root = _mm_sqrt_ps(discriminant);
+        __m128 minus_b = _mm_xor_ps(b, sign);
+        __m128 t0 = _mm_sub_ps(minus_b, root);
+        __m128 t1 = _mm_add_ps(minus_b, root);
+
+        __m128i index = _mm_add_epi32(_mm_set1_epi32(i - last), lane_index);
+        __m128 lanes = _mm_castsi128_ps(_mm_andnot_si128(
+            _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&soa.scene_index[i]), self),
+            _mm_cmplt_epi32(index, _mm_setzero_si128())));
+        lanes = _mm_and_ps(lanes, _mm_cmpgt_ps(discriminant, zero));
+        __m128 in0 = _mm_and_ps(lanes, _mm_and_ps(_mm_cmplt_ps(t0, tmax), _mm_cmpgt_ps(t0, tmin)));
+        __m128 in1 = _mm_and_ps(lanes, _mm_and_ps(_mm_cmplt_ps(t1, tmax), _mm_cmpgt_ps(t1, tmin)));
+        __m128 t = _mm_or_ps(_mm_and_ps(in0, t0), _mm_andnot_ps(in0, t1));
+        __m128 hit = _mm_or_ps(in0, in1);
+        t = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, infinity));
+
+        int hit_mask = _mm_movemask_ps(hit);
+        if (hit_mask) {
+            __m128 m = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            int lane = __builtin_ctz(_mm_movemask_ps(_mm_cmpeq_ps(t, m)) & hit_mask);
+            t_max = _mm_cvtss_f32(m);
+            best = i + lane;
+        }
+    }
+    return best;
+}
+
+bool any_sse(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+             float t_min, float t_max, int self_index) {
+    __m128 ox = _mm_set1_ps(ray.ox), oy = _mm_set1_ps(ray.oy), oz = _mm_set1_ps(ray.oz);
+    __m128 dx = _mm_set1_ps(ray.dx), dy = _mm_set1_ps(ray.dy), dz = _mm_set1_ps(ray.dz);
+    __m128 tmin = _mm_set1_ps(t_min), tmax = _mm_set1_ps(t_max);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128i self = _mm_set1_epi32(self_index);
+    __m128i lane_index = _mm_setr_epi32(0, 1, 2, 3);
+    int last = first + count;
+
+    for (int i = first; i < last; i += 4) {
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(&soa.center_x[i]));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(&soa.center_y[i]));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(&soa.center_z[i]));
+        __m128 r = _mm_loadu_ps(&soa.radius[i]);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+        __m128 root = _mm_sqrt_ps(discriminant);
+        __m128 minus_b = _mm_xor_ps(b, sign);
+        __m128 t0 = _mm_sub_ps(minus_b, root);
+        __m128 t1 = _mm_add_ps(minus_b, root);
+
+        __m128i index = _mm_add_epi32(_mm_set1_epi32(i - last), lane_index);
+        __m128 lanes = _mm_castsi128_ps(_mm_andnot_si128(
+            _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)&soa.scene_index[i]), self),
+            _mm_cmplt_epi32(index, _mm_setzero_si128())));
+        lanes = _mm_and_ps(lanes, _mm_cmpgt_ps(discriminant, zero));
+        __m128 in0 = _mm_and_ps(_mm_cmplt_ps(t0, tmax), _mm_cmpgt_ps(t0, tmin));
+        __m128 in1 = _mm_and_ps(_mm_cmplt_ps(t1, tmax), _mm_cmpgt_ps(t1, tmin));
+        if (_mm_movemask_ps(_mm_and_ps(lanes, _mm_or_ps(in0, in1)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void packet8_sse(const SphereSoA &soa, int index, const RayPacket8 &rays, float t_min, float *t_max, int *hit) {
+    //* Two 4-wide halves of the packet.
+    __m128 cx = _mm_set1_ps(soa.center_x[index]);
+    __m128 cy = _mm_set1_ps(soa.center_y[index]);
+    __m128 cz = _mm_set1_ps(soa.center_z[index]);
+    __m128 r = _mm_set1_ps(soa.radius[index]);
+    __m128 tmin = _mm_set1_ps(t_min);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128i sphere = _mm_set1_epi32(index);
+
+    for (int half = 0; half < 8; half += 4) {
+        __m128 dx = _mm_loadu_ps(&rays.dx[half]), dy = _mm_loadu_ps(&rays.dy[half]), dz = _mm_loadu_ps(&rays.dz[half]);
+        __m128 tmax = _mm_loadu_ps(&t_max[half]);
+        __m128 ocx = _mm_sub_ps(_mm_loadu_ps(&rays.ox[half]), cx);
+        __m128 ocy = _mm_sub_ps(_mm_loadu_ps(&rays.oy[half]), cy);
+        __m128 ocz = _mm_sub_ps(_mm_loadu_ps(&rays.oz[half]), cz);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), c);
+        __m128 root = _mm_sqrt_ps(discriminant);
+        __m128 minus_b = _mm_xor_ps(b, sign);
+        __m128 t0 = _mm_sub_ps(minus_b, root);
+        __m128 t1 = _mm_add_ps(minus_b, root);
+
+        __m128 valid = _mm_cmpgt_ps(discriminant, zero);
+        __m128 in0 = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t0, tmax), _mm_cmpgt_ps(t0, tmin)));
+        __m128 in1 = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t1, tmax), _mm_cmpgt_ps(t1, tmin)));
+        __m128 t = _mm_or_ps(_mm_and_ps(in0, t0), _mm_andnot_ps(in0, t1));
+        __m128 mask = _mm_or_ps(in0, in1);
+        _mm_storeu_ps(&t_max[half], _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, tmax)));
+        __m128i old_hit = _mm_loadu_si128((const __m128i *)&hit[half]);
+        __m128i imask = _mm_castps_si128(mask);
+        _mm_storeu_si128((__m128i *)&hit[half], _mm_or_si128(_mm_and_si128(imask, sphere), _mm_andnot_si128(imask, old_hit)));
+    }
+}
+
+/* AVX2 (8 spheres) */
+
+__attribute__((target("avx2")))
+inline void sphere_roots_avx2(const SphereSoA &soa, int i, __m256 ox, __m256 oy, __m256 oz, __m256 dx, __m256 dy, __m256 dz,
+                              __m256 &discriminant, __m256 &t0, __m256 &t1) {
+    __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&soa.center_x[i]));
+    __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&soa.center_y[i]));
+    __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&soa.center_z[i]));
+    __m256 r = _mm256_loadu_ps(&soa.radius[i]);
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+    discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 root = _mm256_sqrt_ps(discriminant);
+    __m256 minus_b = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+    t0 = _mm256_sub_ps(minus_b, root);
+    t1 = _mm256_add_ps(minus_b, root);
+}
+
+__attribute__((target("avx2")))
+inline __m256 active_lanes_avx2(const SphereSoA &soa, int i, int last, int self_index) {
+    //* Lanes inside [i, last) that are not the self sphere.
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i inside = _mm256_cmpgt_epi32(_mm256_set1_epi32(last), index);
+    __m256i self = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&soa.scene_index[i]), _mm256_set1_epi32(self_index));
+    return _mm256_castsi256_ps(_mm256_andnot_si256(self, inside));
+}
+
+__attribute__((target("avx2")))
+int closest_avx2(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                 float t_min, float &t_max, int self_index) {
+    __m256 ox = _mm256_set1_ps(ray.ox), oy = _mm256_set1_ps(ray.oy), oz = _mm256_set1_ps(ray.oz);
+    __m256 dx = _mm256_set1_ps(ray.dx), dy = _mm256_set1_ps(ray.dy), dz = _mm256_set1_ps(ray.dz);
+    __m256 tmin = _mm256_set1_ps(t_min);
+    __m256 infinity = _mm256_set1_ps(FLT_MAX);
+    int best = -1;
+    int last = first + count;
+
+    for (int i = first; i < last; i += 8) {
+        __m256 tmax = _mm256_set1_ps(t_max);
+        __m256 discriminant, t0, t1;
+        sphere_roots_avx2(soa, i, ox, oy, oz, dx, dy, dz, discriminant, t0, t1);
+        __m256 lanes = _mm256_and_ps(active_lanes_avx2(soa, i, last, self_index),
+                                     _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ));
+        __m256 in0 = _mm256_and_ps(lanes, _mm256_and_ps(_mm256_cmp_ps(t0, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ)));
+        __m256 in1 = _mm256_and_ps(lanes, _mm256_and_ps(_mm256_cmp_ps(t1, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ)));
+        __m256 hit = _mm256_or_ps(in0, in1);
+        int hit_mask = _mm256_movemask_ps(hit);
+        if (hit_mask) {
+            __m256 t = _mm256_blendv_ps(infinity, _mm256_blendv_ps(t1, t0, in0), hit);
+            __m256 m = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            int lane = __builtin_ctz(_mm256_movemask_ps(_mm256_cmp_ps(t, m, _CMP_EQ_OQ)) & hit_mask);
+            t_max = _mm256_cvtss_f32(m);
+            best = i + lane;
+        }
+    }
+    return best;
+}
+
+__attribute__((target("avx2")))
+bool any_avx2(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+              float t_min, float t_max, int self_index) {
+    __m256 ox = _mm256_set1_ps(ray.ox), oy = _mm256_set1_ps(ray.oy), oz = _mm256_set1_ps(ray.oz);
+    __m256 dx = _mm256_set1_ps(ray.dx), dy = _mm256_set1_ps(ray.dy), dz = _mm256_set1_ps(ray.dz);
+    __m256 tmin = _mm256_set1_ps(t_min), tmax = _mm256_set1_ps(t_max);
+    int last = first + count;
+
+    for (int i = first; i < last; i += 8) {
+        __m256 discriminant, t0, t1;
+        sphere_roots_avx2(soa, i, ox, oy, oz, dx, dy, dz, discriminant, t0, t1);
+        __m256 lanes = _mm256_and_ps(active_lanes_avx2(soa, i, last, self_index),
+                                     _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ));
+        __m256 in0 = _mm256_and_ps(_mm256_cmp_ps(t0, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ));
+        __m256 in1 = _mm256_and_ps(_mm256_cmp_ps(t1, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ));
+        if (_mm256_movemask_ps(_mm256_and_ps(lanes, _mm256_or_ps(in0, in1)))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((target("avx2")))
+void packet8_avx2(const SphereSoA &soa, int index, const RayPacket8 &rays, float t_min, float *t_max, int *hit) {
+    __m256 dx = _mm256_loadu_ps(rays.dx), dy = _mm256_loadu_ps(rays.dy), dz = _mm256_loadu_ps(rays.dz);
+    __m256 tmax = _mm256_loadu_ps(t_max);
+    __m256 tmin = _mm256_set1_ps(t_min);
+    __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(rays.ox), _mm256_set1_ps(soa.center_x[index]));
+    __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(rays.oy), _mm256_set1_ps(soa.center_y[index]));
+    __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(rays.oz), _mm256_set1_ps(soa.center_z[index]));
+    __m256 r = _mm256_set1_ps(soa.radius[index]);
+    __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+    __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+    __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), c);
+    __m256 root = _mm256_sqrt_ps(discriminant);
+    __m256 minus_b = _mm256_xor_ps(b, _mm256_set1_ps(-0.0f));
+    __m256 t0 = _mm256_sub_ps(minus_b, root);
+    __m256 t1 = _mm256_add_ps(minus_b, root);
+
+    __m256 valid = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 in0 = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t0, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t0, tmin, _CMP_GT_OQ)));
+    __m256 in1 = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t1, tmax, _CMP_LT_OQ), _mm256_cmp_ps(t1, tmin, _CMP_GT_OQ)));
+    __m256 mask = _mm256_or_ps(in0, in1);
+    _mm256_storeu_ps(t_max, _mm256_blendv_ps(tmax, _mm256_blendv_ps(t1, t0, in0), mask));
+    __m256i old_hit = _mm256_loadu_si256((const __m256i *)hit);
+    _mm256_storeu_si256((__m256i *)hit, _mm256_castps_si256(_mm256_blendv_ps(
+        _mm256_castsi256_ps(old_hit), _mm256_castsi256_ps(_mm256_set1_epi32(index)), mask)));
+}
+
+/* AVX-512 (16 spheres) */
+
+// GCC 12 warns about the _mm512_undefined_ps() inside its own intrinsics.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+inline __mmask16 hit_lanes_avx512(const SphereSoA &soa, int i, int last, int self_index,
+                                  __m512 ox, __m512 oy, __m512 oz, __m512 dx, __m512 dy, __m512 dz,
+                                  __m512 tmin, __m512 tmax, __m512 &t) {
+    //* Lanes with a hit in (t_min, t_max), and their t.
+    __m512 ocx = _mm512_sub_ps(ox, _mm512_loadu_ps(&soa.center_x[i]));
+    __m512 ocy = _mm512_sub_ps(oy, _mm512_loadu_ps(&soa.center_y[i]));
+    __m512 ocz = _mm512_sub_ps(oz, _mm512_loadu_ps(&soa.center_z[i]));
+    __m512 r = _mm512_loadu_ps(&soa.radius[i]);
+    __m512 b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+    __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)), _mm512_mul_ps(r, r));
+    __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(b, b), c);
+    __m512 root = _mm512_sqrt_ps(discriminant);
+    __m512 minus_b = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(b), _mm512_set1_epi32((int)0x80000000)));
+    __m512 t0 = _mm512_sub_ps(minus_b, root);
+    __m512 t1 = _mm512_add_ps(minus_b, root);
+
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    __mmask16 lanes = _mm512_cmplt_epi32_mask(index, _mm512_set1_epi32(last));
+    lanes &= _mm512_cmpneq_epi32_mask(_mm512_loadu_si512(&soa.scene_index[i]), _mm512_set1_epi32(self_index));
+    lanes &= _mm512_cmp_ps_mask(discriminant, _mm512_setzero_ps(), _CMP_GT_OQ);
+    __mmask16 in0 = lanes & _mm512_cmp_ps_mask(t0, tmax, _CMP_LT_OQ) & _mm512_cmp_ps_mask(t0, tmin, _CMP_GT_OQ);
+    __mmask16 in1 = lanes & _mm512_cmp_ps_mask(t1, tmax, _CMP_LT_OQ) & _mm512_cmp_ps_mask(t1, tmin, _CMP_GT_OQ);
+    t = _mm512_mask_blend_ps(in0, t1, t0);
+    return in0 | in1;
+}
+
+__attribute__((target("avx512f")))
+int closest_avx512(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                   float t_min, float &t_max, int self_index) {
+    __m512 ox = _mm512_set1_ps(ray.ox), oy = _mm512_set1_ps(ray.oy), oz = _mm512_set1_ps(ray.oz);
+    __m512 dx = _mm512_set1_ps(ray.dx), dy = _mm512_set1_ps(ray.dy), dz = _mm512_set1_ps(ray.dz);
+    __m512 tmin = _mm512_set1_ps(t_min);
+    int best = -1;
+    int last = first + count;
+
+    for (int i = first; i < last; i += 16) {
+        __m512 t;
+        __mmask16 hit = hit_lanes_avx512(soa, i, last, self_index, ox, oy, oz, dx, dy, dz, tmin, _mm512_set1_ps(t_max), t);
+        if (hit) {
+            t = _mm512_mask_blend_ps(hit, _mm512_set1_ps(FLT_MAX), t);
+            float m = _mm512_reduce_min_ps(t);
+            int lane = __builtin_ctz(_mm512_cmp_ps_mask(t, _mm512_set1_ps(m), _CMP_EQ_OQ) & hit);
+            t_max = m;
+            best = i + lane;
+        }
+    }
+    return best;
+}
+
+__attribute__((target("avx512f")))
+bool any_avx512(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                float t_min, float t_max, int self_index) {
+    __m512 ox = _mm512_set1_ps(ray.ox), oy = _mm512_set1_ps(ray.oy), oz = _mm512_set1_ps(ray.oz);
+    __m512 dx = _mm512_set1_ps(ray.dx), dy = _mm512_set1_ps(ray.dy), dz = _mm512_set1_ps(ray.dz);
+    __m512 tmin = _mm512_set1_ps(t_min), tmax = _mm512_set1_ps(t_max);
+    int last = first + count;
+
+    for (int i = first; i < last; i += 16) {
+        __m512 t;
+        if (hit_lanes_avx512(soa, i, last, self_index, ox, oy, oz, dx, dy, dz, tmin, tmax, t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+RT_NO_CONTRACT_END
+
+#endif
+
+const SphereKernels& sphere_kernels(SimdIsa isa) {
+    //* The kernel table of one ISA (ISA_SCALAR on non-x86 builds).
+    static const SphereKernels table[ISA_COUNT] = {
+        {ISA_SCALAR, "scalar", 1, closest_scalar, any_scalar, packet8_scalar},
+#ifdef RT_SIMD_X86
+        {ISA_SSE, "sse", 4, closest_sse, any_sse, packet8_sse},
+        {ISA_AVX2, "avx2", 8, closest_avx2, any_avx2, packet8_avx2},
+        // AVX-512 uses the AVX2 packet kernel: a packet is 8 rays.
+        {ISA_AVX512, "avx512", 16, closest_avx512, any_avx512, packet8_avx2},
+#else
+        {ISA_SCALAR, "scalar", 1, closest_scalar, any_scalar, packet8_scalar},
+        {ISA_SCALAR, "scalar", 1, closest_scalar, any_scalar, packet8_scalar},
+        {ISA_SCALAR, "scalar", 1, closest_scalar, any_scalar, packet8_scalar},
+#endif
+    };
+    return table[isa];
+}
+
+bool isa_supported(SimdIsa isa) {
+    //* Ask CPUID whether this machine can run the kernels of isa.
+#ifdef RT_SIMD_X86
+    switch (isa) {
+        case ISA_SCALAR: return true;
+        case ISA_SSE: return __builtin_cpu_supports("sse2");
+        case ISA_AVX2: return __builtin_cpu_supports("avx2");
+        case ISA_AVX512: return __builtin_cpu_supports("avx512f");
+        default: return false;
+    }
+#else
+    return isa == ISA_SCALAR;
+#endif
+}
+
+const SphereKernels& select_kernels(const char *name = NULL) {
+    //* The widest kernel the CPU supports, or the one called name
+    //* ("scalar", "sse", "avx2", "avx512") if it is supported.
+    for (int isa = ISA_COUNT - 1; isa >= 0; isa--) {
+        const SphereKernels &kernels = sphere_kernels((SimdIsa)isa);
+        if (!isa_supported((SimdIsa)isa)) {
+            continue;
+        }
+        if (name == NULL || strcmp(name, kernels.name) == 0) {
+            return kernels;
+        }
+    }
+    return sphere_kernels(ISA_SCALAR);
+}
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef SPHERESOAH
+#define SPHERESOAH
+
+#include <math.h>
+#include <float.h>
+#include <algorithm>
+#include <vector>
+
+#include "ray.h"
+#include "sphere.h"
+
+// Padding after the last sphere, so a 16-wide load at any index stays inside the arrays.
+#define SOA_PADDING 16
+
+// The kernels only give the same bits when the compiler does not fuse
+// a * b + c into one FMA instruction, so contraction is off between these.
+#if defined(__clang__)
+#define RT_NO_CONTRACT_BEGIN _Pragma("float_control(push)") _Pragma("clang fp contract(off)")
+#define RT_NO_CONTRACT_END _Pragma("float_control(pop)")
+#elif defined(__GNUC__)
+#define RT_NO_CONTRACT_BEGIN _Pragma("GCC push_options") _Pragma("GCC optimize(\"fp-contract=off\")")
+#define RT_NO_CONTRACT_END _Pragma("GCC pop_options")
+#else
+#define RT_NO_CONTRACT_BEGIN
+#define RT_NO_CONTRACT_END
+#endif
+
+//* Structure-of-arrays copy of the spheres, so the SIMD kernels can load
+//* the same field of 4/8/16 spheres with one instruction.
+//* The arrays are either owned (build) or point into memory owned by the
+//* caller, like a mapped scene file (attach). Each array holds size() +
+//* SOA_PADDING entries.
+class SphereSoA {
+    public:
+        /* constructors */
+        SphereSoA() : count(0), owned(false) {
+            set_arrays(NULL, NULL, NULL, NULL, NULL, NULL);
+        }
+        SphereSoA(const SphereSoA &other) {
+            *this = other;
+        }
+
+        SphereSoA& operator=(const SphereSoA &other);
+
+        void build(const std::vector<Sphere> &spheres, const std::vector<int> &order);
+
+        // Copy the centers and radii of the spheres again, keeping the order (owned arrays only).
+        void refresh(const std::vector<Sphere> &spheres);
+
+        // Use count spheres of arrays stored elsewhere, which must outlive this.
+        void attach(int count, const float *center_x, const float *center_y, const float *center_z,
+                    const float *radius, const int *material_id, const int *scene_index);
+
+        int size() const {
+            return count;
+        }
+
+        const float *center_x;
+        const float *center_y;
+        const float *center_z;
+        const float *radius;
+        const int *material_id;
+        // index of the sphere in the scene list (for self_index and hit records)
+        const int *scene_index;
+
+    private:
+        void set_arrays(const float *cx, const float *cy, const float *cz, const float *r, const int *m, const int *index) {
+            center_x = cx;
+            center_y = cy;
+            center_z = cz;
+            radius = r;
+            material_id = m;
+            scene_index = index;
+        }
+
+        // Set the arrays to the owned storage.
+        void use_storage() {
+            size_t padded = float_storage.size() / 4;
+            set_arrays(&float_storage[0], &float_storage[padded], &float_storage[2 * padded], &float_storage[3 * padded],
+                       &int_storage[0], &int_storage[padded]);
+        }
+
+        int count;
+        bool owned;
+        // center_x, center_y, center_z and radius one after the other
+        std::vector<float> float_storage;
+        // material_id and scene_index
+        std::vector<int> int_storage;
+};
+
+SphereSoA& SphereSoA::operator=(const SphereSoA &other) {
+    count = other.count;
+    owned = other.owned;
+    float_storage = other.float_storage;
+    int_storage = other.int_storage;
+    if (owned) {
+        use_storage();
+    } else {
+        set_arrays(other.center_x, other.center_y, other.center_z, other.radius, other.material_id, other.scene_index);
+    }
+    return *this;
+}
+
+void SphereSoA::build(const std::vector<Sphere> &spheres, const std::vector<int> &order) {
+    //* Copy the spheres in the given order (the BVH leaf order), so the
+    //* spheres of one leaf are next to each other.
+    count = (int)order.size();
+    owned = true;
+    size_t padded = order.size() + SOA_PADDING;
+    float_storage.assign(4 * padded, 0.0f);
+    int_storage.assign(2 * padded, 0);
+    std::fill(int_storage.begin() + padded, int_storage.end(), -1);
+    float *cx = &float_storage[0];
+    float *cy = cx + padded;
+    float *cz = cy + padded;
+    float *r = cz + padded;
+    int *m = &int_storage[0];
+    int *index = m + padded;
+    for (size_t i = 0; i < order.size(); i++) {
+        const Sphere &sphere = spheres[order[i]];
+        cx[i] = sphere.get_center().x();
+        cy[i] = sphere.get_center().y();
+        cz[i] = sphere.get_center().z();
+        r[i] = sphere.get_radius();
+        m[i] = sphere.get_material_id();
+        index[i] = order[i];
+    }
+    use_storage();
+}
+
+void SphereSoA::refresh(const std::vector<Sphere> &spheres) {
+    size_t padded = float_storage.size() / 4;
+    float *cx = &float_storage[0];
+    float *cy = cx + padded;
+    float *cz = cy + padded;
+    float *r = cz + padded;
+    for (int i = 0; i < count; i++) {
+        const Sphere &sphere = spheres[scene_index[i]];
+        cx[i] = sphere.get_center().x();
+        cy[i] = sphere.get_center().y();
+        cz[i] = sphere.get_center().z();
+        r[i] = sphere.get_radius();
+    }
+}
+
+void SphereSoA::attach(int count, const float *center_x, const float *center_y, const float *center_z,
+                       const float *radius, const int *material_id, const int *scene_index) {
+    this->count = count;
+    owned = false;
+    float_storage.clear();
+    int_storage.clear();
+    set_arrays(center_x, center_y, center_z, radius, material_id, scene_index);
+}
+
+//* The ray in the form the kernels use. D is a unit vector (see Ray), so
+//* the quadratic has a = 1 and the kernels leave it out.
+typedef struct KernelRay {
+    float ox, oy, oz;
+    float dx, dy, dz;
+} KernelRay;
+
+inline KernelRay make_kernel_ray(const Ray &ray) {
+    KernelRay kray;
+    kray.ox = ray.origin().x();
+    kray.oy = ray.origin().y();
+    kray.oz = ray.origin().z();
+    kray.dx = ray.direction().x();
+    kray.dy = ray.direction().y();
+    kray.dz = ray.direction().z();
+    return kray;
+}
+
+//* Eight rays in SoA form, for testing a packet against one sphere.
+typedef struct RayPacket8 {
+    float ox[8], oy[8], oz[8];
+    float dx[8], dy[8], dz[8];
+} RayPacket8;
+
+RT_NO_CONTRACT_BEGIN
+
+inline bool soa_sphere_t(const SphereSoA &soa, int i, float ox, float oy, float oz,
+                         float dx, float dy, float dz, float t_min, float t_max, float &t) {
+    //* Scalar reference of the quadratic test, with half b and a unit D:
+    //* t = -b +- sqrt(b * b - c), b = dot(D, OC).
+    //* All kernels do the same float operations in the same order, so they
+    //* give the same bits as this one.
+    float ocx = ox - soa.center_x[i];
+    float ocy = oy - soa.center_y[i];
+    float ocz = oz - soa.center_z[i];
+    float b = dx * ocx + dy * ocy + dz * ocz;
+    float c = ocx * ocx + ocy * ocy + ocz * ocz - soa.radius[i] * soa.radius[i];
+    float discriminant = b * b - c;
+    if (discriminant > 0) {
+        float root = sqrtf(discriminant);
+        float temp = -b - root;
+        if (temp < t_max && temp > t_min) {
+            t = temp;
+            return true;
+        }
+        temp = -b + root;
+        if (temp < t_max && temp > t_min) {
+            t = temp;
+            return true;
+        }
+    }
+    return false;
+}
+
+int closest_scalar(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                   float t_min, float &t_max, int self_index) {
+    //* Closest hit of one ray against soa[first, first + count).
+    //* Return the SoA index of the hit (or -1) and shrink t_max to its t.
+    int best = -1;
+    for (int i = first; i < first + count; i++) {
+        if (soa.scene_index[i] == self_index) continue;
+        float t;
+        if (soa_sphere_t(soa, i, ray.ox, ray.oy, ray.oz, ray.dx, ray.dy, ray.dz, t_min, t_max, t)) {
+            t_max = t;
+            best = i;
+        }
+    }
+    return best;
+}
+
+bool any_scalar(const SphereSoA &soa, int first, int count, const KernelRay &ray,
+                float t_min, float t_max, int self_index) {
+    //* Whether any sphere of soa[first, first + count) is hit in (t_min, t_max).
+    for (int i = first; i < first + count; i++) {
+        if (soa.scene_index[i] == self_index) continue;
+        float t;
+        if (soa_sphere_t(soa, i, ray.ox, ray.oy, ray.oz, ray.dx, ray.dy, ray.dz, t_min, t_max, t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void packet8_scalar(const SphereSoA &soa, int index, const RayPacket8 &rays, float t_min, float *t_max, int *hit) {
+    //* Closest-hit update of 8 rays against the sphere soa[index]:
+    //* a ray that hits it closer than t_max[lane] gets t_max[lane] = t and hit[lane] = index.
+    for (int lane = 0; lane < 8; lane++) {
+        float t;
+        if (soa_sphere_t(soa, index, rays.ox[lane], rays.oy[lane], rays.oz[lane],
+                         rays.dx[lane], rays.dy[lane], rays.dz[lane], t_min, t_max[lane], t)) {
+            t_max[lane] = t;
+            hit[lane] = index;
+        }
+    }
+}
+
+RT_NO_CONTRACT_END
+
+#endif
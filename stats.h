@@ -0,0 +1,85 @@
+#ifndef STATSH
+#define STATSH
+
+#include <mutex>
+
+//* Render counters. Every thread counts into its own thread_stats and
+//* flushes it into global_stats once per tile, so the hot path never
+//* touches shared memory.
+enum Counter {
+    CLOSEST_RAYS,
+    CLOSEST_NODES,
+    CLOSEST_TESTS,
+    SHADOW_RAYS,
+    SHADOW_NODES,
+    SHADOW_TESTS,
+    SHADOW_BLOCKED,
+    HEAP_ALLOCATIONS,
+    PRIMARY_RAYS,
+    SKIPPED_BRANCHES,
+    CULLED_BRANCHES,
+    ROULETTE_TERMINATED,
+    LIGHT_PICKS,
+    LIGHT_TREE_NODES,
+    OCCLUDER_LOOKUPS,
+    OCCLUDER_HITS,
+    INSTANCE_NODES,
+    CACHE_MISSES,
+    L1D_MISSES,
+    COUNTER_COUNT
+};
+
+inline const char *const counter_names[COUNTER_COUNT] = {
+    "closest_rays",
+    "closest_nodes",
+    "closest_tests",
+    "shadow_rays",
+    "shadow_nodes",
+    "shadow_tests",
+    "shadow_blocked",
+    "heap_allocations",
+    "primary_rays",
+    "skipped_branches",
+    "culled_branches",
+    "roulette_terminated",
+    "light_picks",
+    "light_tree_nodes",
+    "occluder_lookups",
+    "occluder_hits",
+    "instance_nodes",
+    "cache_misses",
+    "l1d_misses"
+};
+
+typedef struct RenderStats {
+    unsigned long long count[COUNTER_COUNT];
+
+    void add(const RenderStats &other) {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            count[i] += other.count[i];
+        }
+    }
+
+    void reset() {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            count[i] = 0;
+        }
+    }
+
+    double ratio(Counter numerator, Counter denominator) const {
+        return count[denominator] ? double(count[numerator]) / double(count[denominator]) : 0.0;
+    }
+} RenderStats;
+
+inline thread_local RenderStats thread_stats = {};
+inline RenderStats global_stats = {};
+inline std::mutex global_stats_lock;
+
+inline void flush_thread_stats() {
+    //* Move the counters of the calling thread into global_stats.
+    std::lock_guard<std::mutex> guard(global_stats_lock);
+    global_stats.add(thread_stats);
+    thread_stats.reset();
+}
+
+#endif
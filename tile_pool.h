@@ -0,0 +1,218 @@
+#ifndef TILEPOOLH
+#define TILEPOOLH
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef struct Tile {
+    // pixel range [x0, x1) * [y0, y1)
+    int x0, y0, x1, y1;
+    // the index in the tile list (also the scan order)
+    int index;
+} Tile;
+
+typedef struct WorkerReport {
+    // tiles rendered by this worker
+    int tiles;
+    // tiles taken from another worker's queue
+    int stolen;
+    // seconds spent inside the tile callback
+    double busy_seconds;
+} WorkerReport;
+
+std::vector<Tile> make_tiles(const Tile &region, int tile_size) {
+    //* Split the region [x0, x1) * [y0, y1) of the image into tile_size *
+    //* tile_size tiles (region.index is not used). The order follows the
+    //* scanline order of the output file: top row of tiles first, left to right.
+
+    std::vector<Tile> tiles;
+    int index = 0;
+    for (int y1 = region.y1; y1 > region.y0; y1 -= tile_size) {
+        int y0 = std::max(region.y0, y1 - tile_size);
+        for (int x0 = region.x0; x0 < region.x1; x0 += tile_size) {
+            Tile tile = {x0, y0, std::min(region.x1, x0 + tile_size), y1, index++};
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+std::vector<Tile> make_tiles(int width, int height, int tile_size) {
+    //* Split the whole image into tiles.
+    Tile image = {0, 0, width, height, 0};
+    return make_tiles(image, tile_size);
+}
+
+//* A persistent pool of render threads.
+//* Every render() call deals the tiles out to per-worker queues in contiguous
+//* blocks (neighbouring tiles stay on one thread for cache locality), and a
+//* worker that runs out of its own tiles steals from the back of another
+//* worker's queue. So a thread that got cheap sky tiles keeps helping with the
+//* expensive tiles around the reflective spheres.
+//* render() may be called from several threads (the jobs of a render
+//* server); the calls take turns in the order they came, so a job that
+//* renders in small batches gets the pool between the batches of the others.
+class TilePool {
+    public:
+        /* constructors */
+        explicit TilePool(int thread_count) : generation(0), running(0), stop(false), next_turn(0), turn(0) {
+            thread_count = std::max(1, thread_count);
+            queues = std::vector<WorkQueue>(thread_count);
+            reports = std::vector<WorkerReport>(thread_count);
+            for (int i = 0; i < thread_count; i++) {
+                threads.push_back(std::thread(&TilePool::worker_loop, this, i));
+            }
+        }
+
+        ~TilePool() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stop = true;
+            }
+            wake.notify_all();
+            for (size_t i = 0; i < threads.size(); i++) {
+                threads[i].join();
+            }
+        }
+
+        TilePool(const TilePool&) = delete;
+        TilePool& operator=(const TilePool&) = delete;
+
+        int size() const {
+            return (int)threads.size();
+        }
+
+        const std::vector<WorkerReport>& last_reports() const {
+            return reports;
+        }
+
+        void render(const std::vector<Tile> &tiles, const std::function<void(const Tile&)> &render_tile);
+
+    private:
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<Tile> tiles;
+        };
+
+        void worker_loop(int worker);
+        bool pop_tile(int worker, Tile &tile, bool &stolen);
+
+        std::vector<std::thread> threads;
+        std::vector<WorkQueue> queues;
+        std::vector<WorkerReport> reports;
+        const std::function<void(const Tile&)> *job;
+
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        // bumped once per render() call
+        unsigned long generation;
+        // workers still busy with the current generation
+        int running;
+        bool stop;
+        // render() calls taken a ticket, and the ticket being served
+        unsigned long next_turn;
+        unsigned long turn;
+        std::condition_variable turn_changed;
+};
+
+void TilePool::render(const std::vector<Tile> &tiles, const std::function<void(const Tile&)> &render_tile) {
+    //* Render all tiles and return when the last one is finished.
+
+    std::unique_lock<std::mutex> guard(lock);
+    unsigned long ticket = next_turn++;
+    turn_changed.wait(guard, [&] { return turn == ticket; });
+
+    // The workers are all idle between turns.
+    int thread_count = size();
+    size_t block = (tiles.size() + thread_count - 1) / thread_count;
+    for (int i = 0; i < thread_count; i++) {
+        size_t first = std::min(tiles.size(), i * block);
+        size_t last = std::min(tiles.size(), first + block);
+        queues[i].tiles.assign(tiles.begin() + first, tiles.begin() + last);
+        reports[i] = WorkerReport{0, 0, 0.0};
+    }
+
+    job = &render_tile;
+    running = thread_count;
+    generation++;
+    wake.notify_all();
+    done.wait(guard, [this] { return running == 0; });
+    job = NULL;
+    turn++;
+    turn_changed.notify_all();
+}
+
+bool TilePool::pop_tile(int worker, Tile &tile, bool &stolen) {
+    //* Take the next tile of own queue, or steal the last tile of the
+    //* other queues (nearest neighbour first).
+
+    {
+        WorkQueue &own = queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tiles.empty()) {
+            tile = own.tiles.front();
+            own.tiles.pop_front();
+            stolen = false;
+            return true;
+        }
+    }
+
+    int thread_count = size();
+    for (int offset = 1; offset < thread_count; offset++) {
+        WorkQueue &victim = queues[(worker + offset) % thread_count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            stolen = true;
+            return true;
+        }
+    }
+    // Tiles are never added during a render, so all queues are empty now.
+    return false;
+}
+
+void TilePool::worker_loop(int worker) {
+    unsigned long seen_generation = 0;
+    while (true) {
+        const std::function<void(const Tile&)> *current_job;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stop || generation != seen_generation; });
+            if (stop) {
+                return;
+            }
+            seen_generation = generation;
+            current_job = job;
+        }
+
+        Tile tile;
+        bool stolen;
+        WorkerReport &report = reports[worker];
+        while (pop_tile(worker, tile, stolen)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            (*current_job)(tile);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            report.busy_seconds += elapsed.count();
+            report.tiles++;
+            report.stolen += stolen ? 1 : 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            running--;
+            if (running == 0) {
+                done.notify_all();
+            }
+        }
+    }
+}
+
+#endif
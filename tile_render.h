@@ -0,0 +1,152 @@
+#ifndef TILERENDERH
+#define TILERENDERH
+
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+
+#include "camera.h"
+#include "camera_rays.h"
+#include "profile.h"
+#include "sample_buffer.h"
+#include "scene.h"
+#include "tile_pool.h"
+#include "tracer.h"
+#include "wavefront.h"
+
+//* What a pass over a tile needs to know. Plain data, so a coordinator
+//* can send it to its workers as it is.
+typedef struct TileRenderSettings {
+    int width;
+    int height;
+    // the sample budget of a pixel
+    int samples;
+    // Adaptive sampling: a pixel stops after min_samples once the standard
+    // error of its luminance is below noise (in color units, 0 = off).
+    int min_samples;
+    double noise;
+    // samples per pixel and pass
+    int pass_samples;
+    unsigned int seed;
+    Sampler sampler;
+    Engine engine;
+    TraceOptions trace;
+} TileRenderSettings;
+
+static_assert(std::is_trivially_copyable<TileRenderSettings>::value, "TileRenderSettings is sent over the network");
+
+// The buffers of the render threads, kept from tile to tile: the wavefront
+// engine traces all samples of a tile up front, and the recursive engine
+// makes the camera rays of a pixel in one pass.
+inline thread_local WavefrontEngine tile_wavefront;
+inline thread_local CameraRayBatch tile_camera_rays;
+
+void reserve_tile_render(const TileRenderSettings &settings, int tile_size) {
+    //* Size the buffers of the calling thread for the passes of settings
+    //* over tile_size tiles, so the passes do not allocate them (a no-op
+    //* once they are). Called before the first tile of every thread.
+    size_t pass_samples = (size_t)std::max(1, std::min(settings.samples, settings.pass_samples));
+    if (settings.engine == ENGINE_WAVEFRONT) {
+        size_t pixels = (size_t)tile_size * tile_size;
+        tile_wavefront.reserve(pixels, pixels * pass_samples);
+    } else {
+        tile_camera_rays.reserve(pass_samples);
+    }
+}
+
+inline bool pixel_converged(const PixelSamples &pixel, const TileRenderSettings &settings) {
+    //* Whether a pixel needs no more samples: it has its budget, or its noise is low enough.
+    return pixel.count >= settings.samples ||
+           (settings.noise > 0.0 && pixel.count >= settings.min_samples && standard_error(pixel) <= settings.noise);
+}
+
+bool render_tile_pass(const Tile &tile, SampleBuffer &samples, const Camera &camera, const Scene &scene,
+                      const TileRenderSettings &settings) {
+    //* Add up to pass_samples samples to every pixel of the tile that has
+    //* not converged yet. Return whether the whole tile has converged.
+    //* A pixel only depends on its own samples, so a tile gives the same
+    //* colors in any order, on any thread and in any process.
+    PROFILE_TILE(tile);
+
+    // The wavefront engine traces all samples of the tile up front,
+    // and the loop below picks up their colors in the same order.
+    WavefrontEngine &wavefront = tile_wavefront;
+    CameraRayBatch &camera_rays = tile_camera_rays;
+    bool use_wavefront = settings.engine == ENGINE_WAVEFRONT;
+    SimdIsa isa = scene.bvh.get_kernels().isa;
+#ifdef RT_PROFILE
+    // The profile gives the time of the wavefront engine to the pixels by their samples.
+    double wavefront_ticks_per_sample = 0.0;
+    uint64_t wavefront_start = profile_clock();
+    int wavefront_samples = 0;
+#endif
+    if (use_wavefront) {
+        wavefront.clear();
+        for (int row_index = tile.y1 - 1; row_index >= tile.y0; row_index--) {
+            for (int column_index = tile.x0; column_index < tile.x1; column_index++) {
+                const PixelSamples &pixel = samples.at(row_index, column_index);
+                if (!pixel.converged) {
+                    wavefront.add_pixel(row_index, column_index, pixel.count,
+                                        std::min(settings.samples, pixel.count + settings.pass_samples));
+#ifdef RT_PROFILE
+                    wavefront_samples += std::min(settings.samples, pixel.count + settings.pass_samples) - pixel.count;
+#endif
+                }
+            }
+        }
+        wavefront.run(camera, scene, settings.trace, settings.sampler, settings.seed, settings.width, settings.height);
+#ifdef RT_PROFILE
+        wavefront_ticks_per_sample = double(profile_clock() - wavefront_start) / std::max(1, wavefront_samples);
+#endif
+    }
+    int wavefront_sample = 0;
+    bool tile_converged = true;
+    for (int row_index = tile.y1 - 1; row_index >= tile.y0; row_index--) {
+        for (int column_index = tile.x0; column_index < tile.x1; column_index++) {
+            PixelSamples &pixel = samples.at(row_index, column_index);
+            if (pixel.converged) {
+                continue;
+            }
+            // Deal with anti-alias.
+            // Same pixel calculate many times ray, then sum,
+            // and then calculate average at last.
+            int times_end = std::min(settings.samples, pixel.count + settings.pass_samples);
+            PROFILE_PIXEL(row_index, column_index, wavefront_ticks_per_sample * (times_end - pixel.count));
+            PixelAov *aov = samples.has_aovs() ? &samples.aov_at(row_index, column_index) : NULL;
+            SampleAov sample_aov;
+            int times_begin = pixel.count;
+            if (!use_wavefront) {
+                PROFILE_ZONE(ZONE_CAMERA);
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                camera_rays.clear();
+                camera_rays.add_pixel(camera, settings.sampler, settings.seed, settings.width, settings.height,
+                                      row_index, column_index, times_begin, times_end);
+                camera_rays.generate(camera, isa);
+                thread_stage_stats.items[STAGE_GENERATE] += camera_rays.size();
+                thread_stage_stats.seconds[STAGE_GENERATE] +=
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            for (int times = times_begin; times < times_end; times++) {
+                if (use_wavefront) {
+                    sample_aov = wavefront.sample_aov(wavefront_sample);
+                    add_sample(pixel, wavefront.sample_color(wavefront_sample++));
+                } else {
+                    int k = times - times_begin;
+                    add_sample(pixel, trace_camera_ray(camera_rays.ray(k), scene, settings.trace, camera_rays.path_seed[k],
+                                                       aov ? &sample_aov : NULL));
+                }
+                if (aov) {
+                    aov->albedo += sample_aov.albedo;
+                    aov->normal += sample_aov.normal;
+                    aov->depth += sample_aov.depth;
+                }
+            }
+            pixel.converged = pixel_converged(pixel, settings);
+            tile_converged = tile_converged && pixel.converged;
+        }
+    }
+    flush_thread_stage_stats();
+    return tile_converged;
+}
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef TRACERH
+#define TRACERH
+
+#include <math.h>
+#include <float.h> // for FLT_EPSILON, FLT_MAX
+#include <algorithm>
+
+#include "camera.h"
+#include "camera_rays.h"
+#include "profile.h"
+#include "rng.h"
+#include "scene.h"
+#include "stats.h"
+
+//* The Whitted-style tracer: shading, shadow rays and the recursive ray
+//* tree of one sample. Shared by the renderer and the benchmarks.
+
+#define MAX_STEP 5
+// Hard cap and the lowest survival probability of Russian roulette.
+#define ROULETTE_MAX_STEP 32
+#define ROULETTE_MIN_SURVIVAL 0.1f
+// Most shadow rays a hit may cast (--shadow-rays).
+#define MAX_SHADOW_RAYS 16
+// Slots of the last-occluder cache; light i uses slot i % OCCLUDER_CACHE_SIZE.
+#define OCCLUDER_CACHE_SIZE 64
+
+typedef struct TraceOptions {
+    // Skip branches without weight and cut branches below min_throughput.
+    bool adaptive;
+    float min_throughput;
+    // Depth where Russian roulette starts, -1 for the fixed MAX_STEP cap.
+    int roulette_depth;
+    // Shadow rays per hit. A scene with more lights than that picks the
+    // lights from its light tree.
+    int shadow_rays;
+    // Test the sphere that blocked the last shadow ray to the same light first.
+    bool occluder_cache;
+    // Wavefront engine: sort every wave of secondary rays by direction
+    // octant and origin before intersecting it.
+    bool sort_rays;
+} TraceOptions;
+
+//* The last sphere (BVH order) that blocked a shadow ray of this thread,
+//* per light. Only a hint: an entry from an earlier scene is at worst one
+//* wasted test, as long as it is inside the sphere arrays.
+typedef struct OccluderCache {
+    OccluderCache() {
+        std::fill(sphere, sphere + OCCLUDER_CACHE_SIZE, -1);
+    }
+
+    int sphere[OCCLUDER_CACHE_SIZE];
+} OccluderCache;
+
+inline thread_local OccluderCache occluder_cache;
+
+//* What the camera ray of a sample hits first, the guides of the denoiser:
+//* the diffuse color, the unit normal and the distance from the camera.
+//* A miss has the skybox as albedo, no normal and depth 0.
+typedef struct SampleAov {
+    Vec3 albedo;
+    Vec3 normal;
+    float depth;
+} SampleAov;
+
+inline void set_aov(SampleAov &aov, const hit_record &record, const Material &material) {
+    aov.albedo = material.get_kd();
+    aov.normal = record.normal;
+    aov.depth = record.t;
+}
+
+Vec3 skybox(const Ray &ray) {
+    //* Render the background part.
+    // The direction is a unit vector, so y is in -1~1.
+    // Fix value range 0~2 in the (), and fix value range 0~1 with multiple 0.5.
+    float t = 0.5 * (ray.direction().y() + 1.0);
+    return (1.0 - t) * Vec3(1, 1, 1) + t * Vec3(0.5, 0.7, 1.0);
+}
+
+bool check_in_shadow(const Ray &ray, const Scene &scene, float distance, int self_index, int light = -1) {
+    //* Find whether the shadow ray hit other object. And if there is
+    //* intersection, it means that there are other obstacles between this point
+    //* and the light source, which means that this point is now under the shadow
+    //* of others, which means that the color of this point does not need to
+    //* consider the effect of light from the light source. However, it is necessary
+    //* to notice a situation: when this point (assuming p) is in line with the
+    //* light source and other objects (assuming q), that is, q will be judged
+    //* to be hit by shadow ray, but the light source is actually in p and
+    //* between q, so p is not in the shadow of q. So we need to determine whether
+    //* the distance between p and q is less than the distance between p and
+    //* light source.
+    //* The shadow ray direction is a unit vector, so t is the distance, and
+    //* distance is where the light is.
+    //* self_index is the index of the sphere of current hit point.
+    //* light is the index of the light, for the occluder cache (-1 for none).
+
+    PROFILE_ZONE(ZONE_SHADOW);
+    // Need to skip self surface or set a tmin, or, there will be noise in the surface.
+    int *occluder = light >= 0 ? &occluder_cache.sphere[light % OCCLUDER_CACHE_SIZE] : NULL;
+    bool blocked = scene.bvh.occluded(ray, FLT_EPSILON, distance, self_index, occluder) ||
+                   scene.instances.occluded(ray, FLT_EPSILON, distance, self_index);
+    thread_stats.count[SHADOW_RAYS]++;
+    thread_stats.count[SHADOW_BLOCKED] += blocked;
+    return blocked;
+}
+
+//* A shadow ray of a hit and the local color it adds when it is not blocked.
+typedef struct ShadowSample {
+    Ray ray;
+    float distance;
+    Vec3 color;
+    int light;
+} ShadowSample;
+
+int light_samples(const Scene &scene, const TraceOptions &options, const hit_record &record, const Material &material,
+                  unsigned int path_seed, ShadowSample *samples) {
+    //* The shadow rays of a hit (at most options.shadow_rays), and return
+    //* how many there are. With no more lights than rays every light gets
+    //* one; otherwise every ray goes to a light picked from the light tree,
+    //* and its color is divided by the pick probability and the ray count.
+    PROFILE_ZONE(ZONE_LIGHTS);
+    int light_count = (int)scene.lights.size();
+    // The random numbers of the hit, from its path seed.
+    Pcg32 rng(hash_combine(path_seed, 3));
+    int count = 0;
+    bool all_lights = light_count <= options.shadow_rays;
+    int rays = all_lights ? light_count : options.shadow_rays;
+    for (int s = 0; s < rays; s++) {
+        int light_index = s;
+        float scale = 1.0f;
+        if (!all_lights) {
+            float pdf;
+            thread_stats.count[LIGHT_PICKS]++;
+            if (!scene.light_tree.pick(record.p, record.normal, rng.next_float(), light_index, pdf)) {
+                continue;
+            }
+            scale = 1.0f / (pdf * rays);
+        }
+        const Light &light = scene.lights[light_index];
+        float u1 = light.type == LIGHT_POINT ? 0.0f : rng.next_float();
+        float u2 = light.type == LIGHT_POINT ? 0.0f : rng.next_float();
+        Vec3 direction;
+        float distance, weight;
+        if (!sample_light(light, record.p, record.normal, u1, u2, direction, distance, weight)) {
+            continue;
+        }
+        samples[count].ray = Ray::from_unit(record.p, direction);
+        samples[count].distance = distance;
+        samples[count].color = material.get_kd() * light.emission * (all_lights ? weight : weight * scale);
+        samples[count].light = options.occluder_cache ? light_index : -1;
+        count++;
+    }
+    return count;
+}
+
+Vec3 shading(const hit_record &record, const Material &material, const Scene &scene, const TraceOptions &options,
+             unsigned int path_seed) {
+    //* Compute local color with shadow.
+    //* record is the information about current hit point, and material is its resolved material.
+    ShadowSample samples[MAX_SHADOW_RAYS];
+    int count = light_samples(scene, options, record, material, path_seed, samples);
+
+    // Surface is only illuminated by the lights that nothing blocks.
+    Vec3 local_color(0.0, 0.0, 0.0);
+    for (int s = 0; s < count; s++) {
+        if (!check_in_shadow(samples[s].ray, scene, samples[s].distance, record.in_scene_index, samples[s].light)) {
+            local_color += samples[s].color;
+        }
+    }
+    return local_color;
+}
+
+bool intersect(const Ray &ray, const Scene &scene, float t_min, float t_max, hit_record &record, int self_index) {
+    //* Find there is intersection or no, and record the closest intersection
+    //* to 'record'.
+    //* self_index is the index of the current sphere, and then need to skip
+    //* self, or, it will be noise.
+    //* The instances are tested after the spheres of the scene, only up to
+    //* the closest hit found there.
+
+    PROFILE_ZONE(ZONE_INTERSECT);
+    thread_stats.count[CLOSEST_RAYS]++;
+    bool hit = scene.bvh.intersect(ray, t_min, t_max, record, self_index);
+    if (scene.instances.empty()) {
+        return hit;
+    }
+    return scene.instances.intersect(ray, t_min, hit ? record.t : t_max, record, self_index) || hit;
+}
+
+//* How a hit spawns secondary rays: which branches the material has and
+//* their weights in the mixed color (see mix_color()).
+typedef struct Branching {
+    bool has_reflection;
+    bool has_transmission;
+    float reflected_weight;
+    float transmitted_weight;
+} Branching;
+
+Branching branching(const Material &material) {
+    Branching b;
+    b.has_reflection = !(fabsf(material.get_wr() - 0) < FLT_EPSILON);
+    b.has_transmission = !(fabsf(material.get_wt() - 0) < FLT_EPSILON);
+    b.reflected_weight = b.has_transmission ? (1.0f - material.get_wt()) * material.get_wr() : material.get_wr();
+    b.transmitted_weight = material.get_wt();
+    return b;
+}
+
+Ray reflected_ray(const Ray &ray, const hit_record &record) {
+    // The reflection of a unit direction off a unit normal is a unit vector.
+    return Ray::from_unit(record.p, reflect(ray.direction(), record.normal));
+}
+
+Ray transmitted_ray(const Ray &ray, const hit_record &record) {
+    // assumes that is air to glass.
+    float n_over_nt = 1 / 1.46;
+    Vec3 refracted_direction;
+    if (!refract(ray.direction(), record.normal, n_over_nt, refracted_direction)) {
+        // Total internal reflection: all the light goes the reflected way.
+        return reflected_ray(ray, record);
+    }
+    return Ray::from_unit(record.p, refracted_direction);
+}
+
+Vec3 mix_color(const Material &material, const Branching &b, const Vec3 &local_color,
+               const Vec3 &reflected_color, const Vec3 &transmitted_color) {
+    //* Mix color.
+    if (!b.has_reflection && !b.has_transmission) {
+        // No reflection and refraction.
+        return local_color;
+    } else if (!b.has_transmission) {
+        // Just reflection.
+        return (1.0 - material.get_wr()) * local_color + material.get_wr() * reflected_color;
+    } else {
+        // Need reflection and refraction.
+        return (1.0 - material.get_wt()) * ((1.0 - material.get_wr()) * local_color + material.get_wr() * reflected_color) +
+               material.get_wt() * transmitted_color;
+        // Clamped color [0, 255].
+        // color = (1.0 - material.get_wt()) * (local_color + material.get_wr() * reflected_color) +
+        //         material.get_wt() * transmitted_color;
+    }
+}
+
+bool roulette_step(const TraceOptions &options, int depth, float throughput, unsigned int path_seed,
+                   float &survival, bool &terminated) {
+    //* The end of a path: return true when the ray at depth ends here, with
+    //* terminated = true for a ray killed by Russian roulette (black) and
+    //* false for a ray at the depth cap (skybox). Otherwise survival is the
+    //* probability the ray survived with (its color is divided by it).
+    PROFILE_DEPTH(depth);
+    survival = 1.0f;
+    terminated = false;
+    if (options.roulette_depth >= 0) {
+        // Russian roulette instead of the fixed cap: a ray past roulette_depth
+        // goes on with a probability that follows its throughput, and the
+        // survivors are weighted up so the average stays the same.
+        if (depth >= ROULETTE_MAX_STEP) {
+            PROFILE_DEPTH_CAPPED();
+            return true;
+        }
+        if (depth >= options.roulette_depth) {
+            survival = std::min(1.0f, std::max(ROULETTE_MIN_SURVIVAL, throughput));
+            if (hash_to_float(path_seed) >= survival) {
+                thread_stats.count[ROULETTE_TERMINATED]++;
+                terminated = true;
+                return true;
+            }
+        }
+        return false;
+    }
+    if (depth >= MAX_STEP) {
+        PROFILE_DEPTH_CAPPED();
+        return true;
+    }
+    return false;
+}
+
+Vec3 trace(const Ray &ray, const Scene &scene, const TraceOptions &options, int depth, int self_index = -1,
+           float throughput = 1.0f, unsigned int path_seed = 0, SampleAov *aov = NULL);
+
+Vec3 trace_branch(const Ray &ray, const Scene &scene, const TraceOptions &options, int depth, int self_index,
+                  float throughput, unsigned int path_seed) {
+    //* Trace a reflected or transmitted ray, unless it can not change the
+    //* pixel much: a branch whose throughput (the product of the weights from
+    //* the camera down to here) is below min_throughput ends like a ray at
+    //* the MAX_STEP cap, with the skybox color.
+    if (options.adaptive && throughput < options.min_throughput) {
+        thread_stats.count[CULLED_BRANCHES]++;
+        return skybox(ray);
+    }
+    return trace(ray, scene, options, depth, self_index, throughput, path_seed);
+}
+
+Vec3 trace(const Ray &ray, const Scene &scene, const TraceOptions &options, int depth, int self_index,
+           float throughput, unsigned int path_seed, SampleAov *aov) {
+    //* Deal with the color of the current pixel.
+    //* If the pixel is not sphere, then it is skybox.
+    //* self_index is the index of the current sphere, default -1 means that step is 0.
+    //* When trace to find intersection, need to skip self, or, it will be noise.
+    //* throughput is the weight of this ray in the pixel color, and path_seed
+    //* identifies the ray in the ray tree of the sample (for Russian roulette).
+    //* aov (camera rays only) gets what the ray hits.
+
+    PROFILE_ZONE(ZONE_TRACE);
+    float survival;
+    bool terminated;
+    if (roulette_step(options, depth, throughput, path_seed, survival, terminated)) {
+        return terminated ? Vec3(0.0, 0.0, 0.0) : skybox(ray);
+    }
+
+    /* Spheres part */
+    // Find intersection of this ray with which sphere in the scene and record the information of the intersection.
+    hit_record cloest_record;
+    float t_min = FLT_EPSILON;
+    float t_max = FLT_MAX;
+    bool has_intersection = intersect(ray, scene, t_min, t_max, cloest_record, self_index);
+    if (has_intersection) {
+        // The shadow rays and the branches of the hit are spent on its material.
+        PROFILE_MATERIAL(cloest_record.material_id);
+        const Material &material = scene.material_of(cloest_record);
+        Branching b = branching(material);
+        if (aov) {
+            set_aov(*aov, cloest_record, material);
+        }
+
+        // Local color with shadow.
+        Vec3 local_color = shading(cloest_record, material, scene, options, path_seed);
+
+        // Reflected color
+        // (Not needed when it gets no weight, see the mixing below.)
+        Vec3 reflected_color(0.0, 0.0, 0.0);
+        if (b.has_reflection || !options.adaptive) {
+            reflected_color = trace_branch(reflected_ray(ray, cloest_record), scene, options, depth + 1, cloest_record.in_scene_index,
+                                           throughput * b.reflected_weight, hash_combine(path_seed, 1));
+        } else {
+            thread_stats.count[SKIPPED_BRANCHES]++;
+        }
+
+        // Transmitted color
+        Vec3 transmitted_color(0.0, 0.0, 0.0);
+        if (b.has_transmission || !options.adaptive) {
+            transmitted_color = trace_branch(transmitted_ray(ray, cloest_record), scene, options, depth + 1, cloest_record.in_scene_index,
+                                             throughput * b.transmitted_weight, hash_combine(path_seed, 2));
+        } else {
+            thread_stats.count[SKIPPED_BRANCHES]++;
+        }
+
+        Vec3 color = mix_color(material, b, local_color, reflected_color, transmitted_color);
+        return survival < 1.0f ? color / survival : color;
+    } else {
+        /* Skybox part */
+        if (aov) {
+            aov->albedo = skybox(ray);
+        }
+        return survival < 1.0f ? skybox(ray) / survival : skybox(ray);
+    }
+}
+
+Ray camera_sample(const Camera &camera, Sampler sampler, unsigned int seed, int width, int height,
+                  int row_index, int column_index, int times, unsigned int &path_seed) {
+    //* The camera ray of sample times of a pixel (row 0 is the bottom row)
+    //* and the seed of its ray tree, one at a time (the renders take them
+    //* from a CameraRayBatch, which gives the same rays).
+    PROFILE_ZONE(ZONE_CAMERA);
+    Pcg32 rng = sample_rng(seed, (unsigned int)(row_index * width + column_index), times);
+    float s, t, lens_u, lens_v;
+    camera_sample_position(rng, sampler, seed, width, height, row_index, column_index, times, camera.has_lens(),
+                           s, t, lens_u, lens_v, path_seed);
+    return camera.has_lens() ? camera.get_ray(s, t, lens_u, lens_v) : camera.get_ray(s, t);
+}
+
+Vec3 trace_camera_ray(const Ray &ray, const Scene &scene, const TraceOptions &options, unsigned int path_seed,
+                      SampleAov *aov = NULL) {
+    //* The color of a camera ray, traced depth first, and what it hits
+    //* (when aov is given).
+    thread_stats.count[PRIMARY_RAYS]++;
+    if (aov) {
+        *aov = SampleAov{Vec3(0.0, 0.0, 0.0), Vec3(0.0, 0.0, 0.0), 0.0f};
+    }
+    return trace(ray, scene, options, 0, -1, 1.0f, path_seed, aov);
+}
+
+Vec3 render_sample(const Camera &camera, const Scene &scene, const TraceOptions &options, Sampler sampler, unsigned int seed,
+                   int width, int height, int row_index, int column_index, int times, SampleAov *aov = NULL) {
+    //* The color of sample times of a pixel, traced depth first, and what
+    //* the camera ray hits (when aov is given).
+    unsigned int path_seed;
+    Ray ray = camera_sample(camera, sampler, seed, width, height, row_index, column_index, times, path_seed);
+    return trace_camera_ray(ray, scene, options, path_seed, aov);
+}
+
+#endif
@@ -0,0 +1,504 @@
+#ifndef WAVEFRONTH
+#define WAVEFRONTH
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "camera.h"
+#include "camera_rays.h"
+#include "rng.h"
+#include "scene.h"
+#include "stats.h"
+#include "tracer.h"
+
+//* Breadth-first (wavefront) version of trace().
+//* Instead of following one ray tree at a time, all samples of a tile go
+//* through the same stage together: generate the camera rays, intersect the
+//* whole wave, shade the hits (spawning the shadow rays and the next wave),
+//* test all shadow rays, and repeat with the next wave. Every stage loops
+//* over a structure-of-arrays queue, so it runs one small piece of code over
+//* many rays (warm caches, and the layout the SIMD kernels want).
+//*
+//* trace() mixes the colors of a hit and its two branches on the way back
+//* up. Here every ray gets a node in a ray tree with its own throughput
+//* weight (used for culling and roulette exactly like trace() does), and
+//* after the last wave the tree is resolved from the leaves up with the same
+//* float operations, so the image is the same bit for bit.
+//* With TraceOptions::sort_rays every wave after the camera rays is sorted
+//* first: by the octant of the direction, then along a Morton curve over
+//* the origins. Reflections off one sphere and refractions through one
+//* glass ball then reach the intersection stage together, and go through
+//* the same BVH nodes one after the other. The order of a wave does not
+//* change any color (a ray keeps its node and its seed).
+
+enum Engine {
+    // trace(), one ray tree at a time
+    ENGINE_RECURSIVE,
+    // WavefrontEngine
+    ENGINE_WAVEFRONT
+};
+
+inline const char *const engine_names[] = {"recursive", "wavefront"};
+
+inline bool parse_engine(const char *name, Engine &engine) {
+    if (strcmp(name, "recursive") == 0) {
+        engine = ENGINE_RECURSIVE;
+    } else if (strcmp(name, "wavefront") == 0) {
+        engine = ENGINE_WAVEFRONT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+enum WavefrontStage {
+    STAGE_GENERATE,
+    STAGE_SORT,
+    STAGE_INTERSECT,
+    STAGE_SHADE,
+    STAGE_SHADOW,
+    STAGE_RESOLVE,
+    STAGE_COUNT
+};
+
+inline const char *const stage_names[STAGE_COUNT] = {
+    "generate",
+    "sort",
+    "intersect",
+    "shade",
+    "shadow",
+    "resolve"
+};
+
+//* Time spent in and items processed by every stage, counted per thread
+//* and flushed like the render counters.
+typedef struct StageStats {
+    double seconds[STAGE_COUNT];
+    unsigned long long items[STAGE_COUNT];
+
+    void add(const StageStats &other) {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            seconds[i] += other.seconds[i];
+            items[i] += other.items[i];
+        }
+    }
+
+    void reset() {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            seconds[i] = 0.0;
+            items[i] = 0;
+        }
+    }
+} StageStats;
+
+inline thread_local StageStats thread_stage_stats = {};
+inline StageStats global_stage_stats = {};
+inline std::mutex global_stage_stats_lock;
+
+inline void flush_thread_stage_stats() {
+    std::lock_guard<std::mutex> guard(global_stage_stats_lock);
+    global_stage_stats.add(thread_stage_stats);
+    thread_stage_stats.reset();
+}
+
+//* One wave of rays in SoA form.
+class RayQueue {
+    public:
+        void clear() {
+            ox.clear(); oy.clear(); oz.clear();
+            dx.clear(); dy.clear(); dz.clear();
+            throughput.clear();
+            path_seed.clear();
+            self_index.clear();
+            node.clear();
+        }
+
+        void reserve(size_t count) {
+            ox.reserve(count); oy.reserve(count); oz.reserve(count);
+            dx.reserve(count); dy.reserve(count); dz.reserve(count);
+            throughput.reserve(count);
+            path_seed.reserve(count);
+            self_index.reserve(count);
+            node.reserve(count);
+        }
+
+        void push(const Ray &ray, float ray_throughput, unsigned int seed, int self, int node_index) {
+            ox.push_back(ray.origin().x()); oy.push_back(ray.origin().y()); oz.push_back(ray.origin().z());
+            dx.push_back(ray.direction().x()); dy.push_back(ray.direction().y()); dz.push_back(ray.direction().z());
+            throughput.push_back(ray_throughput);
+            path_seed.push_back(seed);
+            self_index.push_back(self);
+            node.push_back(node_index);
+        }
+
+        void push_camera_rays(const CameraRayBatch &batch, int first_node) {
+            //* All rays of a batch at once, for nodes first_node, first_node + 1, ...
+            size_t base = size(), count = batch.size();
+            ox.insert(ox.end(), batch.ox.begin(), batch.ox.end());
+            oy.insert(oy.end(), batch.oy.begin(), batch.oy.end());
+            oz.insert(oz.end(), batch.oz.begin(), batch.oz.end());
+            dx.insert(dx.end(), batch.dx.begin(), batch.dx.end());
+            dy.insert(dy.end(), batch.dy.begin(), batch.dy.end());
+            dz.insert(dz.end(), batch.dz.begin(), batch.dz.end());
+            throughput.resize(base + count, 1.0f);
+            path_seed.insert(path_seed.end(), batch.path_seed.begin(), batch.path_seed.end());
+            self_index.resize(base + count, -1);
+            node.resize(base + count);
+            for (size_t i = 0; i < count; i++) {
+                node[base + i] = first_node + (int)i;
+            }
+        }
+
+        void swap(RayQueue &other) {
+            ox.swap(other.ox); oy.swap(other.oy); oz.swap(other.oz);
+            dx.swap(other.dx); dy.swap(other.dy); dz.swap(other.dz);
+            throughput.swap(other.throughput);
+            path_seed.swap(other.path_seed);
+            self_index.swap(other.self_index);
+            node.swap(other.node);
+        }
+
+        // Append ray i of other.
+        void push_from(const RayQueue &other, size_t i) {
+            ox.push_back(other.ox[i]); oy.push_back(other.oy[i]); oz.push_back(other.oz[i]);
+            dx.push_back(other.dx[i]); dy.push_back(other.dy[i]); dz.push_back(other.dz[i]);
+            throughput.push_back(other.throughput[i]);
+            path_seed.push_back(other.path_seed[i]);
+            self_index.push_back(other.self_index[i]);
+            node.push_back(other.node[i]);
+        }
+
+        Ray ray(size_t i) const {
+            return Ray::from_unit(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]));
+        }
+
+        size_t size() const {
+            return node.size();
+        }
+
+        std::vector<float> ox, oy, oz;
+        std::vector<float> dx, dy, dz;
+        std::vector<float> throughput;
+        std::vector<unsigned int> path_seed;
+        // sphere the ray starts on (skipped by the intersection), -1 for camera rays
+        std::vector<int> self_index;
+        // the ray's node in the ray tree
+        std::vector<int> node;
+};
+
+//* A node of the ray tree: where a ray's color ends up.
+typedef struct PathNode {
+    // the final color (for a hit only after the resolve stage)
+    Vec3 color;
+    // the shaded color of the hit, summed by the shadow stage over the rays nothing blocks
+    Vec3 local;
+    Branching branching;
+    int material_id;
+    // child nodes, -1 for a branch that was not spawned (black)
+    int reflected;
+    int transmitted;
+    float survival;
+    bool hit;
+} PathNode;
+
+//* The samples a tile asks for: samples [first, end) of one pixel.
+typedef struct SampleRequest {
+    int row_index;
+    int column_index;
+    int first;
+    int end;
+} SampleRequest;
+
+class WavefrontEngine {
+    public:
+        void clear() {
+            requests.clear();
+        }
+
+        void reserve(size_t pixels, size_t samples) {
+            //* Room for the camera rays of samples samples of pixels pixels (the
+            //* secondary waves still grow with what the rays hit).
+            requests.reserve(pixels);
+            nodes.reserve(samples);
+            aovs.reserve(samples);
+            camera_rays.reserve(samples);
+            wave.reserve(samples);
+        }
+
+        void add_pixel(int row_index, int column_index, int first, int end) {
+            SampleRequest request = {row_index, column_index, first, end};
+            requests.push_back(request);
+        }
+
+        void run(const Camera &camera, const Scene &scene, const TraceOptions &options, Sampler sampler, unsigned int seed,
+                 int width, int height);
+
+        const Vec3& sample_color(int index) const {
+            //* Color of the index-th requested sample (in request order).
+            return nodes[index].color;
+        }
+
+        const SampleAov& sample_aov(int index) const {
+            //* What the camera ray of the index-th requested sample hit.
+            return aovs[index];
+        }
+
+    private:
+        static PathNode blank_node() {
+            PathNode node;
+            node.color = Vec3(0.0, 0.0, 0.0);
+            node.local = Vec3(0.0, 0.0, 0.0);
+            node.branching = Branching{false, false, 0.0f, 0.0f};
+            node.material_id = 0;
+            node.hit = false;
+            node.reflected = node.transmitted = -1;
+            node.survival = 1.0f;
+            return node;
+        }
+
+        int new_node() {
+            nodes.push_back(blank_node());
+            return (int)nodes.size() - 1;
+        }
+
+        void spawn(const Ray &ray, const TraceOptions &options, float throughput, unsigned int seed, int self, int &child);
+        void sort_wave();
+
+        std::vector<SampleRequest> requests;
+        std::vector<PathNode> nodes;
+        // of the camera rays, in request order
+        std::vector<SampleAov> aovs;
+        // the camera rays of all requests
+        CameraRayBatch camera_rays;
+        RayQueue wave;
+        RayQueue next_wave;
+        // sort_wave(): the keys and the sorted wave
+        std::vector<uint64_t> sort_keys;
+        RayQueue sorted_wave;
+        std::vector<hit_record> hits;
+        std::vector<char> has_hit;
+        // shadow rays, the sphere they start on and the node they light
+        std::vector<ShadowSample> shadows;
+        std::vector<int> shadow_self;
+        std::vector<int> shadow_node;
+};
+
+void WavefrontEngine::spawn(const Ray &ray, const TraceOptions &options, float throughput, unsigned int seed, int self, int &child) {
+    //* The wavefront trace_branch(): a culled branch is resolved to the
+    //* skybox at once, the others go to the next wave.
+    child = new_node();
+    if (options.adaptive && throughput < options.min_throughput) {
+        thread_stats.count[CULLED_BRANCHES]++;
+        nodes[child].color = skybox(ray);
+        return;
+    }
+    next_wave.push(ray, throughput, seed, self, child);
+}
+
+inline uint32_t spread_bits(uint32_t x) {
+    //* The low 10 bits of x, two zero bits between each (for a 3D Morton code).
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+inline uint32_t morton_cell(float x, float lower, float scale) {
+    //* The cell (0 to 1023) of x on an axis; NaN goes to cell 0.
+    float cell = (x - lower) * scale;
+    return cell >= 0.0f ? (uint32_t)std::min(cell, 1023.0f) : 0;
+}
+
+void WavefrontEngine::sort_wave() {
+    //* Sort the wave by direction octant, then by the 30-bit Morton code of
+    //* the origin in the box of all origins. A key is octant (3 bits),
+    //* Morton code (30 bits) and the index in the wave (31 bits), so one
+    //* sort of plain integers does it.
+    size_t count = wave.size();
+    float lower[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float upper[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    const std::vector<float> *origin[3] = {&wave.ox, &wave.oy, &wave.oz};
+    for (int axis = 0; axis < 3; axis++) {
+        for (size_t i = 0; i < count; i++) {
+            lower[axis] = std::min(lower[axis], (*origin[axis])[i]);
+            upper[axis] = std::max(upper[axis], (*origin[axis])[i]);
+        }
+    }
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = upper[axis] > lower[axis] ? 1023.0f / (upper[axis] - lower[axis]) : 0.0f;
+    }
+    sort_keys.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        uint32_t octant = (wave.dx[i] < 0.0f ? 4 : 0) | (wave.dy[i] < 0.0f ? 2 : 0) | (wave.dz[i] < 0.0f ? 1 : 0);
+        uint32_t morton = (spread_bits(morton_cell(wave.ox[i], lower[0], scale[0])) << 2) |
+                          (spread_bits(morton_cell(wave.oy[i], lower[1], scale[1])) << 1) |
+                          spread_bits(morton_cell(wave.oz[i], lower[2], scale[2]));
+        sort_keys[i] = ((uint64_t)octant << 61) | ((uint64_t)morton << 31) | (uint64_t)i;
+    }
+    std::sort(sort_keys.begin(), sort_keys.end());
+    sorted_wave.clear();
+    for (size_t k = 0; k < count; k++) {
+        sorted_wave.push_from(wave, (size_t)(sort_keys[k] & 0x7FFFFFFF));
+    }
+    wave.swap(sorted_wave);
+}
+
+void WavefrontEngine::run(const Camera &camera, const Scene &scene, const TraceOptions &options, Sampler sampler, unsigned int seed,
+                          int width, int height) {
+    //* Trace all requested samples.
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    nodes.clear();
+    wave.clear();
+    // Generate: the camera rays are the first nodes, in request order.
+    {
+        PROFILE_ZONE(ZONE_CAMERA);
+        camera_rays.clear();
+        for (size_t r = 0; r < requests.size(); r++) {
+            const SampleRequest &request = requests[r];
+            camera_rays.add_pixel(camera, sampler, seed, width, height, request.row_index, request.column_index,
+                                  request.first, request.end);
+        }
+        camera_rays.generate(camera, scene.bvh.get_kernels().isa);
+        wave.push_camera_rays(camera_rays, (int)nodes.size());
+        nodes.resize(nodes.size() + camera_rays.size(), blank_node());
+    }
+    aovs.assign(wave.size(), SampleAov{Vec3(0.0, 0.0, 0.0), Vec3(0.0, 0.0, 0.0), 0.0f});
+    thread_stats.count[PRIMARY_RAYS] += wave.size();
+    thread_stage_stats.items[STAGE_GENERATE] += wave.size();
+    clock::time_point now = clock::now();
+    thread_stage_stats.seconds[STAGE_GENERATE] += std::chrono::duration<double>(now - start).count();
+
+    ShadowSample samples[MAX_SHADOW_RAYS];
+    for (int depth = 0; wave.size() > 0; depth++) {
+        // Sort: the secondary rays, for coherent intersection.
+        if (options.sort_rays && depth > 0 && wave.size() > 1) {
+            start = now;
+            sort_wave();
+            now = clock::now();
+            thread_stage_stats.items[STAGE_SORT] += wave.size();
+            thread_stage_stats.seconds[STAGE_SORT] += std::chrono::duration<double>(now - start).count();
+        }
+
+        // Intersect: the end of a path (cap, roulette), then the closest hits.
+        start = now;
+        size_t count = wave.size();
+        hits.resize(count);
+        has_hit.assign(count, 0);
+        for (size_t i = 0; i < count; i++) {
+            PathNode &node = nodes[wave.node[i]];
+            bool terminated;
+            if (roulette_step(options, depth, wave.throughput[i], wave.path_seed[i], node.survival, terminated)) {
+                node.color = terminated ? Vec3(0.0, 0.0, 0.0) : skybox(wave.ray(i));
+                node.survival = 1.0f;
+                continue;
+            }
+            has_hit[i] = intersect(wave.ray(i), scene, FLT_EPSILON, FLT_MAX, hits[i], wave.self_index[i]);
+            if (!has_hit[i]) {
+                Vec3 sky = skybox(wave.ray(i));
+                node.color = node.survival < 1.0f ? sky / node.survival : sky;
+            }
+            // The camera rays are the first nodes.
+            if (depth == 0 && has_hit[i]) {
+                set_aov(aovs[wave.node[i]], hits[i], scene.material_of(hits[i]));
+            } else if (depth == 0) {
+                aovs[wave.node[i]].albedo = skybox(wave.ray(i));
+            }
+        }
+        now = clock::now();
+        thread_stage_stats.items[STAGE_INTERSECT] += count;
+        thread_stage_stats.seconds[STAGE_INTERSECT] += std::chrono::duration<double>(now - start).count();
+
+        // Shade: the shadow rays (with the color each adds) and the branches.
+        start = now;
+        next_wave.clear();
+        shadows.clear();
+        shadow_self.clear();
+        shadow_node.clear();
+        size_t shaded = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!has_hit[i]) {
+                continue;
+            }
+            shaded++;
+            const hit_record &record = hits[i];
+            PROFILE_MATERIAL(record.material_id);
+            int node_index = wave.node[i];
+            const Material &material = scene.material_of(record);
+            Branching b = branching(material);
+            int sample_count = light_samples(scene, options, record, material, wave.path_seed[i], samples);
+            for (int s = 0; s < sample_count; s++) {
+                shadows.push_back(samples[s]);
+                shadow_self.push_back(record.in_scene_index);
+                shadow_node.push_back(node_index);
+            }
+
+            Ray ray = wave.ray(i);
+            int reflected = -1, transmitted = -1;
+            if (b.has_reflection || !options.adaptive) {
+                spawn(reflected_ray(ray, record), options, wave.throughput[i] * b.reflected_weight,
+                      hash_combine(wave.path_seed[i], 1), record.in_scene_index, reflected);
+            } else {
+                thread_stats.count[SKIPPED_BRANCHES]++;
+            }
+            if (b.has_transmission || !options.adaptive) {
+                spawn(transmitted_ray(ray, record), options, wave.throughput[i] * b.transmitted_weight,
+                      hash_combine(wave.path_seed[i], 2), record.in_scene_index, transmitted);
+            } else {
+                thread_stats.count[SKIPPED_BRANCHES]++;
+            }
+            // (new_node() may have moved the nodes.)
+            PathNode &node = nodes[node_index];
+            node.hit = true;
+            node.branching = b;
+            node.material_id = record.material_id;
+            node.reflected = reflected;
+            node.transmitted = transmitted;
+        }
+        now = clock::now();
+        thread_stage_stats.items[STAGE_SHADE] += shaded;
+        thread_stage_stats.seconds[STAGE_SHADE] += std::chrono::duration<double>(now - start).count();
+
+        // Shadow: one any-hit query per shadow ray. The colors of a hit add
+        // up in the order shading() adds them.
+        start = now;
+        for (size_t i = 0; i < shadows.size(); i++) {
+            PROFILE_MATERIAL(nodes[shadow_node[i]].material_id);
+            if (!check_in_shadow(shadows[i].ray, scene, shadows[i].distance, shadow_self[i], shadows[i].light)) {
+                nodes[shadow_node[i]].local += shadows[i].color;
+            }
+        }
+        now = clock::now();
+        thread_stage_stats.items[STAGE_SHADOW] += shadows.size();
+        thread_stage_stats.seconds[STAGE_SHADOW] += std::chrono::duration<double>(now - start).count();
+
+        wave.swap(next_wave);
+    }
+
+    // Resolve: children always come after their parent, so one backward
+    // sweep mixes every hit after both of its branches are known.
+    start = now;
+    Vec3 black(0.0, 0.0, 0.0);
+    for (size_t n = nodes.size(); n-- > 0;) {
+        PathNode &node = nodes[n];
+        if (!node.hit) {
+            continue;
+        }
+        const Vec3 &reflected_color = node.reflected >= 0 ? nodes[node.reflected].color : black;
+        const Vec3 &transmitted_color = node.transmitted >= 0 ? nodes[node.transmitted].color : black;
+        Vec3 color = mix_color(scene.materials[node.material_id], node.branching, node.local, reflected_color, transmitted_color);
+        node.color = node.survival < 1.0f ? color / node.survival : color;
+    }
+    now = clock::now();
+    thread_stage_stats.items[STAGE_RESOLVE] += nodes.size();
+    thread_stage_stats.seconds[STAGE_RESOLVE] += std::chrono::duration<double>(now - start).count();
+}
+
+#endif